@@ -0,0 +1,257 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+
+#include "AllocationPolicy.h"
+
+// How much each core is worth to a process that has not published a utility
+// curve, when allocating cores by utility.
+#define DEFAULT_CORE_UTILITY 1.0f
+
+namespace CoreArbiter {
+
+/**
+ * Constructs the policy with the given name, which is "priority" for
+ * PriorityAllocationPolicy and "utility" for PriorityAllocationPolicy
+ * allocating by utility.
+ *
+ * \return
+ *     The new policy, which the caller must delete, or NULL if there is no
+ *     policy with that name
+ */
+AllocationPolicy*
+AllocationPolicy::create(const std::string& name) {
+    if (name == "priority") {
+        return new PriorityAllocationPolicy(false);
+    }
+    if (name == "utility") {
+        return new PriorityAllocationPolicy(true);
+    }
+    return NULL;
+}
+
+/**
+ * Constructs a PriorityAllocationPolicy.
+ *
+ * \param allocateByUtility
+ *     True to give the cores at each priority to the processes that value
+ *     them most according to their utility curves, rather than splitting them
+ *     evenly
+ */
+PriorityAllocationPolicy::PriorityAllocationPolicy(bool allocateByUtility)
+    : allocateByUtility(allocateByUtility) {}
+
+void
+PriorityAllocationPolicy::allocate(const AllocationSnapshot& snapshot,
+                                   AllocationDecision* decision) {
+    size_t numCores = snapshot.cores.size();
+    size_t numProcesses = snapshot.processes.size();
+    decision->priorityQueues = snapshot.priorityQueues;
+    if (numCores == 0) {
+        return;
+    }
+
+    // Which threads on managed cores will keep them.
+    std::vector<bool> threadKept(snapshot.threads.size(), false);
+
+    // How many of each process's preempted and blocked threads have been
+    // given cores.
+    std::vector<size_t> numPreemptedChosen(numProcesses, 0);
+    std::vector<size_t> numBlockedChosen(numProcesses, 0);
+
+    // How many cores each process will have at all priorities considered so
+    // far. Only used when allocating by utility.
+    std::vector<uint32_t> numCoresGranted(numProcesses, 0);
+
+    // Iterate from highest to lowest priority
+    bool coresFilled = false;
+    for (size_t priority = 0;
+         priority < decision->priorityQueues.size() && !coresFilled;
+         priority++) {
+        std::vector<size_t>& processes = decision->priorityQueues[priority];
+        bool threadAdded = true;
+
+        // When taking turns in queue order, the index in processes of the
+        // next process to visit. The processes before it are moved to the
+        // back of the queue once this priority is done.
+        size_t nextProcess = 0;
+
+        // A running count of how many cores we have assigned to each process
+        // at this priority, so that no process is given more than it asked
+        // for.
+        std::vector<uint32_t> coreCounts(numProcesses, 0);
+
+        // Any threads that are already managed should remain so at this
+        // priority.
+        for (size_t threadIndex : snapshot.managedThreads) {
+            if (threadKept[threadIndex]) {
+                continue;
+            }
+            size_t process = snapshot.threads[threadIndex].process;
+            if (coreCounts[process] <
+                snapshot.processes[process].desiredCores[priority]) {
+                // We want to keep this thread on its core
+                threadKept[threadIndex] = true;
+                decision->grants.push_back({threadIndex, priority});
+                coreCounts[process]++;
+                numCoresGranted[process]++;
+
+                if (decision->grants.size() == numCores) {
+                    coresFilled = true;
+                    break;
+                }
+            }
+        }
+
+        // Add as many preempted and blocked threads at this priority level as
+        // we can
+        while (threadAdded && !coresFilled) {
+            threadAdded = false;
+
+            // Iterate over every process at this priority level, or only the
+            // one that gains the most from its next core when allocating by
+            // utility
+            size_t numProcessesToVisit =
+                allocateByUtility ? 1 : processes.size();
+            for (size_t i = 0; i < numProcessesToVisit; i++) {
+                size_t process;
+                if (allocateByUtility) {
+                    process = chooseProcessByUtility(
+                        snapshot, processes, priority, coreCounts,
+                        numCoresGranted);
+                    if (process == numProcesses) {
+                        break;
+                    }
+                    // Move the process to the back of the queue, to break
+                    // ties between equally valuable cores the same way
+                    processes.erase(std::find(processes.begin(),
+                                              processes.end(), process));
+                    processes.push_back(process);
+                } else {
+                    // Take turns (so that we share cores evenly accross
+                    // threads at this priority level)
+                    process = processes[nextProcess];
+                    nextProcess = (nextProcess + 1) % processes.size();
+                }
+
+                const AllocationSnapshot::Process& info =
+                    snapshot.processes[process];
+                if (coreCounts[process] == info.desiredCores[priority]) {
+                    continue;
+                }
+
+                // Preempted threads go first, so that they are moved back to
+                // their cores
+                size_t thread;
+                if (numPreemptedChosen[process] <
+                    info.preemptedThreads.size()) {
+                    thread =
+                        info.preemptedThreads[numPreemptedChosen[process]++];
+                } else if (numBlockedChosen[process] <
+                           info.blockedThreads.size()) {
+                    thread = info.blockedThreads[numBlockedChosen[process]++];
+                } else {
+                    if (allocateByUtility) {
+                        // This process has no more threads to put on cores,
+                        // so stop offering it cores at this priority
+                        coreCounts[process] = info.desiredCores[priority];
+                        threadAdded = true;
+                    }
+                    continue;
+                }
+
+                decision->grants.push_back({thread, priority});
+                coreCounts[process]++;
+                numCoresGranted[process]++;
+                threadAdded = true;
+
+                if (decision->grants.size() == numCores) {
+                    coresFilled = true;
+                    break;
+                }
+            }
+        }
+        std::rotate(processes.begin(), processes.begin() + nextProcess,
+                    processes.end());
+    }
+}
+
+/**
+ * Used when allocating by utility to choose which of the processes at a
+ * priority receives the next core: the one that gains the most from an
+ * additional core, given how many it will already have. Ties go to the process
+ * nearest the front of the priority queue.
+ *
+ * \param snapshot
+ *     The state of the server
+ * \param processes
+ *     The processes that want cores at this priority, in queue order
+ * \param priority
+ *     The index in AllocationSnapshot::priorityQueues being distributed
+ * \param coreCounts
+ *     How many cores each process has been given at this priority
+ * \param numCores
+ *     How many cores each process has been given at all priorities
+ * \return
+ *     The index of the chosen process, or the number of processes if every
+ *     process has been given all of the cores it wants at this priority
+ */
+size_t
+PriorityAllocationPolicy::chooseProcessByUtility(
+    const AllocationSnapshot& snapshot, const std::vector<size_t>& processes,
+    size_t priority, const std::vector<uint32_t>& coreCounts,
+    const std::vector<uint32_t>& numCores) {
+    size_t chosenProcess = snapshot.processes.size();
+    float chosenUtility = 0;
+    for (size_t process : processes) {
+        const AllocationSnapshot::Process& info = snapshot.processes[process];
+        if (coreCounts[process] == info.desiredCores[priority]) {
+            continue;
+        }
+        float utility = getMarginalUtility(info, numCores[process]);
+        if (chosenProcess == snapshot.processes.size() ||
+            utility > chosenUtility) {
+            chosenProcess = process;
+            chosenUtility = utility;
+        }
+    }
+    return chosenProcess;
+}
+
+/**
+ * Returns how much a process gains from being given one more core, according
+ * to its utility curve. A process that has not published a curve values every
+ * core at DEFAULT_CORE_UTILITY, and cores beyond the end of a curve are worth
+ * nothing.
+ *
+ * \param process
+ *     The process that would receive the core
+ * \param numCores
+ *     How many cores the process would already have
+ */
+float
+PriorityAllocationPolicy::getMarginalUtility(
+    const AllocationSnapshot::Process& process, uint32_t numCores) {
+    if (process.utilityCurve.empty()) {
+        return DEFAULT_CORE_UTILITY;
+    }
+    if (numCores >= process.utilityCurve.size()) {
+        return 0;
+    }
+    return process.utilityCurve[numCores];
+}
+
+}  // namespace CoreArbiter
@@ -0,0 +1,185 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_ARBITER_ALLOCATION_POLICY_H_
+#define CORE_ARBITER_ALLOCATION_POLICY_H_
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+namespace CoreArbiter {
+
+/**
+ * What an AllocationPolicy knows about the server when it decides which
+ * threads get cores. Processes and threads refer to each other by their
+ * indexes in the snapshot's vectors.
+ */
+struct AllocationSnapshot {
+    struct Thread {
+        pid_t id;
+
+        // The index of this thread's process in processes.
+        size_t process;
+
+        // The ID of the managed core this thread is running on, or -1 if it
+        // has none.
+        int coreId;
+
+        // True if this thread was forcibly moved off its managed core and is
+        // still running on the unmanaged cores.
+        bool preempted;
+    };
+
+    struct Process {
+        pid_t id;
+
+        // How many cores the process should be given at each index in
+        // priorityQueues, which is less than it asked for if the server has
+        // reclaimed idle cores from it.
+        std::vector<uint32_t> desiredCores;
+
+        // Indexes in threads of the process's threads that are running on
+        // managed cores, were preempted, or are blocked. Blocked threads are
+        // in the order the server would rather wake them in.
+        std::vector<size_t> managedThreads;
+        std::vector<size_t> preemptedThreads;
+        std::vector<size_t> blockedThreads;
+
+        // How much the process gains from each additional core (see
+        // CoreArbiterClient::setUtilityCurve()). Only filled in for policies
+        // that use utility curves, and empty if the process has not published
+        // one.
+        std::vector<float> utilityCurve;
+    };
+
+    struct Core {
+        int id;
+        int numaNode;
+
+        // The ID of this core's hypertwin, or -1 if it has none.
+        int hyperTwin;
+    };
+
+    std::vector<Thread> threads;
+    std::vector<Process> processes;
+
+    // Every core the server arbitrates, managed or not.
+    std::vector<Core> cores;
+
+    // Indexes in threads of every thread on a managed core, in the order they
+    // were granted their cores.
+    std::vector<size_t> managedThreads;
+
+    // Indexes in processes of the processes that want cores at each priority,
+    // highest priority first. Policies may use the order of each queue to
+    // take turns between processes; the front is the next in line.
+    std::vector<std::vector<size_t>> priorityQueues;
+};
+
+/**
+ * The target assignment returned by an AllocationPolicy.
+ */
+struct AllocationDecision {
+    struct Grant {
+        // The index in AllocationSnapshot::threads of a thread that should
+        // have a managed core.
+        size_t thread;
+
+        // The index in AllocationSnapshot::priorityQueues that the core is
+        // granted at.
+        size_t priority;
+    };
+
+    // Every thread that should have a managed core, most important first.
+    // Threads that already have one keep it, the others are put on cores as
+    // they become free, and threads on managed cores that are left out are
+    // asked to release them. There must be no more grants than cores.
+    std::vector<Grant> grants;
+
+    // The order the processes in each of AllocationSnapshot::priorityQueues
+    // should be in next time, or empty to leave the queues as they are.
+    std::vector<std::vector<size_t>> priorityQueues;
+};
+
+/**
+ * Decides which threads should run on the cores that the CoreArbiterServer
+ * manages. The server takes a snapshot of its state whenever cores must be
+ * redistributed, asks its policy for a target assignment, and then carries it
+ * out: it chooses the cores, moves threads between cpusets, wakes threads and
+ * asks processes to release cores. Keeping the policy separate lets
+ * allocators be developed and benchmarked (see CoreArbiterSimulator) without
+ * touching those mechanics.
+ */
+class AllocationPolicy {
+  public:
+    virtual ~AllocationPolicy() {}
+
+    /**
+     * Decides which threads should have managed cores.
+     *
+     * \param snapshot
+     *     The state of the server
+     * \param[out] decision
+     *     Filled in with the target assignment. It is empty when this is
+     *     called.
+     */
+    virtual void allocate(const AllocationSnapshot& snapshot,
+                          AllocationDecision* decision) = 0;
+
+    /**
+     * Returns true if the policy needs processes' utility curves, in which
+     * case the server reads them for each snapshot and redistributes cores
+     * whenever one changes.
+     */
+    virtual bool usesUtilityCurves() { return false; }
+
+    static AllocationPolicy* create(const std::string& name);
+};
+
+/**
+ * The default policy. All higher priority requests are granted before lower
+ * priorities. Threads keep their managed cores whenever their processes still
+ * want them, and preempted threads are given cores ahead of blocked ones so
+ * that they can return to the cores they were preempted from. Within a
+ * priority, cores are split evenly between processes by taking turns, or, if
+ * allocating by utility, each core goes to the process that gains the most
+ * from it (ties are broken by taking turns).
+ */
+class PriorityAllocationPolicy : public AllocationPolicy {
+  public:
+    explicit PriorityAllocationPolicy(bool allocateByUtility = false);
+    void allocate(const AllocationSnapshot& snapshot,
+                  AllocationDecision* decision);
+    bool usesUtilityCurves() { return allocateByUtility; }
+
+  private:
+    size_t chooseProcessByUtility(const AllocationSnapshot& snapshot,
+                                  const std::vector<size_t>& processes,
+                                  size_t priority,
+                                  const std::vector<uint32_t>& coreCounts,
+                                  const std::vector<uint32_t>& numCores);
+    static float getMarginalUtility(
+        const AllocationSnapshot::Process& process, uint32_t numCores);
+
+    // If true, cores within a priority go to the processes that value them
+    // most rather than being split evenly.
+    bool allocateByUtility;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_ARBITER_ALLOCATION_POLICY_H_
@@ -14,6 +14,8 @@
  */
 #include "ArbiterClientShim.h"
 #include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 #include <atomic>
 
 namespace Arachne {
@@ -25,10 +27,32 @@ int
 ArbiterClientShim::blockUntilCoreAvailable() {
     static std::atomic<int> nextCoreId(0);
     static thread_local int coreId = nextCoreId.fetch_add(1);
-    waitingForAvailableCore.wait();
+    pid_t threadId = static_cast<pid_t>(syscall(SYS_gettid));
+
+    std::unique_lock<std::mutex> lock(blockMutex);
+    while (availableCores == 0 && cancelledThreads.count(threadId) == 0) {
+        coreAvailable.wait(lock);
+    }
+    if (cancelledThreads.erase(threadId) > 0) {
+        return -1;
+    }
+    availableCores--;
     return coreId;
 }
 
+/**
+ * Implements functionality of CoreArbiterClient::cancelBlock.
+ *
+ * \param threadId
+ *     Same as in CoreArbiterClient::cancelBlock.
+ */
+void
+ArbiterClientShim::cancelBlock(pid_t threadId) {
+    std::lock_guard<std::mutex> guard(blockMutex);
+    cancelledThreads.insert(threadId);
+    coreAvailable.notify_all();
+}
+
 /**
  * Implements functionality of CoreArbiterClient::mustReleaseCore.
  **/
@@ -62,17 +86,38 @@ ArbiterClientShim::setRequestedCores(std::vector<uint32_t> numCores) {
     std::lock_guard<std::mutex> guard(shimLock);
     if (currentRequestedCores > currentCores) {
         uint64_t diff = currentRequestedCores - currentCores;
-        for (uint64_t i = 0; i < diff; i++)
-            waitingForAvailableCore.notify();
+        {
+            std::lock_guard<std::mutex> blockGuard(blockMutex);
+            availableCores += diff;
+        }
+        coreAvailable.notify_all();
         currentCores.store(currentRequestedCores);
     }
 }
 
+/**
+ * Implements functionality of CoreArbiterClient::setRequestedCoreRange.
+ * Without a server there is no contention, so the maximum is always granted.
+ *
+ * \param minCores
+ *     Same as in CoreArbiterClient::setRequestedCoreRange.
+ * \param maxCores
+ *     Same as in CoreArbiterClient::setRequestedCoreRange.
+ */
+void
+ArbiterClientShim::setRequestedCoreRange(std::vector<uint32_t> minCores,
+                                         std::vector<uint32_t> maxCores) {
+    setRequestedCores(maxCores);
+}
+
 /**
  * Implements functionality of CoreArbiterClient::unregisterThread.
  **/
 void
 ArbiterClientShim::unregisterThread() {
-    // Because there is no server, this function is a no-op.
+    // Because there is no server, there is nothing to tell it.
+    pid_t threadId = static_cast<pid_t>(syscall(SYS_gettid));
+    std::lock_guard<std::mutex> guard(blockMutex);
+    cancelledThreads.erase(threadId);
 }
 }  // namespace Arachne
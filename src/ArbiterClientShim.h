@@ -17,10 +17,11 @@
 #define ARBITER_CLIENT_SHIM_H
 
 #include <stdint.h>
+#include <condition_variable>
+#include <unordered_set>
 #include <vector>
 
 #include "CoreArbiterClient.h"
-#include "Semaphore.h"
 
 namespace Arachne {
 
@@ -32,13 +33,18 @@ namespace Arachne {
 class ArbiterClientShim : public CoreArbiter::CoreArbiterClient {
   public:
     int blockUntilCoreAvailable();
+    void cancelBlock(pid_t threadId);
     bool mustReleaseCore();
     void setRequestedCores(std::vector<uint32_t> numCores);
+    void setRequestedCoreRange(std::vector<uint32_t> minCores,
+                               std::vector<uint32_t> maxCores);
     void unregisterThread();
     void reset() {
         currentRequestedCores = 0;
         currentCores = 0;
-        waitingForAvailableCore.reset();
+        std::lock_guard<std::mutex> guard(blockMutex);
+        availableCores = 0;
+        cancelledThreads.clear();
     }
 
     /**
@@ -55,16 +61,36 @@ class ArbiterClientShim : public CoreArbiter::CoreArbiterClient {
      */
     ArbiterClientShim()
         : CoreArbiter::CoreArbiterClient(""),
-          waitingForAvailableCore(),
+          blockMutex(),
+          coreAvailable(),
+          availableCores(0),
+          cancelledThreads(),
           currentRequestedCores(),
           currentCores(),
           shimLock() {}
 
     /**
-     * Threads block on this semaphor while waiting for a core
-     * to become available.
+     * Protects availableCores and cancelledThreads.
      */
-    ::Semaphore waitingForAvailableCore;
+    std::mutex blockMutex;
+
+    /**
+     * Threads block on this while waiting for a core to become available or
+     * for their wait to be cancelled.
+     */
+    std::condition_variable coreAvailable;
+
+    /**
+     * Cores handed out by setRequestedCores() that no thread has woken up on
+     * yet.
+     */
+    uint64_t availableCores;
+
+    /**
+     * Threads passed to cancelBlock() that have not yet returned -1 from
+     * blockUntilCoreAvailable().
+     */
+    std::unordered_set<pid_t> cancelledThreads;
 
     /**
      * The current number of cores this application prefers to have.
@@ -0,0 +1,103 @@
+/* Copyright (c) 2015-2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include "CoreArbiterCommon.h"
+#include "PerfUtils/Util.h"
+
+/**
+ * This program changes which cores a running core arbiter controls, so that
+ * cores can be handed to other systems and taken back without restarting the
+ * arbiter. It must be run as root. Cores that are added start out unmanaged.
+ * Cores that are removed may stay in use for up to a preemption timeout while
+ * the threads on them release them; after that they are left in the unmanaged
+ * cpuset, like the cores the arbiter was never given.
+ */
+
+int
+main(int argc, const char** argv) {
+    std::string socketPath = "/tmp/CoreArbiter/socket";
+    uint8_t msgType = 0;
+    std::vector<int> coreIds;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--socketPath") == 0 && i + 1 < argc) {
+            socketPath = argv[++i];
+        } else if (strcmp(argv[i], "--add") == 0 && i + 1 < argc) {
+            msgType = ADD_ARBITRATED_CORES;
+            coreIds = PerfUtils::Util::parseRanges(argv[++i]);
+        } else if (strcmp(argv[i], "--remove") == 0 && i + 1 < argc) {
+            msgType = REMOVE_ARBITRATED_CORES;
+            coreIds = PerfUtils::Util::parseRanges(argv[++i]);
+        } else {
+            msgType = 0;
+            break;
+        }
+    }
+    if (msgType == 0 || coreIds.empty() ||
+        coreIds.size() > MAX_SUPPORTED_CORES) {
+        fprintf(stderr,
+                "Usage: %s [--socketPath PATH] (--add | --remove) CORES\n"
+                "CORES is a list of core IDs and ranges, such as 4-7,9\n",
+                argv[0]);
+        return 1;
+    }
+
+    int serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverSocket < 0) {
+        fprintf(stderr, "Error creating socket: %s\n", strerror(errno));
+        return 1;
+    }
+    struct sockaddr_un remote;
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    strncpy(remote.sun_path, socketPath.c_str(), sizeof(remote.sun_path) - 1);
+    if (connect(serverSocket, (struct sockaddr*)&remote, sizeof(remote)) < 0) {
+        fprintf(stderr, "Error connecting to %s: %s\n", socketPath.c_str(),
+                strerror(errno));
+        return 1;
+    }
+
+    // The server closes the connection if we are not root
+    pid_t ids[2] = {getpid(), ADMIN_CONNECTION_ID};
+    uint32_t numCores = static_cast<uint32_t>(coreIds.size());
+    uint32_t numCoresChanged;
+    if (send(serverSocket, ids, sizeof(ids), 0) < 0 ||
+        send(serverSocket, &msgType, sizeof(msgType), 0) < 0 ||
+        send(serverSocket, &numCores, sizeof(numCores), 0) < 0 ||
+        send(serverSocket, &coreIds[0], numCores * sizeof(int), 0) < 0) {
+        fprintf(stderr, "Error sending request: %s\n", strerror(errno));
+        return 1;
+    }
+    if (recv(serverSocket, &numCoresChanged, sizeof(numCoresChanged),
+             MSG_WAITALL) != sizeof(numCoresChanged)) {
+        fprintf(stderr,
+                "The core arbiter refused the request; are you root?\n");
+        return 1;
+    }
+    close(serverSocket);
+
+    printf("%s %u of %u cores; see the core arbiter's log for any errors\n",
+           msgType == ADD_ARBITRATED_CORES ? "Added" : "Removing",
+           numCoresChanged, numCores);
+    return numCoresChanged == numCores ? 0 : 1;
+}
@@ -0,0 +1,398 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <iterator>
+
+#include "CoreArbiterAgent.h"
+#include "Logger.h"
+
+namespace CoreArbiter {
+
+typedef CoreArbiterClient::ClientException ClientException;
+
+static Syscall defaultSyscall;
+Syscall* CoreArbiterAgent::sys = &defaultSyscall;
+
+/**
+ * Constructs an agent for the given process. As with the CoreArbiterClient,
+ * the connection to the server is only opened once it is needed.
+ *
+ * \param serverSocketPath
+ *     The path to the socket that the server is listening for connections on.
+ * \param processId
+ *     The process whose threads this agent will register. The process must
+ *     not talk to the server itself.
+ */
+CoreArbiterAgent::CoreArbiterAgent(std::string serverSocketPath,
+                                   pid_t processId)
+    : serverSocketPath(serverSocketPath),
+      processId(processId),
+      serverSocket(-1),
+      processSharedMemFd(-1),
+      processStats(NULL),
+      threads(),
+      grantSlotInUse(MAX_MULTIPLEXED_THREADS, false) {}
+
+/**
+ * Closing the connection makes the server forget the managed process and
+ * move all of its threads back to the unmanaged cores.
+ */
+CoreArbiterAgent::~CoreArbiterAgent() {
+    if (processStats) {
+        sys->munmap(processStats,
+                    sharedMemorySize(sizeof(struct ProcessStats)));
+    }
+    if (processSharedMemFd >= 0) {
+        sys->close(processSharedMemFd);
+    }
+    if (serverSocket >= 0) {
+        sys->close(serverSocket);
+    }
+}
+
+/**
+ * Registers a thread of the managed process with the server. Like a thread
+ * that registers itself, it starts out on the unmanaged cores and must be
+ * reported blocked with threadBlocked() before it can be granted a core.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param threadId
+ *     The thread to register, which must belong to the managed process
+ */
+void
+CoreArbiterAgent::registerThread(pid_t threadId) {
+    if (serverSocket < 0) {
+        connect();
+    }
+    if (threads.find(threadId) != threads.end()) {
+        LOG(WARNING, "Thread %d is already registered", threadId);
+        return;
+    }
+
+    auto freeSlot =
+        std::find(grantSlotInUse.begin(), grantSlotInUse.end(), false);
+    if (freeSlot == grantSlotInUse.end()) {
+        std::string err = "Cannot register more than " +
+                          std::to_string(MAX_MULTIPLEXED_THREADS) +
+                          " threads through an agent";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    uint32_t slot =
+        static_cast<uint32_t>(std::distance(grantSlotInUse.begin(), freeSlot));
+
+    sendMessage(THREAD_REGISTER, threadId, &slot, sizeof(slot),
+                "Error registering thread");
+    grantSlotInUse[slot] = true;
+    struct ProxiedThread& thread = threads[threadId];
+    thread.grantSlot = slot;
+    thread.blockedGrantCount =
+        processStats->threadGrantSlots[slot].grantCount.load();
+
+    LOG(NOTICE, "Registered thread %d of process %d in grant slot %u",
+        threadId, processId, slot);
+}
+
+/**
+ * Tells the server that the given thread no longer wishes to run on managed
+ * cores. The agent should call this before the thread exits, or when it stops
+ * managing the thread.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param threadId
+ *     A thread previously passed to registerThread()
+ */
+void
+CoreArbiterAgent::unregisterThread(pid_t threadId) {
+    struct ProxiedThread& thread = getThread(threadId);
+    grantSlotInUse[thread.grantSlot] = false;
+    threads.erase(threadId);
+    sendMessage(THREAD_UNREGISTER, threadId, NULL, 0,
+                "Error sending unregister message");
+}
+
+/**
+ * Requests cores for the managed process, exactly as
+ * CoreArbiterClient::setRequestedCores() does for the calling process.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param numCores
+ *     The number of cores requested at each of the NUM_PRIORITIES priority
+ *     levels. Lower indexes have higher priority.
+ */
+void
+CoreArbiterAgent::setRequestedCores(std::vector<uint32_t> numCores) {
+    if (numCores.size() != NUM_PRIORITIES) {
+        std::string err = "Core request must have " +
+                          std::to_string(NUM_PRIORITIES) + " priorities";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    if (serverSocket < 0) {
+        connect();
+    }
+
+    sendMessage(CORE_REQUEST, CONTROL_CONNECTION_ID, &numCores[0],
+                sizeof(uint32_t) * NUM_PRIORITIES,
+                "Error sending core request");
+}
+
+/**
+ * Requests cores for the managed process as a whole, as
+ * CoreArbiterClient::setProcessCores() does for the calling process. This is
+ * the simplest way to give a program that cannot be modified exclusive cores:
+ * the agent need not register its threads or yield for them, since the server
+ * moves all of them into a private cpuset holding the granted cores.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param numCores
+ *     The number of cores requested at each of the NUM_PRIORITIES priority
+ *     levels. Lower indexes have higher priority.
+ */
+void
+CoreArbiterAgent::setProcessCores(std::vector<uint32_t> numCores) {
+    if (numCores.size() != NUM_PRIORITIES) {
+        std::string err = "Core request must have " +
+                          std::to_string(NUM_PRIORITIES) + " priorities";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    if (serverSocket < 0) {
+        connect();
+    }
+
+    sendMessage(PROCESS_CORE_REQUEST, CONTROL_CONNECTION_ID, &numCores[0],
+                sizeof(uint32_t) * NUM_PRIORITIES,
+                "Error sending process core request");
+}
+
+/**
+ * Tells the server that the given thread has stopped running and is waiting
+ * for a core. This is how a thread is first offered a core, and how the agent
+ * gives back a core that mustReleaseCore() asked for; in the latter case the
+ * thread must already be stopped (for example, its vCPU paused), since the
+ * server may hand the core to another thread at once. Unlike
+ * CoreArbiterClient::blockUntilCoreAvailable() this does not wait: the agent
+ * polls getGrantedCore() to find out when to let the thread run again.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param threadId
+ *     A thread previously passed to registerThread()
+ */
+void
+CoreArbiterAgent::threadBlocked(pid_t threadId) {
+    struct ProxiedThread& thread = getThread(threadId);
+    thread.blockedGrantCount =
+        processStats->threadGrantSlots[thread.grantSlot].grantCount.load();
+    sendMessage(THREAD_BLOCK, threadId, NULL, 0, "Error sending block message");
+}
+
+/**
+ * Returns the managed core that the server has granted the given thread since
+ * it last blocked, or -1 if it is still waiting for one. By the time a core is
+ * returned the server has already moved the thread onto it.
+ *
+ * \param threadId
+ *     A thread previously passed to registerThread()
+ */
+int
+CoreArbiterAgent::getGrantedCore(pid_t threadId) {
+    struct ProxiedThread& thread = getThread(threadId);
+    ThreadGrantSlot& slot = processStats->threadGrantSlots[thread.grantSlot];
+    if (slot.grantCount.load() == thread.blockedGrantCount) {
+        return -1;
+    }
+    return slot.coreId.load();
+}
+
+/**
+ * Returns true if the server wants the core of the given thread back. The
+ * agent should then stop the thread and call threadBlocked() within
+ * RELEASE_TIMEOUT_MS milliseconds; after that the server moves the thread to
+ * the unmanaged cores itself.
+ *
+ * \param threadId
+ *     A thread previously passed to registerThread()
+ */
+bool
+CoreArbiterAgent::mustReleaseCore(pid_t threadId) {
+    int coreId = getGrantedCore(threadId);
+    if (coreId < 0) {
+        return false;
+    }
+    return processStats->threadCommunicationBlocks[coreId]
+        .coreReleaseRequested.load();
+}
+
+// -- private methods
+
+/**
+ * Opens the agent's connection to the server and maps the managed process's
+ * shared memory.
+ *
+ * Throws a ClientException on error.
+ */
+void
+CoreArbiterAgent::connect() {
+    int socket = sys->socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket < 0) {
+        std::string err =
+            "Error creating socket: " + std::string(strerror(errno));
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+
+    struct sockaddr_un remote;
+    memset(&remote, 0, sizeof(remote));
+    remote.sun_family = AF_UNIX;
+    strncpy(remote.sun_path, serverSocketPath.c_str(),
+            sizeof(remote.sun_path) - 1);
+    if (sys->connect(socket, (struct sockaddr*)&remote, sizeof(remote)) < 0) {
+        std::string err = "Error connecting: " + std::string(strerror(errno));
+        LOG(ERROR, "%s", err.c_str());
+        sys->close(socket);
+        throw ClientException(err);
+    }
+    serverSocket = socket;
+
+    // Identify the managed process rather than ourselves, and mark the
+    // connection as an agent's so that the server checks our credentials.
+    pid_t ids[2] = {processId, AGENT_CONNECTION_ID};
+    if (sys->send(serverSocket, ids, sizeof(ids), 0) < 0) {
+        std::string err =
+            "Error sending process ID: " + std::string(strerror(errno));
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+
+    // The server sends the global shared memory path before the process's,
+    // but the agent has no use for the former.
+    readSharedMemoryPath();
+    std::string path = readSharedMemoryPath();
+    processSharedMemFd = sys->open(path.c_str(), O_RDWR);
+    if (processSharedMemFd < 0) {
+        std::string err = "Opening shared memory at path " + path +
+                          " failed: " + std::string(strerror(errno));
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    void* stats =
+        sys->mmap(NULL, sharedMemorySize(sizeof(struct ProcessStats)),
+                  PROT_READ | PROT_WRITE, MAP_SHARED, processSharedMemFd, 0);
+    if (stats == MAP_FAILED) {
+        std::string err = "mmap failed: " + std::string(strerror(errno));
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    processStats = static_cast<struct ProcessStats*>(stats);
+
+    LOG(NOTICE, "Opened agent connection for process %d", processId);
+}
+
+/**
+ * Reads a shared memory path, preceded by its length, from the server.
+ *
+ * Throws a ClientException on error.
+ */
+std::string
+CoreArbiterAgent::readSharedMemoryPath() {
+    size_t pathLen;
+    readData(&pathLen, sizeof(size_t),
+             "Error receiving shared memory path length");
+    std::vector<char> path(pathLen);
+    readData(&path[0], pathLen, "Error receiving shared memory path");
+    return std::string(&path[0]);
+}
+
+/**
+ * Returns the agent's record of a registered thread.
+ *
+ * Throws a ClientException if the thread is not registered.
+ */
+struct CoreArbiterAgent::ProxiedThread&
+CoreArbiterAgent::getThread(pid_t threadId) {
+    auto threadIter = threads.find(threadId);
+    if (threadIter == threads.end()) {
+        std::string err =
+            "Thread " + std::to_string(threadId) + " is not registered";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    return threadIter->second;
+}
+
+/**
+ * Sends a control message on behalf of one of the managed process's threads
+ * (see makeControlMessage()).
+ *
+ * Throws a ClientException on error.
+ *
+ * \param msgType
+ *     The type of message, e.g. THREAD_BLOCK
+ * \param threadId
+ *     The thread that the message is about
+ * \param payload
+ *     Data that follows the header; may be NULL if payloadBytes is 0
+ * \param payloadBytes
+ *     The number of bytes of payload
+ * \param err
+ *     An error string for if the send fails
+ */
+void
+CoreArbiterAgent::sendMessage(uint8_t msgType, pid_t threadId, void* payload,
+                              size_t payloadBytes, std::string err) {
+    std::vector<char> message =
+        makeControlMessage(msgType, threadId, payload, payloadBytes);
+    if (sys->send(serverSocket, message.data(), message.size(), 0) < 0) {
+        std::string fullErrStr = err + ": " + std::string(strerror(errno));
+        LOG(ERROR, "%s", fullErrStr.c_str());
+        throw ClientException(fullErrStr);
+    }
+}
+
+/**
+ * Reads exactly numBytes from the server into buf.
+ *
+ * Throws a ClientException with the given message on error.
+ */
+void
+CoreArbiterAgent::readData(void* buf, size_t numBytes, std::string err) {
+    ssize_t readBytes = sys->recv(serverSocket, buf, numBytes, 0);
+    if (readBytes < 0) {
+        std::string fullErrStr = err + ": " + std::string(strerror(errno));
+        LOG(ERROR, "%s", fullErrStr.c_str());
+        throw ClientException(fullErrStr);
+    } else if ((size_t)readBytes < numBytes) {
+        std::string fullErrStr = err + ": Expected " +
+                                 std::to_string(numBytes) +
+                                 " bytes but received " +
+                                 std::to_string(readBytes);
+        LOG(ERROR, "%s", fullErrStr.c_str());
+        throw ClientException(fullErrStr);
+    }
+}
+
+}  // namespace CoreArbiter
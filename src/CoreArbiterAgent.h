@@ -0,0 +1,108 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_ARBITER_AGENT_H_
+#define CORE_ARBITER_AGENT_H_
+
+#include <sys/types.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CoreArbiterClient.h"
+#include "CoreArbiterCommon.h"
+#include "Syscall.h"
+
+namespace CoreArbiter {
+
+/**
+ * Lets a privileged process obtain managed cores for the threads of another
+ * process that does not link the CoreArbiterClient, such as the vCPU threads
+ * of a virtual machine. The agent registers those threads with the server,
+ * requests cores on their process's behalf, and does the yielding for them:
+ * when the server asks for one of their cores back, the agent stops the
+ * thread (for example by pausing the vCPU) and tells the server that the
+ * thread has blocked. The server moves the threads between cpusets itself,
+ * exactly as it does for its own clients.
+ *
+ * The server only accepts agents that run as root. An agent is expected to
+ * drive all of its threads from a single loop, so this class is not thread
+ * safe.
+ */
+class CoreArbiterAgent {
+  public:
+    CoreArbiterAgent(std::string serverSocketPath, pid_t processId);
+    ~CoreArbiterAgent();
+
+    void registerThread(pid_t threadId);
+    void unregisterThread(pid_t threadId);
+    void setRequestedCores(std::vector<uint32_t> numCores);
+    void setProcessCores(std::vector<uint32_t> numCores);
+    void threadBlocked(pid_t threadId);
+    int getGrantedCore(pid_t threadId);
+    bool mustReleaseCore(pid_t threadId);
+
+  private:
+    /**
+     * What the agent knows about one of the threads it registered.
+     */
+    struct ProxiedThread {
+        // The index of the ThreadGrantSlot through which the server hands
+        // this thread cores.
+        uint32_t grantSlot;
+
+        // The slot's grantCount when the thread registered or last blocked.
+        // A different count means that the thread has since been granted a
+        // core.
+        int blockedGrantCount;
+    };
+
+    void connect();
+    std::string readSharedMemoryPath();
+    struct ProxiedThread& getThread(pid_t threadId);
+    void sendMessage(uint8_t msgType, pid_t threadId, void* payload,
+                     size_t payloadBytes, std::string err);
+    void readData(void* buf, size_t numBytes, std::string err);
+
+    // The path to the socket that the CoreArbiterServer is listening on.
+    std::string serverSocketPath;
+
+    // The process whose threads this agent manages.
+    pid_t processId;
+
+    // The agent's connection to the server, or -1 before the first call
+    // that needs it.
+    int serverSocket;
+
+    // The file descriptor and mapping of the managed process's
+    // ProcessStats, through which the server grants cores and asks for them
+    // back.
+    int processSharedMemFd;
+    struct ProcessStats* processStats;
+
+    // The threads registered through this agent, by thread ID.
+    std::unordered_map<pid_t, struct ProxiedThread> threads;
+
+    // Entry i is true if index i of ProcessStats::threadGrantSlots belongs to
+    // one of the registered threads.
+    std::vector<bool> grantSlotInUse;
+
+    // Used for all syscalls for easier unit testing.
+    static Syscall* sys;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_ARBITER_AGENT_H_
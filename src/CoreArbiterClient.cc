@@ -14,12 +14,16 @@
  */
 
 #include <fcntl.h>
+#include <linux/rseq.h>
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
 
 #include <algorithm>
 #include <iterator>
@@ -39,6 +43,20 @@ namespace CoreArbiter {
 
 thread_local int CoreArbiterClient::serverSocket = -1;
 thread_local int CoreArbiterClient::coreId = -1;
+thread_local int CoreArbiterClient::grantSlot = -1;
+thread_local struct rseq* CoreArbiterClient::rseqArea = NULL;
+
+// The rseq area registered by registerRseq() when the C library has not
+// already registered one for this thread.
+static thread_local struct rseq ownRseqArea;
+
+// The signature the kernel checks before an rseq abort handler. The value is
+// the one glibc uses, so that the area could be shared with other libraries.
+#ifdef RSEQ_SIG
+static const uint32_t CLIENT_RSEQ_SIG = RSEQ_SIG;
+#else
+static const uint32_t CLIENT_RSEQ_SIG = 0x53053053;
+#endif
 
 static Syscall defaultSyscall;
 Syscall* CoreArbiterClient::sys = &defaultSyscall;
@@ -71,19 +89,33 @@ timeTrace(const char* format, uint64_t arg0 = 0, uint64_t arg1 = 0,
  * \param serverSocketPath
  *     The path to the socket that the server is listening
  *     for connections on.
+ * \param multiplexThreads
+ *     If true, all threads in this process share a single connection to the
+ *     server instead of opening one each. This keeps the server's file
+ *     descriptor and epoll usage proportional to the number of processes
+ *     rather than the number of threads.
  */
-CoreArbiterClient::CoreArbiterClient(std::string serverSocketPath)
+CoreArbiterClient::CoreArbiterClient(std::string serverSocketPath,
+                                     bool multiplexThreads)
     : mutex(),
       numOwnedCores(0),
       numBlockedThreads(0),
       serverSocketPath(serverSocketPath),
       processSharedMemFd(-1),
-      globalSharedMemFd(-1) {}
+      globalSharedMemFd(-1),
+      multiplexThreads(multiplexThreads),
+      controlSocket(-1),
+      controlSocketMutex(),
+      blockingThreads(),
+      grantSlotInUse(MAX_MULTIPLEXED_THREADS, false) {}
 
 CoreArbiterClient::~CoreArbiterClient() {
     if (!testingSkipConnectionSetup) {
         sys->close(processSharedMemFd);
         sys->close(globalSharedMemFd);
+        if (controlSocket >= 0) {
+            sys->close(controlSocket);
+        }
     }
 }
 
@@ -101,6 +133,8 @@ CoreArbiterClient::~CoreArbiterClient() {
  * This request for cores is handled asynchronously by the server. See
  * blockUntilCoreAvailable() and getnumOwnedCores() for how to actually place
  * a thread on a core and check how many cores the process currently owns.
+ * If the server is busy polling, the request is written to shared memory
+ * rather than sent.
  *
  * Throws a ClientException on error.
  *
@@ -130,6 +164,27 @@ CoreArbiterClient::setRequestedCores(std::vector<uint32_t> numCores) {
 
     LOG(NOTICE, "Core request: %s", result.str().c_str());
 
+    if (globalStats && globalStats->busyPolling) {
+        // The server is watching shared memory for requests. The version is
+        // odd while the request is being rewritten, so that the server can
+        // tell that it should not use it yet.
+        Lock lock(mutex);
+        uint32_t version = processStats->coreRequestVersion.load();
+        processStats->coreRequestVersion = version + 1;
+        for (size_t i = 0; i < NUM_PRIORITIES; i++) {
+            processStats->requestedCores[i] = numCores[i];
+        }
+        processStats->coreRequestVersion = version + 2;
+        return;
+    }
+
+    if (multiplexThreads) {
+        sendControlMessage(CORE_REQUEST, &numCores[0],
+                           sizeof(uint32_t) * NUM_PRIORITIES,
+                           "Error sending core request");
+        return;
+    }
+
     uint8_t coreRequestMsg = CORE_REQUEST;
     sendData(serverSocket, &coreRequestMsg, sizeof(uint8_t),
              "Error sending core request prefix");
@@ -138,6 +193,322 @@ CoreArbiterClient::setRequestedCores(std::vector<uint32_t> numCores) {
              "Error sending core request priorities");
 }
 
+/**
+ * Like setRequestedCores(), but asks for a range of cores at each priority
+ * level. This suits applications that can make use of a varying number of
+ * cores: rather than guessing an exact count and sending a new request every
+ * time their load changes, they state what they need and what they could use.
+ * The server guarantees the minimum at each priority as if it had been
+ * requested with setRequestedCores(). The cores beyond it are granted only
+ * after every process's minimums at all priorities have been met, in
+ * priority order, and are reclaimed first when other processes' demand rises.
+ * A later call to setRequestedCores() replaces the range.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param minCores
+ *     The number of cores this process needs at every priority level. The
+ *     vector must have NUM_PRIORITIES entries.
+ * \param maxCores
+ *     The number of cores this process could use at every priority level. The
+ *     vector must have NUM_PRIORITIES entries, none smaller than the
+ *     corresponding entry of minCores.
+ */
+void
+CoreArbiterClient::setRequestedCoreRange(std::vector<uint32_t> minCores,
+                                         std::vector<uint32_t> maxCores) {
+    if (minCores.size() != NUM_PRIORITIES ||
+        maxCores.size() != NUM_PRIORITIES) {
+        std::string err = "Core range request must have " +
+                          std::to_string(NUM_PRIORITIES) + " priorities";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    for (size_t priority = 0; priority < NUM_PRIORITIES; priority++) {
+        if (minCores[priority] > maxCores[priority]) {
+            std::string err = "Core range request has a minimum above its "
+                              "maximum at priority " +
+                              std::to_string(priority);
+            LOG(ERROR, "%s", err.c_str());
+            throw ClientException(err);
+        }
+    }
+
+    if (serverSocket < 0) {
+        // This thread has not yet registered with the server
+        createNewServerConnection();
+    }
+
+    std::stringstream result;
+    for (size_t priority = 0; priority < NUM_PRIORITIES; priority++) {
+        result << minCores[priority] << "-" << maxCores[priority] << " ";
+    }
+    LOG(NOTICE, "Core range request: %s", result.str().c_str());
+
+    std::vector<uint32_t> coreRange(minCores);
+    coreRange.insert(coreRange.end(), maxCores.begin(), maxCores.end());
+    if (multiplexThreads) {
+        sendControlMessage(CORE_RANGE_REQUEST, &coreRange[0],
+                           sizeof(uint32_t) * coreRange.size(),
+                           "Error sending core range request");
+        return;
+    }
+
+    uint8_t coreRangeRequestMsg = CORE_RANGE_REQUEST;
+    sendData(serverSocket, &coreRangeRequestMsg, sizeof(uint8_t),
+             "Error sending core range request prefix");
+    sendData(serverSocket, &coreRange[0], sizeof(uint32_t) * coreRange.size(),
+             "Error sending core range request");
+}
+
+/**
+ * Asks the server for up to numCores additional cores as a scavenger. Scavenger
+ * cores are only granted when no process wants them at any priority set with
+ * setRequestedCores(), and may be revoked at any moment. A thread holding one
+ * must watch mustReleaseCore() closely: it has SCAVENGER_RELEASE_TIMEOUT_MS
+ * rather than RELEASE_TIMEOUT_MS to give the core back before it is moved to
+ * the unmanaged core.
+ *
+ * Like setRequestedCores(), this applies to the whole process and is handled
+ * asynchronously by the server.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param numCores
+ *     The number of scavenger cores this process wants
+ */
+void
+CoreArbiterClient::setScavengerCores(uint32_t numCores) {
+    if (serverSocket < 0) {
+        // This thread has not yet registered with the server
+        createNewServerConnection();
+    }
+
+    LOG(NOTICE, "Scavenger core request: %u", numCores);
+
+    if (multiplexThreads) {
+        sendControlMessage(SCAVENGER_REQUEST, &numCores, sizeof(uint32_t),
+                           "Error sending scavenger core request");
+        return;
+    }
+
+    uint8_t scavengerRequestMsg = SCAVENGER_REQUEST;
+    sendData(serverSocket, &scavengerRequestMsg, sizeof(uint8_t),
+             "Error sending scavenger core request prefix");
+    sendData(serverSocket, &numCores, sizeof(uint32_t),
+             "Error sending scavenger core request");
+}
+
+/**
+ * Asks the server for cores for the whole process rather than for individual
+ * threads, for programs whose threads never call blockUntilCoreAvailable().
+ * The server gives the process a private cpuset containing the cores it is
+ * granted and moves all of its threads into it, growing and shrinking the
+ * cpuset as the grant changes. Cores are shared with other processes by
+ * priority, as with setRequestedCores(), but are taken back without waiting
+ * for the process to release them. A process using this should not also block
+ * its threads for cores.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param numCores
+ *     A vector with the number of cores requested at each of the
+ *     NUM_PRIORITIES priority levels. Lower indexes have higher priority.
+ */
+void
+CoreArbiterClient::setProcessCores(std::vector<uint32_t> numCores) {
+    if (numCores.size() != NUM_PRIORITIES) {
+        std::string err = "Core request must have " +
+                          std::to_string(NUM_PRIORITIES) + " priorities";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+
+    if (serverSocket < 0) {
+        // This thread has not yet registered with the server
+        createNewServerConnection();
+    }
+
+    if (multiplexThreads) {
+        sendControlMessage(PROCESS_CORE_REQUEST, &numCores[0],
+                           sizeof(uint32_t) * NUM_PRIORITIES,
+                           "Error sending process core request");
+        return;
+    }
+
+    uint8_t processCoreRequestMsg = PROCESS_CORE_REQUEST;
+    sendData(serverSocket, &processCoreRequestMsg, sizeof(uint8_t),
+             "Error sending process core request prefix");
+    sendData(serverSocket, &numCores[0], sizeof(uint32_t) * NUM_PRIORITIES,
+             "Error sending process core request");
+}
+
+/**
+ * Asks the server to treat this process's blocked threads as a gang: rather
+ * than waking them one at a time as cores free up, the server holds cores
+ * back until it can wake enough threads at once for the process to be running
+ * gangSize threads on managed cores, preferably within one NUMA node. This
+ * suits bulk-synchronous applications whose threads would otherwise spin at a
+ * barrier waiting for the rest of the gang. If the gang cannot be placed
+ * within timeoutMs, the server falls back to granting cores one at a time.
+ *
+ * Like setRequestedCores(), this applies to the whole process and is handled
+ * asynchronously by the server. The number of cores requested should be at
+ * least gangSize.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param gangSize
+ *     The number of threads that should run together, or 0 to go back to
+ *     waking threads one at a time
+ * \param timeoutMs
+ *     How long the server may hold cores back while assembling the gang
+ */
+void
+CoreArbiterClient::setGangSize(uint32_t gangSize, uint32_t timeoutMs) {
+    if (serverSocket < 0) {
+        // This thread has not yet registered with the server
+        createNewServerConnection();
+    }
+
+    LOG(NOTICE, "Gang request: %u threads, timeout %u ms", gangSize,
+        timeoutMs);
+
+    uint32_t gangRequest[2] = {gangSize, timeoutMs};
+    if (multiplexThreads) {
+        sendControlMessage(GANG_REQUEST, gangRequest, sizeof(gangRequest),
+                           "Error sending gang request");
+        return;
+    }
+
+    uint8_t gangRequestMsg = GANG_REQUEST;
+    sendData(serverSocket, &gangRequestMsg, sizeof(uint8_t),
+             "Error sending gang request prefix");
+    sendData(serverSocket, gangRequest, sizeof(gangRequest),
+             "Error sending gang request");
+}
+
+/**
+ * Asks the server to grant this process cores of the given class where it
+ * can, such as performance cores for latency-sensitive work or efficiency
+ * cores for background work. Whatever the class, the server gives its
+ * highest-capacity cores to the highest priorities first; this only changes
+ * which of the available cores this process's threads are placed on. Cores
+ * of other classes are granted when none of the requested class are free.
+ * The class of each core can be read with getCoreClass().
+ *
+ * Like setRequestedCores(), this applies to the whole process and is handled
+ * asynchronously by the server.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param coreClass
+ *     CORE_CLASS_PERFORMANCE, CORE_CLASS_EFFICIENCY, or CORE_CLASS_ANY to
+ *     take whichever cores the server chooses
+ */
+void
+CoreArbiterClient::setCoreClass(uint8_t coreClass) {
+    if (coreClass > CORE_CLASS_EFFICIENCY) {
+        throw ClientException("Unknown core class " +
+                              std::to_string(coreClass));
+    }
+    if (serverSocket < 0) {
+        // This thread has not yet registered with the server
+        createNewServerConnection();
+    }
+
+    LOG(NOTICE, "Core class request: %u", coreClass);
+
+    if (multiplexThreads) {
+        sendControlMessage(CORE_CLASS_REQUEST, &coreClass, sizeof(coreClass),
+                           "Error sending core class request");
+        return;
+    }
+
+    uint8_t coreClassMsg = CORE_CLASS_REQUEST;
+    sendData(serverSocket, &coreClassMsg, sizeof(uint8_t),
+             "Error sending core class request prefix");
+    sendData(serverSocket, &coreClass, sizeof(coreClass),
+             "Error sending core class request");
+}
+
+/**
+ * Publishes how much this process would gain from each additional core, so
+ * that a server that allocates by utility (see the --allocateByUtility server
+ * option) can give the cores available at a priority to whichever process
+ * gains the most from them. Priorities still take precedence, and the server
+ * never grants more cores than were requested. Utilities are compared across
+ * processes, so they should be in common units such as requests per second;
+ * a process that publishes no curve values every core at 1.
+ *
+ * The curve is written directly into this process's shared memory and picked
+ * up by the server within a few milliseconds, so it is cheap to update as the
+ * process's load changes.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param marginalUtilities
+ *     Entry i is how much more useful i + 1 cores are than i cores. Cores
+ *     beyond the end of the curve are treated as worthless. At most
+ *     MAX_SUPPORTED_CORES entries; an empty curve withdraws the curve.
+ */
+void
+CoreArbiterClient::setUtilityCurve(std::vector<float> marginalUtilities) {
+    if (marginalUtilities.size() > MAX_SUPPORTED_CORES) {
+        std::string err = "Utility curve cannot have more than " +
+                          std::to_string(MAX_SUPPORTED_CORES) + " points";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+
+    if (serverSocket < 0) {
+        // This thread has not yet registered with the server
+        createNewServerConnection();
+    }
+
+    Lock lock(mutex);
+    // The version is odd while the curve is being rewritten, so the server
+    // can tell that it should not use it yet.
+    uint32_t version = processStats->utilityCurveVersion.load();
+    processStats->utilityCurveVersion = version + 1;
+    for (size_t i = 0; i < marginalUtilities.size(); i++) {
+        processStats->marginalUtilities[i] = marginalUtilities[i];
+    }
+    processStats->numUtilityPoints =
+        static_cast<uint32_t>(marginalUtilities.size());
+    processStats->utilityCurveVersion = version + 2;
+}
+
+/**
+ * Tells the server how the calling thread has spent its time on its managed
+ * core since the last call. Runtimes whose threads spin while waiting for work
+ * should call this periodically from each thread that holds a core, so that
+ * the server can tell how many of the process's cores are actually in use. The
+ * server reports each process's efficiency (busy cycles over cycles granted)
+ * in GlobalStats, and when other processes are waiting for cores, it reclaims
+ * cores that stay idle. The process gets reclaimed cores back once it keeps
+ * all of its remaining cores busy or changes its core request.
+ *
+ * This only touches shared memory, and does nothing if the calling thread does
+ * not hold a managed core.
+ *
+ * \param busyCycles
+ *     The number of cycles spent doing useful work since the last call
+ * \param idleCycles
+ *     The number of cycles spent waiting for work since the last call
+ */
+void
+CoreArbiterClient::recordCoreUtilization(uint64_t busyCycles,
+                                         uint64_t idleCycles) {
+    if (coreId < 0 || !processStats) {
+        return;
+    }
+
+    CoreUtilization& utilization = processStats->coreUtilization[coreId];
+    utilization.busyCycles.fetch_add(busyCycles, std::memory_order_relaxed);
+    utilization.idleCycles.fetch_add(idleCycles, std::memory_order_relaxed);
+}
+
 /**
  * Returns true if the server has requested that this client release a core. It
  * will only return true once per core that should be released. The caller is
@@ -186,14 +557,43 @@ CoreArbiterClient::threadPreempted() {
  * Throws a ClientException on error.
  *
  * \return
- *     The core ID of the core that this thread has woken up on.
+ *     The core ID of the core that this thread has woken up on, or -1 if
+ *     cancelBlock() was called on this thread.
  */
 int
 CoreArbiterClient::blockUntilCoreAvailable() {
     if (serverSocket < 0) {
         // This thread has not yet registered with the server
         createNewServerConnection();
-    } else if (coreId >= 0) {
+    }
+
+    // Tell cancelBlock() how to wake this thread. This is done under the same
+    // lock that it takes, and before reading the grant count to wait on, so
+    // that a cancellation is never missed.
+    int grantCount = 0;
+    {
+        Lock lock(mutex);
+        BlockingThread& thread = blockingThreads[sys->gettid()];
+        if (thread.cancelled) {
+            thread.cancelled = false;
+            if (coreId >= 0) {
+                numOwnedCores--;
+                coreId = -1;
+            }
+            LOG(NOTICE, "Thread %d is not blocking because it was cancelled",
+                sys->gettid());
+            return -1;
+        }
+        if (multiplexThreads) {
+            thread.grantSlot = grantSlot;
+            grantCount =
+                processStats->threadGrantSlots[grantSlot].grantCount.load();
+        } else {
+            thread.socket = serverSocket;
+        }
+    }
+
+    if (coreId >= 0) {
         // This thread currently has exclusive access to a core. We need to
         // check whether it should be blocking.
         if (!processStats->threadCommunicationBlocks[coreId]
@@ -211,6 +611,52 @@ CoreArbiterClient::blockUntilCoreAvailable() {
 
     numBlockedThreads++;
 
+    if (multiplexThreads) {
+        // The server grants this thread a core by bumping the grant count in
+        // its slot. Read the count before blocking so that a grant that
+        // arrives before we start waiting is not missed.
+        ThreadGrantSlot& slot = processStats->threadGrantSlots[grantSlot];
+        if (globalStats && globalStats->busyPolling) {
+            // The server is watching the slot, so there is no need to send
+            // a message
+            slot.blockCount++;
+        } else {
+            try {
+                sendControlMessage(THREAD_BLOCK, NULL, 0,
+                                   "Error sending block message");
+            } catch (const ClientException&) {
+                numBlockedThreads--;
+                throw;
+            }
+        }
+
+        LOG(NOTICE, "Thread %d is blocking until granted a core by server",
+            sys->gettid());
+        while (slot.grantCount.load() == grantCount) {
+            if (sys->futexWait(reinterpret_cast<int*>(&slot.grantCount),
+                               grantCount) < 0 &&
+                errno != EAGAIN && errno != EINTR) {
+                std::string err = "Error waiting for core grant: " +
+                                  std::string(strerror(errno));
+                LOG(ERROR, "%s", err.c_str());
+                throw ClientException(err);
+            }
+        }
+        if (takeBlockCancellation()) {
+            numBlockedThreads--;
+            coreId = -1;
+            return -1;
+        }
+        coreId = slot.coreId.load();
+
+        LOG(NOTICE, "Thread %d woke up on core %d.", sys->gettid(), coreId);
+        numOwnedCores++;
+        numBlockedThreads--;
+
+        timeTrace("CLIENT: blockUntilCoreAvailable just obtained a core");
+        return coreId;
+    }
+
     uint8_t threadBlockMsg = THREAD_BLOCK;
     if (sys->send(serverSocket, &threadBlockMsg, sizeof(uint8_t), 0) < 0) {
         numBlockedThreads--;
@@ -224,8 +670,24 @@ CoreArbiterClient::blockUntilCoreAvailable() {
     LOG(NOTICE, "Thread %d is blocking until message received from server",
         sys->gettid());
     coreId = -1;
-    readData(serverSocket, &coreId, sizeof(int),
-             "Error receiving core ID from server");
+    ssize_t readBytes = sys->recv(serverSocket, &coreId, sizeof(int), 0);
+    if (readBytes == 0 && takeBlockCancellation()) {
+        // cancelBlock() shut down the socket for reading
+        numBlockedThreads--;
+        return -1;
+    }
+    if (readBytes != sizeof(int)) {
+        numBlockedThreads--;
+        std::string err = "Error receiving core ID from server";
+        if (readBytes < 0) {
+            err += ": " + std::string(strerror(errno));
+        } else {
+            err += ": Expected " + std::to_string(sizeof(int)) +
+                   " bytes but received " + std::to_string(readBytes);
+        }
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
 
     LOG(NOTICE, "Thread %d woke up on core %d.", sys->gettid(), coreId);
     numOwnedCores++;
@@ -235,6 +697,58 @@ CoreArbiterClient::blockUntilCoreAvailable() {
     return coreId;
 }
 
+/**
+ * Makes a thread's call to blockUntilCoreAvailable() return -1 without a core,
+ * whether the thread is waiting in it now or calls it later. This lets a
+ * thread that may never be granted a core be stopped. The thread should call
+ * unregisterThread() once it has been woken this way, since it can no longer
+ * wait for cores.
+ *
+ * \param threadId
+ *     The thread to wake, which must belong to this process
+ */
+void
+CoreArbiterClient::cancelBlock(pid_t threadId) {
+    Lock lock(mutex);
+    BlockingThread& thread = blockingThreads[threadId];
+    thread.cancelled = true;
+
+    if (thread.grantSlot >= 0) {
+        // Only the server bumps the grant count otherwise, so the thread
+        // knows to check whether it was cancelled
+        ThreadGrantSlot& slot =
+            processStats->threadGrantSlots[thread.grantSlot];
+        slot.grantCount++;
+        if (sys->futexWake(reinterpret_cast<int*>(&slot.grantCount), 1) < 0) {
+            LOG(ERROR, "Error waking thread %d: %s", threadId,
+                strerror(errno));
+        }
+    } else if (thread.socket >= 0) {
+        // The thread's recv() returns 0 once its socket is shut down
+        if (sys->shutdown(thread.socket, SHUT_RD) < 0) {
+            LOG(ERROR, "Error waking thread %d: %s", threadId,
+                strerror(errno));
+        }
+    }
+}
+
+/**
+ * Returns true if cancelBlock() was called on this thread since it last
+ * returned -1 from blockUntilCoreAvailable(), and resets that.
+ */
+bool
+CoreArbiterClient::takeBlockCancellation() {
+    Lock lock(mutex);
+    auto threadIter = blockingThreads.find(sys->gettid());
+    if (threadIter == blockingThreads.end() || !threadIter->second.cancelled) {
+        return false;
+    }
+    threadIter->second.cancelled = false;
+    LOG(NOTICE, "Thread %d stopped blocking because it was cancelled",
+        sys->gettid());
+    return true;
+}
+
 /**
  * Tells the server that this thread no longer wishes to run on managed cores.
  * This should always be called before a thread exits to ensure that the server
@@ -242,6 +756,11 @@ CoreArbiterClient::blockUntilCoreAvailable() {
  */
 void
 CoreArbiterClient::unregisterThread() {
+    {
+        Lock lock(mutex);
+        blockingThreads.erase(sys->gettid());
+    }
+
     if (serverSocket < 0) {
         LOG(WARNING,
             "Cannot unregister a thread that was not previously "
@@ -251,6 +770,23 @@ CoreArbiterClient::unregisterThread() {
 
     LOG(NOTICE, "Unregistering thread %d", sys->gettid());
 
+    if (multiplexThreads) {
+        // The control connection stays open for the process's other threads,
+        // so tell the server about this thread explicitly.
+        try {
+            sendControlMessage(THREAD_UNREGISTER, NULL, 0,
+                               "Error sending unregister message");
+        } catch (const ClientException&) {
+            // The error has already been logged, and there is nothing more
+            // this thread can do about it.
+        }
+        Lock lock(mutex);
+        grantSlotInUse[grantSlot] = false;
+        grantSlot = -1;
+        serverSocket = -1;
+        return;
+    }
+
     // Closing this socket alerts the server, which will clean up this thread's
     // state
     if (sys->close(serverSocket) < 0) {
@@ -258,11 +794,45 @@ CoreArbiterClient::unregisterThread() {
     }
 }
 
+/**
+ * Returns the ID of the managed core that the server most recently granted to
+ * this thread, or -1 if it has none. A thread that has been preempted keeps
+ * this ID until it calls blockUntilCoreAvailable(); see getCurrentCore() for
+ * the core it is actually running on.
+ */
 int
 CoreArbiterClient::getCoreId() {
     return coreId;
 }
 
+/**
+ * Returns the ID of the core that this thread is running on right now. Once
+ * the thread has registered with the server this is a single load from its
+ * rseq area, which the kernel updates whenever the thread migrates; otherwise
+ * it falls back to sched_getcpu().
+ */
+int
+CoreArbiterClient::getCurrentCore() {
+    if (rseqArea) {
+        int32_t cpu = static_cast<int32_t>(
+            __atomic_load_n(&rseqArea->cpu_id, __ATOMIC_RELAXED));
+        if (cpu >= 0)
+            return cpu;
+    }
+    return sys->sched_getcpu();
+}
+
+/**
+ * Returns true if this thread holds a managed core and is still running on it.
+ * A thread that the server has forcibly moved to the unmanaged cores, because
+ * it did not release its core in time, gets false even though getCoreId()
+ * still reports the core it was granted.
+ */
+bool
+CoreArbiterClient::onManagedCore() {
+    return coreId >= 0 && getCurrentCore() == coreId;
+}
+
 // -- methods for testing
 
 /**
@@ -309,6 +879,22 @@ CoreArbiterClient::getNumBlockedThreads() {
     return numBlockedThreads.load();
 }
 
+/**
+ * Returns the class of the given core (CORE_CLASS_PERFORMANCE or
+ * CORE_CLASS_EFFICIENCY), or CORE_CLASS_ANY if the server does not arbitrate
+ * it.
+ */
+uint8_t
+CoreArbiterClient::getCoreClass(int coreId) {
+    if (serverSocket < 0) {
+        createNewServerConnection();
+    }
+    if (coreId < 0 || coreId >= MAX_SUPPORTED_CORES) {
+        return CORE_CLASS_ANY;
+    }
+    return globalStats->coreClasses[coreId];
+}
+
 /**
  * Returns the number of available cores under the server's control that do not
  * currently have a thread running exclusively.
@@ -357,9 +943,77 @@ CoreArbiterClient::createNewServerConnection() {
         return;
     }
 
+    registerRseq();
+    if (multiplexThreads) {
+        registerMultiplexedThread();
+        return;
+    }
+
+    pid_t threadId = sys->gettid();
+    serverSocket = connectToServer(threadId);
+
+    if (!processStats) {
+        // This is the first time this process is registering so we need to
+        // set up the shared memory pages
+        globalSharedMemFd = openSharedMemory(
+            reinterpret_cast<void**>(&globalStats),
+            sharedMemorySize(sizeof(struct GlobalStats)), false);
+        processSharedMemFd = openSharedMemory(
+            reinterpret_cast<void**>(&processStats),
+            sharedMemorySize(sizeof(struct ProcessStats)), true);
+    }
+
+    LOG(NOTICE, "Successfully registered process %d, thread %d with server.",
+        sys->getpid(), threadId);
+}
+
+/**
+ * Finds or sets up the calling thread's rseq area so that getCurrentCore() can
+ * read the thread's core from memory. Recent C libraries register an area for
+ * every thread themselves, and the kernel allows only one per thread, so that
+ * one is reused when it exists. If rseq is unavailable, rseqArea stays NULL
+ * and getCurrentCore() uses sched_getcpu() instead.
+ */
+void
+CoreArbiterClient::registerRseq() {
+    if (rseqArea)
+        return;
+
+#if __has_include(<sys/rseq.h>)
+    if (__rseq_size > 0) {
+        rseqArea = reinterpret_cast<struct rseq*>(
+            static_cast<char*>(__builtin_thread_pointer()) + __rseq_offset);
+        return;
+    }
+#endif
+
+    memset(&ownRseqArea, 0, sizeof(ownRseqArea));
+    ownRseqArea.cpu_id = static_cast<uint32_t>(RSEQ_CPU_ID_UNINITIALIZED);
+    if (sys->rseq(&ownRseqArea, sizeof(ownRseqArea), 0, CLIENT_RSEQ_SIG) < 0) {
+        LOG(NOTICE, "Unable to register rseq: %s; using sched_getcpu",
+            strerror(errno));
+        return;
+    }
+    rseqArea = &ownRseqArea;
+}
+
+/**
+ * Opens a new connection to the server and identifies this process and the
+ * given thread on it.
+ *
+ * Throws a ClientException on error.
+ *
+ * \param threadId
+ *     The thread that the connection belongs to, or CONTROL_CONNECTION_ID
+ *     for a control connection shared by all of this process's threads.
+ * \return
+ *     The socket file descriptor of the new connection
+ */
+int
+CoreArbiterClient::connectToServer(pid_t threadId) {
     // Set up a socket
-    serverSocket = sys->socket(AF_UNIX, SOCK_STREAM, 0);
-    if (serverSocket < 0) {
+    int socket = sys->socket(AF_UNIX, SOCK_STREAM, 0);
+    if (socket < 0) {
         std::string err =
             "Error creating socket: " + std::string(strerror(errno));
         LOG(ERROR, "%s", err.c_str());
@@ -371,34 +1025,90 @@ CoreArbiterClient::createNewServerConnection() {
     remote.sun_family = AF_UNIX;
     strncpy(remote.sun_path, serverSocketPath.c_str(),
             sizeof(remote.sun_path) - 1);
-    if (sys->connect(serverSocket, (struct sockaddr*)&remote, sizeof(remote)) <
-        0) {
+    if (sys->connect(socket, (struct sockaddr*)&remote, sizeof(remote)) < 0) {
         std::string err = "Error connecting: " + std::string(strerror(errno));
         LOG(ERROR, "%s", err.c_str());
-        serverSocket = -1;  // Set serverSocket back to -1 if connection failed
+        sys->close(socket);
         throw ClientException(err);
     }
 
     // Tell the server our process ID
     pid_t processId = sys->getpid();
-    sendData(serverSocket, &processId, sizeof(pid_t),
-             "Error sending process ID");
+    sendData(socket, &processId, sizeof(pid_t), "Error sending process ID");
 
     // Tell the server our thread ID
-    pid_t threadId = sys->gettid();
-    sendData(serverSocket, &threadId, sizeof(pid_t), "Error sending thread ID");
+    sendData(socket, &threadId, sizeof(pid_t), "Error sending thread ID");
 
-    if (!processStats) {
-        // This is the first time this process is registering so we need to
-        // set up the shared memory pages
-        globalSharedMemFd =
-            openSharedMemory(reinterpret_cast<void**>(&globalStats));
-        processSharedMemFd =
-            openSharedMemory(reinterpret_cast<void**>(&processStats));
+    return socket;
+}
+
+/**
+ * Registers the calling thread over this process's control connection,
+ * opening the connection first if this is the process's first thread. The
+ * thread is assigned a ThreadGrantSlot through which the server will hand it
+ * cores. The caller must hold mutex.
+ *
+ * Throws a ClientException on error.
+ */
+void
+CoreArbiterClient::registerMultiplexedThread() {
+    if (controlSocket < 0) {
+        serverSocket = connectToServer(CONTROL_CONNECTION_ID);
+        controlSocket = serverSocket;
+        globalSharedMemFd = openSharedMemory(
+            reinterpret_cast<void**>(&globalStats),
+            sharedMemorySize(sizeof(struct GlobalStats)), false);
+        processSharedMemFd = openSharedMemory(
+            reinterpret_cast<void**>(&processStats),
+            sharedMemorySize(sizeof(struct ProcessStats)), true);
+        LOG(NOTICE, "Opened control connection for process %d",
+            sys->getpid());
     }
 
-    LOG(NOTICE, "Successfully registered process %d, thread %d with server.",
-        processId, threadId);
+    auto freeSlot =
+        std::find(grantSlotInUse.begin(), grantSlotInUse.end(), false);
+    if (freeSlot == grantSlotInUse.end()) {
+        std::string err = "Cannot register more than " +
+                          std::to_string(MAX_MULTIPLEXED_THREADS) +
+                          " threads over a control connection";
+        LOG(ERROR, "%s", err.c_str());
+        throw ClientException(err);
+    }
+    uint32_t slot =
+        static_cast<uint32_t>(std::distance(grantSlotInUse.begin(), freeSlot));
+
+    serverSocket = controlSocket;
+    sendControlMessage(THREAD_REGISTER, &slot, sizeof(slot),
+                       "Error registering thread");
+    grantSlotInUse[slot] = true;
+    grantSlot = static_cast<int>(slot);
+
+    LOG(NOTICE, "Registered thread %d in grant slot %u", sys->gettid(), slot);
+}
+
+/**
+ * Sends a message on behalf of the calling thread over this process's control
+ * connection (see makeControlMessage()).
+ *
+ * Throws a ClientException on error.
+ *
+ * \param msgType
+ *     The type of message, e.g. THREAD_BLOCK
+ * \param payload
+ *     Data that follows the header; may be NULL if payloadBytes is 0
+ * \param payloadBytes
+ *     The number of bytes of payload
+ * \param err
+ *     An error string for if the send fails
+ */
+void
+CoreArbiterClient::sendControlMessage(uint8_t msgType, void* payload,
+                                      size_t payloadBytes, std::string err) {
+    std::vector<char> message =
+        makeControlMessage(msgType, sys->gettid(), payload, payloadBytes);
+
+    Lock lock(controlSocketMutex);
+    sendData(controlSocket, message.data(), message.size(), err);
 }
 
 /**
@@ -408,11 +1118,16 @@ CoreArbiterClient::createNewServerConnection() {
  *
  * \param bufPtr
  *     Double pointer to the location of the shared memory structure
+ * \param size
+ *     The number of bytes to map (see sharedMemorySize())
+ * \param writable
+ *     True if the client writes to part of the shared memory
  * \return
  *     The fild descriptor of the opened shared memory file
  */
 int
-CoreArbiterClient::openSharedMemory(void** bufPtr) {
+CoreArbiterClient::openSharedMemory(void** bufPtr, size_t size,
+                                    bool writable) {
     // Read the shared memory path length from the server
     size_t pathLen;
     readData(serverSocket, &pathLen, sizeof(size_t),
@@ -424,7 +1139,7 @@ CoreArbiterClient::openSharedMemory(void** bufPtr) {
              "Error receiving shared memory path");
 
     // Open the shared memory
-    int fd = sys->open(sharedMemPath, O_RDONLY);
+    int fd = sys->open(sharedMemPath, writable ? O_RDWR : O_RDONLY);
     if (fd < 0) {
         std::string err = "Opening shared memory at path " +
                           std::string(sharedMemPath) + " failed" +
@@ -433,7 +1148,8 @@ CoreArbiterClient::openSharedMemory(void** bufPtr) {
         throw ClientException(err);
     }
 
-    *bufPtr = sys->mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, fd, 0);
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    *bufPtr = sys->mmap(NULL, size, prot, MAP_SHARED, fd, 0);
     if (*bufPtr == MAP_FAILED) {
         std::string err = "mmap failed: " + std::string(strerror(errno));
         LOG(ERROR, "%s", err.c_str());
@@ -22,6 +22,7 @@
 #include <iostream>
 #include <mutex>
 #include <stdexcept>
+#include <unordered_map>
 #include <vector>
 
 #include "CoreArbiterCommon.h"
@@ -42,10 +43,11 @@ namespace CoreArbiter {
  */
 class CoreArbiterClient {
   public:
-    // Singleton methods
+    // Singleton methods. The arguments only take effect on the first call.
     static CoreArbiterClient* getInstance(
-        std::string serverSocketPath = "/tmp/CoreArbiter/socket") {
-        static CoreArbiterClient instance(serverSocketPath);
+        std::string serverSocketPath = "/tmp/CoreArbiter/socket",
+        bool multiplexThreads = false) {
+        static CoreArbiterClient instance(serverSocketPath, multiplexThreads);
         return &instance;
     }
     CoreArbiterClient(CoreArbiterClient const&) = delete;
@@ -54,12 +56,26 @@ class CoreArbiterClient {
     ~CoreArbiterClient();
 
     virtual void setRequestedCores(std::vector<uint32_t> numCores);
+    virtual void setRequestedCoreRange(std::vector<uint32_t> minCores,
+                                       std::vector<uint32_t> maxCores);
+    virtual void setScavengerCores(uint32_t numCores);
+    virtual void setProcessCores(std::vector<uint32_t> numCores);
+    virtual void setGangSize(uint32_t gangSize,
+                             uint32_t timeoutMs = GANG_TIMEOUT_MS);
+    virtual void setCoreClass(uint8_t coreClass);
+    virtual void setUtilityCurve(std::vector<float> marginalUtilities);
+    virtual void recordCoreUtilization(uint64_t busyCycles,
+                                       uint64_t idleCycles);
     virtual bool mustReleaseCore();
     virtual bool threadPreempted();
     virtual int blockUntilCoreAvailable();
+    virtual void cancelBlock(pid_t threadId);
     virtual uint32_t getNumOwnedCores();
     virtual void unregisterThread();
     virtual int getCoreId();
+    virtual int getCurrentCore();
+    virtual bool onManagedCore();
+    virtual uint8_t getCoreClass(int coreId);
 
     // Meant for testing, not general use
     uint32_t getNumOwnedCoresFromServer();
@@ -76,14 +92,21 @@ class CoreArbiterClient {
 
   protected:
     // Constructor is protected because CoreArbiterClient is a singleton
-    explicit CoreArbiterClient(std::string serverSocketPath);
+    explicit CoreArbiterClient(std::string serverSocketPath,
+                               bool multiplexThreads = false);
 
   private:
     void createNewServerConnection();
-    int openSharedMemory(void** bufPtr);
+    void registerRseq();
+    int connectToServer(pid_t threadId);
+    void registerMultiplexedThread();
+    void sendControlMessage(uint8_t msgType, void* payload,
+                            size_t payloadBytes, std::string err);
+    int openSharedMemory(void** bufPtr, size_t size, bool writable);
     void registerThread();
     void readData(int socket, void* buf, size_t numBytes, std::string err);
     void sendData(int socket, void* buf, size_t numBytes, std::string err);
+    bool takeBlockCancellation();
 
     typedef std::unique_lock<std::mutex> Lock;
 
@@ -125,16 +148,68 @@ class CoreArbiterClient {
     // clients connected to the server. This is mmapped for fast access.
     int globalSharedMemFd;
 
+    // If true, this process talks to the server over a single control
+    // connection shared by all of its threads, and the server hands cores to
+    // threads through ThreadGrantSlots in shared memory. Otherwise every
+    // thread opens its own connection to the server.
+    bool multiplexThreads;
+
+    // The socket file descriptor of this process's control connection, or -1
+    // if it has not been opened. Only used if multiplexThreads is set.
+    int controlSocket;
+
+    // Serializes messages sent over controlSocket so that messages from
+    // different threads are not interleaved.
+    std::mutex controlSocketMutex;
+
+    /**
+     * What cancelBlock() needs in order to wake a thread that is waiting in
+     * blockUntilCoreAvailable().
+     */
+    struct BlockingThread {
+        BlockingThread() : socket(-1), grantSlot(-1), cancelled(false) {}
+
+        // The thread's own connection to the server, or -1 if it has none.
+        int socket;
+
+        // The thread's ThreadGrantSlot, or -1 if it has none.
+        int grantSlot;
+
+        // Set by cancelBlock() and cleared when blockUntilCoreAvailable()
+        // returns -1 because of it.
+        bool cancelled;
+    };
+
+    // Threads that have blocked, or been passed to cancelBlock(), since they
+    // last unregistered, by thread ID. Protected by mutex.
+    std::unordered_map<pid_t, BlockingThread> blockingThreads;
+
+    // Entry i is true if index i of ProcessStats::threadGrantSlots belongs to
+    // a registered thread. Protected by mutex.
+    std::vector<bool> grantSlotInUse;
+
     // The socket file descriptor used to communicate with the server. Every
-    // thread has its own socket connection to the server.
+    // thread has its own socket connection to the server, unless
+    // multiplexThreads is set, in which case this is the control connection.
     static thread_local int serverSocket;
 
-    // The ID of the core that this thread is running on. A value of -1
+    // The index of this thread's ThreadGrantSlot, or -1 if it has none. Only
+    // used if multiplexThreads is set.
+    static thread_local int grantSlot;
+
+    // The ID of the core that the server granted to this thread. A value of -1
     // indicates that the server has not assigned a core to this thread. Every
-    // thread has its own coreId. This ID is NOT accurate for threads that have
-    // been preempted from their managed core.
+    // thread has its own coreId. A thread that has been preempted keeps the ID
+    // of the core it was granted, since that is where the server asks for the
+    // core back, even though it is no longer running there; use
+    // onManagedCore() to find out whether it still is.
     static thread_local int coreId;
 
+    // This thread's restartable sequences area, whose cpu_id field the kernel
+    // keeps up to date with the core the thread is running on. NULL if the
+    // thread has not registered with the server or rseq is unavailable.
+    static thread_local struct rseq* rseqArea;
+
     // Used for all syscalls for easier unit testing.
     static Syscall* sys;
 
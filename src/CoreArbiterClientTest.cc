@@ -13,11 +13,21 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <linux/rseq.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <thread>
+#include <unordered_set>
+
 #define private public
 #define protected public
 
 #include "ArbiterClientShim.h"
+#include "CoreArbiterAgent.h"
 #include "CoreArbiterClient.h"
+#include "CoreDemandEstimator.h"
+#include "CoreExecutor.h"
 #include "Logger.h"
 #include "MockSyscall.h"
 
@@ -114,6 +124,75 @@ TEST_F(CoreArbiterClientTest, setRequestedCores) {
     }
 }
 
+TEST_F(CoreArbiterClientTest, setRequestedCores_busyPolling) {
+    connectClient();
+    globalStats.busyPolling = true;
+    client.setRequestedCores({0, 1, 2, 3, 4, 5, 6, 7});
+    globalStats.busyPolling = false;
+    client.serverSocket = -1;
+
+    // Nothing is sent; the request is written to shared memory instead
+    uint8_t msgType;
+    EXPECT_LT(recv(serverSocket, &msgType, sizeof(msgType), MSG_DONTWAIT), 0);
+    EXPECT_EQ(processStats.coreRequestVersion, 2u);
+    for (uint32_t i = 0; i < NUM_PRIORITIES; i++) {
+        EXPECT_EQ(processStats.requestedCores[i], i);
+    }
+}
+
+TEST_F(CoreArbiterClientTest, setRequestedCoreRange) {
+    connectClient();
+
+    // Minimum above maximum
+    ASSERT_THROW(client.setRequestedCoreRange({0, 0, 0, 0, 0, 0, 0, 2},
+                                              {0, 0, 0, 0, 0, 0, 0, 1}),
+                 CoreArbiterClient::ClientException);
+
+    client.setRequestedCoreRange({0, 1, 2, 3, 4, 5, 6, 7},
+                                 {1, 2, 3, 4, 5, 6, 7, 8});
+    client.serverSocket = -1;
+
+    uint8_t msgType;
+    recv(serverSocket, &msgType, sizeof(msgType), 0);
+    ASSERT_EQ(msgType, CORE_RANGE_REQUEST);
+
+    uint32_t requestArr[2 * NUM_PRIORITIES];
+    recv(serverSocket, requestArr, sizeof(requestArr), 0);
+    for (uint32_t i = 0; i < NUM_PRIORITIES; i++) {
+        ASSERT_EQ(requestArr[i], i);
+        ASSERT_EQ(requestArr[NUM_PRIORITIES + i], i + 1);
+    }
+}
+
+TEST_F(CoreArbiterClientTest, setUtilityCurve) {
+    connectClient();
+
+    ASSERT_THROW(
+        client.setUtilityCurve(std::vector<float>(MAX_SUPPORTED_CORES + 1)),
+        CoreArbiterClient::ClientException);
+
+    client.setUtilityCurve({3, 2, 1});
+    EXPECT_EQ(processStats.utilityCurveVersion, 2u);
+    ASSERT_EQ(processStats.numUtilityPoints, 3u);
+    EXPECT_EQ(processStats.marginalUtilities[0], 3.0f);
+    EXPECT_EQ(processStats.marginalUtilities[2], 1.0f);
+}
+
+TEST_F(CoreArbiterClientTest, recordCoreUtilization) {
+    connectClient();
+
+    // Nothing is recorded for a thread without a core
+    client.coreId = -1;
+    client.recordCoreUtilization(10, 20);
+
+    client.coreId = 1;
+    client.recordCoreUtilization(10, 20);
+    client.recordCoreUtilization(5, 0);
+    EXPECT_EQ(processStats.coreUtilization[1].busyCycles, 15u);
+    EXPECT_EQ(processStats.coreUtilization[1].idleCycles, 20u);
+    client.coreId = -1;
+}
+
 TEST_F(CoreArbiterClientTest, mustReleaseCore) {
     connectClient();
     ASSERT_FALSE(client.mustReleaseCore());
@@ -129,6 +208,41 @@ TEST_F(CoreArbiterClientTest, mustReleaseCore) {
     ASSERT_FALSE(client.mustReleaseCore());
 }
 
+TEST_F(CoreArbiterClientTest, onManagedCore) {
+    struct rseq area;
+    memset(&area, 0, sizeof(area));
+    area.cpu_id = 3;
+    client.rseqArea = &area;
+
+    // A thread without a core is never on a managed core
+    EXPECT_EQ(client.getCurrentCore(), 3);
+    EXPECT_FALSE(client.onManagedCore());
+
+    client.coreId = 3;
+    EXPECT_TRUE(client.onManagedCore());
+
+    // The kernel migrated the thread off its core after a preemption
+    area.cpu_id = 0;
+    EXPECT_FALSE(client.onManagedCore());
+    EXPECT_EQ(client.getCoreId(), 3);
+
+    // Fall back to sched_getcpu until the kernel fills in the area
+    area.cpu_id = static_cast<uint32_t>(RSEQ_CPU_ID_UNINITIALIZED);
+    sys->schedGetcpuCore = 3;
+    EXPECT_TRUE(client.onManagedCore());
+    client.rseqArea = NULL;
+    sys->schedGetcpuCore = 5;
+    EXPECT_EQ(client.getCurrentCore(), 5);
+    client.coreId = -1;
+}
+
+TEST_F(CoreArbiterClientTest, registerRseq) {
+    client.registerRseq();
+    ASSERT_TRUE(client.rseqArea != NULL);
+    EXPECT_GE(client.getCurrentCore(), 0);
+    client.rseqArea = NULL;
+}
+
 TEST_F(CoreArbiterClientTest, blockUntilCoreAvailable_establishConnection) {
     CoreArbiterClient::testingSkipConnectionSetup = true;
     disconnectClient();
@@ -168,6 +282,124 @@ TEST_F(CoreArbiterClientTest, blockUntilCoreAvailable_alreadyExclusive) {
     EXPECT_EQ(blockMsg, THREAD_BLOCK);
 }
 
+TEST_F(CoreArbiterClientTest, blockUntilCoreAvailable_multiplexed) {
+    connectClient();
+    client.multiplexThreads = true;
+    client.controlSocket = clientSocket;
+    client.grantSlot = 1;
+    client.coreId = -1;
+    pid_t clientThreadId = sys->gettid();
+
+    // Play the part of the server: wait for the block message, then grant a
+    // core through the thread's slot.
+    std::thread server([this, clientThreadId] {
+        uint8_t msgType;
+        pid_t threadId;
+        recv(serverSocket, &msgType, sizeof(uint8_t), 0);
+        recv(serverSocket, &threadId, sizeof(pid_t), 0);
+        EXPECT_EQ(msgType, THREAD_BLOCK);
+        EXPECT_EQ(threadId, clientThreadId);
+
+        ThreadGrantSlot& slot = processStats.threadGrantSlots[1];
+        slot.coreId = 3;
+        slot.grantCount++;
+        sys->futexWake(reinterpret_cast<int*>(&slot.grantCount), 1);
+    });
+    EXPECT_EQ(client.blockUntilCoreAvailable(), 3);
+    server.join();
+    EXPECT_EQ(client.getNumOwnedCores(), 1u);
+    EXPECT_EQ(client.getNumBlockedThreads(), 0u);
+
+    client.multiplexThreads = false;
+    client.controlSocket = -1;
+    client.grantSlot = -1;
+}
+
+TEST_F(CoreArbiterClientTest, blockUntilCoreAvailable_busyPolling) {
+    connectClient();
+    client.multiplexThreads = true;
+    client.controlSocket = clientSocket;
+    client.grantSlot = 1;
+    client.coreId = -1;
+    globalStats.busyPolling = true;
+
+    // Play the part of a busy polling server: watch the slot's block count,
+    // then grant a core through it.
+    std::thread server([this] {
+        ThreadGrantSlot& slot = processStats.threadGrantSlots[1];
+        while (slot.blockCount == 0) {
+        }
+        slot.coreId = 4;
+        slot.grantCount++;
+        sys->futexWake(reinterpret_cast<int*>(&slot.grantCount), 1);
+    });
+    EXPECT_EQ(client.blockUntilCoreAvailable(), 4);
+    server.join();
+    EXPECT_EQ(processStats.threadGrantSlots[1].blockCount, 1);
+
+    // Nothing was sent
+    uint8_t msgType;
+    EXPECT_LT(recv(serverSocket, &msgType, sizeof(msgType), MSG_DONTWAIT), 0);
+
+    globalStats.busyPolling = false;
+    client.multiplexThreads = false;
+    client.controlSocket = -1;
+    client.grantSlot = -1;
+}
+
+TEST_F(CoreArbiterClientTest, cancelBlock) {
+    connectClient();
+    client.coreId = -1;
+    pid_t clientThreadId = sys->gettid();
+
+    // A thread cancelled before it blocks returns without telling the server
+    client.cancelBlock(clientThreadId);
+    EXPECT_EQ(client.blockUntilCoreAvailable(), -1);
+    uint8_t msgType;
+    EXPECT_LT(recv(serverSocket, &msgType, sizeof(msgType), MSG_DONTWAIT), 0);
+
+    // A blocked thread is woken without a core
+    std::thread canceller([this, clientThreadId] {
+        uint8_t msgType;
+        recv(serverSocket, &msgType, sizeof(uint8_t), 0);
+        EXPECT_EQ(msgType, THREAD_BLOCK);
+        client.cancelBlock(clientThreadId);
+    });
+    EXPECT_EQ(client.blockUntilCoreAvailable(), -1);
+    canceller.join();
+    EXPECT_EQ(client.getNumOwnedCores(), 0u);
+    EXPECT_EQ(client.getNumBlockedThreads(), 0u);
+    EXPECT_FALSE(client.blockingThreads[clientThreadId].cancelled);
+}
+
+TEST_F(CoreArbiterClientTest, cancelBlock_multiplexed) {
+    connectClient();
+    client.multiplexThreads = true;
+    client.controlSocket = clientSocket;
+    client.grantSlot = 1;
+    client.coreId = -1;
+    globalStats.busyPolling = true;
+    pid_t clientThreadId = sys->gettid();
+
+    std::thread canceller([this, clientThreadId] {
+        ThreadGrantSlot& slot = processStats.threadGrantSlots[1];
+        while (slot.blockCount == 0) {
+        }
+        client.cancelBlock(clientThreadId);
+    });
+    EXPECT_EQ(client.blockUntilCoreAvailable(), -1);
+    canceller.join();
+    EXPECT_EQ(processStats.threadGrantSlots[1].grantCount, 1);
+    EXPECT_EQ(client.getNumOwnedCores(), 0u);
+    EXPECT_EQ(client.getNumBlockedThreads(), 0u);
+    EXPECT_FALSE(client.blockingThreads[clientThreadId].cancelled);
+
+    globalStats.busyPolling = false;
+    client.multiplexThreads = false;
+    client.controlSocket = -1;
+    client.grantSlot = -1;
+}
+
 TEST_F(CoreArbiterClientTest, getNumOwnedCores) {
     client.numOwnedCores = 99;
     EXPECT_EQ(client.getNumOwnedCores(), 99u);
@@ -183,4 +415,177 @@ TEST_F(CoreArbiterClientTest, mustReleaseCore_shim) {
     ASSERT_EQ(shim_client.mustReleaseCore(), true);
 }
 
+/**
+ * Records the core requests that a CoreDemandEstimator makes instead of
+ * sending them to a server.
+ */
+class RecordingClient : public CoreArbiterClient {
+  public:
+    RecordingClient() : CoreArbiterClient(""), requests() {}
+    void setRequestedCores(std::vector<uint32_t> numCores) {
+        requests.push_back(numCores[NUM_PRIORITIES - 1]);
+    }
+    std::vector<uint32_t> requests;
+};
+
+TEST_F(CoreArbiterClientTest, CoreDemandEstimator_invalidBounds) {
+    RecordingClient recordingClient;
+    ASSERT_THROW(CoreDemandEstimator(&recordingClient, 0, 4),
+                 CoreArbiterClient::ClientException);
+    ASSERT_THROW(CoreDemandEstimator(&recordingClient, 5, 4),
+                 CoreArbiterClient::ClientException);
+}
+
+TEST_F(CoreArbiterClientTest, CoreDemandEstimator_update) {
+    RecordingClient recordingClient;
+    CoreDemandEstimator estimator(&recordingClient, 1, 3);
+
+    // The first update asks for the minimum
+    EXPECT_EQ(estimator.update(), 1u);
+
+    // Nothing recorded, nothing changes
+    EXPECT_EQ(estimator.update(), 1u);
+
+    // Too many runnable tasks per core
+    estimator.recordLoad(2);
+    estimator.recordLoad(3);
+    EXPECT_EQ(estimator.update(), 2u);
+
+    // Cores that are almost fully busy
+    estimator.recordCoreUsage(95, 100);
+    EXPECT_EQ(estimator.update(), 3u);
+
+    // Never more than the maximum
+    estimator.recordLoad(100);
+    EXPECT_EQ(estimator.update(), 3u);
+
+    // Hysteresis keeps a core that is only barely not needed
+    estimator.recordCoreUsage(180, 300);
+    EXPECT_EQ(estimator.update(), 3u);
+
+    // A core is given back once the work clearly fits on fewer
+    estimator.recordCoreUsage(100, 300);
+    estimator.recordLoad(1);
+    EXPECT_EQ(estimator.update(), 2u);
+
+    std::vector<uint32_t> expectedRequests = {1, 2, 3, 2};
+    EXPECT_EQ(recordingClient.requests, expectedRequests);
+}
+
+TEST_F(CoreArbiterClientTest, CoreExecutor_runsAllTasks) {
+    std::atomic<int> numTasksRun(0);
+    {
+        CoreExecutor executor(&shim_client, 1, 3);
+        for (int i = 0; i < 50; i++) {
+            executor.submit([&executor, &numTasksRun] {
+                numTasksRun++;
+                // Tasks submitted from a worker go to its own queue
+                executor.submit([&numTasksRun] { numTasksRun++; });
+            });
+        }
+        executor.shutdown();
+        EXPECT_EQ(numTasksRun, 100);
+    }
+    shim_client.reset();
+}
+
+// Grants a core to the first numCores threads that block, and never to any
+// others, however many cores are requested.
+class LimitedClient : public CoreArbiterClient {
+  public:
+    explicit LimitedClient(uint32_t numCores)
+        : CoreArbiterClient(""),
+          numCores(numCores),
+          mutex(),
+          threadCancelled(),
+          cancelledThreads() {}
+    int blockUntilCoreAvailable() {
+        pid_t threadId = static_cast<pid_t>(syscall(SYS_gettid));
+        std::unique_lock<std::mutex> lock(mutex);
+        if (numCores > 0 && cancelledThreads.count(threadId) == 0) {
+            numCores--;
+            return 0;
+        }
+        while (cancelledThreads.count(threadId) == 0) {
+            threadCancelled.wait(lock);
+        }
+        return -1;
+    }
+    void cancelBlock(pid_t threadId) {
+        std::lock_guard<std::mutex> guard(mutex);
+        cancelledThreads.insert(threadId);
+        threadCancelled.notify_all();
+    }
+    bool mustReleaseCore() { return false; }
+    void setRequestedCores(std::vector<uint32_t> numCores) {}
+    void unregisterThread() {}
+
+    uint32_t numCores;
+    std::mutex mutex;
+    std::condition_variable threadCancelled;
+    std::unordered_set<pid_t> cancelledThreads;
+};
+
+TEST_F(CoreArbiterClientTest, CoreExecutor_fewerCoresThanWorkers) {
+    LimitedClient limitedClient(1);
+    std::atomic<int> numTasksRun(0);
+    CoreExecutor executor(&limitedClient, 1, 3);
+    for (int i = 0; i < 10; i++) {
+        executor.submit([&numTasksRun] { numTasksRun++; });
+    }
+
+    // Two of the three workers are never granted a core, and must still be
+    // woken
+    executor.shutdown();
+    EXPECT_EQ(numTasksRun, 10);
+    EXPECT_EQ(limitedClient.cancelledThreads.size(), 3u);
+}
+
+TEST_F(CoreArbiterClientTest, CoreArbiterAgent) {
+    CoreArbiterAgent agent("", 100);
+    agent.serverSocket = clientSocket;
+    agent.processStats = &processStats;
+
+    // Registering a foreign thread sends its ID and a free grant slot
+    agent.registerThread(101);
+    uint8_t msgType;
+    pid_t threadId;
+    uint32_t grantSlot;
+    recv(serverSocket, &msgType, sizeof(uint8_t), 0);
+    recv(serverSocket, &threadId, sizeof(pid_t), 0);
+    recv(serverSocket, &grantSlot, sizeof(uint32_t), 0);
+    EXPECT_EQ(msgType, THREAD_REGISTER);
+    EXPECT_EQ(threadId, 101);
+    EXPECT_EQ(grantSlot, 0u);
+    EXPECT_EQ(agent.getGrantedCore(101), -1);
+
+    agent.threadBlocked(101);
+    recv(serverSocket, &msgType, sizeof(uint8_t), 0);
+    recv(serverSocket, &threadId, sizeof(pid_t), 0);
+    EXPECT_EQ(msgType, THREAD_BLOCK);
+    EXPECT_EQ(threadId, 101);
+    EXPECT_EQ(agent.getGrantedCore(101), -1);
+
+    // The server grants a core through the slot and later asks for it back
+    processStats.threadGrantSlots[0].coreId = 2;
+    processStats.threadGrantSlots[0].grantCount++;
+    EXPECT_EQ(agent.getGrantedCore(101), 2);
+    EXPECT_FALSE(agent.mustReleaseCore(101));
+    processStats.threadCommunicationBlocks[2].coreReleaseRequested = true;
+    EXPECT_TRUE(agent.mustReleaseCore(101));
+
+    // Once the thread has yielded, it waits for a new grant
+    agent.threadBlocked(101);
+    recv(serverSocket, &msgType, sizeof(uint8_t), 0);
+    recv(serverSocket, &threadId, sizeof(pid_t), 0);
+    EXPECT_EQ(agent.getGrantedCore(101), -1);
+    EXPECT_FALSE(agent.mustReleaseCore(101));
+
+    agent.unregisterThread(101);
+    EXPECT_THROW(agent.getGrantedCore(101),
+                 CoreArbiterClient::ClientException);
+    agent.serverSocket = -1;
+    agent.processStats = NULL;
+}
+
 }  // namespace CoreArbiter
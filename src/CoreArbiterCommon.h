@@ -18,18 +18,56 @@
 
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
 #include <atomic>
 #include <cstddef>
+#include <vector>
 
 #define NUM_PRIORITIES 8
 #define RELEASE_TIMEOUT_MS 10
+#define SCAVENGER_RELEASE_TIMEOUT_MS 1
 #define CPUSET_UPDATE_TIMEOUT_MS 10
+#define GANG_TIMEOUT_MS 100
 
 #define THREAD_BLOCK 1
 #define CORE_REQUEST 2
+#define THREAD_REGISTER 3
+#define THREAD_UNREGISTER 4
+#define SCAVENGER_REQUEST 5
+#define GANG_REQUEST 6
+#define CORE_RANGE_REQUEST 7
+#define PROCESS_CORE_REQUEST 8
+#define ADD_ARBITRATED_CORES 9
+#define REMOVE_ARBITRATED_CORES 10
+#define CORE_CLASS_REQUEST 11
 
 #define MAX_SUPPORTED_CORES 256
 
+// The number of processes whose efficiency is reported in GlobalStats.
+#define MAX_REPORTED_PROCESSES 64
+
+// The number of threads a process can have registered at once when it
+// multiplexes all of its threads over a single control connection.
+#define MAX_MULTIPLEXED_THREADS 256
+
+// Sent in place of a thread ID when a process opens its control connection.
+#define CONTROL_CONNECTION_ID 0
+
+// Sent in place of a thread ID when a privileged agent opens a control
+// connection on behalf of another process (see CoreArbiterAgent).
+#define AGENT_CONNECTION_ID -1
+
+// Sent in place of a thread ID by a privileged administrator connection that
+// changes which cores the server arbitrates (see coreArbiterAdmin).
+#define ADMIN_CONNECTION_ID -2
+
+// Classes of cores, by peak performance, that a process can ask to be granted
+// (see CoreArbiterClient::setCoreClass()). On machines whose cores all
+// perform alike, every core is a performance core.
+#define CORE_CLASS_ANY 0
+#define CORE_CLASS_PERFORMANCE 1
+#define CORE_CLASS_EFFICIENCY 2
+
 namespace CoreArbiter {
 
 /**
@@ -40,10 +78,49 @@ struct ThreadCommunicationBlock {
     // True means that the thread should yield its core.
     std::atomic<bool> coreReleaseRequested;
 };
+
+/**
+ * Used by the CoreArbiter to hand cores to the threads of a process that
+ * multiplexes all of its threads over one control connection. Such threads
+ * have no socket of their own to receive a core ID on, so each is assigned one
+ * of these slots when it registers.
+ */
+struct ThreadGrantSlot {
+    // Incremented by the server every time it grants this slot's thread a
+    // core, and by the client when it cancels the thread's wait (see
+    // CoreArbiterClient::cancelBlock()). A blocked thread waits for this to
+    // change with a futex.
+    std::atomic<int> grantCount;
+
+    // The ID of the core that the server most recently granted to this slot's
+    // thread. Only valid once grantCount has changed.
+    std::atomic<int> coreId;
+
+    // Incremented by this slot's thread when it blocks while the server is
+    // busy polling (see GlobalStats::busyPolling), in place of sending
+    // THREAD_BLOCK.
+    std::atomic<int> blockCount;
+};
+
+/**
+ * Written by a client to tell the server how much of the time it spends on a
+ * managed core is useful work (see CoreArbiterClient::recordCoreUtilization()).
+ * Both counts only ever increase.
+ */
+struct CoreUtilization {
+    // Cycles spent doing useful work on this core.
+    std::atomic<uint64_t> busyCycles;
+
+    // Cycles spent spinning on this core with nothing to do.
+    std::atomic<uint64_t> idleCycles;
+};
+
 /**
  * Statistics kept per process. The server creates a file with this information
  * which is mmapped into memory by both the server and client. Only the server
- * can write to the shared memory.
+ * writes to the shared memory, except for the core request, the utility curve
+ * and the core utilization at the end, and the block counts in the grant
+ * slots, which only the client writes.
  */
 struct ProcessStats {
     // A monotonically increasing count of the number of times the server has
@@ -58,6 +135,11 @@ struct ProcessStats {
     // exclusive cores.
     std::atomic<uint64_t> unpreemptedCount;
 
+    // A monotonically increasing count of the number of times the server has
+    // forceably moved a thread belonging to this process off a core it was
+    // granted as a scavenger. These are not included in preemptedCount.
+    std::atomic<uint64_t> scavengerRevokedCount;
+
     // The number of threads that a processes currently has blocked waiting for
     // the server to assign them a core.
     std::atomic<uint32_t> numBlockedThreads;
@@ -70,15 +152,71 @@ struct ProcessStats {
     // the return value of blockUntilCoreAvailable.
     ThreadCommunicationBlock threadCommunicationBlocks[MAX_SUPPORTED_CORES];
 
+    // This array is indexed by the slot that a thread chose when registering
+    // over its process's control connection.
+    ThreadGrantSlot threadGrantSlots[MAX_MULTIPLEXED_THREADS];
+
+    // Incremented by the client both before and after it rewrites
+    // requestedCores, so that it is odd while the request is being changed.
+    // Only used while the server is busy polling; otherwise core requests are
+    // sent as CORE_REQUEST messages.
+    std::atomic<uint32_t> coreRequestVersion;
+
+    // The number of cores the process wants at each priority, as in a
+    // CORE_REQUEST message.
+    std::atomic<uint32_t> requestedCores[NUM_PRIORITIES];
+
+    // Incremented by the client both before and after it rewrites the utility
+    // curve below, so that it is odd while the curve is being changed.
+    std::atomic<uint32_t> utilityCurveVersion;
+
+    // The number of meaningful entries in marginalUtilities. 0 means that the
+    // process has not published a utility curve.
+    std::atomic<uint32_t> numUtilityPoints;
+
+    // Entry i is how much more useful i + 1 cores are to this process than i
+    // cores are. Only compared across processes when the server allocates
+    // cores by utility (see CoreArbiterClient::setUtilityCurve()).
+    std::atomic<float> marginalUtilities[MAX_SUPPORTED_CORES];
+
+    // This array is indexed by physical core ID, and records how busy this
+    // process's threads have kept each core they were granted.
+    CoreUtilization coreUtilization[MAX_SUPPORTED_CORES];
+
     ProcessStats()
         : preemptedCount(0),
           unpreemptedCount(0),
+          scavengerRevokedCount(0),
           numBlockedThreads(0),
-          numOwnedCores(0) {
+          numOwnedCores(0),
+          threadGrantSlots(),
+          coreRequestVersion(0),
+          requestedCores(),
+          utilityCurveVersion(0),
+          numUtilityPoints(0),
+          marginalUtilities(),
+          coreUtilization() {
         memset(threadCommunicationBlocks, 0, sizeof(threadCommunicationBlocks));
     }
 };
 
+/**
+ * How efficiently a process uses the cores it is granted, as reported by the
+ * server in GlobalStats. Its efficiency is usefulCycles / grantedCycles.
+ */
+struct ProcessEfficiency {
+    // The process that this entry describes, or 0 if the entry is unused.
+    std::atomic<pid_t> processId;
+
+    // The cycles that the process reported doing useful work on its managed
+    // cores.
+    std::atomic<uint64_t> usefulCycles;
+
+    // The cycles that the process held managed cores for, while reporting
+    // its utilization of them.
+    std::atomic<uint64_t> grantedCycles;
+};
+
 /**
  * Statistics kept accross all processes. The server creates a file with this
  * information which is mmapped into memory by both the server and client. Only
@@ -92,9 +230,66 @@ struct GlobalStats {
     // The total number of processes currently connected to a CoreArbiterServer
     std::atomic<uint32_t> numProcesses;
 
-    GlobalStats() : numUnoccupiedCores(0), numProcesses(0) {}
+    // True if the server spins on its own core watching shared memory for
+    // core requests and blocking threads, rather than waiting for messages.
+    // Every client then publishes its core requests in ProcessStats instead
+    // of sending them. Clients that multiplex their threads also block them
+    // through their ThreadGrantSlots rather than their control connections.
+    std::atomic<bool> busyPolling;
+
+    // The efficiency of up to MAX_REPORTED_PROCESSES connected processes.
+    ProcessEfficiency processEfficiency[MAX_REPORTED_PROCESSES];
+
+    // The class of each core the server arbitrates, indexed by core ID, or
+    // CORE_CLASS_ANY for cores it does not arbitrate.
+    std::atomic<uint8_t> coreClasses[MAX_SUPPORTED_CORES];
+
+    GlobalStats()
+        : numUnoccupiedCores(0),
+          numProcesses(0),
+          busyPolling(false),
+          processEfficiency(),
+          coreClasses() {}
 };
 
+/**
+ * Returns the number of bytes that the server and its clients map for a shared
+ * memory structure of the given size, which is rounded up to whole pages.
+ */
+inline size_t
+sharedMemorySize(size_t structSize) {
+    size_t pageSize = getpagesize();
+    return (structSize + pageSize - 1) / pageSize * pageSize;
+}
+
+/**
+ * Builds a message to send over a control connection, which carries messages
+ * about many threads: the message's type and the ID of the thread it is about,
+ * followed by a type-specific payload. The whole message should be sent with a
+ * single send() so that messages from concurrent senders stay intact.
+ *
+ * \param msgType
+ *     The type of message, e.g. THREAD_BLOCK
+ * \param threadId
+ *     The thread that the message is about
+ * \param payload
+ *     Data that follows the header; may be NULL if payloadBytes is 0
+ * \param payloadBytes
+ *     The number of bytes of payload
+ */
+inline std::vector<char>
+makeControlMessage(uint8_t msgType, pid_t threadId, const void* payload,
+                   size_t payloadBytes) {
+    const size_t headerBytes = sizeof(uint8_t) + sizeof(pid_t);
+    std::vector<char> message(headerBytes + payloadBytes);
+    memcpy(message.data(), &msgType, sizeof(uint8_t));
+    memcpy(message.data() + sizeof(uint8_t), &threadId, sizeof(pid_t));
+    if (payloadBytes > 0) {
+        memcpy(message.data() + headerBytes, payload, payloadBytes);
+    }
+    return message;
+}
+
 }  // namespace CoreArbiter
 
 #endif  // CORE_ARBITER_COMMON_H
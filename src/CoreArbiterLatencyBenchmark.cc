@@ -0,0 +1,124 @@
+/* Copyright (c) 2015-2018 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "CoreArbiterClient.h"
+#include "PerfUtils/Cycles.h"
+
+/**
+ * This benchmark measures how long it takes the core arbiter to hand a core
+ * to a blocked thread: the time from a core request to the thread waking up
+ * on its new core. Run it once against a server started normally and once
+ * against a server started with --busyPollCore to compare the two modes.
+ * Pass --multiplexThreads so that the thread blocks through shared memory
+ * when the server is busy polling, rather than over its own connection.
+ */
+
+using CoreArbiter::CoreArbiterClient;
+using PerfUtils::Cycles;
+
+#define DEFAULT_NUM_TRIALS 1000
+
+std::atomic<bool> end(false);
+
+// The time at which the worker last woke up on a managed core, or 0 if it has
+// not woken up since the last request.
+std::atomic<uint64_t> wakeupTime(0);
+
+/**
+ * This thread blocks until it is given a core, records when it woke up, and
+ * blocks again as soon as it is asked to release the core.
+ */
+void
+coreExec(CoreArbiterClient* client) {
+    while (!end) {
+        client->blockUntilCoreAvailable();
+        wakeupTime = Cycles::rdtsc();
+        while (!client->mustReleaseCore() && !end)
+            ;
+    }
+}
+
+/**
+ * Returns the given percentile of sorted latencies in microseconds.
+ */
+double
+percentile(const std::vector<uint64_t>& latencies, double fraction) {
+    size_t index = static_cast<size_t>(
+        fraction * static_cast<double>(latencies.size() - 1));
+    return static_cast<double>(Cycles::toNanoseconds(latencies[index])) /
+           1000.0;
+}
+
+int
+main(int argc, const char** argv) {
+    bool multiplexThreads = false;
+    int numTrials = DEFAULT_NUM_TRIALS;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--multiplexThreads") == 0) {
+            multiplexThreads = true;
+        } else if (strcmp(argv[i], "--numTrials") == 0 && i + 1 < argc &&
+                   atoi(argv[i + 1]) > 0) {
+            numTrials = atoi(argv[++i]);
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [--multiplexThreads] [--numTrials N]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    CoreArbiterClient* client = CoreArbiterClient::getInstance(
+        "/tmp/CoreArbiter/socket", multiplexThreads);
+    std::thread worker(coreExec, client);
+
+    std::vector<uint32_t> noCores = {0, 0, 0, 0, 0, 0, 0, 0};
+    std::vector<uint32_t> oneCore = {1, 0, 0, 0, 0, 0, 0, 0};
+    std::vector<uint64_t> latencies;
+    for (int i = 0; i < numTrials; i++) {
+        // Wait for the worker to block
+        while (client->getNumBlockedThreadsFromServer() != 1)
+            ;
+
+        wakeupTime = 0;
+        uint64_t requestTime = Cycles::rdtsc();
+        client->setRequestedCores(oneCore);
+        while (wakeupTime == 0)
+            ;
+        latencies.push_back(wakeupTime - requestTime);
+
+        client->setRequestedCores(noCores);
+        while (client->getNumOwnedCoresFromServer() != 0)
+            ;
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    printf("Request to wakeup latency over %d trials (us): median %.2f, "
+           "90%% %.2f, 99%% %.2f, max %.2f\n",
+           numTrials, percentile(latencies, 0.5), percentile(latencies, 0.9),
+           percentile(latencies, 0.99), percentile(latencies, 1.0));
+
+    end = true;
+    client->setRequestedCores(oneCore);
+    worker.join();
+    client->unregisterThread();
+}
@@ -14,13 +14,18 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <sched.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <sys/eventfd.h>
 #include <sys/un.h>
 
 #include <algorithm>
 #include <iostream>
+#include <set>
+#include <sstream>
 #include <thread>
 
 #include "CoreArbiterServer.h"
@@ -59,6 +64,119 @@ timeTrace(const char* format, uint64_t arg0 = 0, uint64_t arg1 = 0,
 #endif
 }
 
+/**
+ * Returns the NUMA node that the given core belongs to, as reported in sysfs,
+ * or 0 if that cannot be determined (for example on machines without NUMA).
+ *
+ * \param coreId
+ *     The core whose NUMA node will be returned.
+ */
+int
+CoreArbiterServer::getNumaNode(int coreId) {
+    std::string cpuPath =
+        "/sys/devices/system/cpu/cpu" + std::to_string(coreId);
+    DIR* dir = sys->opendir(cpuPath.c_str());
+    if (!dir) {
+        return 0;
+    }
+
+    // The core's directory contains a link named after its node
+    int numaNode = 0;
+    for (struct dirent* entry = sys->readdir(dir); entry != NULL;
+         entry = sys->readdir(dir)) {
+        if (sscanf(entry->d_name, "node%d", &numaNode) == 1) {
+            break;
+        }
+    }
+    sys->closedir(dir);
+    return numaNode;
+}
+
+/**
+ * Returns the ID of the hypertwin of the given core, or -1 if it has none or
+ * the topology cannot be read. This code assumes there is at most one such
+ * hypertwin, and that hypertwins are delimited by the comma separator.
+ *
+ * \param coreId
+ *     The core whose hypertwin's ID will be returned.
+ */
+static int
+getHyperTwin(int coreId) {
+    // This file contains the siblings of core coreId.
+    std::string siblingFilePath = "/sys/devices/system/cpu/cpu" +
+                                  std::to_string(coreId) +
+                                  "/topology/thread_siblings_list";
+    FILE* siblingFile = fopen(siblingFilePath.c_str(), "r");
+    if (!siblingFile) {
+        return -1;
+    }
+    int twin1, twin2;
+    // The first cpuid in the file is always that of the physical core
+    int numSiblings = fscanf(siblingFile, "%d,%d", &twin1, &twin2);
+    fclose(siblingFile);
+    if (numSiblings != 2) {
+        return -1;
+    }
+    if (coreId == twin1)
+        return twin2;
+    return twin1;
+}
+
+/**
+ * Returns the peak performance of the given core relative to the others, as
+ * reported by the kernel: its ACPI CPPC highest performance on machines with
+ * favored cores, or otherwise its scheduler capacity, which distinguishes the
+ * performance and efficiency cores of hybrid machines. Returns 0 if neither
+ * is reported, in which case all cores are treated alike.
+ *
+ * \param coreId
+ *     The core whose capacity will be returned.
+ */
+static uint32_t
+getCoreCapacity(int coreId) {
+    std::string cpuPath =
+        "/sys/devices/system/cpu/cpu" + std::to_string(coreId);
+    for (const char* fileName : {"/acpi_cppc/highest_perf", "/cpu_capacity"}) {
+        std::ifstream capacityFile(cpuPath + fileName);
+        uint32_t capacity;
+        if (capacityFile >> capacity) {
+            return capacity;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the core that the given thread last ran on, as reported in
+ * /proc, or -1 if that cannot be read (for example because the thread has
+ * exited).
+ *
+ * \param threadId
+ *     The thread whose last core will be returned.
+ */
+static int
+getLastCore(pid_t threadId) {
+    std::ifstream statFile("/proc/" + std::to_string(threadId) + "/stat");
+    std::string stat;
+    std::getline(statFile, stat);
+
+    // The command name may contain spaces, so count fields from the end of
+    // it. The core is field 39, and the first one after the name is field 3.
+    size_t nameEnd = stat.rfind(')');
+    if (nameEnd == std::string::npos) {
+        return -1;
+    }
+    std::istringstream fields(stat.substr(nameEnd + 1));
+    std::string field;
+    for (int i = 3; i < 39 && fields >> field; i++) {
+    }
+    int coreId;
+    if (!(fields >> coreId)) {
+        return -1;
+    }
+    return coreId;
+}
+
 /**
  * Constructs a CoreArbiterServer object and sets up all necessary state for
  * server operation. This includes creating a socket to listen for new
@@ -102,10 +220,26 @@ CoreArbiterServer::CoreArbiterServer(std::string socketPath,
       advisoryLockPath("/tmp/coreArbiterAdvisoryLock"),
       advisoryLockFd(-1),
       epollFd(-1),
+      busyPolling(false),
       preemptionTimeout(RELEASE_TIMEOUT_MS),
+      scavengerPreemptionTimeout(SCAVENGER_RELEASE_TIMEOUT_MS),
+      blockedThreadPolicy(MOST_RECENTLY_BLOCKED),
+      allocationPolicy(new PriorityAllocationPolicy()),
+      threadPidFdsSupported(true),
+      deferCoreDistribution(false),
+      coreDistributionPending(false),
       alwaysUnmanagedString(""),
+      coreNumaNodes(),
       cpusetUpdateTimeout(CPUSET_UPDATE_TIMEOUT_MS),
-      corePriorityQueues(NUM_PRIORITIES),
+      lastUtilizationSample(0),
+      unmanagedFloor(0),
+      minUnmanagedFloor(0),
+      maxUnmanagedFloor(0),
+      lastPressureSample(0),
+      lastPressureStallUs(0),
+      numIdlePressureSamples(0),
+      lastRunQueueSample(0),
+      corePriorityQueues(NUM_PRIORITY_QUEUES),
       terminationFd(eventfd(0, 0)) {
     if (sys->geteuid()) {
         LOG(ERROR, "The core arbiter server must be run as root");
@@ -157,28 +291,64 @@ CoreArbiterServer::CoreArbiterServer(std::string socketPath,
         }
     }
 
+    for (int id = 0; id < static_cast<int>(numCores); id++) {
+        coreNumaNodes.push_back(getNumaNode(id));
+    }
+
     std::string arbiterCpusetPath = cpusetPath + "/CoreArbiter";
     if (!testingSkipCpusetAllocation) {
         // Remove any old cpusets from a previous server
         removeOldCpusets(arbiterCpusetPath);
 
+        // Group the cores by NUMA node, for the per-node unmanaged cpusets
+        std::map<int, std::string> nodeCores;
+        for (int id = 0; id < static_cast<int>(numCores); id++) {
+            nodeCores[coreNumaNodes[id]] += std::to_string(id) + ",";
+        }
+        std::string allMems;
+        for (auto& nodeAndCores : nodeCores) {
+            allMems += std::to_string(nodeAndCores.first) + ",";
+        }
+
         // Create a new cpuset directory for core arbitration. Since this is
         // going to be a parent of all the arbiter's individual core cpusets, it
-        // needs to include every core.
+        // needs to include every core, and every node for the unmanaged ones.
         std::string allCores = "0-" + std::to_string(numCores - 1);
-        createCpuset(arbiterCpusetPath, allCores, "0");
+        createCpuset(arbiterCpusetPath, allCores, allMems);
 
-        // Set up managed cores
+        // Set up managed cores, each allocating memory on its own node
         for (int core : managedCoreIds) {
             std::string managedCpusetPath =
                 arbiterCpusetPath + "/Managed" + std::to_string(core);
-            createCpuset(managedCpusetPath, std::to_string(core), "0");
+            createCpuset(managedCpusetPath, std::to_string(core),
+                         std::to_string(getCoreNumaNode(core)));
         }
 
         // Set up the unmanaged cpuset. This starts with all cores and is
         // scaled down as processes ask for managed cores.
         std::string unmanagedCpusetPath = arbiterCpusetPath + "/Unmanaged";
-        createCpuset(unmanagedCpusetPath, allCores, "0");
+        createCpuset(unmanagedCpusetPath, allCores, allMems);
+
+        // With more than one NUMA node, unmanaged threads whose memory is on
+        // a known node are kept on that node's unmanaged cores, in a cpuset
+        // that only changes when that node's cores do.
+        if (nodeCores.size() > 1) {
+            for (auto& nodeAndCores : nodeCores) {
+                struct NodeCpuset& nodeCpuset =
+                    unmanagedNodeCpusets[nodeAndCores.first];
+                nodeCpuset.path = arbiterCpusetPath + "/UnmanagedNode" +
+                                  std::to_string(nodeAndCores.first);
+                nodeCpuset.cores = nodeAndCores.second;
+                createCpuset(nodeCpuset.path, nodeCpuset.cores,
+                             std::to_string(nodeAndCores.first));
+                nodeCpuset.tasks.open(nodeCpuset.path + "/tasks");
+                if (!nodeCpuset.tasks.is_open()) {
+                    LOG(ERROR, "Unable to open %s/tasks",
+                        nodeCpuset.path.c_str());
+                    exit(-1);
+                }
+            }
+        }
 
         // Move all of the currently running processes to the unmanaged cpuset
         std::string allProcsPath = cpusetPath + "/cgroup.procs";
@@ -202,12 +372,17 @@ CoreArbiterServer::CoreArbiterServer(std::string socketPath,
             LOG(ERROR, "Unable to open %s", unmanagedTasksPath.c_str());
             exit(-1);
         }
+
+        placeUnmanagedThreads();
     }
 
     for (int coreId : managedCoreIds) {
         std::string managedTasksPath =
             arbiterCpusetPath + "/Managed" + std::to_string(coreId) + "/tasks";
         struct CoreInfo* core = new CoreInfo(coreId, managedTasksPath);
+        core->numaNode = getCoreNumaNode(coreId);
+        core->hyperTwin = getHyperTwin(coreId);
+        core->capacity = getCoreCapacity(coreId);
         unmanagedCores.push_back(core);
     }
 
@@ -225,9 +400,9 @@ CoreArbiterServer::CoreArbiterServer(std::string socketPath,
     // Our clients are not necessarily root
     sys->chmod(globalSharedMemPath.c_str(), 0777);
 
-    size_t globalSharedMemSize = sizeof(struct GlobalStats);
+    size_t globalSharedMemSize = sharedMemorySize(sizeof(struct GlobalStats));
     sys->ftruncate(globalSharedMemFd, globalSharedMemSize);
-    stats = (struct GlobalStats*)sys->mmap(NULL, getpagesize(),
+    stats = (struct GlobalStats*)sys->mmap(NULL, globalSharedMemSize,
                                            PROT_READ | PROT_WRITE, MAP_SHARED,
                                            globalSharedMemFd, 0);
     if (stats == MAP_FAILED) {
@@ -235,6 +410,7 @@ CoreArbiterServer::CoreArbiterServer(std::string socketPath,
         exit(-1);
     }
     stats->numUnoccupiedCores = (uint32_t)unmanagedCores.size();
+    classifyCores();
 
     // Set up unix domain socket
     listenSocket = sys->socket(AF_UNIX, SOCK_STREAM, 0);
@@ -339,11 +515,31 @@ CoreArbiterServer::~CoreArbiterServer() {
     TimeTrace::print();
 #endif
 
+    for (struct CoreInfo* core : managedCores) {
+        if (core->cpusetFd >= 0) {
+            sys->close(core->cpusetFd);
+        }
+    }
+    for (struct CoreInfo* core : unmanagedCores) {
+        if (core->cpusetFd >= 0) {
+            sys->close(core->cpusetFd);
+        }
+    }
+    for (struct CoreInfo* core : removingCores) {
+        if (core->cpusetFd >= 0) {
+            sys->close(core->cpusetFd);
+        }
+    }
+
     if (!testingSkipMemoryDeallocation) {
         for (struct CoreInfo* core : managedCores) {
             core->cpusetFile.close();
             delete core;
         }
+        for (struct CoreInfo* core : removingCores) {
+            core->cpusetFile.close();
+            delete core;
+        }
 
         for (auto& proccessIdAndInfo : processIdToInfo) {
             struct ProcessInfo* process = proccessIdAndInfo.second;
@@ -404,6 +600,184 @@ CoreArbiterServer::endArbitration() {
     }
 }
 
+/**
+ * Chooses which of a process's blocked threads is woken up when the process
+ * is granted a core. This should be set before arbitration starts.
+ *
+ * \param policy
+ *     See BlockedThreadPolicy
+ */
+void
+CoreArbiterServer::setBlockedThreadPolicy(BlockedThreadPolicy policy) {
+    blockedThreadPolicy = policy;
+}
+
+/**
+ * Chooses whether the cores available at each priority are handed out evenly
+ * between the processes that want them, or to the processes that gain the most
+ * from them according to the utility curves they publish in shared memory (see
+ * CoreArbiterClient::setUtilityCurve()). Priorities are respected either way.
+ * This replaces the allocation policy with a PriorityAllocationPolicy, and
+ * should be set before arbitration starts.
+ *
+ * \param enabled
+ *     True to allocate cores by utility
+ */
+void
+CoreArbiterServer::setUtilityAllocation(bool enabled) {
+    allocationPolicy.reset(new PriorityAllocationPolicy(enabled));
+}
+
+/**
+ * Replaces the policy that decides which threads are given managed cores. The
+ * default is a PriorityAllocationPolicy. This should be set before arbitration
+ * starts.
+ *
+ * \param policy
+ *     The new policy, which the server takes ownership of
+ */
+void
+CoreArbiterServer::setAllocationPolicy(AllocationPolicy* policy) {
+    allocationPolicy.reset(policy);
+}
+
+/**
+ * Makes the server batch the grants of each core distribution through
+ * io_uring: the cpuset writes that move threads onto their cores and the
+ * sends that wake them are submitted together with a single system call,
+ * rather than with two system calls per grant. This should be called before
+ * arbitration starts.
+ *
+ * Only grants go through the ring. Messages from clients are still received
+ * with one recv() per message once epoll_wait() reports them, and release
+ * deadlines are still timerfds in the epoll set, since the message framing
+ * and the deadlines are shared with the synchronous path and the simulator.
+ *
+ * \return
+ *     True if io_uring is in use, or false if the kernel does not support it
+ *     (in which case grants are made one at a time, as before)
+ */
+bool
+CoreArbiterServer::enableIoUring() {
+    // io_uring writes to file descriptors rather than to the streams each
+    // core already has open. The ring is only set up once they are all open,
+    // since grants are batched whenever it is.
+    if (!testingSkipCpusetAllocation) {
+        std::vector<struct CoreInfo*> cores(managedCores);
+        cores.insert(cores.end(), unmanagedCores.begin(),
+                     unmanagedCores.end());
+        for (struct CoreInfo* core : cores) {
+            core->cpusetFd =
+                sys->open(core->cpusetFilename.c_str(), O_WRONLY);
+            if (core->cpusetFd < 0) {
+                LOG(WARNING, "Unable to open %s for io_uring: %s",
+                    core->cpusetFilename.c_str(), strerror(errno));
+                return false;
+            }
+        }
+    }
+    // Room for a write and a send for every core
+    return ioUring.init(2 * MAX_SUPPORTED_CORES);
+}
+
+/**
+ * Makes the server spin on a core of its own instead of sleeping in
+ * epoll_wait(), for hosts where the latency of handing cores over matters
+ * more than the core the server burns. The server pins itself to pollingCore
+ * at real-time priority, and rather than waiting for messages it watches
+ * shared memory for every client's core requests, and for the blocking
+ * threads of clients that multiplex over a control connection (see
+ * GlobalStats::busyPolling). Connections are
+ * still used to register and unregister threads and to detect exits. This
+ * should be called before arbitration starts.
+ *
+ * \param pollingCore
+ *     The core to spin on. It must not be one of the cores the server
+ *     arbitrates, so that it always stays unmanaged.
+ * \return
+ *     True if busy polling was enabled
+ */
+bool
+CoreArbiterServer::enableBusyPolling(int pollingCore) {
+    std::vector<struct CoreInfo*> cores(managedCores);
+    cores.insert(cores.end(), unmanagedCores.begin(), unmanagedCores.end());
+    for (struct CoreInfo* core : cores) {
+        if (core->id == pollingCore) {
+            LOG(ERROR, "Cannot busy poll on core %d, which is arbitrated",
+                pollingCore);
+            return false;
+        }
+    }
+    if (pollingCore < 0 || pollingCore >= CPU_SETSIZE) {
+        LOG(ERROR, "Invalid busy polling core %d", pollingCore);
+        return false;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(pollingCore, &cpuset);
+    if (sys->sched_setaffinity(0, sizeof(cpuset), &cpuset) < 0) {
+        LOG(ERROR, "Unable to pin the server to core %d: %s", pollingCore,
+            strerror(errno));
+        return false;
+    }
+
+    // Nothing else should run on the core, but if something does it must not
+    // delay the server. Note that the kernel still throttles real-time
+    // threads that never sleep (see sched_rt_runtime_us).
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO);
+    if (sys->sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        LOG(WARNING, "Unable to run the server at real-time priority: %s",
+            strerror(errno));
+    }
+
+    busyPolling = true;
+    stats->busyPolling = true;
+    LOG(NOTICE, "Busy polling on core %d", pollingCore);
+    return true;
+}
+
+/**
+ * Keeps some of the arbitrated cores in the unmanaged cpuset however many
+ * cores applications request, so that system daemons, the unmanaged threads
+ * of applications and the server itself are not squeezed onto the cores that
+ * are never arbitrated. The number of cores held back starts at minCores and
+ * follows the load on the unmanaged cpuset (see sampleUnmanagedPressure()),
+ * but stays between minCores and maxCores. Cores held back are taken from
+ * applications like cores that other applications need more. This should be
+ * set before arbitration starts.
+ *
+ * \param minCores
+ *     The fewest arbitrated cores to keep unmanaged
+ * \param maxCores
+ *     The most arbitrated cores to keep unmanaged. If it is equal to
+ *     minCores, the load on the unmanaged cpuset is not sampled.
+ */
+void
+CoreArbiterServer::setUnmanagedFloor(uint32_t minCores, uint32_t maxCores) {
+    minUnmanagedFloor = minCores;
+    maxUnmanagedFloor = std::max(minCores, maxCores);
+    unmanagedFloor = minCores;
+    numIdlePressureSamples = 0;
+}
+
+/**
+ * Makes the server change the cpufreq settings of the cores it arbitrates as
+ * they move between being unmanaged, managed without a thread, and managed
+ * with a thread (see updateCoreFrequencies()). The cores' original settings
+ * are restored when the server shuts down. This should be set before
+ * arbitration starts.
+ *
+ * \param manager
+ *     The settings to apply, which the server takes ownership of
+ */
+void
+CoreArbiterServer::setFrequencyManager(CpuFrequencyManager* manager) {
+    frequencyManager.reset(manager);
+}
+
 /**
  * This is the top-level event handling method for the Core Arbiter Server.
  * It returns true to indicate that event handling should continue and false
@@ -412,20 +786,30 @@ CoreArbiterServer::endArbitration() {
 bool
 CoreArbiterServer::handleEvents() {
     struct epoll_event events[MAX_EPOLL_EVENTS];
-    uint64_t msSinceLastCpusetUpdate =
-        Cycles::toMilliseconds(Cycles::rdtsc() - unmanagedCpusetLastUpdate);
-    uint64_t nextCpusetUpdate =
-        msSinceLastCpusetUpdate >= cpusetUpdateTimeout
-            ? 0
-            : cpusetUpdateTimeout - msSinceLastCpusetUpdate;
-    int numFds = sys->epoll_wait(epollFd, events, MAX_EPOLL_EVENTS,
-                                 static_cast<int>(nextCpusetUpdate));
-    LOG(DEBUG, "SERVER: epoll_wait returned with %d file descriptors.", numFds);
+    uint64_t msSinceLastCpusetUpdate;
+    int numFds;
+    do {
+        msSinceLastCpusetUpdate =
+            Cycles::toMilliseconds(sys->rdtsc() - unmanagedCpusetLastUpdate);
+        uint64_t nextCpusetUpdate =
+            msSinceLastCpusetUpdate >= cpusetUpdateTimeout
+                ? 0
+                : cpusetUpdateTimeout - msSinceLastCpusetUpdate;
+        // When busy polling, or when cores are waiting to be redistributed,
+        // only look for events that are already pending
+        int timeout = busyPolling || coreDistributionPending
+                          ? 0
+                          : static_cast<int>(nextCpusetUpdate);
+        numFds = sys->epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, timeout);
+        LOG(DEBUG, "SERVER: epoll_wait returned with %d file descriptors.",
+            numFds);
+
+        // Interrupted system calls are normal, for example after an io_uring
+        // is torn down (see ~IoUring()), so wait out the rest of the timeout
+        // rather than putting off the periodic work below.
+    } while (numFds < 0 && errno == EINTR);
     if (numFds < 0) {
-        // Interrupted system calls are normal, so there is no need to log them
-        // as errors.
-        if (errno != EINTR)
-            LOG(ERROR, "Error on epoll_wait: %s", strerror(errno));
+        LOG(ERROR, "Error on epoll_wait: %s", strerror(errno));
         return true;
     }
 
@@ -436,6 +820,18 @@ CoreArbiterServer::handleEvents() {
     }
 #endif
 
+    // When a process dies, all of its connections hang up and its threads
+    // exit at about the same time. Handle whole-process exits first so that
+    // the rest of the batch does not clean the process up thread by thread,
+    // and redistribute cores only once for the whole batch.
+    deferCoreDistribution = true;
+    for (int i = 0; i < numFds; i++) {
+        int pidFd = events[i].data.fd;
+        if (processPidFdToInfo.find(pidFd) != processPidFdToInfo.end()) {
+            processExited(pidFd);
+        }
+    }
+
     for (int i = 0; i < numFds; i++) {
         int socket = events[i].data.fd;
         if (events[i].events & EPOLLRDHUP) {
@@ -446,6 +842,9 @@ CoreArbiterServer::handleEvents() {
         } else if (socket == listenSocket) {
             // A new thread is connecting
             acceptConnection(listenSocket);
+        } else if (threadPidFdToInfo.find(socket) != threadPidFdToInfo.end()) {
+            // A thread exited, possibly without closing its connection
+            threadExited(socket);
         } else if (timerFdToInfo.find(socket) != timerFdToInfo.end()) {
             // Core retrieval timer timeout
             LOG(WARNING, "Timer fire closing socket %d", socket);
@@ -460,6 +859,7 @@ CoreArbiterServer::handleEvents() {
             }
             timerFdToInfo.erase(socket);
         } else if (socket == terminationFd) {
+            deferCoreDistribution = false;
             return false;
         } else {
             // Thread is making some sort of request
@@ -467,6 +867,22 @@ CoreArbiterServer::handleEvents() {
                 LOG(WARNING, "Did not receive a message type.");
                 continue;
             }
+            if (controlSocketToProcess.find(socket) !=
+                controlSocketToProcess.end()) {
+                // A thread is making a request over its process's control
+                // connection
+                handleControlMessage(socket);
+                continue;
+            }
+            if (adminSockets.find(socket) != adminSockets.end()) {
+                handleAdminMessage(socket);
+                continue;
+            }
+            if (threadSocketToInfo.find(socket) == threadSocketToInfo.end()) {
+                // The connection was cleaned up by an earlier event in this
+                // batch, for example because its thread or process exited.
+                continue;
+            }
 
             uint8_t msgType;
             if (!readData(socket, &msgType, sizeof(uint8_t),
@@ -481,6 +897,21 @@ CoreArbiterServer::handleEvents() {
                 case CORE_REQUEST:
                     coresRequested(socket);
                     break;
+                case SCAVENGER_REQUEST:
+                    scavengerCoresRequested(socket);
+                    break;
+                case CORE_RANGE_REQUEST:
+                    coreRangeRequested(socket);
+                    break;
+                case GANG_REQUEST:
+                    gangRequested(socket);
+                    break;
+                case PROCESS_CORE_REQUEST:
+                    processCoresRequested(socket);
+                    break;
+                case CORE_CLASS_REQUEST:
+                    coreClassRequested(socket);
+                    break;
                 default:
                     LOG(ERROR, "Unknown message type: %u", msgType);
                     break;
@@ -488,12 +919,21 @@ CoreArbiterServer::handleEvents() {
         }
     }
 
+    if (busyPolling) {
+        pollSharedMemory();
+    }
+
+    deferCoreDistribution = false;
+    if (coreDistributionPending) {
+        distributeCores();
+    }
+
     // Update the unmanaged cpuset if we haven't in a while
     msSinceLastCpusetUpdate =
-        Cycles::toMilliseconds(Cycles::rdtsc() - unmanagedCpusetLastUpdate);
+        Cycles::toMilliseconds(sys->rdtsc() - unmanagedCpusetLastUpdate);
     if (msSinceLastCpusetUpdate >= cpusetUpdateTimeout) {
         bool cpusetChanged = false;
-        uint64_t now = Cycles::rdtsc();
+        uint64_t now = sys->rdtsc();
 
         for (auto coreIter = managedCores.begin();
              coreIter != managedCores.end();) {
@@ -521,6 +961,15 @@ CoreArbiterServer::handleEvents() {
         if (cpusetChanged) {
             updateUnmanagedCpuset();
         }
+
+        finishCoreRemovals();
+        removeDrainedCpusets();
+        reapExitedThreads();
+        checkGangTimeouts();
+        checkUtilityCurves();
+        sampleCoreUtilization();
+        sampleUnmanagedPressure();
+        sampleRunQueues();
     }
 
     return true;
@@ -571,6 +1020,37 @@ CoreArbiterServer::acceptConnection(int listenSocket) {
         return;
     }
 
+    if (threadId == AGENT_CONNECTION_ID) {
+        // The connection comes from an agent that will register the threads
+        // of another process, so the process ID it sent cannot be trusted to
+        // be its own. Only root may do this, and only for a process that is
+        // not already talking to us itself.
+        bool allowed = isPrivilegedPeer(socket);
+        if (allowed && processIdToInfo.find(processId) !=
+                           processIdToInfo.end()) {
+            LOG(ERROR, "Process %d is already registered; refusing agent",
+                processId);
+            allowed = false;
+        }
+        if (!allowed) {
+            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, NULL);
+            sys->close(socket);
+            return;
+        }
+    } else if (threadId == ADMIN_CONNECTION_ID) {
+        // An administrator changing which cores we arbitrate. It is not a
+        // process that wants cores, so none of the state below applies.
+        if (!isPrivilegedPeer(socket)) {
+            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, NULL);
+            sys->close(socket);
+            return;
+        }
+        adminSockets.insert(socket);
+        LOG(NOTICE, "Registered administrator connection on socket %d",
+            socket);
+        return;
+    }
+
     if (processIdToInfo.find(processId) == processIdToInfo.end()) {
         // This is a new process, so we need to do some setup.
         // Construct shared memory page
@@ -586,10 +1066,11 @@ CoreArbiterServer::acceptConnection(int listenSocket) {
         // Our clients are not necessarily root
         sys->chmod(processSharedMemPath.c_str(), 0777);
 
-        size_t processSharedMemSize = sizeof(struct ProcessStats);
+        size_t processSharedMemSize =
+            sharedMemorySize(sizeof(struct ProcessStats));
         sys->ftruncate(processSharedMemFd, processSharedMemSize);
         struct ProcessStats* processStats = (struct ProcessStats*)sys->mmap(
-            NULL, getpagesize(), PROT_READ | PROT_WRITE, MAP_SHARED,
+            NULL, processSharedMemSize, PROT_READ | PROT_WRITE, MAP_SHARED,
             processSharedMemFd, 0);
         if (processStats == MAP_FAILED) {
             LOG(ERROR, "Error on mmap: %s", strerror(errno));
@@ -624,8 +1105,10 @@ CoreArbiterServer::acceptConnection(int listenSocket) {
         }
 
         // Update process information since everything succeeded
-        processIdToInfo[processId] =
+        struct ProcessInfo* process =
             new ProcessInfo(processId, processSharedMemFd, processStats);
+        processIdToInfo[processId] = process;
+        watchProcessExit(process);
 
         stats->numProcesses++;
 
@@ -633,11 +1116,32 @@ CoreArbiterServer::acceptConnection(int listenSocket) {
             socket);
     }
 
+    if (threadId == CONTROL_CONNECTION_ID || threadId == AGENT_CONNECTION_ID) {
+        // The process will register its threads over this connection rather
+        // than opening one per thread.
+        struct ProcessInfo* process = processIdToInfo[processId];
+        if (process->controlSocket >= 0) {
+            LOG(ERROR, "Process %d already has a control connection",
+                processId);
+            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, NULL);
+            sys->close(socket);
+            return;
+        }
+        process->controlSocket = socket;
+        process->proxied = threadId == AGENT_CONNECTION_ID;
+        controlSocketToProcess[socket] = process;
+        LOG(NOTICE,
+            "Registered %s connection for process %d on socket %d",
+            process->proxied ? "agent" : "control", processId, socket);
+        return;
+    }
+
     struct ThreadInfo* thread =
         new ThreadInfo(threadId, processIdToInfo[processId], socket);
     threadSocketToInfo[socket] = thread;
     processIdToInfo[processId]->threadStateToSet[RUNNING_UNMANAGED].insert(
         thread);
+    watchThreadExit(thread);
 
     LOG(NOTICE, "Registered thread with id %d on process %d on socket %d",
         threadId, processId, socket);
@@ -646,408 +1150,2499 @@ CoreArbiterServer::acceptConnection(int listenSocket) {
 }
 
 /**
- * Registers a thread as blocked so that it can be assigned to a managed core.
- * If appropriate, this method also reassigns cores. Note that this method can
- * cause inconsistent state between the server and client if the client does not
- * call recv() after it sends its blocking message to the server.
+ * Returns true if the process at the other end of the given socket runs as
+ * root, and may therefore act as an agent for other processes or change which
+ * cores the server arbitrates.
  *
  * \param socket
- *     The socket whose associated thread is blocking.
+ *     A connection accepted from the listening socket
+ */
+bool
+CoreArbiterServer::isPrivilegedPeer(int socket) {
+    struct ucred credentials;
+    socklen_t len = sizeof(credentials);
+    if (sys->getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &len) <
+        0) {
+        LOG(ERROR, "Error reading peer credentials: %s", strerror(errno));
+        return false;
+    }
+    if (credentials.uid != 0) {
+        LOG(ERROR, "Process %d with uid %u is not privileged",
+            credentials.pid, credentials.uid);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Handles a message sent on behalf of one of a process's threads over the
+ * process's control connection. Each such message starts with its type and
+ * the ID of the thread that sent it. This method should only be called once it
+ * is known that the given socket has pending data to be read.
+ *
+ * \param socket
+ *     The control connection to read the message from
  */
 void
-CoreArbiterServer::threadBlocking(int socket) {
-    timeTrace("SERVER: Start handling thread blocking request");
+CoreArbiterServer::handleControlMessage(int socket) {
+    struct ProcessInfo* process = controlSocketToProcess[socket];
 
-    if (threadSocketToInfo.find(socket) == threadSocketToInfo.end()) {
-        LOG(WARNING, "Unknown thread is blocking");
+    uint8_t msgType;
+    if (!readData(socket, &msgType, sizeof(uint8_t),
+                  "Error reading message type")) {
         return;
     }
 
-    struct ThreadInfo* thread = threadSocketToInfo[socket];
-    LOG(DEBUG, "Thread %d is blocking", thread->id);
-
-    struct ProcessInfo* process = thread->process;
-    bool shouldDistributeCores = true;
-
-    if (thread->state == BLOCKED) {
-        LOG(WARNING, "Thread %d was already blocked", thread->id);
+    pid_t threadId;
+    if (!readData(socket, &threadId, sizeof(pid_t),
+                  "Error reading thread ID")) {
         return;
-    } else if (thread->state == RUNNING_UNMANAGED) {
-        // No need to do anything; later code will handle this case
-    } else if (thread->state == RUNNING_MANAGED) {
-        int coreId =
-            thread->core ? thread->core->id : thread->corePreemptedFrom->id;
-        bool coreReleaseRequested =
-            process->stats->threadCommunicationBlocks[coreId]
-                .coreReleaseRequested;
-        if (coreReleaseRequested) {
-            LOG(NOTICE, "Removing thread %d from core %d", thread->id, coreId);
-            removeThreadFromManagedCore(thread, false);
-            process->stats->threadCommunicationBlocks[coreId]
-                .coreReleaseRequested = false;
-        } else {
-            // This thread has not been asked to release its core, so don't
-            // allow it to block.
-            LOG(WARNING, "Thread %d should not be blocking", thread->id);
-            wakeupThread(thread, thread->core);
+    }
+
+    if (msgType == THREAD_REGISTER) {
+        uint32_t grantSlot;
+        if (!readData(socket, &grantSlot, sizeof(uint32_t),
+                      "Error reading grant slot")) {
             return;
         }
-    } else if (thread->state == RUNNING_PREEMPTED) {
-        int coreId =
-            thread->core ? thread->core->id : thread->corePreemptedFrom->id;
-        bool coreReleaseRequested =
-            process->stats->threadCommunicationBlocks[coreId]
-                .coreReleaseRequested;
-        if (!coreReleaseRequested) {
-            // If we did not ask for the core back, there should be no reason
-            // for the thread to be in a preempted state.
-            LOG(ERROR,
-                "Thread %d should not be unmanaged, since no core preemption "
-                "was requested!",
-                thread->id);
-            abort();
-        }
-        LOG(DEBUG, "Preempted thread %d is blocking", thread->id);
-        process->stats->unpreemptedCount++;
-        process->stats->threadCommunicationBlocks[coreId].coreReleaseRequested =
-            false;
-        assert(process->coresPreemptedFrom.find(thread->corePreemptedFrom) !=
-               process->coresPreemptedFrom.end());
-        process->coresPreemptedFrom.erase(thread->corePreemptedFrom);
-        thread->corePreemptedFrom = NULL;
-        shouldDistributeCores = false;
+        registerMultiplexedThread(process, threadId, grantSlot);
+        return;
+    } else if (msgType == CORE_REQUEST) {
+        coresRequested(socket);
+        return;
+    } else if (msgType == SCAVENGER_REQUEST) {
+        scavengerCoresRequested(socket);
+        return;
+    } else if (msgType == CORE_RANGE_REQUEST) {
+        coreRangeRequested(socket);
+        return;
+    } else if (msgType == GANG_REQUEST) {
+        gangRequested(socket);
+        return;
+    } else if (msgType == PROCESS_CORE_REQUEST) {
+        processCoresRequested(socket);
+        return;
+    } else if (msgType == CORE_CLASS_REQUEST) {
+        coreClassRequested(socket);
+        return;
     }
 
-    changeThreadState(thread, BLOCKED);
-    process->stats->numBlockedThreads++;
+    auto threadIter = process->multiplexedThreads.find(threadId);
+    if (threadIter == process->multiplexedThreads.end()) {
+        LOG(WARNING, "Message %u from unknown thread %d of process %d",
+            msgType, threadId, process->id);
+        return;
+    }
 
-    LOG(DEBUG, "Process %d now has %u blocked threads", process->id,
-        process->stats->numBlockedThreads.load());
-    if (shouldDistributeCores) {
-        distributeCores();
+    switch (msgType) {
+        case THREAD_BLOCK:
+            blockThread(threadIter->second);
+            break;
+        case THREAD_UNREGISTER:
+            LOG(NOTICE, "Unregistering thread %d of process %d", threadId,
+                process->id);
+            cleanupThread(threadIter->second);
+            break;
+        default:
+            LOG(ERROR, "Unknown message type: %u", msgType);
+            break;
     }
-
-    timeTrace("SERVER: Finished thread blocking request");
 }
 
 /**
- * Handles a new core request from a client. The request comes from a thread's
- * socket, but is applied to the entire process. Managed cores are reassigned if
- * necessary. This method should only be called once it is known that the given
- * socket has pending data to be read.
+ * Sets up the state for a thread that registered over its process's control
+ * connection. Like a thread with its own connection, it starts out assumed to
+ * be running in the unmanaged cpuset.
  *
- * \param socket
- *     The socket to read the core request from
+ * \param process
+ *     The process the thread belongs to
+ * \param threadId
+ *     The ID of the new thread
+ * \param grantSlot
+ *     The index in the process's ProcessStats::threadGrantSlots through which
+ *     the thread will be handed cores
  */
 void
-CoreArbiterServer::coresRequested(int socket) {
-    timeTrace("SERVER: Starting to serve core request");
+CoreArbiterServer::registerMultiplexedThread(struct ProcessInfo* process,
+                                             pid_t threadId,
+                                             uint32_t grantSlot) {
+    if (grantSlot >= MAX_MULTIPLEXED_THREADS) {
+        LOG(ERROR, "Thread %d of process %d chose invalid grant slot %u",
+            threadId, process->id, grantSlot);
+        return;
+    }
+    if (process->multiplexedThreads.find(threadId) !=
+        process->multiplexedThreads.end()) {
+        LOG(WARNING, "Thread %d of process %d is already registered",
+            threadId, process->id);
+        return;
+    }
 
-    // TODO(jspeiser): maybe combine this and the original read into one read
-    uint32_t numCoresArr[NUM_PRIORITIES];
-    if (!readData(socket, &numCoresArr, sizeof(uint32_t) * NUM_PRIORITIES,
-                  "Error receiving number of cores requested")) {
+    struct ThreadInfo* thread = new ThreadInfo(threadId, process, -1);
+    struct stat taskStat;
+    if (process->proxied &&
+        sys->stat(getTaskPath(thread).c_str(), &taskStat) < 0) {
+        // An agent names threads of another process, so make sure that the
+        // thread really belongs to it before we start moving it around.
+        LOG(ERROR, "Agent registered thread %d, which is not in process %d",
+            threadId, process->id);
+        delete thread;
         return;
     }
-    timeTrace("SERVER: Read number of cores requested");
+    thread->grantSlot = static_cast<int>(grantSlot);
+    process->multiplexedThreads[threadId] = thread;
+    process->threadStateToSet[RUNNING_UNMANAGED].insert(thread);
+    watchThreadExit(thread);
 
-    struct ProcessInfo* process = threadSocketToInfo[socket]->process;
+    LOG(NOTICE, "Registered thread with id %d on process %d in grant slot %u",
+        threadId, process->id, grantSlot);
+}
 
-    LOG(DEBUG, "Received core request from process %d:", process->id);
-    for (size_t i = 0; i < NUM_PRIORITIES; i++) {
-        LOG(DEBUG, " %u", numCoresArr[i]);
+/**
+ * Handles a request from an administrator connection to add cores to, or
+ * remove them from, the set of cores the server arbitrates, so that cores can
+ * be lent to other systems without restarting the server. A request is its
+ * type (ADD_ARBITRATED_CORES or REMOVE_ARBITRATED_CORES), the number of cores
+ * in it as a uint32_t, and their IDs as ints. The server replies with the
+ * number of those cores that it added or started removing, as a uint32_t.
+ * This method should only be called once it is known that the given socket
+ * has pending data to be read.
+ *
+ * \param socket
+ *     The administrator connection to read the request from
+ */
+void
+CoreArbiterServer::handleAdminMessage(int socket) {
+    uint8_t msgType;
+    if (!readData(socket, &msgType, sizeof(uint8_t),
+                  "Error reading message type")) {
+        return;
     }
 
-    bool desiredCoresChanged = false;
-    for (size_t priority = 0; priority < NUM_PRIORITIES; priority++) {
-        // Update information for a single priority
-        uint32_t prevNumCoresDesired = process->desiredCorePriorities[priority];
-        uint32_t numCoresDesired = numCoresArr[priority];
-
-        process->desiredCorePriorities[priority] = numCoresDesired;
+    uint32_t numCores;
+    if (!readData(socket, &numCores, sizeof(uint32_t),
+                  "Error reading number of cores")) {
+        return;
+    }
+    if (numCores > MAX_SUPPORTED_CORES) {
+        // We can't tell where the next request starts, so give up on this
+        // connection
+        LOG(ERROR, "Administrator request for %u cores is too large",
+            numCores);
+        sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, NULL);
+        cleanupConnection(socket);
+        return;
+    }
 
-        if (numCoresDesired != prevNumCoresDesired) {
-            desiredCoresChanged = true;
-        }
+    int coreIds[MAX_SUPPORTED_CORES];
+    if (!readData(socket, coreIds, numCores * sizeof(int),
+                  "Error reading core IDs")) {
+        return;
+    }
 
-        if (numCoresDesired > 0 && prevNumCoresDesired == 0) {
-            // This process wants a core at a priority that it previously did
-            // not, so we need to add it to the priority queue
-            corePriorityQueues[priority].push_back(process);
-        } else if (numCoresDesired == 0 && prevNumCoresDesired > 0) {
-            // This process previously wanted a core at this priority and no
-            // longer does, so we need to remove it from the priority queue
-            auto& queue = corePriorityQueues[priority];
-            queue.erase(std::find(queue.begin(), queue.end(), process));
+    uint32_t numCoresChanged = 0;
+    for (uint32_t i = 0; i < numCores; i++) {
+        if (msgType == ADD_ARBITRATED_CORES) {
+            numCoresChanged += addArbitratedCore(coreIds[i]) ? 1 : 0;
+        } else if (msgType == REMOVE_ARBITRATED_CORES) {
+            numCoresChanged += removeArbitratedCore(coreIds[i]) ? 1 : 0;
+        } else {
+            LOG(ERROR, "Unknown administrator message type: %u", msgType);
+            break;
         }
     }
 
-    if (desiredCoresChanged) {
-        // Even if the total number of cores this process wants is the same, we
-        // may need to shuffle cores around because of priority changes.
+    if (numCoresChanged > 0) {
+        finishCoreRemovals();
         distributeCores();
     }
-
-    timeTrace("SERVER: Finished serving core request");
+    sendData(socket, &numCoresChanged, sizeof(uint32_t),
+             "Error sending administrator reply");
 }
 
 /**
- * This method is called whenever a timer for thread preemption goes off. If the
- * process in question has not released the core it was supposed to, it is moved
- * to the unmanaged cpuset and all cores are redistributed. Otherwise nothing
- * happens.
+ * Puts a core that the server does not arbitrate under its control. The core
+ * joins the unmanaged cores, from which distributeCores() makes cores managed
+ * as they are needed. The caller is responsible for redistributing cores.
  *
- * \param timerFd
- *     The timer that went off
+ * \param coreId
+ *     The ID of the core to add
+ * \return
+ *     True if the core was added
  */
-void
-CoreArbiterServer::timeoutThreadPreemption(int timerFd) {
-    if (!testingSkipSocketCommunication) {
-        uint64_t time;
-        ssize_t ret = read(timerFd, &time, sizeof(uint64_t));
-        if (ret == -1) {
-            LOG(ERROR, "Error reading number of expirations of the timer: %s",
-                strerror(errno));
-            exit(1);
-        }
+bool
+CoreArbiterServer::addArbitratedCore(int coreId) {
+    int numCores = static_cast<int>(std::thread::hardware_concurrency());
+    if (coreId < 0 || coreId >= MAX_SUPPORTED_CORES ||
+        (!testingDoNotChangeManagedCores && coreId >= numCores)) {
+        LOG(ERROR, "Cannot arbitrate nonexistent core %d", coreId);
+        return false;
     }
 
-    struct TimerInfo* timer = &timerFdToInfo[timerFd];
-    if (processIdToInfo.find(timer->processId) == processIdToInfo.end()) {
-        // This process is no longer registered with the server
-        LOG(DEBUG,
-            "Core retrieval timer went off for process %d, which "
-            "is no longer registered with the server",
-            timer->processId);
-        return;
+    std::vector<struct CoreInfo*> cores(managedCores);
+    cores.insert(cores.end(), unmanagedCores.begin(), unmanagedCores.end());
+    cores.insert(cores.end(), removingCores.begin(), removingCores.end());
+    for (struct CoreInfo* core : cores) {
+        if (core->id == coreId) {
+            LOG(ERROR, "Core %d is already arbitrated%s", coreId,
+                core->removing ? " and is still being removed" : "");
+            return false;
+        }
     }
-    struct ProcessInfo* process = processIdToInfo[timer->processId];
-    struct ThreadInfo* thread = timer->coreInfo->managedThread;
 
-    if (!thread || thread->process != process) {
-        // This process gave up the core it was supposed to
-        LOG(DEBUG,
-            "Core retrieval timer went off for process %d, but process "
-            "already released the core it was supposed to.\n",
-            process->id);
-        return;
+    std::string managedCpusetPath =
+        cpusetPath + "/CoreArbiter/Managed" + std::to_string(coreId);
+    if (!testingSkipCpusetAllocation) {
+        createCpuset(managedCpusetPath, std::to_string(coreId),
+                     std::to_string(getCoreNumaNode(coreId)));
+    }
+    struct CoreInfo* core = new CoreInfo(coreId, managedCpusetPath + "/tasks");
+    core->numaNode = getCoreNumaNode(coreId);
+    core->hyperTwin = getHyperTwin(coreId);
+    core->capacity = getCoreCapacity(coreId);
+    if (ioUring.isInitialized() && !testingSkipCpusetAllocation) {
+        // Grants are batched, so they write to the tasks file through a file
+        // descriptor (see enableIoUring())
+        core->cpusetFd = sys->open(core->cpusetFilename.c_str(), O_WRONLY);
+        if (core->cpusetFd < 0) {
+            LOG(ERROR, "Unable to open %s: %s", core->cpusetFilename.c_str(),
+                strerror(errno));
+            delete core;
+            sys->rmdir(managedCpusetPath.c_str());
+            return false;
+        }
     }
 
-    timeTrace("SERVER: Timing out thread preemption");
-
-    LOG(DEBUG,
-        "Core retrieval timer went off for process %d. Moving one of "
-        "its threads to the unmanaged core.\n",
-        process->id);
-
-    // Remove the thread we requested preemption on from its managed core.
-    // Keep around the original core that a thread was preempted from to ensure
-    // that it is restored to this core when it is unpreempted.
-    thread->corePreemptedFrom = thread->core;
-    // Track at the process level the cores that have threads preempted from
-    // them, so that another thread from the same process does not get
-    // scheduled onto the core.
-    thread->process->coresPreemptedFrom.insert(thread->core);
-
-    removeThreadFromManagedCore(thread);
-    changeThreadState(thread, RUNNING_PREEMPTED);
-    process->stats->preemptedCount++;
-    distributeCores();
-
-    timeTrace("SERVER: Finished thread preemption");
+    unmanagedCores.push_back(core);
+    stats->numUnoccupiedCores++;
+    classifyCores();
+    updateAlwaysUnmanagedString();
+    LOG(NOTICE, "Now arbitrating core %d", coreId);
+    return true;
 }
 
 /**
- * This method should be called when a thread hangs up its socket connection. It
- * cleans up all state associated with the thread, and will also clean up
- * process state if the process no longer has any threads connected. If this
- * thread was running on a managed core, then cores are redistributed.
+ * Takes a core out of the server's control. The core is never granted again.
+ * If a thread is running on it, the thread is asked to release it just as if
+ * it were being preempted, and is moved off it if it does not do so in time.
+ * The core is retired by finishCoreRemovals() once nothing uses it, after
+ * which it is always part of the unmanaged cpuset, like the cores the server
+ * was never given. The caller is responsible for redistributing cores.
  *
- * \param socket
- *     The socket whose thread disconnected
+ * \param coreId
+ *     The ID of the core to remove
+ * \return
+ *     True if the core is being removed
  */
-void
-CoreArbiterServer::cleanupConnection(int socket) {
-    if (threadSocketToInfo.find(socket) == threadSocketToInfo.end()) {
-        return;
+bool
+CoreArbiterServer::removeArbitratedCore(int coreId) {
+    auto hasId = [coreId](struct CoreInfo* core) {
+        return core->id == coreId;
+    };
+    struct CoreInfo* core = NULL;
+    auto managedIter =
+        std::find_if(managedCores.begin(), managedCores.end(), hasId);
+    auto unmanagedIter =
+        std::find_if(unmanagedCores.begin(), unmanagedCores.end(), hasId);
+    if (managedIter != managedCores.end()) {
+        core = *managedIter;
+        managedCores.erase(managedIter);
+    } else if (unmanagedIter != unmanagedCores.end()) {
+        core = *unmanagedIter;
+        unmanagedCores.erase(unmanagedIter);
+    } else {
+        LOG(ERROR, "Core %d is not arbitrated, or is already being removed",
+            coreId);
+        return false;
     }
-    ThreadInfo* thread = threadSocketToInfo[socket];
-    ProcessInfo* process = thread->process;
 
-    LOG(DEBUG, "Cleaning up state for thread %d", thread->id);
+    LOG(NOTICE, "Removing core %d from arbitration", coreId);
+    core->removing = true;
+    removingCores.push_back(core);
 
-    if (sys->close(socket) < 0) {
-        LOG(ERROR, "Error closing socket: %s", strerror(errno));
+    struct ThreadInfo* thread = core->managedThread;
+    if (thread && thread->placeholder) {
+        releaseProcessCore(thread);
+        updateProcessCpuset(thread->process);
+    } else if (thread) {
+        requestCoreRelease(core);
     }
+    return true;
+}
 
-    // We'll only distribute cores at the end if necessary
-    bool shouldDistributeCores = false;
-
-    // Update state pertaining to cores
-    if (thread->state == RUNNING_MANAGED) {
-        managedThreads.erase(
-            std::remove(managedThreads.begin(), managedThreads.end(), thread),
-            managedThreads.end());
-        thread->core->managedThread = NULL;
-        thread->core->threadRemovalTime = Cycles::rdtsc();
-        process->stats->numOwnedCores--;
-
-        // If we hand this core to another thread of the same process, do not
-        // ask it to give back the core immediately.
-        process->stats->threadCommunicationBlocks[thread->core->id]
-            .coreReleaseRequested = false;
-        stats->numUnoccupiedCores++;
-        shouldDistributeCores = true;
-    } else if (thread->state == RUNNING_PREEMPTED) {
-        process->stats->unpreemptedCount++;
-        assert(process->coresPreemptedFrom.find(thread->corePreemptedFrom) !=
-               process->coresPreemptedFrom.end());
-        process->coresPreemptedFrom.erase(thread->corePreemptedFrom);
-        thread->corePreemptedFrom = NULL;
+/**
+ * Retires each core being removed from arbitration (see
+ * removeArbitratedCore()) that is no longer used: it has no thread on it, and
+ * no thread that was preempted from it and might return to it.
+ */
+void
+CoreArbiterServer::finishCoreRemovals() {
+    bool coresRetired = false;
+    for (auto coreIter = removingCores.begin();
+         coreIter != removingCores.end();) {
+        struct CoreInfo* core = *coreIter;
+        bool inUse = core->managedThread != NULL;
+        for (auto& processIdAndInfo : processIdToInfo) {
+            struct ProcessInfo* process = processIdAndInfo.second;
+            if (process->coresPreemptedFrom.count(core) > 0) {
+                inUse = true;
+            }
+        }
+        if (inUse) {
+            coreIter++;
+            continue;
+        }
+        coreIter = removingCores.erase(coreIter);
+        retireCore(core);
+        coresRetired = true;
     }
 
-    // Remove thread from all maps
-    process->threadStateToSet[thread->state].erase(thread);
-    threadSocketToInfo.erase(thread->socket);
+    if (coresRetired) {
+        updateAlwaysUnmanagedString();
+        updateUnmanagedCpuset();
+    }
+}
 
-    // If there are no remaining threads in this process, also delete all
-    // process state
-    bool noRemainingThreads = true;
-    for (auto& kv : process->threadStateToSet) {
-        if (!kv.second.empty()) {
-            noRemainingThreads = false;
-            break;
+/**
+ * Forgets a core that has been taken out of arbitration and is no longer in
+ * use, emptying its managed cpuset for removal and dropping every remaining
+ * reference to it.
+ *
+ * \param core
+ *     The core to retire, which is freed
+ */
+void
+CoreArbiterServer::retireCore(struct CoreInfo* core) {
+    LOG(NOTICE, "Core %d is no longer arbitrated", core->id);
+
+    // A release timer may still be pending if the core's thread gave it up
+    // in time
+    for (auto timerIter = timerFdToInfo.begin();
+         timerIter != timerFdToInfo.end();) {
+        if (timerIter->second.coreInfo != core) {
+            timerIter++;
+            continue;
         }
+        sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, timerIter->first, NULL);
+        if (sys->close(timerIter->first) < 0) {
+            LOG(ERROR, "Error closing timerFd: %s", strerror(errno));
+        }
+        timerIter = timerFdToInfo.erase(timerIter);
     }
 
-    if (noRemainingThreads) {
-        LOG(NOTICE,
-            "All of process %d's threads have exited. Removing all "
-            "process records.\n",
-            process->id);
-        if (sys->close(process->sharedMemFd) < 0) {
-            LOG(ERROR, "Error closing sharedMemFd: %s", strerror(errno));
-        }
-        processIdToInfo.erase(process->id);
-
-        // Remove this process from the core priority queue
-        for (size_t i = 0; i < NUM_PRIORITIES; i++) {
-            std::deque<struct ProcessInfo*>& queue = corePriorityQueues[i];
-            for (auto processIter = queue.begin(); processIter != queue.end();
-                 processIter++) {
-                if (*processIter == process) {
-                    queue.erase(processIter);
-                    break;
+    for (auto& processIdAndInfo : processIdToInfo) {
+        for (auto& threadStateAndSet :
+             processIdAndInfo.second->threadStateToSet) {
+            for (struct ThreadInfo* thread : threadStateAndSet.second) {
+                if (thread->lastCore == core) {
+                    thread->lastCore = NULL;
                 }
             }
         }
+    }
+
+    if (core->cpusetFd >= 0) {
+        sys->close(core->cpusetFd);
+    }
+    core->cpusetFile.close();
+    if (!testingSkipCpusetAllocation) {
+        // Threads that blocked on the core are still in its cpuset
+        std::string managedCpusetPath =
+            cpusetPath + "/CoreArbiter/Managed" + std::to_string(core->id);
+        moveProcsToCpuset(managedCpusetPath + "/tasks",
+                          cpusetPath + "/CoreArbiter/Unmanaged/tasks");
+        drainingCpusets.insert(managedCpusetPath);
+    }
 
-        stats->numProcesses--;
-        LOG(NOTICE, "The server now has %u processes connected.",
-            stats->numProcesses.load());
+    if (frequencyManager) {
+        frequencyManager->restoreCore(core->id);
+    }
+    if (core->id < MAX_SUPPORTED_CORES) {
+        stats->coreClasses[core->id] = CORE_CLASS_ANY;
+    }
+
+    stats->numUnoccupiedCores--;
+    delete core;
+}
 
-        delete process;
+/**
+ * Recomputes alwaysUnmanagedString after the set of cores the server
+ * arbitrates has changed. Cores still being removed are left out of it until
+ * they have been retired.
+ */
+void
+CoreArbiterServer::updateAlwaysUnmanagedString() {
+    if (testingDoNotChangeManagedCores) {
+        return;
     }
 
-    delete thread;
+    std::unordered_set<int> arbitratedCoreIds;
+    for (struct CoreInfo* core : managedCores) {
+        arbitratedCoreIds.insert(core->id);
+    }
+    for (struct CoreInfo* core : unmanagedCores) {
+        arbitratedCoreIds.insert(core->id);
+    }
+    for (struct CoreInfo* core : removingCores) {
+        arbitratedCoreIds.insert(core->id);
+    }
 
-    if (shouldDistributeCores) {
-        distributeCores();
+    alwaysUnmanagedString = "";
+    int numCores = static_cast<int>(std::thread::hardware_concurrency());
+    for (int id = 0; id < numCores; id++) {
+        if (arbitratedCoreIds.find(id) == arbitratedCoreIds.end()) {
+            alwaysUnmanagedString += std::to_string(id) + ",";
+        }
     }
 }
 
 /**
- * Get the core id of the hypertwin of the given core. This code assumes there
- * is only one such hypertwin on the system it is running on. It also assumes
-that hypertwins are delimited by the comma separator.
+ * Registers a thread as blocked so that it can be assigned to a managed core.
+ * If appropriate, this method also reassigns cores. Note that this method can
+ * cause inconsistent state between the server and client if the client does not
+ * call recv() after it sends its blocking message to the server.
  *
- * \param coreId
- *     The coreId whose hypertwin's ID will be returned.
+ * \param socket
+ *     The socket whose associated thread is blocking.
  */
-int
-getHyperTwin(int coreId) {
-    // This file contains the siblings of core coreId.
-    std::string siblingFilePath = "/sys/devices/system/cpu/cpu" +
-                                  std::to_string(coreId) +
-                                  "/topology/thread_siblings_list";
-    FILE* siblingFile = fopen(siblingFilePath.c_str(), "r");
-    int twin1, twin2;
-    // The first cpuid in the file is always that of the physical core
-    fscanf(siblingFile, "%d,%d", &twin1, &twin2);
-    if (coreId == twin1)
-        return twin2;
-    return twin1;
+void
+CoreArbiterServer::threadBlocking(int socket) {
+    if (threadSocketToInfo.find(socket) == threadSocketToInfo.end()) {
+        LOG(WARNING, "Unknown thread is blocking");
+        return;
+    }
+
+    blockThread(threadSocketToInfo[socket]);
 }
 
 /**
- * Find the best core for a given process from the candidate deque, and remove
- * it from the candidate deque.
+ * Does the work of threadBlocking() for a thread that has already been looked
+ * up, however it reached the server.
+ *
+ * \param thread
+ *     The thread that is blocking
  */
-CoreArbiterServer::CoreInfo*
-CoreArbiterServer::findGoodCoreForProcess(
-    ProcessInfo* process, std::deque<struct CoreInfo*>& candidates) {
-    // Compute the set of cores this process currently has managed threads
-    // on, which may be empty.
-    std::unordered_set<int> coresOwnedByProcess;
-    for (struct ThreadInfo* threadInfo :
-         process->threadStateToSet[RUNNING_MANAGED]) {
-        // We assume managed threads have a core.
-        coresOwnedByProcess.insert(threadInfo->core->id);
-    }
+void
+CoreArbiterServer::blockThread(struct ThreadInfo* thread) {
+    timeTrace("SERVER: Start handling thread blocking request");
 
-    std::unordered_set<int> availableManagedCoreIds;
+    LOG(DEBUG, "Thread %d is blocking", thread->id);
 
-    // First look for a core which is the hypertwin of one of this
-    // process's existing cores
+    struct ProcessInfo* process = thread->process;
+    bool shouldDistributeCores = true;
+
+    if (thread->state == BLOCKED) {
+        LOG(WARNING, "Thread %d was already blocked", thread->id);
+        return;
+    } else if (thread->state == RUNNING_UNMANAGED) {
+        // No need to do anything; later code will handle this case
+    } else if (thread->state == RUNNING_MANAGED) {
+        int coreId =
+            thread->core ? thread->core->id : thread->corePreemptedFrom->id;
+        bool coreReleaseRequested =
+            process->stats->threadCommunicationBlocks[coreId]
+                .coreReleaseRequested;
+        if (coreReleaseRequested) {
+            LOG(NOTICE, "Removing thread %d from core %d", thread->id, coreId);
+            removeThreadFromManagedCore(thread, false);
+            process->stats->threadCommunicationBlocks[coreId]
+                .coreReleaseRequested = false;
+        } else {
+            // This thread has not been asked to release its core, so don't
+            // allow it to block.
+            LOG(WARNING, "Thread %d should not be blocking", thread->id);
+            wakeupThread(thread, thread->core);
+            return;
+        }
+    } else if (thread->state == RUNNING_PREEMPTED) {
+        int coreId =
+            thread->core ? thread->core->id : thread->corePreemptedFrom->id;
+        bool coreReleaseRequested =
+            process->stats->threadCommunicationBlocks[coreId]
+                .coreReleaseRequested;
+        if (!coreReleaseRequested) {
+            // If we did not ask for the core back, there should be no reason
+            // for the thread to be in a preempted state.
+            LOG(ERROR,
+                "Thread %d should not be unmanaged, since no core preemption "
+                "was requested!",
+                thread->id);
+            abort();
+        }
+        LOG(DEBUG, "Preempted thread %d is blocking", thread->id);
+        recordUnpreemption(thread);
+        process->stats->threadCommunicationBlocks[coreId].coreReleaseRequested =
+            false;
+        assert(process->coresPreemptedFrom.find(thread->corePreemptedFrom) !=
+               process->coresPreemptedFrom.end());
+        process->coresPreemptedFrom.erase(thread->corePreemptedFrom);
+        thread->corePreemptedFrom = NULL;
+        shouldDistributeCores = false;
+    }
+
+    changeThreadState(thread, BLOCKED);
+    process->stats->numBlockedThreads++;
+
+    LOG(DEBUG, "Process %d now has %u blocked threads", process->id,
+        process->stats->numBlockedThreads.load());
+    if (shouldDistributeCores) {
+        distributeCores();
+    }
+
+    timeTrace("SERVER: Finished thread blocking request");
+}
+
+/**
+ * Handles a new core request from a client. The request comes from a thread's
+ * socket, but is applied to the entire process. Managed cores are reassigned if
+ * necessary. This method should only be called once it is known that the given
+ * socket has pending data to be read.
+ *
+ * \param socket
+ *     The socket to read the core request from
+ */
+void
+CoreArbiterServer::coresRequested(int socket) {
+    timeTrace("SERVER: Starting to serve core request");
+
+    // TODO(jspeiser): maybe combine this and the original read into one read
+    uint32_t numCoresArr[NUM_PRIORITIES];
+    if (!readData(socket, &numCoresArr, sizeof(uint32_t) * NUM_PRIORITIES,
+                  "Error receiving number of cores requested")) {
+        return;
+    }
+    timeTrace("SERVER: Read number of cores requested");
+
+    applyCoreRequest(getRequestingProcess(socket), numCoresArr);
+
+    timeTrace("SERVER: Finished serving core request");
+}
+
+/**
+ * Does the work of coresRequested() once the request has been read, whether
+ * from a socket or from shared memory.
+ *
+ * \param process
+ *     The process that made the request
+ * \param numCores
+ *     The number of cores the process wants at each priority
+ */
+void
+CoreArbiterServer::applyCoreRequest(struct ProcessInfo* process,
+                                    const uint32_t numCores[NUM_PRIORITIES]) {
+    LOG(DEBUG, "Received core request from process %d:", process->id);
+    for (size_t i = 0; i < NUM_PRIORITIES; i++) {
+        LOG(DEBUG, " %u", numCores[i]);
+    }
+
+    // An exact request replaces any range requested earlier
+    bool desiredCoresChanged = false;
+    for (size_t priority = 0; priority < NUM_PRIORITIES; priority++) {
+        if (setDesiredCores(process, priority, numCores[priority])) {
+            desiredCoresChanged = true;
+        }
+        if (setDesiredCores(process, SPARE_PRIORITY(priority), 0)) {
+            desiredCoresChanged = true;
+        }
+    }
+
+    if (desiredCoresChanged) {
+        // Even if the total number of cores this process wants is the same, we
+        // may need to shuffle cores around because of priority changes.
+        distributeCores();
+    }
+}
+
+/**
+ * Used when busy polling to pick up the requests that clients make through
+ * shared memory rather than over their connections: core requests (see
+ * ProcessStats::requestedCores) and threads blocking in their grant slots (see
+ * ThreadGrantSlot::blockCount). Called from handleEvents() on every pass.
+ */
+void
+CoreArbiterServer::pollSharedMemory() {
+    std::vector<struct ThreadInfo*> blockingThreads;
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        struct ProcessStats* stats = process->stats;
+
+        uint32_t version = stats->coreRequestVersion.load();
+        if (version != process->coreRequestVersion && version % 2 == 0) {
+            uint32_t numCores[NUM_PRIORITIES];
+            for (size_t i = 0; i < NUM_PRIORITIES; i++) {
+                numCores[i] = stats->requestedCores[i].load();
+            }
+            // Otherwise the client changed the request while we were reading
+            // it, and we will pick up the new one on the next pass
+            if (stats->coreRequestVersion.load() == version) {
+                timeTrace("SERVER: Read core request from shared memory");
+                process->coreRequestVersion = version;
+                applyCoreRequest(process, numCores);
+            }
+        }
+
+        // A thread bumps its block count only after it has registered, but
+        // its registration may not have been read yet, in which case the
+        // block is left for a later pass.
+        for (auto& threadIdAndInfo : process->multiplexedThreads) {
+            struct ThreadInfo* thread = threadIdAndInfo.second;
+            int blockCount =
+                stats->threadGrantSlots[thread->grantSlot].blockCount.load();
+            if (blockCount != process->blockCounts[thread->grantSlot]) {
+                process->blockCounts[thread->grantSlot] = blockCount;
+                blockingThreads.push_back(thread);
+            }
+        }
+    }
+
+    // Blocking a thread can redistribute cores, so do it once we are done
+    // walking the processes
+    for (struct ThreadInfo* thread : blockingThreads) {
+        timeTrace("SERVER: Read thread block from shared memory");
+        blockThread(thread);
+    }
+}
+
+/**
+ * Handles a request from a client for a range of cores at each priority (see
+ * CoreArbiterClient::setRequestedCoreRange()). The minimum at each priority
+ * is treated like a core request at that priority. The cores beyond it are
+ * queued at SPARE_PRIORITY, so they are only granted once every process's
+ * minimums have been met, and are the first to be reclaimed when another
+ * process's demand rises. This method should only be called once it is known
+ * that the given socket has pending data to be read.
+ *
+ * \param socket
+ *     The socket to read the core range request from
+ */
+void
+CoreArbiterServer::coreRangeRequested(int socket) {
+    // The minimums at each priority, followed by the maximums
+    uint32_t coreRangeArr[2 * NUM_PRIORITIES];
+    if (!readData(socket, &coreRangeArr, sizeof(coreRangeArr),
+                  "Error receiving core range requested")) {
+        return;
+    }
+
+    struct ProcessInfo* process = getRequestingProcess(socket);
+
+    LOG(DEBUG, "Received core range request from process %d:", process->id);
+    bool desiredCoresChanged = false;
+    for (size_t priority = 0; priority < NUM_PRIORITIES; priority++) {
+        uint32_t minCores = coreRangeArr[priority];
+        uint32_t maxCores =
+            std::max(minCores, coreRangeArr[NUM_PRIORITIES + priority]);
+        LOG(DEBUG, " %u-%u", minCores, maxCores);
+
+        if (setDesiredCores(process, priority, minCores)) {
+            desiredCoresChanged = true;
+        }
+        if (setDesiredCores(process, SPARE_PRIORITY(priority),
+                            maxCores - minCores)) {
+            desiredCoresChanged = true;
+        }
+    }
+
+    if (desiredCoresChanged) {
+        distributeCores();
+    }
+}
+
+/**
+ * Handles a request from a client for scavenger cores. These are granted only
+ * when no process wants them at any priority, and are revoked with a shorter
+ * timeout (see requestCoreRelease()). This method should only be called once
+ * it is known that the given socket has pending data to be read.
+ *
+ * \param socket
+ *     The socket to read the request from
+ */
+void
+CoreArbiterServer::scavengerCoresRequested(int socket) {
+    uint32_t numCoresDesired;
+    if (!readData(socket, &numCoresDesired, sizeof(uint32_t),
+                  "Error receiving number of scavenger cores requested")) {
+        return;
+    }
+
+    struct ProcessInfo* process = getRequestingProcess(socket);
+    LOG(DEBUG, "Process %d requested %u scavenger cores", process->id,
+        numCoresDesired);
+
+    if (setDesiredCores(process, SCAVENGER_PRIORITY, numCoresDesired)) {
+        distributeCores();
+    }
+}
+
+/**
+ * Handles a request from a client to have its blocked threads woken as a gang
+ * (see CoreArbiterClient::setGangSize()). This method should only be called
+ * once it is known that the given socket has pending data to be read.
+ *
+ * \param socket
+ *     The socket to read the request from
+ */
+void
+CoreArbiterServer::gangRequested(int socket) {
+    uint32_t gangRequest[2];
+    if (!readData(socket, gangRequest, sizeof(gangRequest),
+                  "Error receiving gang request")) {
+        return;
+    }
+
+    struct ProcessInfo* process = getRequestingProcess(socket);
+    LOG(DEBUG, "Process %d requested gangs of %u threads, timeout %u ms",
+        process->id, gangRequest[0], gangRequest[1]);
+
+    process->gangSize = gangRequest[0];
+    process->gangTimeout = gangRequest[1];
+    process->gangWaitStart = 0;
+    process->gangTimedOut = false;
+
+    // Threads that were being held back may now be woken
+    distributeCores();
+}
+
+/**
+ * Handles a request for the class of cores (see CORE_CLASS_PERFORMANCE) that
+ * a process would rather be granted. The class is a preference: the process
+ * is granted cores of other classes when none of its class are available.
+ * Cores the process already holds are not moved. This method should only be
+ * called once it is known that the given socket has pending data to be read.
+ *
+ * \param socket
+ *     The socket to read the request from
+ */
+void
+CoreArbiterServer::coreClassRequested(int socket) {
+    uint8_t coreClass;
+    if (!readData(socket, &coreClass, sizeof(coreClass),
+                  "Error receiving core class request")) {
+        return;
+    }
+    if (coreClass > CORE_CLASS_EFFICIENCY) {
+        LOG(WARNING, "Ignoring request for unknown core class %u", coreClass);
+        return;
+    }
+
+    struct ProcessInfo* process = getRequestingProcess(socket);
+    LOG(DEBUG, "Process %d requested cores of class %u", process->id,
+        coreClass);
+    process->coreClass = coreClass;
+}
+
+/**
+ * Handles a request for a whole-process grant, made for programs whose
+ * threads cannot block and be woken one at a time. The process asks for cores
+ * at each priority exactly as in a CORE_REQUEST, but instead of being handed
+ * to individual threads, the cores it is granted make up a private cpuset
+ * that all of its threads are moved into. Cores are drawn from the same pool
+ * as other processes': the process gets one placeholder thread per core it
+ * asked for, which distributeCores() treats like any blocked thread, and the
+ * private cpuset is resized as the placeholders gain and lose cores. A process
+ * that asks for whole-process cores should not also register threads. This
+ * method should only be called once it is known that the given socket has
+ * pending data to be read.
+ *
+ * \param socket
+ *     The socket to read the request from
+ */
+void
+CoreArbiterServer::processCoresRequested(int socket) {
+    uint32_t numCores[NUM_PRIORITIES];
+    if (!readData(socket, &numCores, sizeof(uint32_t) * NUM_PRIORITIES,
+                  "Error receiving number of process cores requested")) {
+        return;
+    }
+
+    struct ProcessInfo* process = getRequestingProcess(socket);
+    size_t numCoresRequested = 0;
+    for (size_t i = 0; i < NUM_PRIORITIES; i++) {
+        numCoresRequested += numCores[i];
+    }
+    LOG(DEBUG, "Process %d requested %lu cores for all of its threads",
+        process->id, numCoresRequested);
+
+    std::vector<struct ThreadInfo*>& placeholders = process->placeholders;
+    while (placeholders.size() < numCoresRequested) {
+        struct ThreadInfo* placeholder = new ThreadInfo(0, process, -1);
+        placeholder->placeholder = true;
+        placeholder->state = BLOCKED;
+        process->threadStateToSet[BLOCKED].insert(placeholder);
+        process->blockedThreads.push_back(placeholder);
+        process->stats->numBlockedThreads++;
+        placeholders.push_back(placeholder);
+    }
+
+    bool coresReleased = false;
+    while (placeholders.size() > numCoresRequested) {
+        // Give up placeholders that have no core first
+        auto placeholderIter = std::find_if(
+            placeholders.begin(), placeholders.end(),
+            [](struct ThreadInfo* thread) { return thread->state == BLOCKED; });
+        if (placeholderIter == placeholders.end()) {
+            placeholderIter = placeholders.end() - 1;
+            releaseProcessCore(*placeholderIter);
+            coresReleased = true;
+        }
+        process->stats->numBlockedThreads--;
+        removeThread(*placeholderIter);
+        placeholders.erase(placeholderIter);
+    }
+    if (coresReleased) {
+        updateProcessCpuset(process);
+    }
+
+    applyCoreRequest(process, numCores);
+}
+
+/**
+ * Takes a core back from a whole-process grant. Unlike a thread, a
+ * placeholder gives its core up immediately, so the core can be handed out
+ * again straight away. The caller must update the process's cpuset with
+ * updateProcessCpuset() once it is done taking cores back.
+ *
+ * \param placeholder
+ *     A placeholder thread (see processCoresRequested()) on a managed core
+ */
+void
+CoreArbiterServer::releaseProcessCore(struct ThreadInfo* placeholder) {
+    struct ProcessInfo* process = placeholder->process;
+    LOG(NOTICE, "Taking core %d back from process %d", placeholder->core->id,
+        process->id);
+    removeThreadFromManagedCore(placeholder, false);
+    changeThreadState(placeholder, BLOCKED);
+    process->stats->numBlockedThreads++;
+}
+
+/**
+ * Returns the path of the private cpuset used for a process's whole-process
+ * grant.
+ */
+std::string
+CoreArbiterServer::getProcessCpusetPath(struct ProcessInfo* process) {
+    return cpusetPath + "/CoreArbiter/Process" + std::to_string(process->id);
+}
+
+/**
+ * Makes the private cpuset of a process with a whole-process grant contain
+ * exactly the cores its placeholders hold, creating the cpuset the first time
+ * it is needed. All of the process's threads are moved into the cpuset while
+ * it has any cores, and back to the unmanaged cpuset when it has none, since
+ * a cpuset without cores cannot hold threads.
+ *
+ * \param process
+ *     The process whose grant changed
+ */
+void
+CoreArbiterServer::updateProcessCpuset(struct ProcessInfo* process) {
+    if (testingSkipCpusetAllocation) {
+        return;
+    }
+
+    // The process allocates memory on the nodes of the cores it holds
+    std::string cores;
+    std::set<int> nodes;
+    for (struct ThreadInfo* placeholder : process->placeholders) {
+        if (placeholder->core) {
+            cores += std::to_string(placeholder->core->id) + ",";
+            nodes.insert(placeholder->core->numaNode);
+        }
+    }
+    std::string mems;
+    for (int node : nodes) {
+        mems += std::to_string(node) + ",";
+    }
+
+    std::string processCpusetPath = getProcessCpusetPath(process);
+    if (!process->hasCpuset) {
+        if (cores.empty()) {
+            return;
+        }
+        createCpuset(processCpusetPath, cores, mems);
+        process->hasCpuset = true;
+    }
+
+    std::string pid = std::to_string(process->id);
+    if (cores.empty() && process->inCpuset) {
+        std::ofstream unmanagedProcs(cpusetPath +
+                                     "/CoreArbiter/Unmanaged/cgroup.procs");
+        unmanagedProcs << pid;
+        unmanagedProcs.flush();
+        if (unmanagedProcs.bad()) {
+            LOG(ERROR, "Unable to move process %d to the unmanaged cpuset",
+                process->id);
+        }
+        process->inCpuset = false;
+    }
+
+    if (!mems.empty()) {
+        // A cpuset that holds threads can't be left without a node
+        std::ofstream memsFile(processCpusetPath + "/cpuset.mems");
+        memsFile << mems << std::endl;
+        if (memsFile.bad()) {
+            LOG(ERROR, "Unable to change the memory nodes of process %d to %s",
+                process->id, mems.c_str());
+        }
+    }
+
+    std::ofstream cpusFile(processCpusetPath + "/cpuset.cpus");
+    cpusFile << cores << std::endl;
+    if (cpusFile.bad()) {
+        LOG(ERROR, "Unable to change the cores of process %d to %s",
+            process->id, cores.c_str());
+    }
+
+    if (!cores.empty() && !process->inCpuset) {
+        std::ofstream procsFile(processCpusetPath + "/cgroup.procs");
+        procsFile << pid;
+        procsFile.flush();
+        if (procsFile.bad()) {
+            // The process has probably exited, and will be cleaned up soon
+            LOG(ERROR, "Unable to move process %d to its cpuset", process->id);
+            return;
+        }
+        process->inCpuset = true;
+    }
+}
+
+/**
+ * Removes the private cpuset of a process with a whole-process grant, if it
+ * has one, moving any of its remaining threads to the unmanaged cpuset. The
+ * directory itself is removed once they have left (see
+ * removeDrainedCpusets()).
+ *
+ * \param process
+ *     The process being removed
+ */
+void
+CoreArbiterServer::removeProcessCpuset(struct ProcessInfo* process) {
+    if (!process->hasCpuset) {
+        return;
+    }
+
+    std::string processCpusetPath = getProcessCpusetPath(process);
+    if (process->inCpuset) {
+        moveProcsToCpuset(processCpusetPath + "/cgroup.procs",
+                          cpusetPath + "/CoreArbiter/Unmanaged/cgroup.procs");
+    }
+    drainingCpusets.insert(processCpusetPath);
+    process->hasCpuset = false;
+    process->inCpuset = false;
+}
+
+/**
+ * Removes the cpusets whose threads have been moved out (see
+ * drainingCpusets). The kernel moves threads asynchronously, so a cpuset that
+ * is still busy is emptied again and retried on the next pass instead of
+ * blocking the event loop until it can be removed.
+ */
+void
+CoreArbiterServer::removeDrainedCpusets() {
+    for (auto pathIter = drainingCpusets.begin();
+         pathIter != drainingCpusets.end();) {
+        const std::string& path = *pathIter;
+        if (sys->rmdir(path.c_str()) < 0) {
+            if (errno == EBUSY) {
+                // A thread is still on its way out, or slipped in
+                moveProcsToCpuset(path + "/tasks",
+                                  cpusetPath + "/CoreArbiter/Unmanaged/tasks");
+                pathIter++;
+                continue;
+            }
+            LOG(ERROR, "Error on rmdir %s: %s", path.c_str(), strerror(errno));
+        }
+        pathIter = drainingCpusets.erase(pathIter);
+    }
+}
+
+/**
+ * Returns the process that a request arriving on the given socket applies to.
+ * The socket must be either a registered thread's socket or a control
+ * connection.
+ */
+CoreArbiterServer::ProcessInfo*
+CoreArbiterServer::getRequestingProcess(int socket) {
+    auto controlIter = controlSocketToProcess.find(socket);
+    if (controlIter != controlSocketToProcess.end()) {
+        return controlIter->second;
+    }
+    return threadSocketToInfo[socket]->process;
+}
+
+/**
+ * Updates how many cores a process desires at a single priority, and its
+ * place in that priority's queue.
+ *
+ * \param process
+ *     The process whose request changed
+ * \param priority
+ *     The index in corePriorityQueues to update
+ * \param numCoresDesired
+ *     The number of cores the process now wants at this priority
+ * \return
+ *     True if the number of cores desired changed, in which case cores should
+ *     be redistributed
+ */
+bool
+CoreArbiterServer::setDesiredCores(struct ProcessInfo* process,
+                                   size_t priority, uint32_t numCoresDesired) {
+    uint32_t prevNumCoresDesired = process->desiredCorePriorities[priority];
+    process->desiredCorePriorities[priority] = numCoresDesired;
+
+    if (numCoresDesired != prevNumCoresDesired) {
+        // The process has reconsidered how many cores it needs
+        process->numIdleCoresReclaimed = 0;
+    }
+
+    if (numCoresDesired > 0 && prevNumCoresDesired == 0) {
+        // This process wants a core at a priority that it previously did
+        // not, so we need to add it to the priority queue
+        corePriorityQueues[priority].push_back(process);
+    } else if (numCoresDesired == 0 && prevNumCoresDesired > 0) {
+        // This process previously wanted a core at this priority and no
+        // longer does, so we need to remove it from the priority queue
+        auto& queue = corePriorityQueues[priority];
+        queue.erase(std::find(queue.begin(), queue.end(), process));
+    }
+
+    return numCoresDesired != prevNumCoresDesired;
+}
+
+/**
+ * This method is called whenever a timer for thread preemption goes off. If the
+ * process in question has not released the core it was supposed to, it is moved
+ * to the unmanaged cpuset and all cores are redistributed. Otherwise nothing
+ * happens.
+ *
+ * \param timerFd
+ *     The timer that went off
+ */
+void
+CoreArbiterServer::timeoutThreadPreemption(int timerFd) {
+    if (!testingSkipSocketCommunication) {
+        uint64_t time;
+        ssize_t ret = sys->read(timerFd, &time, sizeof(uint64_t));
+        if (ret == -1) {
+            LOG(ERROR, "Error reading number of expirations of the timer: %s",
+                strerror(errno));
+            exit(1);
+        }
+    }
+
+    struct TimerInfo* timer = &timerFdToInfo[timerFd];
+    if (processIdToInfo.find(timer->processId) == processIdToInfo.end()) {
+        // This process is no longer registered with the server
+        LOG(DEBUG,
+            "Core retrieval timer went off for process %d, which "
+            "is no longer registered with the server",
+            timer->processId);
+        return;
+    }
+    struct ProcessInfo* process = processIdToInfo[timer->processId];
+    struct ThreadInfo* thread = timer->coreInfo->managedThread;
+
+    if (!thread || thread->process != process) {
+        // This process gave up the core it was supposed to
+        LOG(DEBUG,
+            "Core retrieval timer went off for process %d, but process "
+            "already released the core it was supposed to.\n",
+            process->id);
+        return;
+    }
+
+    timeTrace("SERVER: Timing out thread preemption");
+
+    LOG(DEBUG,
+        "Core retrieval timer went off for process %d. Moving one of "
+        "its threads to the unmanaged core.\n",
+        process->id);
+
+    // Remove the thread we requested preemption on from its managed core.
+    // Keep around the original core that a thread was preempted from to ensure
+    // that it is restored to this core when it is unpreempted.
+    thread->corePreemptedFrom = thread->core;
+    // Track at the process level the cores that have threads preempted from
+    // them, so that another thread from the same process does not get
+    // scheduled onto the core.
+    thread->process->coresPreemptedFrom.insert(thread->core);
+
+    removeThreadFromManagedCore(thread);
+    changeThreadState(thread, RUNNING_PREEMPTED);
+    if (thread->scavenging) {
+        // Scavenger cores are expected to be taken back at any moment, so
+        // this is not held against the process as a preemption.
+        thread->scavengerRevoked = true;
+        process->stats->scavengerRevokedCount++;
+    } else {
+        process->stats->preemptedCount++;
+    }
+    distributeCores();
+
+    timeTrace("SERVER: Finished thread preemption");
+}
+
+/**
+ * Records in its process's stats that a preempted thread is no longer
+ * preempted, unless it was only moved off a scavenger core, which
+ * timeoutThreadPreemption() did not count as a preemption.
+ *
+ * \param thread
+ *     The thread that was preempted
+ */
+void
+CoreArbiterServer::recordUnpreemption(struct ThreadInfo* thread) {
+    if (thread->scavengerRevoked) {
+        thread->scavengerRevoked = false;
+    } else {
+        thread->process->stats->unpreemptedCount++;
+    }
+}
+
+/**
+ * This method should be called when a thread hangs up its socket connection. It
+ * cleans up all state associated with the thread, and will also clean up
+ * process state if the process no longer has any threads connected. If this
+ * thread was running on a managed core, then cores are redistributed. If the
+ * socket is a process's control connection, the whole process is cleaned up.
+ *
+ * \param socket
+ *     The socket whose thread disconnected
+ */
+void
+CoreArbiterServer::cleanupConnection(int socket) {
+    if (adminSockets.erase(socket) > 0) {
+        LOG(NOTICE, "Administrator connection on socket %d closed", socket);
+        if (sys->close(socket) < 0) {
+            LOG(ERROR, "Error closing socket: %s", strerror(errno));
+        }
+        return;
+    }
+
+    auto controlIter = controlSocketToProcess.find(socket);
+    if (controlIter != controlSocketToProcess.end()) {
+        LOG(NOTICE,
+            "Process %d closed its control connection. Removing all process "
+            "records.",
+            controlIter->second->id);
+        cleanupProcess(controlIter->second);
+        return;
+    }
+
+    if (threadSocketToInfo.find(socket) == threadSocketToInfo.end()) {
+        return;
+    }
+    cleanupThread(threadSocketToInfo[socket]);
+}
+
+/**
+ * Cleans up all state associated with a thread that has disconnected or
+ * exited, and also cleans up its process if that was its last thread. If the
+ * thread was running on a managed core, then cores are redistributed.
+ *
+ * \param thread
+ *     The thread to clean up
+ */
+void
+CoreArbiterServer::cleanupThread(struct ThreadInfo* thread) {
+    ProcessInfo* process = thread->process;
+
+    bool shouldDistributeCores = removeThread(thread);
+
+    // If there are no remaining threads in this process, also delete all
+    // process state, including the placeholders of any whole-process grant.
+    // A process with a control connection keeps its state until that
+    // connection closes, since it may register more threads.
+    size_t numThreads = 0;
+    for (auto& kv : process->threadStateToSet) {
+        numThreads += kv.second.size();
+    }
+    bool noRemainingThreads = process->controlSocket < 0 &&
+                              numThreads == process->placeholders.size();
+
+    if (noRemainingThreads) {
+        LOG(NOTICE,
+            "All of process %d's threads have exited. Removing all "
+            "process records.\n",
+            process->id);
+        cleanupProcess(process);
+    }
+
+    if (shouldDistributeCores) {
+        distributeCores();
+    }
+}
+
+/**
+ * This method is called when the pidfd of a registered process becomes
+ * readable, meaning that the whole process has exited. All of its threads,
+ * its shared memory and its priority queue entries are torn down together,
+ * and cores are redistributed once rather than once per thread.
+ *
+ * \param pidFd
+ *     The pidfd that became readable
+ */
+void
+CoreArbiterServer::processExited(int pidFd) {
+    struct ProcessInfo* process = processPidFdToInfo[pidFd];
+    LOG(NOTICE, "Process %d exited. Removing all process records.",
+        process->id);
+    cleanupProcess(process);
+}
+
+/**
+ * Tears down a process and all of its threads at once, redistributing cores
+ * at most once.
+ *
+ * \param process
+ *     The process to clean up
+ */
+void
+CoreArbiterServer::cleanupProcess(struct ProcessInfo* process) {
+    // Collect the threads first, since removing a thread changes the sets
+    // we would otherwise be iterating over.
+    std::vector<struct ThreadInfo*> threads;
+    for (auto& threadStateAndSet : process->threadStateToSet) {
+        threads.insert(threads.end(), threadStateAndSet.second.begin(),
+                       threadStateAndSet.second.end());
+    }
+
+    bool shouldDistributeCores = false;
+    for (struct ThreadInfo* thread : threads) {
+        if (thread->socket >= 0) {
+            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, thread->socket, NULL);
+        }
+        if (removeThread(thread)) {
+            shouldDistributeCores = true;
+        }
+    }
+    removeProcess(process);
+
+    if (shouldDistributeCores) {
+        distributeCores();
+    }
+}
+
+/**
+ * Closes the given thread's connection and removes all state associated with
+ * it, including the thread itself. The caller is responsible for removing the
+ * thread's process once it has no threads left and for redistributing cores.
+ *
+ * \param thread
+ *     The thread to remove
+ * \return
+ *     True if the thread was holding a managed core, in which case cores
+ *     should be redistributed
+ */
+bool
+CoreArbiterServer::removeThread(struct ThreadInfo* thread) {
+    ProcessInfo* process = thread->process;
+
+    LOG(DEBUG, "Cleaning up state for thread %d", thread->id);
+
+    if (thread->socket >= 0 && sys->close(thread->socket) < 0) {
+        LOG(ERROR, "Error closing socket: %s", strerror(errno));
+    }
+    unwatchThreadExit(thread);
+
+    bool heldManagedCore = false;
+
+    // Update state pertaining to cores
+    if (thread->state == RUNNING_MANAGED) {
+        managedThreads.erase(
+            std::remove(managedThreads.begin(), managedThreads.end(), thread),
+            managedThreads.end());
+        thread->core->managedThread = NULL;
+        thread->core->threadRemovalTime = sys->rdtsc();
+        process->stats->numOwnedCores--;
+
+        // If we hand this core to another thread of the same process, do not
+        // ask it to give back the core immediately.
+        process->stats->threadCommunicationBlocks[thread->core->id]
+            .coreReleaseRequested = false;
+        stats->numUnoccupiedCores++;
+        heldManagedCore = true;
+    } else if (thread->state == RUNNING_PREEMPTED) {
+        recordUnpreemption(thread);
+        assert(process->coresPreemptedFrom.find(thread->corePreemptedFrom) !=
+               process->coresPreemptedFrom.end());
+        process->coresPreemptedFrom.erase(thread->corePreemptedFrom);
+        thread->corePreemptedFrom = NULL;
+    }
+
+    // Remove thread from all maps
+    process->threadStateToSet[thread->state].erase(thread);
+    if (thread->state == BLOCKED) {
+        auto& blockedThreads = process->blockedThreads;
+        blockedThreads.erase(
+            std::find(blockedThreads.begin(), blockedThreads.end(), thread));
+    }
+    if (thread->socket >= 0) {
+        threadSocketToInfo.erase(thread->socket);
+    } else {
+        process->multiplexedThreads.erase(thread->id);
+    }
+
+    delete thread;
+    return heldManagedCore;
+}
+
+/**
+ * Removes all state associated with a process that no longer has any threads,
+ * including its shared memory and its entries in the core priority queues.
+ *
+ * \param process
+ *     The process to remove
+ */
+void
+CoreArbiterServer::removeProcess(struct ProcessInfo* process) {
+    if (process->pidFd >= 0) {
+        sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, process->pidFd, NULL);
+        if (sys->close(process->pidFd) < 0) {
+            LOG(ERROR, "Error closing process pidfd: %s", strerror(errno));
+        }
+        processPidFdToInfo.erase(process->pidFd);
+    }
+
+    if (process->controlSocket >= 0) {
+        sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, process->controlSocket, NULL);
+        if (sys->close(process->controlSocket) < 0) {
+            LOG(ERROR, "Error closing control socket: %s", strerror(errno));
+        }
+        controlSocketToProcess.erase(process->controlSocket);
+    }
+
+    if (!testingSkipMemoryDeallocation) {
+        if (sys->munmap(process->stats,
+                        sharedMemorySize(sizeof(struct ProcessStats))) < 0) {
+            LOG(ERROR, "Error unmapping shared memory of process %d: %s",
+                process->id, strerror(errno));
+        }
+        std::string processSharedMemPath =
+            sharedMemPathPrefix + std::to_string(process->id);
+        sys->unlink(processSharedMemPath.c_str());
+    }
+    if (sys->close(process->sharedMemFd) < 0) {
+        LOG(ERROR, "Error closing sharedMemFd: %s", strerror(errno));
+    }
+    removeProcessCpuset(process);
+    processIdToInfo.erase(process->id);
+
+    // Remove this process from the core priority queue
+    for (size_t i = 0; i < corePriorityQueues.size(); i++) {
+        std::deque<struct ProcessInfo*>& queue = corePriorityQueues[i];
+        for (auto processIter = queue.begin(); processIter != queue.end();
+             processIter++) {
+            if (*processIter == process) {
+                queue.erase(processIter);
+                break;
+            }
+        }
+    }
+
+    for (ProcessEfficiency& efficiency : stats->processEfficiency) {
+        if (efficiency.processId == process->id) {
+            efficiency.usefulCycles = 0;
+            efficiency.grantedCycles = 0;
+            efficiency.processId = 0;
+        }
+    }
+
+    stats->numProcesses--;
+    LOG(NOTICE, "The server now has %u processes connected.",
+        stats->numProcesses.load());
+
+    delete process;
+}
+
+/**
+ * This method is called when the pidfd of a registered thread becomes
+ * readable, meaning that the thread has exited. A thread's connection normally
+ * closes when it calls unregisterThread(), but its socket is owned by the
+ * process and stays open if the thread exits without unregistering. Cleaning
+ * up here returns the thread's core to the pool without waiting for the whole
+ * process to die.
+ *
+ * \param pidFd
+ *     The pidfd that became readable
+ */
+void
+CoreArbiterServer::threadExited(int pidFd) {
+    struct ThreadInfo* thread = threadPidFdToInfo[pidFd];
+    LOG(NOTICE, "Thread %d of process %d exited without unregistering",
+        thread->id, thread->process->id);
+    if (thread->socket >= 0) {
+        sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, thread->socket, NULL);
+    }
+    cleanupThread(thread);
+}
+
+/**
+ * Starts watching for the exit of a newly registered thread, using a pidfd in
+ * the epoll set when the kernel supports PIDFD_THREAD. Otherwise the thread is
+ * left to reapExitedThreads(), which only runs in the periodic pass of
+ * handleEvents(). A thread that exits without unregistering may then keep its
+ * managed core for up to cpusetUpdateTimeout milliseconds
+ * (CPUSET_UPDATE_TIMEOUT_MS by default) before it is noticed and the core is
+ * given to another thread.
+ *
+ * \param thread
+ *     The thread to watch
+ */
+void
+CoreArbiterServer::watchThreadExit(struct ThreadInfo* thread) {
+    if (threadPidFdsSupported) {
+        int pidFd = sys->pidfd_open(thread->id, PIDFD_THREAD);
+        if (pidFd >= 0) {
+            struct epoll_event pidFdEvent;
+            pidFdEvent.events = EPOLLIN;
+            pidFdEvent.data.fd = pidFd;
+            if (sys->epoll_ctl(epollFd, EPOLL_CTL_ADD, pidFd, &pidFdEvent) ==
+                0) {
+                thread->pidFd = pidFd;
+                threadPidFdToInfo[pidFd] = thread;
+                return;
+            }
+            LOG(ERROR, "Error adding pidfd for thread %d to epoll: %s",
+                thread->id, strerror(errno));
+            sys->close(pidFd);
+        } else if (errno == EINVAL || errno == ENOSYS) {
+            LOG(NOTICE,
+                "Thread pidfds are not supported (%s); polling /proc for "
+                "thread exits instead",
+                strerror(errno));
+            threadPidFdsSupported = false;
+        }
+    }
+
+    // Only poll for threads that we can see. A thread in another PID
+    // namespace would otherwise look like it has already exited.
+    struct stat taskStat;
+    if (sys->stat(getTaskPath(thread).c_str(), &taskStat) == 0) {
+        thread->pollForExit = true;
+    } else {
+        LOG(WARNING, "Unable to watch thread %d of process %d for exit: %s",
+            thread->id, thread->process->id, strerror(errno));
+    }
+}
+
+/**
+ * Starts watching for the exit of a newly registered process with a pidfd in
+ * the epoll set. If the kernel cannot provide one, the process is cleaned up
+ * one thread at a time as its threads' exits are detected.
+ *
+ * \param process
+ *     The process to watch
+ */
+void
+CoreArbiterServer::watchProcessExit(struct ProcessInfo* process) {
+    int pidFd = sys->pidfd_open(process->id, 0);
+    if (pidFd < 0) {
+        LOG(WARNING, "Error opening pidfd for process %d: %s", process->id,
+            strerror(errno));
+        return;
+    }
+
+    struct epoll_event pidFdEvent;
+    pidFdEvent.events = EPOLLIN;
+    pidFdEvent.data.fd = pidFd;
+    if (sys->epoll_ctl(epollFd, EPOLL_CTL_ADD, pidFd, &pidFdEvent) < 0) {
+        LOG(ERROR, "Error adding pidfd for process %d to epoll: %s",
+            process->id, strerror(errno));
+        sys->close(pidFd);
+        return;
+    }
+
+    process->pidFd = pidFd;
+    processPidFdToInfo[pidFd] = process;
+}
+
+/**
+ * Stops watching for the exit of the given thread and releases its pidfd, if
+ * it has one. This should be called whenever a thread's state is cleaned up.
+ *
+ * \param thread
+ *     The thread that should no longer be watched
+ */
+void
+CoreArbiterServer::unwatchThreadExit(struct ThreadInfo* thread) {
+    if (thread->pidFd < 0) {
+        return;
+    }
+    sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, thread->pidFd, NULL);
+    if (sys->close(thread->pidFd) < 0) {
+        LOG(ERROR, "Error closing pidfd: %s", strerror(errno));
+    }
+    threadPidFdToInfo.erase(thread->pidFd);
+    thread->pidFd = -1;
+}
+
+/**
+ * Cleans up every polled thread (see watchThreadExit()) whose /proc entry has
+ * disappeared. This is the fallback for kernels that cannot notify us of
+ * individual thread exits, and is called periodically from handleEvents().
+ */
+void
+CoreArbiterServer::reapExitedThreads() {
+    std::vector<struct ThreadInfo*> exitedThreads;
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        for (auto& threadStateAndSet : process->threadStateToSet) {
+            for (struct ThreadInfo* thread : threadStateAndSet.second) {
+                if (!thread->pollForExit) {
+                    continue;
+                }
+                struct stat taskStat;
+                if (sys->stat(getTaskPath(thread).c_str(), &taskStat) < 0 &&
+                    errno == ENOENT) {
+                    exitedThreads.push_back(thread);
+                }
+            }
+        }
+    }
+
+    for (struct ThreadInfo* thread : exitedThreads) {
+        LOG(NOTICE, "Thread %d of process %d exited without unregistering",
+            thread->id, thread->process->id);
+        if (thread->socket >= 0) {
+            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, thread->socket, NULL);
+        }
+        cleanupThread(thread);
+    }
+}
+
+/**
+ * Returns the path of the given thread's entry under /proc.
+ */
+std::string
+CoreArbiterServer::getTaskPath(struct ThreadInfo* thread) {
+    return "/proc/" + std::to_string(thread->process->id) + "/task/" +
+           std::to_string(thread->id);
+}
+
+/**
+ * Find the best core for a given process from the candidate deque, and remove
+ * it from the candidate deque.
+ */
+CoreArbiterServer::CoreInfo*
+CoreArbiterServer::findGoodCoreForProcess(
+    ProcessInfo* process, std::deque<struct CoreInfo*>& candidates) {
+    // Compute the set of cores this process currently has managed threads
+    // on, which may be empty.
+    std::unordered_set<int> coresOwnedByProcess;
+    for (struct ThreadInfo* threadInfo :
+         process->threadStateToSet[RUNNING_MANAGED]) {
+        // We assume managed threads have a core.
+        coresOwnedByProcess.insert(threadInfo->core->id);
+    }
+
+    std::unordered_set<int> availableManagedCoreIds;
+
+    // First look for a core which is the hypertwin of one of this
+    // process's existing cores
+    for (struct CoreInfo* candidate : candidates) {
+        LOG(DEBUG, "Considering candidate %d, hypertwin of %d", candidate->id,
+            candidate->hyperTwin);
+        if (coresOwnedByProcess.find(candidate->hyperTwin) !=
+            coresOwnedByProcess.end()) {
+            LOG(NOTICE, "candidate %d, hypertwin of %d has been selected",
+                candidate->id, candidate->hyperTwin);
+            candidates.erase(
+                std::find(candidates.begin(), candidates.end(), candidate));
+            return candidate;
+        }
+
+        availableManagedCoreIds.insert(candidate->id);
+    }
+
+    // Next look for a core whose hypertwin is also in the set of
+    // available cores.
     for (struct CoreInfo* candidate : candidates) {
-        LOG(DEBUG, "Considering candidate %d, hypertwin of %d", candidate->id,
-            getHyperTwin(candidate->id));
-        if (coresOwnedByProcess.find(getHyperTwin(candidate->id)) !=
-            coresOwnedByProcess.end()) {
-            LOG(NOTICE, "candidate %d, hypertwin of %d has been selected",
-                candidate->id, getHyperTwin(candidate->id));
+        if (availableManagedCoreIds.find(candidate->hyperTwin) !=
+            availableManagedCoreIds.end()) {
             candidates.erase(
                 std::find(candidates.begin(), candidates.end(), candidate));
             return candidate;
         }
+    }
+
+    // Finally, find any available core
+    CoreInfo* core = candidates.front();
+    candidates.pop_front();
+    return core;
+}
+
+/**
+ * Find the best core for a given thread from the candidate deque, and remove
+ * it from the candidate deque. This is the core the thread last ran on if it
+ * is a candidate, and otherwise the best core for the thread's process.
+ */
+CoreArbiterServer::CoreInfo*
+CoreArbiterServer::findGoodCoreForThread(
+    ThreadInfo* thread, std::deque<struct CoreInfo*>& candidates) {
+    ProcessInfo* process = thread->process;
+    int numaNode = process->gangNumaNode;
+    uint8_t coreClass = process->coreClass;
+    CoreInfo* lastCore = thread->lastCore;
+    if (lastCore && (numaNode < 0 || lastCore->numaNode == numaNode) &&
+        (coreClass == CORE_CLASS_ANY || lastCore->coreClass == coreClass) &&
+        process->coresPreemptedFrom.find(lastCore) ==
+            process->coresPreemptedFrom.end()) {
+        auto lastCoreIter =
+            std::find(candidates.begin(), candidates.end(), lastCore);
+        if (lastCoreIter != candidates.end()) {
+            candidates.erase(lastCoreIter);
+            return lastCore;
+        }
+    }
+
+    // Keep the thread's gang together on one NUMA node, and then prefer the
+    // class of cores its process asked for
+    std::deque<struct CoreInfo*> preferredCandidates;
+    for (struct CoreInfo* candidate : candidates) {
+        if (numaNode < 0 || candidate->numaNode == numaNode) {
+            preferredCandidates.push_back(candidate);
+        }
+    }
+    if (preferredCandidates.empty()) {
+        preferredCandidates = candidates;
+    }
+    if (coreClass != CORE_CLASS_ANY) {
+        std::deque<struct CoreInfo*> sameClassCandidates;
+        for (struct CoreInfo* candidate : preferredCandidates) {
+            if (candidate->coreClass == coreClass) {
+                sameClassCandidates.push_back(candidate);
+            }
+        }
+        if (!sameClassCandidates.empty()) {
+            preferredCandidates.swap(sameClassCandidates);
+        }
+    }
+    if (preferredCandidates.size() == candidates.size()) {
+        return findGoodCoreForProcess(process, candidates);
+    }
+
+    CoreInfo* core = findGoodCoreForProcess(process, preferredCandidates);
+    candidates.erase(std::find(candidates.begin(), candidates.end(), core));
+    return core;
+}
+
+/**
+ * Chooses the next of a process's blocked threads to receive a core,
+ * according to blockedThreadPolicy.
+ *
+ * \param process
+ *     The process whose blocked thread should receive a core
+ * \param numChosen
+ *     The number of this process's blocked threads that have already been
+ *     chosen during the current distribution. Incremented if a thread is
+ *     chosen.
+ * \return
+ *     The chosen thread, or NULL if every blocked thread has been chosen
+ */
+CoreArbiterServer::ThreadInfo*
+CoreArbiterServer::chooseBlockedThread(ProcessInfo* process,
+                                       size_t* numChosen) {
+    std::deque<struct ThreadInfo*>& blockedThreads = process->blockedThreads;
+    if (*numChosen >= blockedThreads.size()) {
+        return NULL;
+    }
+
+    size_t index = blockedThreadPolicy == LONGEST_BLOCKED
+                       ? *numChosen
+                       : blockedThreads.size() - 1 - *numChosen;
+    (*numChosen)++;
+    return blockedThreads[index];
+}
+
+/**
+ * Used by distributeCores() to describe the server's processes, threads and
+ * cores to allocationPolicy. Each process's blocked threads are listed in the
+ * order given by blockedThreadPolicy. If the policy uses utility curves, they
+ * are read from the processes' shared memory first.
+ *
+ * \param[out] snapshot
+ *     Filled in with the state of the server
+ * \param[out] threads
+ *     Filled in with the thread at each index in snapshot->threads
+ * \param[out] processes
+ *     Filled in with the process at each index in snapshot->processes
+ */
+void
+CoreArbiterServer::takeAllocationSnapshot(
+    AllocationSnapshot* snapshot, std::vector<struct ThreadInfo*>* threads,
+    std::vector<struct ProcessInfo*>* processes) {
+    bool usesUtilityCurves = allocationPolicy->usesUtilityCurves();
+    std::unordered_map<struct ProcessInfo*, size_t> processToIndex;
+    processToIndex.reserve(processIdToInfo.size());
+    processes->reserve(processIdToInfo.size());
+    snapshot->processes.reserve(processIdToInfo.size());
+    auto addThread = [&](struct ThreadInfo* thread, size_t processIndex) {
+        snapshot->threads.push_back(
+            {thread->id, processIndex, thread->core ? thread->core->id : -1,
+             thread->state == RUNNING_PREEMPTED});
+        threads->push_back(thread);
+        return snapshot->threads.size() - 1;
+    };
+
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        size_t processIndex = processes->size();
+        processToIndex[process] = processIndex;
+        processes->push_back(process);
+        snapshot->processes.emplace_back();
+        AllocationSnapshot::Process& info = snapshot->processes.back();
+        info.id = process->id;
+
+        // Same as getDesiredCores() at every priority, but withholds
+        // reclaimed cores from the lowest priorities in a single pass
+        info.desiredCores.resize(corePriorityQueues.size());
+        uint32_t numWithheld = process->numIdleCoresReclaimed;
+        for (size_t priority = corePriorityQueues.size(); priority-- > 0;) {
+            uint32_t numDesired = process->desiredCorePriorities[priority];
+            uint32_t numPriorityWithheld = std::min(numWithheld, numDesired);
+            info.desiredCores[priority] = numDesired - numPriorityWithheld;
+            numWithheld -= numPriorityWithheld;
+        }
+        for (struct ThreadInfo* thread :
+             process->threadStateToSet[RUNNING_PREEMPTED]) {
+            // A thread preempted from a core being removed can only be given
+            // a core again once it has blocked.
+            if (thread->corePreemptedFrom &&
+                thread->corePreemptedFrom->removing) {
+                continue;
+            }
+            info.preemptedThreads.push_back(addThread(thread, processIndex));
+        }
+        size_t numChosen = 0;
+        info.blockedThreads.reserve(process->blockedThreads.size());
+        while (struct ThreadInfo* thread =
+                   chooseBlockedThread(process, &numChosen)) {
+            info.blockedThreads.push_back(addThread(thread, processIndex));
+        }
+        if (usesUtilityCurves) {
+            readUtilityCurve(process);
+            info.utilityCurve = process->utilityCurve;
+        }
+    }
+
+    for (struct ThreadInfo* thread : managedThreads) {
+        // Threads on cores being removed are about to lose them whatever the
+        // policy decides.
+        if (thread->core && thread->core->removing) {
+            continue;
+        }
+        size_t processIndex = processToIndex[thread->process];
+        size_t threadIndex = addThread(thread, processIndex);
+        snapshot->managedThreads.push_back(threadIndex);
+        snapshot->processes[processIndex].managedThreads.push_back(
+            threadIndex);
+    }
+
+    for (struct CoreInfo* core : managedCores) {
+        snapshot->cores.push_back({core->id, core->numaNode, core->hyperTwin});
+    }
+    for (struct CoreInfo* core : unmanagedCores) {
+        snapshot->cores.push_back({core->id, core->numaNode, core->hyperTwin});
+    }
+    // Leave out the cores held back for the unmanaged cpuset, so that the
+    // policy does not hand them out
+    snapshot->cores.resize(getMaxManagedCores());
+
+    for (std::deque<struct ProcessInfo*>& queue : corePriorityQueues) {
+        snapshot->priorityQueues.emplace_back();
+        for (struct ProcessInfo* process : queue) {
+            snapshot->priorityQueues.back().push_back(processToIndex[process]);
+        }
+    }
+}
+
+/**
+ * Copies a process's utility curve out of its shared memory, unless the client
+ * is in the middle of changing it, in which case the previous copy is kept.
+ *
+ * \param process
+ *     The process whose utility curve is read
+ * \return
+ *     True if a different version of the curve was read
+ */
+bool
+CoreArbiterServer::readUtilityCurve(struct ProcessInfo* process) {
+    struct ProcessStats* stats = process->stats;
+    uint32_t version = stats->utilityCurveVersion.load();
+    if (version == process->utilityCurveVersion || version % 2 == 1) {
+        return false;
+    }
+
+    uint32_t numPoints =
+        std::min(stats->numUtilityPoints.load(), (uint32_t)MAX_SUPPORTED_CORES);
+    std::vector<float> utilityCurve(numPoints);
+    for (uint32_t i = 0; i < numPoints; i++) {
+        utilityCurve[i] = stats->marginalUtilities[i].load();
+    }
+    if (stats->utilityCurveVersion.load() != version) {
+        // The client changed the curve while we were reading it
+        return false;
+    }
+
+    process->utilityCurve.swap(utilityCurve);
+    process->utilityCurveVersion = version;
+    return true;
+}
+
+/**
+ * Redistributes cores if some process has published a new utility curve since
+ * the last distribution. Clients change their curves without telling the
+ * server, so this is called periodically from handleEvents().
+ */
+void
+CoreArbiterServer::checkUtilityCurves() {
+    if (!allocationPolicy->usesUtilityCurves()) {
+        return;
+    }
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        uint32_t version = process->stats->utilityCurveVersion.load();
+        if (version != process->utilityCurveVersion && version % 2 == 0) {
+            distributeCores();
+            return;
+        }
+    }
+}
+
+/**
+ * Returns how many cores distributeCores() should try to give a process at a
+ * priority. This is the number it asked for, less any idle cores that have
+ * been reclaimed from it, which are taken from its lowest priorities first.
+ *
+ * \param process
+ *     The process whose cores are being distributed
+ * \param priority
+ *     The index in corePriorityQueues being distributed
+ */
+uint32_t
+CoreArbiterServer::getDesiredCores(struct ProcessInfo* process,
+                                   size_t priority) {
+    std::vector<uint32_t>& desiredCores = process->desiredCorePriorities;
+    uint32_t numWithheld = process->numIdleCoresReclaimed;
+    for (size_t i = desiredCores.size() - 1; i > priority; i--) {
+        numWithheld -= std::min(numWithheld, desiredCores[i]);
+    }
+    return desiredCores[priority] -
+           std::min(numWithheld, desiredCores[priority]);
+}
+
+/**
+ * Reads how busy each process has kept its managed cores since the last call
+ * (see CoreArbiterClient::recordCoreUtilization()), and adds it to the
+ * processes' efficiency in GlobalStats. Arachne-style runtimes spin on idle
+ * cores, so this is the only way for the server to tell whether they need
+ * them. A core that stays idle for IDLE_CORE_RECLAIM_MS while other processes
+ * wait for cores is reclaimed from its process, which does not get it back
+ * until it keeps all of its remaining cores busy or changes its request. This
+ * is called periodically from handleEvents().
+ */
+void
+CoreArbiterServer::sampleCoreUtilization() {
+    uint64_t now = sys->rdtsc();
+    uint64_t elapsed =
+        lastUtilizationSample == 0 ? 0 : now - lastUtilizationSample;
+    lastUtilizationSample = now;
+
+    std::unordered_set<struct ProcessInfo*> processesWithIdleCores;
+    std::unordered_set<struct ProcessInfo*> processesWithBusyCores;
+    bool redistributeCores = false;
+    for (size_t i = 0; i < managedCores.size(); i++) {
+        struct CoreInfo* core = managedCores[i];
+        struct ThreadInfo* thread = core->managedThread;
+        if (!thread) {
+            core->sampledProcessId = 0;
+            core->idleSince = 0;
+            continue;
+        }
+
+        struct ProcessInfo* process = thread->process;
+        CoreUtilization& utilization =
+            process->stats->coreUtilization[core->id];
+        uint64_t busyCycles = utilization.busyCycles.load();
+        uint64_t idleCycles = utilization.idleCycles.load();
+        uint64_t busyDelta = busyCycles - core->sampledBusyCycles;
+        uint64_t idleDelta = idleCycles - core->sampledIdleCycles;
+        uint64_t reportedDelta = busyDelta + idleDelta;
+        bool sampledBefore = core->sampledProcessId == process->id;
+        core->sampledProcessId = process->id;
+        core->sampledBusyCycles = busyCycles;
+        core->sampledIdleCycles = idleCycles;
+        if (!sampledBefore || reportedDelta == 0) {
+            // Either the core changed hands since the last sample, or its
+            // process does not report its utilization
+            core->idleSince = 0;
+            continue;
+        }
+
+        ProcessEfficiency* efficiency = getProcessEfficiency(process->id);
+        if (efficiency) {
+            efficiency->usefulCycles += busyDelta;
+            efficiency->grantedCycles += elapsed;
+        }
+
+        if (static_cast<double>(busyDelta) >=
+            IDLE_CORE_BUSY_FRACTION * static_cast<double>(reportedDelta)) {
+            processesWithBusyCores.insert(process);
+            core->idleSince = 0;
+            continue;
+        }
+        processesWithIdleCores.insert(process);
+        if (core->idleSince == 0) {
+            core->idleSince = now;
+        } else if (Cycles::toMilliseconds(now - core->idleSince) >=
+                       IDLE_CORE_RECLAIM_MS &&
+                   processesWaitingForCores(process)) {
+            LOG(NOTICE, "Reclaiming idle core %d from process %d", core->id,
+                process->id);
+            process->numIdleCoresReclaimed++;
+            core->idleSince = 0;
+
+            // Make this the thread that distributeCores() preempts
+            managedThreads.erase(std::find(managedThreads.begin(),
+                                           managedThreads.end(), thread));
+            managedThreads.push_back(thread);
+            redistributeCores = true;
+        }
+    }
+
+    for (struct ProcessInfo* process : processesWithBusyCores) {
+        if (process->numIdleCoresReclaimed > 0 &&
+            processesWithIdleCores.find(process) ==
+                processesWithIdleCores.end()) {
+            LOG(NOTICE, "Process %d is using all of its cores again",
+                process->id);
+            process->numIdleCoresReclaimed = 0;
+            redistributeCores = true;
+        }
+    }
+
+    if (redistributeCores) {
+        distributeCores();
+    }
+}
+
+/**
+ * Measures how much the threads in the unmanaged cpuset are competing for
+ * CPUs, and moves unmanagedFloor (see setUnmanagedFloor()) accordingly.
+ * Competition is measured in two ways: the fraction of the time that some
+ * unmanaged thread was waiting for a CPU, from the pressure stall information
+ * (PSI) of the unmanaged cpuset, or of the whole system if the kernel does
+ * not keep it per cgroup; and the number of runnable threads per unmanaged
+ * core, counting every runnable thread on the system except the ones on
+ * managed cores. This is called periodically from handleEvents(), and does
+ * nothing more often than every UNMANAGED_PRESSURE_SAMPLE_MS.
+ */
+void
+CoreArbiterServer::sampleUnmanagedPressure() {
+    if (maxUnmanagedFloor == minUnmanagedFloor) {
+        return;
+    }
+    uint64_t now = sys->rdtsc();
+    if (lastPressureSample != 0 &&
+        Cycles::toMilliseconds(now - lastPressureSample) <
+            UNMANAGED_PRESSURE_SAMPLE_MS) {
+        return;
+    }
+
+    if (pressurePath.empty()) {
+        pressurePath = findPressurePath();
+    }
+
+    // The cumulative stall time is the total= field of the "some" line
+    uint64_t stallUs = 0;
+    bool stallRead = false;
+    std::ifstream pressureFile(pressurePath);
+    std::string line;
+    while (!stallRead && std::getline(pressureFile, line)) {
+        size_t total = line.find("total=");
+        if (line.compare(0, 5, "some ") != 0 || total == std::string::npos) {
+            continue;
+        }
+        const char* start = line.c_str() + total + 6;
+        char* end;
+        errno = 0;
+        stallUs = strtoull(start, &end, 10);
+        if (end == start || (*end != '\0' && !isspace(*end)) || errno != 0) {
+            LOG(WARNING, "Malformed line in %s: %s", pressurePath.c_str(),
+                line.c_str());
+            stallUs = 0;
+            break;
+        }
+        stallRead = true;
+    }
+
+    uint32_t numRunnable = 0;
+    std::ifstream statFile("/proc/stat");
+    std::string field;
+    while (statFile >> field) {
+        if (field == "procs_running") {
+            statFile >> numRunnable;
+            break;
+        }
+    }
+
+    uint64_t elapsedUs = Cycles::toMicroseconds(now - lastPressureSample);
+    bool firstSample = lastPressureSample == 0;
+    uint64_t stallDeltaUs = stallUs - std::min(stallUs, lastPressureStallUs);
+    lastPressureSample = now;
+    lastPressureStallUs = stallUs;
+    if (firstSample || elapsedUs == 0) {
+        return;
+    }
+
+    size_t numUnmanagedCores =
+        unmanagedCores.size() + static_cast<size_t>(std::count(
+                                    alwaysUnmanagedString.begin(),
+                                    alwaysUnmanagedString.end(), ','));
+    size_t numUnmanagedRunnable =
+        numRunnable - std::min<size_t>(numRunnable, managedThreads.size());
+    double stallFraction =
+        stallRead ? static_cast<double>(stallDeltaUs) /
+                        static_cast<double>(elapsedUs)
+                  : 0.0;
+    double runnablePerCore =
+        static_cast<double>(numUnmanagedRunnable) /
+        static_cast<double>(std::max<size_t>(numUnmanagedCores, 1));
+    if (adjustUnmanagedFloor(stallFraction, runnablePerCore)) {
+        distributeCores();
+    }
+}
+
+/**
+ * Used by sampleUnmanagedPressure() to find where the kernel keeps the
+ * pressure stall information for the unmanaged cpuset. That is the
+ * cpu.pressure file of the Unmanaged cgroup when cpusetPath is a cgroup2
+ * hierarchy, or of an Unmanaged cgroup mirrored under a cgroup2 mount
+ * beside the cgroup v1 cpuset hierarchy. Failing both, it is the
+ * system-wide /proc/pressure/cpu, which also counts stalls on managed cores.
+ *
+ * \return
+ *     The path of the file to read
+ */
+std::string
+CoreArbiterServer::findPressurePath() {
+    const std::string unmanagedPressure = "/CoreArbiter/Unmanaged/cpu.pressure";
+    std::vector<std::string> candidates = {cpusetPath + unmanagedPressure};
+    std::ifstream mountsFile("/proc/mounts");
+    std::string device, mountPoint, fsType, rest;
+    while (mountsFile >> device >> mountPoint >> fsType &&
+           std::getline(mountsFile, rest)) {
+        if (fsType == "cgroup2" && mountPoint != cpusetPath) {
+            candidates.push_back(mountPoint + unmanagedPressure);
+        }
+    }
+    for (std::string& path : candidates) {
+        if (std::ifstream(path).good()) {
+            LOG(NOTICE, "Reading unmanaged pressure from %s", path.c_str());
+            return path;
+        }
+    }
+    LOG(NOTICE,
+        "Per-cgroup pressure stall information is unavailable for the "
+        "unmanaged cpuset; using the system-wide /proc/pressure/cpu");
+    return "/proc/pressure/cpu";
+}
+
+/**
+ * Used by sampleUnmanagedPressure() to decide whether to hold back more or
+ * fewer cores for the unmanaged cpuset, given one sample of its load.
+ *
+ * \param stallFraction
+ *     The fraction of the time since the last sample that some unmanaged
+ *     thread was waiting for a CPU
+ * \param runnablePerCore
+ *     The number of runnable unmanaged threads per unmanaged core
+ * \return
+ *     True if unmanagedFloor changed, in which case cores must be
+ *     redistributed
+ */
+bool
+CoreArbiterServer::adjustUnmanagedFloor(double stallFraction,
+                                        double runnablePerCore) {
+    if (stallFraction >= UNMANAGED_PRESSURE_RAISE_FRACTION ||
+        runnablePerCore > UNMANAGED_RUNNABLE_RAISE_PER_CORE) {
+        numIdlePressureSamples = 0;
+        if (unmanagedFloor >= maxUnmanagedFloor) {
+            return false;
+        }
+        unmanagedFloor++;
+        LOG(NOTICE,
+            "Unmanaged threads are stalled %.0f%% of the time with %.1f "
+            "runnable per core; keeping %u cores unmanaged",
+            stallFraction * 100, runnablePerCore, unmanagedFloor);
+        return true;
+    }
+
+    if (stallFraction >= UNMANAGED_PRESSURE_LOWER_FRACTION ||
+        runnablePerCore >= UNMANAGED_RUNNABLE_LOWER_PER_CORE) {
+        numIdlePressureSamples = 0;
+        return false;
+    }
+    numIdlePressureSamples++;
+    if (numIdlePressureSamples < UNMANAGED_FLOOR_LOWER_SAMPLES ||
+        unmanagedFloor <= minUnmanagedFloor) {
+        return false;
+    }
+    numIdlePressureSamples = 0;
+    unmanagedFloor--;
+    LOG(NOTICE, "Unmanaged threads are idle; keeping %u cores unmanaged",
+        unmanagedFloor);
+    return true;
+}
+
+/**
+ * Returns the number of cores that can be managed at once: every arbitrated
+ * core except those held back for the unmanaged cpuset (see
+ * setUnmanagedFloor()).
+ */
+size_t
+CoreArbiterServer::getMaxManagedCores() {
+    size_t numArbitratedCores = managedCores.size() + unmanagedCores.size();
+    return numArbitratedCores -
+           std::min<size_t>(unmanagedFloor, numArbitratedCores);
+}
+
+/**
+ * Measures how busy each unmanaged core has been since the last call, as the
+ * average number of tasks running or waiting to run on it, from the
+ * cumulative run and wait times in /proc/schedstat (see
+ * CoreInfo::runQueueOccupancy). This is called periodically from
+ * handleEvents().
+ */
+void
+CoreArbiterServer::sampleRunQueues() {
+    uint64_t now = sys->rdtsc();
+    uint64_t elapsedNs =
+        lastRunQueueSample == 0
+            ? 0
+            : Cycles::toNanoseconds(now - lastRunQueueSample);
+    lastRunQueueSample = now;
+
+    // A core's counters are only compared with a sample taken while it was
+    // unmanaged
+    for (struct CoreInfo* core : managedCores) {
+        core->sampledSchedNs = 0;
+        core->runQueueOccupancy = 0;
+    }
+    std::unordered_map<int, struct CoreInfo*> idToCore;
+    for (struct CoreInfo* core : unmanagedCores) {
+        idToCore[core->id] = core;
+    }
+
+    // Each CPU has a line "cpu<N>" followed by nine counters, of which the
+    // seventh and eighth are the time spent running and waiting to run.
+    std::ifstream schedStat("/proc/schedstat");
+    std::string line;
+    while (std::getline(schedStat, line)) {
+        int coreId;
+        uint64_t counters[9];
+        if (sscanf(line.c_str(),
+                   "cpu%d %lu %lu %lu %lu %lu %lu %lu %lu %lu", &coreId,
+                   &counters[0], &counters[1], &counters[2], &counters[3],
+                   &counters[4], &counters[5], &counters[6], &counters[7],
+                   &counters[8]) != 10) {
+            continue;
+        }
+        auto coreIter = idToCore.find(coreId);
+        if (coreIter == idToCore.end()) {
+            continue;
+        }
+        struct CoreInfo* core = coreIter->second;
+        uint64_t schedNs = counters[6] + counters[7];
+        if (elapsedNs > 0 && core->sampledSchedNs != 0) {
+            core->runQueueOccupancy =
+                static_cast<double>(schedNs -
+                                    std::min(schedNs, core->sampledSchedNs)) /
+                static_cast<double>(elapsedNs);
+        }
+        core->sampledSchedNs = schedNs;
+    }
+}
+
+/**
+ * Returns true if any process other than the given one has threads waiting
+ * for cores that it asked for at some priority, short of scavenging.
+ *
+ * \param exceptProcess
+ *     The process to ignore
+ */
+bool
+CoreArbiterServer::processesWaitingForCores(struct ProcessInfo* exceptProcess) {
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        if (process == exceptProcess ||
+            process->stats->numBlockedThreads == 0) {
+            continue;
+        }
+        uint32_t numCoresDesired = 0;
+        for (size_t priority = 0; priority < SCAVENGER_PRIORITY; priority++) {
+            numCoresDesired += getDesiredCores(process, priority);
+        }
+        if (process->stats->numOwnedCores < numCoresDesired) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the entry in GlobalStats that reports the efficiency of the given
+ * process, claiming an unused entry if it has none yet.
+ *
+ * \param processId
+ *     The process whose entry is returned
+ * \return
+ *     The process's entry, or NULL if all MAX_REPORTED_PROCESSES entries are
+ *     in use by other processes
+ */
+ProcessEfficiency*
+CoreArbiterServer::getProcessEfficiency(pid_t processId) {
+    ProcessEfficiency* unusedEntry = NULL;
+    for (ProcessEfficiency& efficiency : stats->processEfficiency) {
+        if (efficiency.processId == processId) {
+            return &efficiency;
+        }
+        if (!unusedEntry && efficiency.processId == 0) {
+            unusedEntry = &efficiency;
+        }
+    }
+    if (unusedEntry) {
+        unusedEntry->processId = processId;
+    }
+    return unusedEntry;
+}
+
+/**
+ * Utility function for waking up a given thread on the specific core.
+ */
+void
+CoreArbiterServer::wakeupThread(ThreadInfo* thread, CoreInfo* core) {
+    if (thread->grantSlot >= 0) {
+        // The thread is waiting on its grant slot rather than a socket.
+        ThreadGrantSlot* slot =
+            &thread->process->stats->threadGrantSlots[thread->grantSlot];
+        slot->coreId = core->id;
+        slot->grantCount++;
+        if (sys->futexWake(reinterpret_cast<int*>(&slot->grantCount), 1) < 0) {
+            LOG(ERROR, "Error waking thread %d: %s", thread->id,
+                strerror(errno));
+        }
+        return;
+    }
+
+    if (!sendData(
+            thread->socket, &core->id, sizeof(int),
+            "Error sending core ID to thread " + std::to_string(thread->id))) {
+        if (errno == EPIPE) {
+            // The system got a broken pipe error, then clean
+            // up the connection.
+            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, thread->socket, NULL);
+            cleanupConnection(thread->socket);
+        } else {
+            exit(-1);
+        }
+    }
+}
+
+/**
+ * Used by distributeCores() to put a thread on a managed core. The thread is
+ * moved into the core's cpuset before it is woken up, so that it wakes up in
+ * its new cpuset; a preempted thread is already running and just needs moving.
+ *
+ * \param thread
+ *     A blocked or preempted thread
+ * \param core
+ *     The managed core it is granted, which has no thread on it
+ */
+void
+CoreArbiterServer::grantCore(struct ThreadInfo* thread, struct CoreInfo* core) {
+    struct ProcessInfo* process = thread->process;
+    ThreadState prevState = thread->state;
+    if (thread->placeholder) {
+        // There is no thread to move or wake up. The process's threads get
+        // the core through its private cpuset instead.
+        moveThreadToManagedCore(thread, core, false);
+        process->stats->numBlockedThreads--;
+        updateProcessCpuset(process);
+        return;
+    }
+    if (!moveThreadToManagedCore(thread, core)) {
+        // We were probably unable to move this thread to a managed
+        // core because it has exited. To handle this case, it is
+        // easiest to leave this core unoccupied for now, since we will
+        // receive a hangup message from the thread's socket at which
+        // point distributeCores() will be called again and this core
+        // will be filled.
+        LOG(DEBUG,
+            "Skipping assignment of core %d because were were "
+            "unable to write to it\n",
+            core->id);
+        return;
+    }
+
+    if (prevState == RUNNING_PREEMPTED) {
+        LOG(DEBUG,
+            "Thread %d was previously running preempted on the "
+            "unmanaged core\n",
+            thread->id);
+        recordUnpreemption(thread);
+    } else {
+        // Thread was blocked
+        if (!testingSkipSocketCommunication) {
+            // Wake up the thread
+            // TimeTrace::record("SERVER: Sending wakeup");
+            wakeupThread(thread, core);
+            // TimeTrace::record("SERVER: Finished sending wakeup\n");
+            LOG(DEBUG, "Sent wakeup");
+        }
 
-        availableManagedCoreIds.insert(candidate->id);
+        process->stats->numBlockedThreads--;
+        LOG(DEBUG, "Process %d now has %u blocked threads", process->id,
+            process->stats->numBlockedThreads.load());
     }
+}
 
-    // Next look for a core whose hypertwin is also in the set of
-    // available cores.
-    for (struct CoreInfo* candidate : candidates) {
-        if (availableManagedCoreIds.find(getHyperTwin(candidate->id)) !=
-            availableManagedCoreIds.end()) {
-            candidates.erase(
-                std::find(candidates.begin(), candidates.end(), candidate));
-            return candidate;
-        }
+/**
+ * Used by distributeCores() in place of grantCore() when grants are batched
+ * with io_uring. The write that moves the thread into the core's cpuset and
+ * the send that wakes it are queued on ioUring, linked so that the thread is
+ * only woken once it has been moved. The rest of the grant happens in
+ * completeQueuedGrants().
+ *
+ * \param thread
+ *     A blocked or preempted thread
+ * \param core
+ *     The managed core it is granted, which has no thread on it
+ */
+void
+CoreArbiterServer::queueGrant(struct ThreadInfo* thread,
+                              struct CoreInfo* core) {
+    if (thread->placeholder) {
+        // Nothing would be queued for a whole-process grant
+        grantCore(thread, core);
+        return;
     }
 
-    // Finally, find any available core
-    CoreInfo* core = candidates.front();
-    candidates.pop_front();
-    return core;
+    // A thread waiting on its grant slot is woken with a futex, which can't
+    // be linked to the write.
+    bool sendWakeup = thread->state == BLOCKED && thread->grantSlot < 0 &&
+                      !testingSkipSocketCommunication;
+    bool writeCpuset = !testingSkipCpusetAllocation;
+
+    queuedGrants.emplace_back();
+    QueuedGrant& grant = queuedGrants.back();
+    grant.thread = thread;
+    grant.core = core;
+    grant.prevState = thread->state;
+    grant.writeResult = 0;
+    grant.sendResult = 0;
+    int length =
+        snprintf(grant.threadId, sizeof(grant.threadId), "%d", thread->id);
+
+    // The index of the grant, then whether the completion is for the send
+    uint64_t userData = (queuedGrants.size() - 1) << 1;
+    bool queued = true;
+    if (writeCpuset) {
+        queued = ioUring.prepareWrite(core->cpusetFd, grant.threadId,
+                                      static_cast<size_t>(length), userData,
+                                      sendWakeup);
+    }
+    if (queued && sendWakeup) {
+        queued = ioUring.prepareSend(thread->socket, &core->id, sizeof(int),
+                                     MSG_NOSIGNAL, userData | 1, false);
+    }
+    if (!queued) {
+        // The ring is sized for a grant on every core, so this should never
+        // happen
+        LOG(ERROR, "Unable to queue grant of core %d on io_uring", core->id);
+        exit(-1);
+    }
 }
 
 /**
- * Utility function for waking up a given thread on the specific core.
+ * Submits every grant queued by queueGrant(), waits for their writes and
+ * sends to finish (with a single system call), and then completes them as
+ * grantCore() would have. A grant whose cpuset write failed leaves its core
+ * unoccupied, and its thread is not woken. Threads whose connections turn out
+ * to be broken are cleaned up once every grant has been completed.
  */
 void
-CoreArbiterServer::wakeupThread(ThreadInfo* thread, CoreInfo* core) {
-    if (!sendData(
-            thread->socket, &core->id, sizeof(int),
-            "Error sending core ID to thread " + std::to_string(thread->id))) {
-        if (errno == EPIPE) {
-            // The system got a broken pipe error, then clean
-            // up the connection.
-            sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, thread->socket, NULL);
-            cleanupConnection(thread->socket);
+CoreArbiterServer::completeQueuedGrants() {
+    if (queuedGrants.empty()) {
+        return;
+    }
+
+    timeTrace("SERVER: Submitting queued grants");
+    if (!ioUring.submitAndWait()) {
+        LOG(ERROR, "Error submitting grants to io_uring: %s",
+            strerror(errno));
+        exit(-1);
+    }
+    uint64_t userData;
+    int result;
+    while (ioUring.popCompletion(&userData, &result)) {
+        QueuedGrant& grant = queuedGrants[userData >> 1];
+        if (userData & 1) {
+            grant.sendResult = result;
         } else {
-            exit(-1);
+            grant.writeResult = result;
+        }
+    }
+    timeTrace("SERVER: Finished submitting queued grants");
+
+    // Cleaning up a broken connection can redistribute cores and queue more
+    // grants, so the connections are only cleaned up once every grant in
+    // this batch has been completed.
+    std::deque<struct QueuedGrant> grants;
+    grants.swap(queuedGrants);
+    std::vector<int> brokenSockets;
+    for (QueuedGrant& grant : grants) {
+        struct ThreadInfo* thread = grant.thread;
+        struct CoreInfo* core = grant.core;
+        if (grant.writeResult < 0) {
+            // As in moveThreadToManagedCore(), the thread has probably exited
+            LOG(ERROR, "Unable to write %d to cpuset file for core %d: %s",
+                thread->id, core->id, strerror(-grant.writeResult));
+            continue;
+        }
+
+        moveThreadToManagedCore(thread, core, false);
+        if (grant.prevState == RUNNING_PREEMPTED) {
+            recordUnpreemption(thread);
+            continue;
+        }
+        thread->process->stats->numBlockedThreads--;
+        if (thread->grantSlot >= 0 && !testingSkipSocketCommunication) {
+            wakeupThread(thread, core);
+        } else if (grant.sendResult < 0) {
+            LOG(ERROR, "Error sending core ID to thread %d: %s", thread->id,
+                strerror(-grant.sendResult));
+            if (grant.sendResult != -EPIPE) {
+                exit(-1);
+            }
+            brokenSockets.push_back(thread->socket);
         }
     }
+
+    if (brokenSockets.empty()) {
+        return;
+    }
+    bool wasDeferred = deferCoreDistribution;
+    deferCoreDistribution = true;
+    for (int socket : brokenSockets) {
+        sys->epoll_ctl(epollFd, EPOLL_CTL_DEL, socket, NULL);
+        cleanupConnection(socket);
+    }
+    deferCoreDistribution = wasDeferred;
+    if (!deferCoreDistribution && coreDistributionPending) {
+        distributeCores();
+    }
 }
 
 /**
@@ -1057,9 +3652,8 @@ CoreArbiterServer::wakeupThread(ThreadInfo* thread, CoreInfo* core) {
  * If a thread needs to be preempted a timer is set and the process is notified
  * that it should release a core, but no changes to the cpuset occur.
  *
- * Threads are assigned to cores based on their priorities. All higher priority
- * requests are granted before lower priorities. Within a priority, cores are
- * split evenly among processes.
+ * Which threads are assigned to cores is up to allocationPolicy; this method
+ * carries out its decision.
  */
 void
 CoreArbiterServer::distributeCores() {
@@ -1070,11 +3664,43 @@ CoreArbiterServer::distributeCores() {
         return;
     }
 
+    if (deferCoreDistribution) {
+        // handleEvents() will distribute cores once it has processed every
+        // event in its current batch.
+        coreDistributionPending = true;
+        return;
+    }
+    coreDistributionPending = false;
+
     LOG(DEBUG, "Distributing cores among threads...");
 
-    size_t maxManagedCores = managedCores.size() + unmanagedCores.size();
+    size_t maxManagedCores = getMaxManagedCores();
+
+    // First, ask the policy which threads should have cores.
+    AllocationSnapshot snapshot;
+    std::vector<struct ThreadInfo*> snapshotThreads;
+    std::vector<struct ProcessInfo*> snapshotProcesses;
+    takeAllocationSnapshot(&snapshot, &snapshotThreads, &snapshotProcesses);
+    AllocationDecision decision;
+    allocationPolicy->allocate(snapshot, &decision);
+
+    // Keep the order the policy left the priority queues in, so that it can
+    // take turns between processes across distributions.
+    if (decision.priorityQueues.size() == corePriorityQueues.size()) {
+        for (size_t priority = 0; priority < corePriorityQueues.size();
+             priority++) {
+            std::vector<size_t>& order = decision.priorityQueues[priority];
+            if (order.size() != corePriorityQueues[priority].size()) {
+                continue;
+            }
+            std::deque<struct ProcessInfo*> queue;
+            for (size_t processIndex : order) {
+                queue.push_back(snapshotProcesses.at(processIndex));
+            }
+            corePriorityQueues[priority].swap(queue);
+        }
+    }
 
-    // First, find the threads that should receive cores.
     // This is a queue (front has higher priority) of threads not currently
     // managed that should be placed on cores
     std::deque<struct ThreadInfo*> threadsToReceiveCores;
@@ -1083,97 +3709,26 @@ CoreArbiterServer::distributeCores() {
     // so. Threads that will be preempted do not make it into this set.
     std::unordered_set<struct ThreadInfo*> threadsAlreadyManaged;
 
-    // Iterate from highest to lowest priority
-    bool coresFilled = false;
-    for (size_t priority = 0;
-         priority < corePriorityQueues.size() && !coresFilled; priority++) {
-        auto& processes = corePriorityQueues[priority];
-        bool threadAdded = true;
-
-        // A running count of how many cores we have assigned to a process at
-        // this priority. This makes it easy to ensure that we don't assign
-        // more cores to a process than it has requested.
-        std::unordered_map<struct ProcessInfo*, uint32_t> processToCoreCount;
-
-        // Any threads that are already managed should remain so at this
-        // priority.
-        for (struct ThreadInfo* thread : managedThreads) {
-            if (threadsAlreadyManaged.find(thread) !=
-                threadsAlreadyManaged.end()) {
-                continue;
-            }
-
-            struct ProcessInfo* process = thread->process;
-            if (processToCoreCount[process] <
-                process->desiredCorePriorities[priority]) {
-                // We want to keep this thread on its core
-                threadsAlreadyManaged.insert(thread);
-                processToCoreCount[process]++;
-
-                if (threadsToReceiveCores.size() +
-                        threadsAlreadyManaged.size() ==
-                    maxManagedCores) {
-                    coresFilled = true;
-                    break;
-                }
-            }
+    for (AllocationDecision::Grant& grant : decision.grants) {
+        if (threadsToReceiveCores.size() + threadsAlreadyManaged.size() ==
+            maxManagedCores) {
+            LOG(WARNING, "Allocation policy granted more threads than cores");
+            break;
         }
-
-        // Add as many blocked threads at this priority level as we can
-        while (threadAdded && !coresFilled) {
-            threadAdded = false;
-
-            // Iterate over every process at this priority level
-            for (size_t i = 0; i < processes.size(); i++) {
-                // Pop off the first processes and put it at the back of the
-                // deque (so that we share cores evenly accross threads at this
-                // priority level)
-                struct ProcessInfo* process = processes.front();
-                processes.pop_front();
-                processes.push_back(process);
-
-                if (processToCoreCount[process] ==
-                    process->desiredCorePriorities[priority]) {
-                    continue;
-                }
-
-                // Prefer moving preempted threads back to their cores over
-                // blocked threads.
-                std::unordered_set<struct ThreadInfo*>* threadSet =
-                    &(process->threadStateToSet[RUNNING_PREEMPTED]);
-                if (threadSet->empty()) {
-                    threadSet = &(process->threadStateToSet[BLOCKED]);
-                }
-                if (!threadSet->empty()) {
-                    // Choose some blocked thread to put on a core
-                    struct ThreadInfo* thread = *(threadSet->begin());
-                    threadsToReceiveCores.push_back(thread);
-                    processToCoreCount[process]++;
-                    threadAdded = true;
-
-                    // Temporarily remove the thread from the process's set of
-                    // threads so that we don't assign it to a core more than
-                    // once
-                    threadSet->erase(thread);
-
-                    if (threadsToReceiveCores.size() +
-                            threadsAlreadyManaged.size() ==
-                        maxManagedCores) {
-                        coresFilled = true;
-                        break;
-                    }
-                }
-            }
+        struct ThreadInfo* thread = snapshotThreads.at(grant.thread);
+        if (thread->state == RUNNING_MANAGED) {
+            threadsAlreadyManaged.insert(thread);
+        } else if (std::find(threadsToReceiveCores.begin(),
+                             threadsToReceiveCores.end(),
+                             thread) == threadsToReceiveCores.end()) {
+            threadsToReceiveCores.push_back(thread);
         }
+        thread->scavenging = grant.priority == SCAVENGER_PRIORITY;
+        thread->grantPriority = grant.priority;
     }
 
     timeTrace("SERVER: Finished deciding which threads to put on cores");
 
-    // Add threads back to the correct sets in their process
-    for (struct ThreadInfo* thread : threadsToReceiveCores) {
-        thread->process->threadStateToSet[thread->state].insert(thread);
-    }
-
     size_t numAssignedCores =
         threadsToReceiveCores.size() + threadsAlreadyManaged.size();
     if (numAssignedCores > managedCores.size()) {
@@ -1191,9 +3746,22 @@ CoreArbiterServer::distributeCores() {
         // set. A more strict calculation would throw out all parts of the
         // managed core set which do not already have a thread, and reconsider
         // the additions to the managed core set from scratch.
+        // Every unmanaged task on a core we take has to be moved off it
+        // before its managed thread runs undisturbed, so among otherwise
+        // equally good cores prefer the least loaded ones.
+        // Cores with the most capacity come first, so that the cores left
+        // unmanaged are the slowest ones.
+        std::stable_sort(unmanagedCores.begin(), unmanagedCores.end(),
+                         [](struct CoreInfo* a, struct CoreInfo* b) {
+                             if (a->capacity != b->capacity) {
+                                 return a->capacity > b->capacity;
+                             }
+                             return a->runQueueOccupancy <
+                                    b->runQueueOccupancy;
+                         });
         for (uint32_t i = 0; i < numCoresToMakeManaged; i++) {
-            CoreInfo* coreToAdd = findGoodCoreForProcess(
-                threadsToReceiveCores[i + offset]->process, unmanagedCores);
+            CoreInfo* coreToAdd = findGoodCoreForThread(
+                threadsToReceiveCores[i + offset], unmanagedCores);
             managedCores.push_back(coreToAdd);
         }
 
@@ -1219,6 +3787,15 @@ CoreArbiterServer::distributeCores() {
         }
     }
 
+    // threadsToReceiveCores is in priority order, so offering the cores with
+    // the most capacity first gives them to the highest priorities and leaves
+    // the slowest ones for scavengers.
+    std::stable_sort(availableManagedCores.begin(),
+                     availableManagedCores.end(),
+                     [](struct CoreInfo* a, struct CoreInfo* b) {
+                         return a->capacity > b->capacity;
+                     });
+
     // First restore all previously preempted threads among the
     // threadsToReceiveCores and ensure that they are satisfied.
     for (auto it = threadsToReceiveCores.begin();
@@ -1240,19 +3817,10 @@ CoreArbiterServer::distributeCores() {
             LOG(NOTICE, "Re-granting core %d to thread %d from process %d",
                 core->id, thread->id, process->id);
 
-            // Move the thread before waking it up so that it wakes up in its
-            // new cpuset
-            if (!moveThreadToManagedCore(thread, core)) {
-                // We were probably unable to move this thread to a managed
-                // core because it has exited. To handle this case, it is
-                // easiest to leave this core unoccupied for now, since we will
-                // receive a hangup message from the thread's socket at which
-                // point distributeCores() will be called again and this core
-                // will be filled.
-                LOG(DEBUG,
-                    "Skipping assignment of core %d because were were "
-                    "unable to write to it\n",
-                    core->id);
+            if (ioUring.isInitialized()) {
+                queueGrant(thread, core);
+            } else {
+                grantCore(thread, core);
             }
             availableManagedCores.erase(availableCoresIt);
         }
@@ -1262,13 +3830,19 @@ CoreArbiterServer::distributeCores() {
     // managed vs unmanaged cores, and the managed core set is too small.
     // Somehow we need to consider all cores when we decide what to do.
 
+    // Don't wake part of a gang. Its cores are left unoccupied until the rest
+    // of the gang's cores have been released.
+    std::vector<struct ProcessInfo*> gangsPlaced;
+    holdBackIncompleteGangs(threadsToReceiveCores, threadsAlreadyManaged,
+                            availableManagedCores, gangsPlaced);
+
     // Go through threads and try to find a core for them.
     while (!threadsToReceiveCores.empty() && !availableManagedCores.empty()) {
         struct ThreadInfo* thread = threadsToReceiveCores.front();
         threadsToReceiveCores.pop_front();
 
         struct ProcessInfo* process = thread->process;
-        CoreInfo* core = findGoodCoreForProcess(process, availableManagedCores);
+        CoreInfo* core = findGoodCoreForThread(thread, availableManagedCores);
 
         // Refuse to take cores which threads were previously booted from.
         while (process->coresPreemptedFrom.find(core) !=
@@ -1304,44 +3878,22 @@ CoreArbiterServer::distributeCores() {
             abort();
         }
 
-        // Move the thread before waking it up so that it wakes up in its
-        // new cpuset
-        ThreadState prevState = thread->state;
-        if (!moveThreadToManagedCore(thread, core)) {
-            // We were probably unable to move this thread to a managed
-            // core because it has exited. To handle this case, it is
-            // easiest to leave this core unoccupied for now, since we will
-            // receive a hangup message from the thread's socket at which
-            // point distributeCores() will be called again and this core
-            // will be filled.
-            LOG(DEBUG,
-                "Skipping assignment of core %d because were were "
-                "unable to write to it\n",
-                core->id);
-            continue;
+        if (ioUring.isInitialized()) {
+            queueGrant(thread, core);
+        } else {
+            grantCore(thread, core);
         }
+    }
+    completeQueuedGrants();
 
-        if (prevState == RUNNING_PREEMPTED) {
-            LOG(DEBUG,
-                "Thread %d was previously running preempted on the "
-                "unmanaged core\n",
-                thread->id);
-            process->stats->unpreemptedCount++;
-        } else {
-            // Thread was blocked
-            if (!testingSkipSocketCommunication) {
-                // Wake up the thread
-                // TimeTrace::record("SERVER: Sending wakeup");
-                wakeupThread(thread, core);
-                // TimeTrace::record("SERVER: Finished sending wakeup\n");
-                LOG(DEBUG, "Sent wakeup");
-            }
+    for (auto& idAndProcess : processIdToInfo) {
+        updateUnmanagedAffinity(idAndProcess.second);
+    }
 
-            process->stats->numBlockedThreads--;
-            LOG(DEBUG, "Process %d now has %u blocked threads", process->id,
-                process->stats->numBlockedThreads.load());
-        }
+    for (struct ProcessInfo* process : gangsPlaced) {
+        process->gangNumaNode = -1;
     }
+
     // Sanity check; make sure we have enough preemptible cores to cover the
     // threads that should receive cores.
     if (preemptibleManagedCores.size() < threadsToReceiveCores.size()) {
@@ -1354,15 +3906,165 @@ CoreArbiterServer::distributeCores() {
     // All cores which are preemptible must be preempted; otherwise
     // applications cannot scale down unless there is competition from other
     // applications.
+    std::unordered_set<struct ProcessInfo*> processesReleasingCores;
     while (!preemptibleManagedCores.empty()) {
         struct CoreInfo* core = preemptibleManagedCores.front();
         preemptibleManagedCores.pop_front();
-        requestCoreRelease(core);
+        if (core->managedThread->placeholder) {
+            processesReleasingCores.insert(core->managedThread->process);
+            releaseProcessCore(core->managedThread);
+        } else {
+            requestCoreRelease(core);
+        }
+    }
+
+    // Cores taken back from whole-process grants are free already. Rather
+    // than handing them out from within this distribution, have
+    // handleEvents() run another one as soon as it can.
+    for (struct ProcessInfo* process : processesReleasingCores) {
+        updateProcessCpuset(process);
+    }
+    if (!processesReleasingCores.empty()) {
+        coreDistributionPending = true;
     }
 
+    updateCoreFrequencies();
+
     timeTrace("SERVER: Finished core distribution");
 }
 
+/**
+ * Used by distributeCores() to keep the threads of gang processes (see
+ * CoreArbiterClient::setGangSize()) from being woken before their whole gang
+ * can run. A gang is placed only if, after the threads ahead of it in
+ * threadsToReceiveCores have taken their cores, enough cores are available to
+ * wake all of its threads at once and bring it up to its gang size. Otherwise
+ * all of its threads are removed from threadsToReceiveCores, unless the gang
+ * has been waiting longer than its timeout.
+ *
+ * \param threadsToReceiveCores
+ *     Threads that distributeCores() would put on cores, in order.
+ * \param threadsAlreadyManaged
+ *     Threads that will stay on their managed cores.
+ * \param availableManagedCores
+ *     Managed cores that currently have no thread.
+ * \param gangsPlaced
+ *     Gangs that will be placed in full are appended here. Their
+ *     gangNumaNode is set to a node with room for the whole gang, if any.
+ */
+void
+CoreArbiterServer::holdBackIncompleteGangs(
+    std::deque<struct ThreadInfo*>& threadsToReceiveCores,
+    std::unordered_set<struct ThreadInfo*>& threadsAlreadyManaged,
+    std::deque<struct CoreInfo*>& availableManagedCores,
+    std::vector<struct ProcessInfo*>& gangsPlaced) {
+    uint64_t now = sys->rdtsc();
+    size_t numCoresLeft = availableManagedCores.size();
+    std::unordered_set<struct ProcessInfo*> gangsConsidered;
+    std::unordered_set<struct ProcessInfo*> gangsHeldBack;
+    std::unordered_set<struct ProcessInfo*> gangsStillWaking;
+
+    for (auto it = threadsToReceiveCores.begin();
+         it != threadsToReceiveCores.end();) {
+        struct ProcessInfo* process = (*it)->process;
+        if (gangsHeldBack.find(process) != gangsHeldBack.end()) {
+            it = threadsToReceiveCores.erase(it);
+            continue;
+        }
+        if (gangsConsidered.find(process) != gangsConsidered.end()) {
+            // Placed gangs have already claimed their cores
+            it++;
+            continue;
+        }
+        if (process->gangSize == 0 || process->gangTimedOut) {
+            if (numCoresLeft > 0) {
+                numCoresLeft--;
+            } else if (process->gangTimedOut) {
+                gangsStillWaking.insert(process);
+            }
+            it++;
+            continue;
+        }
+        gangsConsidered.insert(process);
+
+        auto inProcess = [process](struct ThreadInfo* thread) {
+            return thread->process == process;
+        };
+        size_t numWaking =
+            std::count_if(it, threadsToReceiveCores.end(), inProcess);
+        size_t numRunning =
+            std::count_if(threadsAlreadyManaged.begin(),
+                          threadsAlreadyManaged.end(), inProcess);
+
+        if (numRunning + numWaking >= process->gangSize &&
+            numWaking <= numCoresLeft) {
+            LOG(DEBUG, "Placing gang of %lu threads from process %d",
+                numRunning + numWaking, process->id);
+            process->gangWaitStart = 0;
+
+            // Prefer a NUMA node that can fit all of the threads being woken
+            std::unordered_map<int, size_t> numaNodeToNumCores;
+            for (struct CoreInfo* core : availableManagedCores) {
+                if (++numaNodeToNumCores[core->numaNode] == numWaking) {
+                    process->gangNumaNode = core->numaNode;
+                    break;
+                }
+            }
+            gangsPlaced.push_back(process);
+            numCoresLeft -= numWaking;
+            it++;
+        } else if (process->gangWaitStart != 0 &&
+                   Cycles::toMilliseconds(now - process->gangWaitStart) >=
+                       process->gangTimeout) {
+            LOG(NOTICE,
+                "Gang of process %d could not be placed within %lu ms; "
+                "waking its threads as cores become available",
+                process->id, process->gangTimeout);
+            process->gangWaitStart = 0;
+            process->gangTimedOut = true;
+            gangsConsidered.erase(process);
+            // Revisit this thread as an ordinary one
+        } else {
+            LOG(DEBUG, "Holding back %lu threads of process %d for its gang",
+                numWaking, process->id);
+            if (process->gangWaitStart == 0) {
+                process->gangWaitStart = now;
+            }
+            gangsHeldBack.insert(process);
+            it = threadsToReceiveCores.erase(it);
+        }
+    }
+
+    // A gang that timed out goes back to all-or-nothing once all of its
+    // threads have been woken.
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        if (process->gangTimedOut &&
+            gangsStillWaking.find(process) == gangsStillWaking.end()) {
+            process->gangTimedOut = false;
+        }
+    }
+}
+
+/**
+ * Redistributes cores if some process's gang has been held back for longer
+ * than its timeout, so that its threads can start receiving cores. This is
+ * called periodically from handleEvents().
+ */
+void
+CoreArbiterServer::checkGangTimeouts() {
+    uint64_t now = sys->rdtsc();
+    for (auto& processIdAndInfo : processIdToInfo) {
+        struct ProcessInfo* process = processIdAndInfo.second;
+        if (process->gangWaitStart != 0 &&
+            Cycles::toMilliseconds(now - process->gangWaitStart) >=
+                process->gangTimeout) {
+            distributeCores();
+            return;
+        }
+    }
+}
+
 /**
  * Tells the process with a thread running on the given managed core that it
  * should release a core and sets a timer to enforce this request. When the
@@ -1405,8 +4107,13 @@ CoreArbiterServer::requestCoreRelease(struct CoreInfo* core) {
     struct itimerspec timerSpec;
     timerSpec.it_interval.tv_sec = 0;
     timerSpec.it_interval.tv_nsec = 0;
-    timerSpec.it_value.tv_sec = preemptionTimeout / 1000;
-    timerSpec.it_value.tv_nsec = (preemptionTimeout % 1000) * 1000000;
+    // Scavenger grants are revocable at any moment, so they get much less time
+    // to give their core back.
+    uint64_t timeout = core->managedThread->scavenging
+                           ? scavengerPreemptionTimeout
+                           : preemptionTimeout;
+    timerSpec.it_value.tv_sec = timeout / 1000;
+    timerSpec.it_value.tv_nsec = (timeout % 1000) * 1000000;
 
     if (sys->timerfd_settime(timerFd, 0, &timerSpec, NULL) < 0) {
         LOG(ERROR, "Error on timerFd_settime: %s", strerror(errno));
@@ -1510,7 +4217,9 @@ CoreArbiterServer::sendData(int socket, void* buf, size_t numBytes,
 void
 CoreArbiterServer::createCpuset(std::string dirName, std::string cores,
                                 std::string mems) {
-    if (sys->mkdir(dirName.c_str(), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP |
+    // A cpuset that has been emptied but not yet removed is simply reused
+    if (drainingCpusets.erase(dirName) == 0 &&
+        sys->mkdir(dirName.c_str(), S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP |
                                         S_IXGRP | S_IROTH | S_IXOTH) < 0) {
         LOG(ERROR, "Error creating cpuset directory at %s: %s", dirName.c_str(),
             strerror(errno));
@@ -1607,10 +4316,12 @@ CoreArbiterServer::removeUnmanagedThreadsFromCore(CoreInfo* core) {
         if (threadId == core->managedThread->id)
             continue;
 
-        // Every other thread should be moved to the unmanagedCpusetTasks.
-        unmanagedCpusetTasks << threadId;
-        unmanagedCpusetTasks.flush();
-        if (unmanagedCpusetTasks.bad()) {
+        // Every other thread should be moved to the unmanaged cpuset, on the
+        // core's node if we can.
+        std::ofstream& unmanagedTasks = getUnmanagedTasks(core->numaNode);
+        unmanagedTasks << threadId;
+        unmanagedTasks.flush();
+        if (unmanagedTasks.bad()) {
             // This error is likely because the thread has exited. Sleeping
             // helps keep the kernel from giving more errors the next time we
             // try to move a legitimate thread.
@@ -1699,14 +4410,18 @@ CoreArbiterServer::removeOldCpusets(std::string arbiterCpusetPath) {
  *     The thread to move to a managed core
  * \param core
  *     The managed core to move the thread to
+ * \param changeCpuset
+ *     False if the thread has already been written into the core's cpuset
+ *     (see completeQueuedGrants())
  * \return
  *     True if the thread is successfully placed on the core and false
  *     otherwise
  */
 bool
 CoreArbiterServer::moveThreadToManagedCore(struct ThreadInfo* thread,
-                                           struct CoreInfo* core) {
-    if (!testingSkipCpusetAllocation) {
+                                           struct CoreInfo* core,
+                                           bool changeCpuset) {
+    if (changeCpuset && !testingSkipCpusetAllocation) {
         timeTrace("SERVER: Moving thread to managed cpuset");
 
         core->cpusetFile << thread->id;
@@ -1776,9 +4491,17 @@ CoreArbiterServer::removeThreadFromManagedCore(struct ThreadInfo* thread,
         // one it belonged to before
         timeTrace("SERVER: Removing thread from managed cpuset");
 
-        unmanagedCpusetTasks << thread->id;
-        unmanagedCpusetTasks.flush();
-        if (unmanagedCpusetTasks.bad()) {
+        // Keep the thread with the rest of its process's unmanaged threads
+        // if they have been placed, and otherwise on its core's node, where
+        // its memory most likely is
+        int numaNode = thread->process->unmanagedNode;
+        if (numaNode < 0) {
+            numaNode = thread->core->numaNode;
+        }
+        std::ofstream& unmanagedTasks = getUnmanagedTasks(numaNode);
+        unmanagedTasks << thread->id;
+        unmanagedTasks.flush();
+        if (unmanagedTasks.bad()) {
             // This error is likely because the thread has exited. Sleeping
             // helps keep the kernel from giving more errors the next time we
             // try to move a legitimate thread.
@@ -1792,7 +4515,8 @@ CoreArbiterServer::removeThreadFromManagedCore(struct ThreadInfo* thread,
 
     thread->process->stats->numOwnedCores--;
     thread->core->managedThread = NULL;
-    thread->core->threadRemovalTime = Cycles::rdtsc();
+    thread->core->threadRemovalTime = sys->rdtsc();
+    thread->lastCore = thread->core;
     thread->core = NULL;
     managedThreads.erase(
         std::remove(managedThreads.begin(), managedThreads.end(), thread),
@@ -1824,6 +4548,277 @@ CoreArbiterServer::updateUnmanagedCpuset() {
         LOG(ERROR, "Error changing unmanaged cpuset cpus");
         exit(-1);  // TODO(jspeiser): handle elegantly
     }
+
+    if (unmanagedNodeCpusets.empty()) {
+        return;
+    }
+
+    // Only rewrite the cpusets of nodes whose unmanaged cores changed, so
+    // that taking cores on one node doesn't disturb threads on the others
+    std::map<int, std::string> nodeCores;
+    for (auto& nodeAndCpuset : unmanagedNodeCpusets) {
+        nodeCores[nodeAndCpuset.first] = "";
+    }
+    size_t start = 0;
+    for (size_t comma = alwaysUnmanagedString.find(',');
+         comma != std::string::npos;
+         start = comma + 1, comma = alwaysUnmanagedString.find(',', start)) {
+        std::string id = alwaysUnmanagedString.substr(start, comma - start);
+        nodeCores[getCoreNumaNode(std::stoi(id))] += id + ",";
+    }
+    for (CoreInfo* core : unmanagedCores) {
+        nodeCores[core->numaNode] += std::to_string(core->id) + ",";
+    }
+
+    for (auto& nodeAndCores : nodeCores) {
+        auto cpusetIter = unmanagedNodeCpusets.find(nodeAndCores.first);
+        if (cpusetIter == unmanagedNodeCpusets.end() ||
+            cpusetIter->second.cores == nodeAndCores.second) {
+            continue;
+        }
+        struct NodeCpuset& nodeCpuset = cpusetIter->second;
+        if (nodeAndCores.second.empty()) {
+            // A cpuset without cores can't hold threads, so let them use the
+            // other nodes' unmanaged cores until this one has some again
+            moveProcsToCpuset(nodeCpuset.path + "/tasks",
+                              cpusetPath + "/CoreArbiter/Unmanaged/tasks");
+            for (auto& idAndProcess : processIdToInfo) {
+                if (idAndProcess.second->unmanagedNode == nodeAndCores.first) {
+                    idAndProcess.second->unmanagedNode = -1;
+                }
+            }
+        }
+
+        LOG(DEBUG, "Changing unmanaged cpuset of node %d to %s",
+            nodeAndCores.first, nodeAndCores.second.c_str());
+        std::ofstream cpusFile(nodeCpuset.path + "/cpuset.cpus");
+        cpusFile << nodeAndCores.second << std::endl;
+        if (cpusFile.bad()) {
+            LOG(ERROR, "Error changing the unmanaged cpuset cpus of node %d",
+                nodeAndCores.first);
+            continue;
+        }
+        nodeCpuset.cores = nodeAndCores.second;
+    }
+}
+
+/**
+ * Brings the cpufreq settings of every arbitrated core in line with its
+ * state after a core distribution. A managed core with a thread gets the
+ * settings of the priority it was granted at, so a process's cores at
+ * different priorities can be set differently. The frequency manager only
+ * writes to sysfs for cores whose settings change.
+ */
+void
+CoreArbiterServer::updateCoreFrequencies() {
+    if (!frequencyManager) {
+        return;
+    }
+
+    for (struct CoreInfo* core : managedCores) {
+        if (!core->managedThread) {
+            frequencyManager->setCoreState(
+                core->id, CpuFrequencyManager::MANAGED_IDLE);
+            continue;
+        }
+        // Cores beyond a process's minimum use the settings of the priority
+        // they were asked for at, and scavenger cores those of the lowest
+        size_t priority = core->managedThread->grantPriority;
+        if (priority == SCAVENGER_PRIORITY) {
+            priority = NUM_PRIORITIES - 1;
+        } else if (priority >= NUM_PRIORITIES) {
+            priority -= NUM_PRIORITIES;
+        }
+        frequencyManager->setCoreState(
+            core->id, CpuFrequencyManager::MANAGED_OCCUPIED, priority);
+    }
+    for (struct CoreInfo* core : unmanagedCores) {
+        frequencyManager->setCoreState(core->id,
+                                       CpuFrequencyManager::UNMANAGED);
+    }
+}
+
+/**
+ * Divides the arbitrated cores into performance and efficiency cores by
+ * capacity, and publishes each core's class in GlobalStats for clients. A
+ * core is a performance core if its capacity is at least three quarters of
+ * the largest, so that the few favored cores of a machine with otherwise
+ * identical cores don't make up a class of their own.
+ */
+void
+CoreArbiterServer::classifyCores() {
+    std::vector<struct CoreInfo*> cores(managedCores);
+    cores.insert(cores.end(), unmanagedCores.begin(), unmanagedCores.end());
+    uint32_t maxCapacity = 0;
+    for (struct CoreInfo* core : cores) {
+        maxCapacity = std::max(maxCapacity, core->capacity);
+    }
+    for (struct CoreInfo* core : cores) {
+        core->coreClass = uint64_t(core->capacity) * 4 >=
+                                  uint64_t(maxCapacity) * 3
+                              ? CORE_CLASS_PERFORMANCE
+                              : CORE_CLASS_EFFICIENCY;
+        if (core->id < MAX_SUPPORTED_CORES) {
+            stats->coreClasses[core->id] = core->coreClass;
+        }
+    }
+}
+
+/**
+ * Returns the NUMA node of the given core. The nodes of the cores that were
+ * present at startup are looked up in sysfs only once.
+ *
+ * \param coreId
+ *     The core whose NUMA node will be returned.
+ */
+int
+CoreArbiterServer::getCoreNumaNode(int coreId) {
+    if (coreId >= 0 && static_cast<size_t>(coreId) < coreNumaNodes.size()) {
+        return coreNumaNodes[coreId];
+    }
+    return getNumaNode(coreId);
+}
+
+/**
+ * Moves every thread in the unmanaged cpuset that spans every node into the
+ * unmanaged cpuset of the node it last ran on, so that threads that were
+ * already running when the server started stay near their memory rather
+ * than only those the server later takes off managed cores. Threads that
+ * cannot be moved, such as those that have exited, are left where they are.
+ */
+void
+CoreArbiterServer::placeUnmanagedThreads() {
+    if (unmanagedNodeCpusets.empty() || testingSkipCpusetAllocation) {
+        return;
+    }
+
+    std::string unmanagedTasksPath =
+        cpusetPath + "/CoreArbiter/Unmanaged/tasks";
+    std::ifstream unmanagedTasks(unmanagedTasksPath);
+    if (!unmanagedTasks.is_open()) {
+        LOG(ERROR, "Unable to open %s", unmanagedTasksPath.c_str());
+        return;
+    }
+
+    pid_t threadId;
+    while (unmanagedTasks >> threadId) {
+        int coreId = getLastCore(threadId);
+        if (coreId < 0) {
+            continue;
+        }
+        std::ofstream& nodeTasks = getUnmanagedTasks(getCoreNumaNode(coreId));
+        if (&nodeTasks == &unmanagedCpusetTasks) {
+            continue;
+        }
+        nodeTasks << threadId;
+        nodeTasks.flush();
+        if (nodeTasks.bad()) {
+            // The thread has most likely exited since we listed it
+            LOG(DEBUG, "Unable to move thread %d to node %d", threadId,
+                getCoreNumaNode(coreId));
+            nodeTasks.clear();
+        }
+    }
+}
+
+/**
+ * Returns the stream through which threads are moved into the unmanaged
+ * cpuset of the given NUMA node, or into the unmanaged cpuset that spans
+ * every node if there are no per-node cpusets or that node currently has no
+ * unmanaged cores.
+ *
+ * \param numaNode
+ *     The node on which the thread should preferably run
+ */
+std::ofstream&
+CoreArbiterServer::getUnmanagedTasks(int numaNode) {
+    auto cpusetIter = unmanagedNodeCpusets.find(numaNode);
+    if (cpusetIter == unmanagedNodeCpusets.end() ||
+        cpusetIter->second.cores.empty()) {
+        return unmanagedCpusetTasks;
+    }
+    return cpusetIter->second.tasks;
+}
+
+/**
+ * Keeps a process's threads that are not on managed cores, such as its I/O
+ * threads and threads that have been preempted, on the unmanaged cores of the
+ * NUMA node where most of its managed cores are, so that they share memory
+ * and caches with the threads on those cores. The threads are only moved
+ * when a different node gains the majority, since finding them means reading
+ * the process's task list from /proc. Threads the process creates afterwards
+ * inherit the cpuset of the thread that creates them.
+ *
+ * \param process
+ *     The process whose managed cores may have changed
+ */
+void
+CoreArbiterServer::updateUnmanagedAffinity(struct ProcessInfo* process) {
+    if (unmanagedNodeCpusets.empty() || process->inCpuset) {
+        return;
+    }
+
+    // Threads on managed cores must stay where they are
+    std::map<int, uint32_t> numCoresOnNode;
+    std::unordered_set<pid_t> managedThreadIds;
+    for (struct ThreadInfo* thread :
+         process->threadStateToSet[RUNNING_MANAGED]) {
+        if (thread->core) {
+            numCoresOnNode[thread->core->numaNode]++;
+            managedThreadIds.insert(thread->id);
+        }
+    }
+
+    // Ties go to the current node, so that threads don't move back and forth
+    int numaNode = process->unmanagedNode;
+    uint32_t mostCores = numaNode < 0 ? 0 : numCoresOnNode[numaNode];
+    for (auto& nodeAndCount : numCoresOnNode) {
+        if (nodeAndCount.second > mostCores) {
+            numaNode = nodeAndCount.first;
+            mostCores = nodeAndCount.second;
+        }
+    }
+    if (numaNode == process->unmanagedNode) {
+        return;
+    }
+    auto cpusetIter = unmanagedNodeCpusets.find(numaNode);
+    if (cpusetIter == unmanagedNodeCpusets.end() ||
+        cpusetIter->second.cores.empty()) {
+        return;
+    }
+
+    LOG(DEBUG, "Moving unmanaged threads of process %d to node %d",
+        process->id, numaNode);
+    process->unmanagedNode = numaNode;
+    if (testingSkipCpusetAllocation) {
+        return;
+    }
+
+    std::string taskPath = "/proc/" + std::to_string(process->id) + "/task";
+    DIR* dir = sys->opendir(taskPath.c_str());
+    if (dir == NULL) {
+        // The process has probably exited, and will be cleaned up soon
+        LOG(WARNING, "Error on opendir %s: %s", taskPath.c_str(),
+            strerror(errno));
+        return;
+    }
+    std::ofstream& nodeTasks = cpusetIter->second.tasks;
+    for (struct dirent* entry = sys->readdir(dir); entry != NULL;
+         entry = sys->readdir(dir)) {
+        pid_t threadId = atoi(entry->d_name);
+        if (threadId <= 0 || managedThreadIds.count(threadId)) {
+            continue;
+        }
+        nodeTasks << threadId;
+        nodeTasks.flush();
+        if (nodeTasks.bad()) {
+            // The thread has most likely exited since we listed it
+            LOG(DEBUG, "Unable to move thread %d to node %d", threadId,
+                numaNode);
+            nodeTasks.clear();
+        }
+    }
+    sys->closedir(dir);
 }
 
 /**
@@ -1838,9 +4833,19 @@ void
 CoreArbiterServer::changeThreadState(struct ThreadInfo* thread,
                                      ThreadState state) {
     ThreadState prevState = thread->state;
+    ProcessInfo* process = thread->process;
     thread->state = state;
-    thread->process->threadStateToSet[prevState].erase(thread);
-    thread->process->threadStateToSet[state].insert(thread);
+    process->threadStateToSet[prevState].erase(thread);
+    process->threadStateToSet[state].insert(thread);
+
+    if (prevState == BLOCKED) {
+        auto& blockedThreads = process->blockedThreads;
+        blockedThreads.erase(
+            std::find(blockedThreads.begin(), blockedThreads.end(), thread));
+    }
+    if (state == BLOCKED) {
+        process->blockedThreads.push_back(thread);
+    }
 }
 
 /**
@@ -23,18 +23,59 @@
 #include <atomic>
 #include <deque>
 #include <fstream>
+#include <map>
+#include <memory>
 #include <stdexcept>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
 
+#include "AllocationPolicy.h"
 #include "CoreArbiterCommon.h"
+#include "CpuFrequencyManager.h"
+#include "IoUring.h"
 #include "Logger.h"
 #include "PerfUtils/Cycles.h"
 #include "Syscall.h"
 
 #define MAX_EPOLL_EVENTS 1000
 
+// Processes may ask for a range of cores at each priority. The minimum is
+// queued at the priority itself, and the cores beyond it at SPARE_PRIORITY of
+// that priority, which ranks below the minimums of every priority.
+#define SPARE_PRIORITY(priority) (NUM_PRIORITIES + (priority))
+
+// The index in corePriorityQueues of the scavenger tier, which only receives
+// cores that no priority wants.
+#define SCAVENGER_PRIORITY (2 * NUM_PRIORITIES)
+
+// The number of entries in corePriorityQueues.
+#define NUM_PRIORITY_QUEUES (SCAVENGER_PRIORITY + 1)
+
+// A managed core is considered idle while its process reports that less than
+// this fraction of its cycles on it are busy. A core that stays idle for
+// IDLE_CORE_RECLAIM_MS is reclaimed if other processes are waiting for cores.
+#define IDLE_CORE_BUSY_FRACTION 0.05
+#define IDLE_CORE_RECLAIM_MS 100
+
+// The unmanaged floor (see setUnmanagedFloor()) is raised by a core when the
+// threads in the unmanaged cpuset spend at least this fraction of the time
+// waiting for a CPU, or have more than this many runnable threads per
+// unmanaged core. It is lowered by a core after
+// UNMANAGED_FLOOR_LOWER_SAMPLES samples in a row below the lower thresholds.
+// The pressure is sampled every UNMANAGED_PRESSURE_SAMPLE_MS.
+#define UNMANAGED_PRESSURE_RAISE_FRACTION 0.1
+#define UNMANAGED_RUNNABLE_RAISE_PER_CORE 2.0
+#define UNMANAGED_PRESSURE_LOWER_FRACTION 0.01
+#define UNMANAGED_RUNNABLE_LOWER_PER_CORE 0.5
+#define UNMANAGED_FLOOR_LOWER_SAMPLES 10
+#define UNMANAGED_PRESSURE_SAMPLE_MS 100
+
+// Available since Linux 6.9; older headers do not define it.
+#ifndef PIDFD_THREAD
+#define PIDFD_THREAD O_EXCL
+#endif
+
 using PerfUtils::Cycles;
 
 namespace CoreArbiter {
@@ -61,11 +102,35 @@ class CoreArbiterServer {
     void startArbitration();
     void endArbitration();
 
+    /**
+     * Determines which of a process's blocked threads is woken up first when
+     * the process is granted a core.
+     */
+    enum BlockedThreadPolicy {
+        // Wake the thread that blocked most recently, since its cache is the
+        // most likely to still be warm.
+        MOST_RECENTLY_BLOCKED,
+
+        // Wake the thread that has been blocked the longest, so that no thread
+        // waits indefinitely while others come and go.
+        LONGEST_BLOCKED
+    };
+    void setBlockedThreadPolicy(BlockedThreadPolicy policy);
+    void setUtilityAllocation(bool enabled);
+    void setAllocationPolicy(AllocationPolicy* policy);
+    bool enableIoUring();
+    bool enableBusyPolling(int pollingCore);
+    void setUnmanagedFloor(uint32_t minCores, uint32_t maxCores);
+    void setFrequencyManager(CpuFrequencyManager* manager);
+
     // Point at the most recently constructed instance of the
     // CoreArbiterServer.
     static CoreArbiterServer* volatile mostRecentInstance;
 
   private:
+    // Runs the server against a simulated kernel (see CoreArbiterSimulator.h).
+    friend class CoreArbiterSimulator;
+
     struct ThreadInfo;
     struct ProcessInfo;
     struct CoreInfo;
@@ -91,18 +156,88 @@ class CoreArbiterServer {
         // A stream pointing to the tasks file of this core's managed cpuset.
         std::ofstream cpusetFile;
 
+        // A file descriptor for the same tasks file, through which threads
+        // are moved onto this core when grants are batched with io_uring, or
+        // -1.
+        int cpusetFd;
+
         // The last time (in cycles) that this core had a thread removed from
         // it. If there is no thread running on this core, this value tells us
         // how long the core has been unoccupied.
         uint64_t threadRemovalTime;
 
-        CoreInfo() : managedThread(NULL) {}
+        // The NUMA node this core belongs to.
+        int numaNode;
+
+        // The ID of this core's hypertwin, or -1 if it has none. Read from
+        // sysfs once when the server starts, since cores are placed next to
+        // their twins on every distribution.
+        int hyperTwin;
+
+        // The process whose CoreUtilization for this core was last sampled,
+        // and the counts it held at the time.
+        pid_t sampledProcessId;
+        uint64_t sampledBusyCycles;
+        uint64_t sampledIdleCycles;
+
+        // The time (in cycles) since which the thread on this core has been
+        // reported idle, or 0 if it is not idle.
+        uint64_t idleSince;
+
+        // The total time in nanoseconds that tasks had spent running or
+        // waiting to run on this core according to /proc/schedstat as of the
+        // last sampleRunQueues(), and the average number of tasks that were
+        // running or waiting to run on it since the sample before. Only
+        // sampled for unmanaged cores, since the occupancy is used to choose
+        // the unmanaged core that is cheapest to make managed.
+        uint64_t sampledSchedNs;
+        double runQueueOccupancy;
+
+        // True once this core has been taken out of arbitration (see
+        // removeArbitratedCore()) but still has a thread on it, or a thread
+        // that was preempted from it, that must give it up first.
+        bool removing;
+
+        // The core's peak performance relative to the others, as reported by
+        // the kernel (see getCoreCapacity()), or 0 if it is not reported.
+        // Cores with more capacity are granted first.
+        uint32_t capacity;
+
+        // CORE_CLASS_PERFORMANCE or CORE_CLASS_EFFICIENCY, by capacity.
+        uint8_t coreClass;
+
+        CoreInfo()
+            : managedThread(NULL),
+              cpusetFd(-1),
+              numaNode(0),
+              hyperTwin(-1),
+              sampledProcessId(0),
+              sampledBusyCycles(0),
+              sampledIdleCycles(0),
+              idleSince(0),
+              sampledSchedNs(0),
+              runQueueOccupancy(0),
+              removing(false),
+              capacity(0),
+              coreClass(CORE_CLASS_PERFORMANCE) {}
 
         CoreInfo(int id, std::string managedTasksPath)
             : id(id),
               managedThread(NULL),
               cpusetFilename(managedTasksPath),
-              threadRemovalTime(0) {
+              cpusetFd(-1),
+              threadRemovalTime(0),
+              numaNode(0),
+              hyperTwin(-1),
+              sampledProcessId(0),
+              sampledBusyCycles(0),
+              sampledIdleCycles(0),
+              idleSince(0),
+              sampledSchedNs(0),
+              runQueueOccupancy(0),
+              removing(false),
+              capacity(0),
+              coreClass(CORE_CLASS_PERFORMANCE) {
             if (!testingSkipCpusetAllocation) {
                 cpusetFile.open(cpusetFilename);
                 if (!cpusetFile.is_open()) {
@@ -113,6 +248,23 @@ class CoreArbiterServer {
         }
     };
 
+    /**
+     * One of the unmanaged cpusets that are limited to a single NUMA node (see
+     * updateUnmanagedCpuset()).
+     */
+    struct NodeCpuset {
+        // The path to this cpuset's directory.
+        std::string path;
+
+        // A comma-delimited string of the IDs of the cores currently in this
+        // cpuset. Empty while the node has no unmanaged cores, in which case
+        // the cpuset holds no threads.
+        std::string cores;
+
+        // A stream pointing to this cpuset's tasks file.
+        std::ofstream tasks;
+    };
+
     /**
      * Used by ThreadInfo to keep track of a thread's state.
      */
@@ -147,9 +299,15 @@ class CoreArbiterServer {
         struct ProcessInfo* process;
 
         // The file descriptor for the socket used to communicate with this
-        // thread.
+        // thread. -1 if the thread's process multiplexes its threads over a
+        // control connection.
         int socket;
 
+        // The index of the slot in its process's
+        // ProcessStats::threadGrantSlots through which this thread is handed
+        // cores. -1 if the thread has its own socket.
+        int grantSlot;
+
         // A pointer to the managed core this thread is running on. NULL if this
         // thread is not running on a managed core.
         struct CoreInfo* core;
@@ -163,15 +321,55 @@ class CoreArbiterServer {
         // is assumed to be RUNNING_UNMANAGED.
         ThreadState state;
 
+        // True if this thread's current core was granted to it as a
+        // scavenger, and can therefore be revoked at short notice.
+        bool scavenging;
+
+        // The index in corePriorityQueues that this thread's current core was
+        // granted at in the last core distribution.
+        size_t grantPriority;
+
+        // True if this thread was forceably moved off a scavenger core and
+        // has not yet blocked or been restored. Such preemptions are not
+        // counted in ProcessStats::preemptedCount.
+        bool scavengerRevoked;
+
+        // The managed core this thread most recently ran on, or NULL if it has
+        // never had one. When the thread next receives a core it is given this
+        // one if possible, so that it can reuse what it left in the caches.
+        struct CoreInfo* lastCore;
+
+        // A pidfd referring to this thread, which becomes readable as soon as
+        // the thread exits. -1 if the kernel could not provide one.
+        int pidFd;
+
+        // True if this thread has no pidfd and its exit must instead be
+        // detected by polling its /proc entry.
+        bool pollForExit;
+
+        // True if this is not a real thread but a placeholder for one of the
+        // cores of a whole-process grant (see processCoresRequested()). A
+        // placeholder is either blocked or on a managed core, and all of its
+        // process's threads share the cores that its placeholders hold.
+        bool placeholder;
+
         ThreadInfo() {}
 
         ThreadInfo(pid_t threadId, struct ProcessInfo* process, int socket)
             : id(threadId),
               process(process),
               socket(socket),
+              grantSlot(-1),
               core(NULL),
               corePreemptedFrom(NULL),
-              state(RUNNING_UNMANAGED) {}
+              state(RUNNING_UNMANAGED),
+              scavenging(false),
+              grantPriority(0),
+              scavengerRevoked(false),
+              lastCore(NULL),
+              pidFd(-1),
+              pollForExit(false),
+              placeholder(false) {}
     };
 
     /**
@@ -201,22 +399,141 @@ class CoreArbiterServer {
         // blocks and can be assigned a new core.
         std::unordered_set<CoreInfo*> coresPreemptedFrom;
 
-        // How many cores this process desires at each priority level. Smaller
-        // indexes mean higher priority.
+        // How many cores this process desires at each index of
+        // corePriorityQueues. Smaller indexes mean higher priority. The
+        // entries from SPARE_PRIORITY(0) on are the cores it could use beyond
+        // its minimum at each priority, and the last entry, at
+        // SCAVENGER_PRIORITY, is the number of scavenger cores it desires.
         std::vector<uint32_t> desiredCorePriorities;
 
+        // A pidfd referring to this process, which becomes readable when the
+        // whole process exits. -1 if the kernel could not provide one.
+        int pidFd;
+
+        // The socket of the control connection over which this process
+        // multiplexes the messages of all of its threads. -1 if each of its
+        // threads has its own connection.
+        int controlSocket;
+
+        // True if the control connection belongs to a privileged agent that
+        // registers this process's threads and yields their cores for them,
+        // rather than to the process itself.
+        bool proxied;
+
+        // Maps the IDs of threads registered over the control connection to
+        // their associated threads.
+        std::unordered_map<pid_t, struct ThreadInfo*> multiplexedThreads;
+
+        // The last consistent copy of this process's utility curve (see
+        // ProcessStats::marginalUtilities), and the utilityCurveVersion it
+        // was read at.
+        std::vector<float> utilityCurve;
+        uint32_t utilityCurveVersion;
+
+        // The ProcessStats::coreRequestVersion of the last core request read
+        // from shared memory while busy polling.
+        uint32_t coreRequestVersion;
+
+        // The ThreadGrantSlot::blockCount of each grant slot as of the last
+        // block the server handled from it while busy polling.
+        std::vector<int> blockCounts;
+
+        // The number of this process's cores that the server has reclaimed
+        // because the process left them idle while other processes waited.
+        // These are withheld from its lowest priorities until it changes its
+        // request or the contention ends.
+        uint32_t numIdleCoresReclaimed;
+
         // A map of ThreadState to the threads this process owns in that state.
         std::unordered_map<ThreadState, std::unordered_set<struct ThreadInfo*>,
                            std::hash<int>>
             threadStateToSet;
 
-        ProcessInfo() : desiredCorePriorities(NUM_PRIORITIES) {}
+        // The same threads as threadStateToSet[BLOCKED], in the order in which
+        // they blocked (the front has been blocked the longest).
+        std::deque<struct ThreadInfo*> blockedThreads;
+
+        // If nonzero, this process's blocked threads are only woken once
+        // enough cores are available to have this many of its threads
+        // running on managed cores at once.
+        uint32_t gangSize;
+
+        // How long (in milliseconds) cores may be held back while assembling
+        // this process's gang before falling back to partial grants.
+        uint64_t gangTimeout;
+
+        // The time (in cycles) at which this process's gang was first held
+        // back, or 0 if it is not currently waiting.
+        uint64_t gangWaitStart;
+
+        // True if this process's gang could not be placed within gangTimeout,
+        // in which case its threads are woken as cores become available until
+        // all of its blocked threads have received cores.
+        bool gangTimedOut;
+
+        // The NUMA node that the gang currently being placed should be put
+        // on, or -1 if there is no preference.
+        int gangNumaNode;
+
+        // One placeholder thread for every core this process asked for with a
+        // whole-process request, or empty if it manages its own threads.
+        std::vector<struct ThreadInfo*> placeholders;
+
+        // True once this process has a private cpuset holding the cores of
+        // its placeholders, and true while its threads are in it rather
+        // than in the unmanaged cpuset.
+        bool hasCpuset;
+        bool inCpuset;
+
+        // The NUMA node whose unmanaged cpuset holds this process's threads
+        // that are not on managed cores (see updateUnmanagedAffinity()), or
+        // -1 if they are in the unmanaged cpuset that spans every node.
+        int unmanagedNode;
+
+        // The class of cores this process would rather be granted, or
+        // CORE_CLASS_ANY.
+        uint8_t coreClass;
+
+        ProcessInfo()
+            : desiredCorePriorities(NUM_PRIORITY_QUEUES),
+              pidFd(-1),
+              controlSocket(-1),
+              proxied(false),
+              utilityCurveVersion(0),
+              coreRequestVersion(0),
+              blockCounts(MAX_MULTIPLEXED_THREADS, 0),
+              numIdleCoresReclaimed(0),
+              gangSize(0),
+              gangTimeout(GANG_TIMEOUT_MS),
+              gangWaitStart(0),
+              gangTimedOut(false),
+              gangNumaNode(-1),
+              hasCpuset(false),
+              inCpuset(false),
+              unmanagedNode(-1),
+              coreClass(CORE_CLASS_ANY) {}
 
         ProcessInfo(pid_t id, int sharedMemFd, struct ProcessStats* stats)
             : id(id),
               sharedMemFd(sharedMemFd),
               stats(stats),
-              desiredCorePriorities(NUM_PRIORITIES) {}
+              desiredCorePriorities(NUM_PRIORITY_QUEUES),
+              pidFd(-1),
+              controlSocket(-1),
+              proxied(false),
+              utilityCurveVersion(0),
+              coreRequestVersion(0),
+              blockCounts(MAX_MULTIPLEXED_THREADS, 0),
+              numIdleCoresReclaimed(0),
+              gangSize(0),
+              gangTimeout(GANG_TIMEOUT_MS),
+              gangWaitStart(0),
+              gangTimedOut(false),
+              gangNumaNode(-1),
+              hasCpuset(false),
+              inCpuset(false),
+              unmanagedNode(-1),
+              coreClass(CORE_CLASS_ANY) {}
     };
 
     /**
@@ -229,15 +546,100 @@ class CoreArbiterServer {
         CoreInfo* coreInfo;
     };
 
+    /**
+     * A core grant whose cpuset write and wakeup have been queued on ioUring
+     * but whose results have not yet been processed.
+     */
+    struct QueuedGrant {
+        struct ThreadInfo* thread;
+        struct CoreInfo* core;
+
+        // The thread's state before the grant.
+        ThreadState prevState;
+
+        // The thread's ID as written to the cpuset's tasks file.
+        char threadId[16];
+
+        // The results of the cpuset write and of the send that wakes the
+        // thread, as returned by write() and send() or minus the errno.
+        int writeResult;
+        int sendResult;
+    };
+
     bool handleEvents();
     void acceptConnection(int listenSocket);
+    bool isPrivilegedPeer(int socket);
+    void handleControlMessage(int socket);
+    void handleAdminMessage(int socket);
+    bool addArbitratedCore(int coreId);
+    bool removeArbitratedCore(int coreId);
+    void finishCoreRemovals();
+    void retireCore(struct CoreInfo* core);
+    void updateAlwaysUnmanagedString();
+    void registerMultiplexedThread(struct ProcessInfo* process,
+                                   pid_t threadId, uint32_t grantSlot);
     void threadBlocking(int socket);
+    void blockThread(struct ThreadInfo* thread);
     void coresRequested(int socket);
+    void applyCoreRequest(struct ProcessInfo* process,
+                          const uint32_t numCores[NUM_PRIORITIES]);
+    void pollSharedMemory();
+    void scavengerCoresRequested(int socket);
+    void coreRangeRequested(int socket);
+    void gangRequested(int socket);
+    void coreClassRequested(int socket);
+    void processCoresRequested(int socket);
+    void releaseProcessCore(struct ThreadInfo* placeholder);
+    void updateProcessCpuset(struct ProcessInfo* process);
+    void removeProcessCpuset(struct ProcessInfo* process);
+    void removeDrainedCpusets();
+    std::string getProcessCpusetPath(struct ProcessInfo* process);
+    void holdBackIncompleteGangs(
+        std::deque<struct ThreadInfo*>& threadsToReceiveCores,
+        std::unordered_set<struct ThreadInfo*>& threadsAlreadyManaged,
+        std::deque<struct CoreInfo*>& availableManagedCores,
+        std::vector<struct ProcessInfo*>& gangsPlaced);
+    void checkGangTimeouts();
+    bool readUtilityCurve(struct ProcessInfo* process);
+    void checkUtilityCurves();
+    uint32_t getDesiredCores(struct ProcessInfo* process, size_t priority);
+    void sampleCoreUtilization();
+    void sampleUnmanagedPressure();
+    std::string findPressurePath();
+    bool adjustUnmanagedFloor(double stallFraction, double runnablePerCore);
+    size_t getMaxManagedCores();
+    void sampleRunQueues();
+    bool processesWaitingForCores(struct ProcessInfo* exceptProcess);
+    ProcessEfficiency* getProcessEfficiency(pid_t processId);
+    struct ProcessInfo* getRequestingProcess(int socket);
+    bool setDesiredCores(struct ProcessInfo* process, size_t priority,
+                         uint32_t numCoresDesired);
+    void recordUnpreemption(struct ThreadInfo* thread);
     void timeoutThreadPreemption(int timerFd);
     void cleanupConnection(int socket);
+    void cleanupThread(struct ThreadInfo* thread);
+    void cleanupProcess(struct ProcessInfo* process);
+    void processExited(int pidFd);
+    bool removeThread(struct ThreadInfo* thread);
+    void removeProcess(struct ProcessInfo* process);
+    void threadExited(int pidFd);
+    void watchProcessExit(struct ProcessInfo* process);
+    void watchThreadExit(struct ThreadInfo* thread);
+    void unwatchThreadExit(struct ThreadInfo* thread);
+    void reapExitedThreads();
+    std::string getTaskPath(struct ThreadInfo* thread);
     CoreInfo* findGoodCoreForProcess(ProcessInfo* process,
                                      std::deque<struct CoreInfo*>& candidates);
+    CoreInfo* findGoodCoreForThread(ThreadInfo* thread,
+                                    std::deque<struct CoreInfo*>& candidates);
+    ThreadInfo* chooseBlockedThread(ProcessInfo* process, size_t* numChosen);
+    void takeAllocationSnapshot(AllocationSnapshot* snapshot,
+                                std::vector<struct ThreadInfo*>* threads,
+                                std::vector<struct ProcessInfo*>* processes);
     void wakeupThread(ThreadInfo* thread, CoreInfo* core);
+    void grantCore(struct ThreadInfo* thread, struct CoreInfo* core);
+    void queueGrant(struct ThreadInfo* thread, struct CoreInfo* core);
+    void completeQueuedGrants();
     void distributeCores();
     void requestCoreRelease(struct CoreInfo* core);
 
@@ -249,10 +651,18 @@ class CoreArbiterServer {
     void removeUnmanagedThreadsFromCore(struct CoreInfo* core);
     void removeOldCpusets(std::string arbiterCpusetPath);
     bool moveThreadToManagedCore(struct ThreadInfo* thread,
-                                 struct CoreInfo* core);
+                                 struct CoreInfo* core,
+                                 bool changeCpuset = true);
     void removeThreadFromManagedCore(struct ThreadInfo* thread,
                                      bool changeCpuset = true);
     void updateUnmanagedCpuset();
+    std::ofstream& getUnmanagedTasks(int numaNode);
+    static int getNumaNode(int coreId);
+    int getCoreNumaNode(int coreId);
+    void placeUnmanagedThreads();
+    void updateUnmanagedAffinity(struct ProcessInfo* process);
+    void updateCoreFrequencies();
+    void classifyCores();
     void changeThreadState(struct ThreadInfo* thread, ThreadState state);
 
     void installSignalHandler();
@@ -291,16 +701,71 @@ class CoreArbiterServer {
     // The file descriptor used to block on client requests.
     int epollFd;
 
+    // True if the server spins rather than blocking in epoll_wait, and reads
+    // core requests and blocking threads from shared memory (see
+    // enableBusyPolling()).
+    bool busyPolling;
+
     // A map of core preemption timers to their related information.
     std::unordered_map<int, struct TimerInfo> timerFdToInfo;
 
+    // If initialized, the cpuset writes and sends that grant cores during a
+    // distribution are submitted together through this ring (see
+    // enableIoUring()).
+    IoUring ioUring;
+
+    // The grants queued on ioUring during the current distribution. A deque,
+    // so that the buffers the kernel reads from never move.
+    std::deque<struct QueuedGrant> queuedGrants;
+
     // The amount of time in milliseconds to wait before forceably preempting
     // a thread from its managed core to the unmanaged core.
     uint64_t preemptionTimeout;
 
+    // The amount of time in milliseconds to wait before forceably preempting
+    // a thread from a core it was granted as a scavenger.
+    uint64_t scavengerPreemptionTimeout;
+
+    // Which blocked thread of a process receives the next core granted to it.
+    BlockedThreadPolicy blockedThreadPolicy;
+
+    // Decides which threads distributeCores() puts on managed cores.
+    std::unique_ptr<AllocationPolicy> allocationPolicy;
+
+    // Changes the cpufreq settings of cores as they are granted and released,
+    // or NULL to leave them as the host has them.
+    std::unique_ptr<CpuFrequencyManager> frequencyManager;
+
     // Maps thread socket file desriptors to their associated threads.
     std::unordered_map<int, struct ThreadInfo*> threadSocketToInfo;
 
+    // Maps control connection sockets to the processes that own them.
+    std::unordered_map<int, struct ProcessInfo*> controlSocketToProcess;
+
+    // The sockets of administrator connections (see handleAdminMessage()).
+    std::unordered_set<int> adminSockets;
+
+    // Maps thread pidfds to their associated threads. Only threads for which
+    // the kernel could provide a pidfd appear here.
+    std::unordered_map<int, struct ThreadInfo*> threadPidFdToInfo;
+
+    // False once the kernel has refused to create a thread pidfd (kernels
+    // older than 6.9 do not support PIDFD_THREAD). From then on we rely on
+    // polling /proc to notice threads that exit without unregistering.
+    bool threadPidFdsSupported;
+
+    // Maps process pidfds to their associated processes.
+    std::unordered_map<int, struct ProcessInfo*> processPidFdToInfo;
+
+    // While true, calls to distributeCores() only record that cores need to
+    // be redistributed. handleEvents() sets this while it works through a
+    // batch of events so that cores are redistributed once per batch.
+    bool deferCoreDistribution;
+
+    // True if distributeCores() was called while deferCoreDistribution was
+    // set.
+    bool coreDistributionPending;
+
     // Maps process IDs to their associated processes.
     std::unordered_map<pid_t, struct ProcessInfo*> processIdToInfo;
 
@@ -315,6 +780,16 @@ class CoreArbiterServer {
     // unused for an extended period.
     std::deque<struct CoreInfo*> unmanagedCores;
 
+    // Contains the information about cores that have been taken out of
+    // arbitration but are still in use (see CoreInfo::removing). These cores
+    // are neither managed nor unmanaged, and are never granted again.
+    std::vector<struct CoreInfo*> removingCores;
+
+    // The paths of cpusets being removed, whose threads have been moved to
+    // the unmanaged cpuset but may not all have left yet. They are removed
+    // by removeDrainedCpusets() on a later pass of the event loop.
+    std::unordered_set<std::string> drainingCpusets;
+
     // The file used to change which cores belong to the unmanaged cpuset.
     std::ofstream unmanagedCpusetCpus;
 
@@ -322,10 +797,18 @@ class CoreArbiterServer {
     // cpuset.
     std::ofstream unmanagedCpusetTasks;
 
+    // On machines with more than one NUMA node, an unmanaged cpuset for each
+    // node, by node, holding the node's unmanaged cores. Empty otherwise.
+    std::map<int, struct NodeCpuset> unmanagedNodeCpusets;
+
     // A comma-delimited string of CPU IDs for cores not under the arbiter's
     // control.
     std::string alwaysUnmanagedString;
 
+    // The NUMA node of every core that was present at startup, by ID, since
+    // finding a core's node means listing its directory in sysfs.
+    std::vector<int> coreNumaNodes;
+
     // The last time (in cycles) that the unmanaged cpuset's set of cores was
     // updated.
     uint64_t unmanagedCpusetLastUpdate;
@@ -340,9 +823,37 @@ class CoreArbiterServer {
     // The set of the threads currently running on cores in managedCores.
     std::vector<struct ThreadInfo*> managedThreads;
 
+    // The last time (in cycles) that sampleCoreUtilization() ran.
+    uint64_t lastUtilizationSample;
+
+    // The number of arbitrated cores kept in the unmanaged cpuset however
+    // many cores are requested, on top of the cores that are never
+    // arbitrated. It moves between minUnmanagedFloor and maxUnmanagedFloor
+    // with the load on the unmanaged cpuset (see sampleUnmanagedPressure()).
+    uint32_t unmanagedFloor;
+    uint32_t minUnmanagedFloor;
+    uint32_t maxUnmanagedFloor;
+
+    // The last time (in cycles) that sampleUnmanagedPressure() ran, and the
+    // total time in microseconds that unmanaged threads had spent waiting
+    // for a CPU as of then.
+    uint64_t lastPressureSample;
+    uint64_t lastPressureStallUs;
+
+    // The file that sampleUnmanagedPressure() reads the stall time from,
+    // chosen by findPressurePath() the first time it runs.
+    std::string pressurePath;
+
+    // The number of samples in a row in which the unmanaged cpuset was idle
+    // enough to lower unmanagedFloor.
+    uint32_t numIdlePressureSamples;
+
+    // The last time (in cycles) that sampleRunQueues() ran.
+    uint64_t lastRunQueueSample;
+
     // The smallest index in the vector is the highest priority and the first
     // entry in the deque is the next process that should receive a core at
-    // that priority.
+    // that priority. The last entry is the scavenger tier.
     std::vector<std::deque<struct ProcessInfo*>> corePriorityQueues;
 
     // When this file descriptor is written, the core arbiter will return from
@@ -14,16 +14,46 @@
  */
 
 #include <string.h>
+#include <algorithm>
 #include "CoreArbiterServer.h"
 #include "Logger.h"
 #include "PerfUtils/Util.h"
 
 using CoreArbiter::CoreArbiterServer;
+using CoreArbiter::CpuFrequencyManager;
 using CoreArbiter::Logger;
 
 std::string socketPath = "/tmp/CoreArbiter/socket";
 std::string sharedMemoryPath = "/tmp/CoreArbiter/sharedmemory";
 std::vector<int> coresUsed = std::vector<int>();
+CoreArbiterServer::BlockedThreadPolicy blockedThreadPolicy =
+    CoreArbiterServer::MOST_RECENTLY_BLOCKED;
+std::string allocationPolicy = "priority";
+bool useIoUring = false;
+int busyPollCore = -1;
+uint32_t minUnmanagedCores = 0;
+uint32_t maxUnmanagedCores = 0;
+std::vector<CpuFrequencyManager::Setting> occupiedFrequencies;
+CpuFrequencyManager::Setting idleFrequency;
+CpuFrequencyManager::Setting unmanagedFrequency;
+bool manageFrequencies = false;
+
+/**
+ * Parses the argument of one of the frequency options, exiting if it is
+ * malformed.
+ */
+CpuFrequencyManager::Setting
+parseFrequencySetting(const char* optionName, const std::string& spec) {
+    CpuFrequencyManager::Setting setting;
+    if (!CpuFrequencyManager::parseSetting(spec, &setting)) {
+        LOG(CoreArbiter::ERROR,
+            "%s must be GOVERNOR,MIN_FREQUENCY_KHZ,ENERGY_PREFERENCE, not %s",
+            optionName, spec.c_str());
+        abort();
+    }
+    manageFrequencies = true;
+    return setting;
+}
 
 /**
  * This function currently supports only long options.
@@ -44,7 +74,17 @@ parseOptions(int* argcp, const char** argv) {
         bool takesArgument;
     } optionSpecifiers[] = {{"socketPath", 'p', true},
                             {"sharedMemoryPath", 'm', true},
-                            {"coresUsed", 's', true}};
+                            {"coresUsed", 's', true},
+                            {"blockedThreadPolicy", 'b', true},
+                            {"allocateByUtility", 'u', false},
+                            {"allocationPolicy", 'a', true},
+                            {"ioUring", 'i', false},
+                            {"busyPollCore", 'c', true},
+                            {"minUnmanagedCores", 'n', true},
+                            {"maxUnmanagedCores", 'x', true},
+                            {"occupiedFrequency", 'o', true},
+                            {"idleFrequency", 'd', true},
+                            {"unmanagedFrequency", 'f', true}};
     const int UNRECOGNIZED = ~0;
 
     int i = 1;
@@ -94,6 +134,61 @@ parseOptions(int* argcp, const char** argv) {
                 else
                     coresUsed = PerfUtils::Util::parseRanges(optionArgument);
                 break;
+            case 'b':
+                if (strcmp(optionArgument, "LIFO") == 0) {
+                    blockedThreadPolicy =
+                        CoreArbiterServer::MOST_RECENTLY_BLOCKED;
+                } else if (strcmp(optionArgument, "FIFO") == 0) {
+                    blockedThreadPolicy = CoreArbiterServer::LONGEST_BLOCKED;
+                } else {
+                    LOG(CoreArbiter::ERROR,
+                        "blockedThreadPolicy must be LIFO or FIFO, not %s",
+                        optionArgument);
+                    abort();
+                }
+                break;
+            case 'u':
+                allocationPolicy = "utility";
+                break;
+            case 'a':
+                allocationPolicy = optionArgument;
+                break;
+            case 'i':
+                useIoUring = true;
+                break;
+            case 'c':
+                busyPollCore = atoi(optionArgument);
+                break;
+            case 'n':
+                minUnmanagedCores = atoi(optionArgument);
+                break;
+            case 'x':
+                maxUnmanagedCores = atoi(optionArgument);
+                break;
+            case 'o': {
+                // One setting per priority, separated by slashes
+                std::string specs = optionArgument;
+                occupiedFrequencies.clear();
+                size_t start = 0;
+                for (size_t slash = specs.find('/');
+                     slash != std::string::npos;
+                     start = slash + 1, slash = specs.find('/', start)) {
+                    occupiedFrequencies.push_back(parseFrequencySetting(
+                        "occupiedFrequency",
+                        specs.substr(start, slash - start)));
+                }
+                occupiedFrequencies.push_back(parseFrequencySetting(
+                    "occupiedFrequency", specs.substr(start)));
+                break;
+            }
+            case 'd':
+                idleFrequency =
+                    parseFrequencySetting("idleFrequency", optionArgument);
+                break;
+            case 'f':
+                unmanagedFrequency =
+                    parseFrequencySetting("unmanagedFrequency", optionArgument);
+                break;
             case UNRECOGNIZED:
                 LOG(CoreArbiter::ERROR, "Unrecognized option %s given.",
                     optionName);
@@ -117,8 +212,45 @@ main(int argc, const char** argv) {
             printf(" %d", coresUsed[i]);
         putchar('\n');
     }
+    printf("blockedThreadPolicy: %s\n",
+           blockedThreadPolicy == CoreArbiterServer::LONGEST_BLOCKED ? "FIFO"
+                                                                      : "LIFO");
+    printf("allocationPolicy: %s\n", allocationPolicy.c_str());
+    printf("ioUring: %s\n", useIoUring ? "true" : "false");
+    printf("busyPollCore: %d\n", busyPollCore);
+    printf("unmanagedCores: %u-%u\n", minUnmanagedCores,
+           std::max(minUnmanagedCores, maxUnmanagedCores));
+    printf("manageFrequencies: %s\n", manageFrequencies ? "true" : "false");
     fflush(stdout);
 
-    CoreArbiterServer server(socketPath, sharedMemoryPath, coresUsed);
+    CoreArbiter::AllocationPolicy* policy =
+        CoreArbiter::AllocationPolicy::create(allocationPolicy);
+    if (policy == NULL) {
+        LOG(CoreArbiter::ERROR, "Unknown allocation policy %s",
+            allocationPolicy.c_str());
+        abort();
+    }
+
+    CoreArbiterServer server(socketPath, sharedMemoryPath, coresUsed, false);
+    server.setBlockedThreadPolicy(blockedThreadPolicy);
+    server.setAllocationPolicy(policy);
+    if (useIoUring && !server.enableIoUring()) {
+        LOG(CoreArbiter::WARNING,
+            "Unable to set up io_uring; granting cores without it");
+    }
+    server.setUnmanagedFloor(minUnmanagedCores, maxUnmanagedCores);
+    if (manageFrequencies) {
+        CpuFrequencyManager* frequencyManager = new CpuFrequencyManager();
+        frequencyManager->setOccupiedSettings(occupiedFrequencies);
+        frequencyManager->setIdleSetting(idleFrequency);
+        frequencyManager->setUnmanagedSetting(unmanagedFrequency);
+        server.setFrequencyManager(frequencyManager);
+    }
+    if (busyPollCore >= 0 && !server.enableBusyPolling(busyPollCore)) {
+        LOG(CoreArbiter::ERROR, "Unable to busy poll on core %d",
+            busyPollCore);
+        abort();
+    }
+    server.startArbitration();
     return 0;
 }
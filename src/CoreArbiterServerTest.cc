@@ -17,6 +17,7 @@
 #define private public
 
 #include "CoreArbiterServer.h"
+#include "CoreArbiterSimulator.h"
 #include "Logger.h"
 #include "MockSyscall.h"
 
@@ -37,6 +38,7 @@ class CoreArbiterServerTest : public ::testing::Test {
     typedef CoreArbiterServer::ProcessInfo ProcessInfo;
     typedef CoreArbiterServer::CoreInfo CoreInfo;
     typedef CoreArbiterServer::ThreadState ThreadState;
+    typedef CoreArbiterServer::NodeCpuset NodeCpuset;
 
     CoreArbiterServerTest()
         : socketPath("/tmp/CoreArbiter/testsocket"),
@@ -85,6 +87,8 @@ class CoreArbiterServerTest : public ::testing::Test {
             core->managedThread = thread;
         } else if (state == CoreArbiterServer::RUNNING_PREEMPTED) {
             process->stats->preemptedCount++;
+        } else if (state == CoreArbiterServer::BLOCKED) {
+            process->blockedThreads.push_back(thread);
         }
         return thread;
     }
@@ -166,6 +170,92 @@ TEST_F(CoreArbiterServerTest, defaultCores) {
     CoreArbiterServer::testingSkipCpusetAllocation = false;
 }
 
+TEST_F(CoreArbiterServerTest, handleAdminMessage_addCores) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    uint32_t numUnoccupiedCores = server.stats->numUnoccupiedCores;
+
+    // Core 1 is already arbitrated and core -1 does not exist
+    uint8_t msgType = ADD_ARBITRATED_CORES;
+    uint32_t numCores = 3;
+    int coreIds[] = {2, 1, -1};
+    send(clientSocket, &msgType, sizeof(msgType), 0);
+    send(clientSocket, &numCores, sizeof(numCores), 0);
+    send(clientSocket, coreIds, sizeof(coreIds), 0);
+    server.handleAdminMessage(serverSocket);
+
+    uint32_t numCoresChanged;
+    ASSERT_EQ(recv(clientSocket, &numCoresChanged, sizeof(uint32_t), 0),
+              (ssize_t)sizeof(uint32_t));
+    EXPECT_EQ(numCoresChanged, 1u);
+    ASSERT_EQ(server.unmanagedCores.size(), 2u);
+    EXPECT_EQ(server.unmanagedCores.back()->id, 2);
+    EXPECT_EQ(server.stats->numUnoccupiedCores, numUnoccupiedCores + 1);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, removeArbitratedCore) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+    CoreInfo* managedCore = server.unmanagedCores[0];
+    CoreInfo* unmanagedCore = server.unmanagedCores[1];
+    server.unmanagedCores.pop_front();
+    server.managedCores.push_back(managedCore);
+    uint32_t numUnoccupiedCores = server.stats->numUnoccupiedCores;
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    ThreadInfo* thread =
+        createThread(server, 1, process, serverSocket,
+                     CoreArbiterServer::RUNNING_MANAGED, managedCore);
+
+    // An unused core is retired straight away
+    EXPECT_TRUE(server.removeArbitratedCore(unmanagedCore->id));
+    EXPECT_FALSE(server.removeArbitratedCore(unmanagedCore->id));
+    server.finishCoreRemovals();
+    EXPECT_TRUE(server.unmanagedCores.empty());
+    EXPECT_TRUE(server.removingCores.empty());
+    EXPECT_EQ(server.stats->numUnoccupiedCores, numUnoccupiedCores - 1);
+
+    // A core in use is taken back from its thread first
+    EXPECT_TRUE(server.removeArbitratedCore(managedCore->id));
+    EXPECT_TRUE(server.managedCores.empty());
+    EXPECT_TRUE(managedCore->removing);
+    EXPECT_TRUE(processStats.threadCommunicationBlocks[managedCore->id]
+                    .coreReleaseRequested);
+    server.finishCoreRemovals();
+    ASSERT_EQ(server.removingCores.size(), 1u);
+
+    // Its thread is no longer offered to the allocation policy
+    AllocationSnapshot snapshot;
+    std::vector<ThreadInfo*> snapshotThreads;
+    std::vector<ProcessInfo*> snapshotProcesses;
+    server.takeAllocationSnapshot(&snapshot, &snapshotThreads,
+                                  &snapshotProcesses);
+    EXPECT_TRUE(snapshot.managedThreads.empty());
+
+    server.blockThread(thread);
+    EXPECT_EQ(thread->lastCore, managedCore);
+    server.finishCoreRemovals();
+    EXPECT_TRUE(server.removingCores.empty());
+    EXPECT_EQ(thread->lastCore, (CoreInfo*)NULL);
+    EXPECT_TRUE(server.timerFdToInfo.empty());
+    EXPECT_EQ(server.stats->numUnoccupiedCores, numUnoccupiedCores - 1);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
 TEST_F(CoreArbiterServerTest, threadBlocking_basic) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipSocketCommunication = true;
@@ -351,6 +441,126 @@ TEST_F(CoreArbiterServerTest, coresRequested) {
     CoreArbiterServer::testingDoNotChangeManagedCores = false;
 }
 
+TEST_F(CoreArbiterServerTest, scavengerCoresRequested) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    createThread(server, 1, process, serverSocket,
+                 CoreArbiterServer::RUNNING_UNMANAGED);
+    std::deque<ProcessInfo*>& scavengers =
+        server.corePriorityQueues[SCAVENGER_PRIORITY];
+
+    uint32_t numCores = 2;
+    send(clientSocket, &numCores, sizeof(uint32_t), 0);
+    server.scavengerCoresRequested(serverSocket);
+    EXPECT_EQ(process->desiredCorePriorities[SCAVENGER_PRIORITY], 2u);
+    ASSERT_EQ(scavengers.size(), 1u);
+    EXPECT_EQ(scavengers.front(), process);
+
+    numCores = 0;
+    send(clientSocket, &numCores, sizeof(uint32_t), 0);
+    server.scavengerCoresRequested(serverSocket);
+    EXPECT_EQ(process->desiredCorePriorities[SCAVENGER_PRIORITY], 0u);
+    EXPECT_TRUE(scavengers.empty());
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+}
+
+TEST_F(CoreArbiterServerTest, coreRangeRequested) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    createThread(server, 1, process, serverSocket,
+                 CoreArbiterServer::RUNNING_UNMANAGED);
+
+    // The minimum is queued at its priority and the rest as spare cores
+    uint32_t coreRange[2 * NUM_PRIORITIES] = {0};
+    coreRange[1] = 4;
+    coreRange[NUM_PRIORITIES + 1] = 24;
+    send(clientSocket, coreRange, sizeof(coreRange), 0);
+    server.coreRangeRequested(serverSocket);
+    EXPECT_EQ(process->desiredCorePriorities[1], 4u);
+    EXPECT_EQ(process->desiredCorePriorities[SPARE_PRIORITY(1)], 20u);
+    EXPECT_EQ(server.corePriorityQueues[1].size(), 1u);
+    EXPECT_EQ(server.corePriorityQueues[SPARE_PRIORITY(1)].size(), 1u);
+
+    // An exact request drops the spare cores
+    uint32_t numCores[NUM_PRIORITIES] = {0};
+    numCores[1] = 4;
+    send(clientSocket, numCores, sizeof(numCores), 0);
+    server.coresRequested(serverSocket);
+    EXPECT_EQ(process->desiredCorePriorities[1], 4u);
+    EXPECT_EQ(process->desiredCorePriorities[SPARE_PRIORITY(1)], 0u);
+    EXPECT_TRUE(server.corePriorityQueues[SPARE_PRIORITY(1)].empty());
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+}
+
+TEST_F(CoreArbiterServerTest, processCoresRequested) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+    makeUnmanagedCoresManaged(server);
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    createThread(server, 1, process, serverSocket,
+                 CoreArbiterServer::RUNNING_UNMANAGED);
+
+    // Each requested core gets a blocked placeholder
+    uint32_t numCores[NUM_PRIORITIES] = {0};
+    numCores[0] = 2;
+    send(clientSocket, numCores, sizeof(numCores), 0);
+    server.processCoresRequested(serverSocket);
+    ASSERT_EQ(process->placeholders.size(), 2u);
+    EXPECT_EQ(process->blockedThreads.size(), 2u);
+    EXPECT_EQ(processStats.numBlockedThreads, 2u);
+    EXPECT_EQ(process->desiredCorePriorities[0], 2u);
+    EXPECT_EQ(server.corePriorityQueues[0].size(), 1u);
+
+    // A placeholder takes a core without any thread being woken
+    ThreadInfo* granted = process->placeholders[0];
+    CoreInfo* core = server.managedCores[0];
+    server.grantCore(granted, core);
+    EXPECT_EQ(granted->state, CoreArbiterServer::RUNNING_MANAGED);
+    EXPECT_EQ(core->managedThread, granted);
+    EXPECT_EQ(processStats.numOwnedCores, 1u);
+    EXPECT_EQ(processStats.numBlockedThreads, 1u);
+
+    // Shrinking the request drops the placeholder without a core first
+    numCores[0] = 1;
+    send(clientSocket, numCores, sizeof(numCores), 0);
+    server.processCoresRequested(serverSocket);
+    ASSERT_EQ(process->placeholders.size(), 1u);
+    EXPECT_EQ(process->placeholders[0], granted);
+    EXPECT_EQ(processStats.numBlockedThreads, 0u);
+    EXPECT_EQ(core->managedThread, granted);
+
+    // Dropping the last placeholder frees its core at once
+    numCores[0] = 0;
+    send(clientSocket, numCores, sizeof(numCores), 0);
+    server.processCoresRequested(serverSocket);
+    EXPECT_TRUE(process->placeholders.empty());
+    EXPECT_TRUE(process->blockedThreads.empty());
+    EXPECT_EQ(core->managedThread, (ThreadInfo*)NULL);
+    EXPECT_EQ(processStats.numOwnedCores, 0u);
+    EXPECT_EQ(processStats.numBlockedThreads, 0u);
+    EXPECT_TRUE(server.corePriorityQueues[0].empty());
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
 TEST_F(CoreArbiterServerTest, distributeCores_noBlockedThreads) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipSocketCommunication = true;
@@ -386,6 +596,171 @@ TEST_F(CoreArbiterServerTest, distributeCores_noBlockedThreads) {
     }
 }
 
+TEST_F(CoreArbiterServerTest, distributeCores_regrantPreemptedCore) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipSocketCommunication = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+    makeUnmanagedCoresManaged(server);
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    server.corePriorityQueues[7].push_back(process);
+    process->desiredCorePriorities[7] = 2;
+
+    // One thread was preempted, the other only lost a scavenger core
+    ThreadInfo* threads[2];
+    for (int i = 0; i < 2; i++) {
+        CoreInfo* core = server.managedCores[i];
+        threads[i] = createThread(server, i + 1, process, i + 1,
+                                  CoreArbiterServer::RUNNING_PREEMPTED);
+        threads[i]->corePreemptedFrom = core;
+        process->coresPreemptedFrom.insert(core);
+    }
+    processStats.preemptedCount = 1;
+    threads[1]->scavengerRevoked = true;
+    processStats.scavengerRevokedCount = 1;
+
+    // Getting its old core back ends the preemption
+    server.distributeCores();
+    for (int i = 0; i < 2; i++) {
+        EXPECT_EQ(threads[i]->state, CoreArbiterServer::RUNNING_MANAGED);
+        EXPECT_EQ(threads[i]->core, server.managedCores[i]);
+    }
+    EXPECT_EQ(processStats.unpreemptedCount, 1u);
+    EXPECT_FALSE(threads[1]->scavengerRevoked);
+    EXPECT_TRUE(process->coresPreemptedFrom.empty());
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipSocketCommunication = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, distributeCores_ioUring) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    {
+        CoreArbiterServer server(socketPath, memPath, {1}, false);
+        // Skip the test if this kernel doesn't support io_uring
+        if (server.enableIoUring()) {
+            ProcessInfo* process =
+                createProcess(server, 1, new ProcessStats());
+            ThreadInfo* thread = createThread(server, 1, process, serverSocket,
+                                              CoreArbiterServer::BLOCKED);
+            process->stats->numBlockedThreads = 1;
+            server.corePriorityQueues[7].push_back(process);
+            process->desiredCorePriorities[7] = 1;
+
+            // The wakeup is sent by the ring, not by send()
+            sys->sendErrno = EINVAL;
+            server.distributeCores();
+            sys->sendErrno = 0;
+            EXPECT_EQ(thread->state, CoreArbiterServer::RUNNING_MANAGED);
+            EXPECT_EQ(thread->core, server.managedCores[0]);
+            EXPECT_EQ(process->stats->numBlockedThreads, 0u);
+            EXPECT_TRUE(server.queuedGrants.empty());
+            int coreId;
+            EXPECT_EQ(recv(clientSocket, &coreId, sizeof(int), MSG_DONTWAIT),
+                      static_cast<ssize_t>(sizeof(int)));
+            EXPECT_EQ(coreId, server.managedCores[0]->id);
+
+            delete process->stats;
+        }
+    }
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, distributeCores_ioUringBrokenConnection) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    CoreArbiterServer::testingSkipMemoryDeallocation = true;
+
+    {
+        CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+        // Skip the test if this kernel doesn't support io_uring
+        if (server.enableIoUring()) {
+            makeUnmanagedCoresManaged(server);
+            ProcessStats processStats;
+            ProcessInfo* process = createProcess(server, 1, &processStats);
+            ThreadInfo* thread = createThread(server, 1, process, serverSocket,
+                                              CoreArbiterServer::BLOCKED);
+            int brokenFds[2];
+            ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, brokenFds), 0);
+            close(brokenFds[0]);
+            createThread(server, 2, process, brokenFds[1],
+                         CoreArbiterServer::BLOCKED);
+            processStats.numBlockedThreads = 2;
+            server.corePriorityQueues[7].push_back(process);
+            process->desiredCorePriorities[7] = 2;
+
+            // The thread whose wakeup fails is cleaned up only after both
+            // grants have been completed
+            server.distributeCores();
+            EXPECT_TRUE(server.queuedGrants.empty());
+            EXPECT_EQ(thread->state, CoreArbiterServer::RUNNING_MANAGED);
+            EXPECT_EQ(server.threadSocketToInfo.count(brokenFds[1]), 0u);
+            EXPECT_EQ(server.managedThreads.size(), 1u);
+            EXPECT_EQ(processStats.numBlockedThreads, 0u);
+            EXPECT_EQ(processStats.numOwnedCores, 1u);
+            EXPECT_FALSE(server.coreDistributionPending);
+        }
+    }
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+    CoreArbiterServer::testingSkipMemoryDeallocation = false;
+}
+
+TEST(IoUringTest, linkedOperations) {
+    IoUring ring;
+    if (!ring.init(8)) {
+        // This kernel doesn't support io_uring
+        return;
+    }
+    int pipeFds[2];
+    int socketFds[2];
+    ASSERT_EQ(pipe(pipeFds), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, socketFds), 0);
+
+    // A successful write is followed by its linked send, while a failed one
+    // cancels it.
+    const char* message = "1234";
+    int value = 5;
+    EXPECT_TRUE(ring.prepareWrite(pipeFds[1], message, 4, 0, true));
+    EXPECT_TRUE(ring.prepareSend(socketFds[0], &value, sizeof(int),
+                                 MSG_NOSIGNAL, 1, false));
+    EXPECT_TRUE(ring.prepareWrite(-1, message, 4, 2, true));
+    EXPECT_TRUE(ring.prepareSend(socketFds[0], &value, sizeof(int),
+                                 MSG_NOSIGNAL, 3, false));
+    EXPECT_TRUE(ring.submitAndWait());
+
+    int results[4] = {0, 0, 0, 0};
+    uint64_t userData;
+    int result;
+    int numCompletions = 0;
+    while (ring.popCompletion(&userData, &result)) {
+        ASSERT_LT(userData, 4u);
+        results[userData] = result;
+        numCompletions++;
+    }
+    EXPECT_EQ(numCompletions, 4);
+    EXPECT_EQ(results[0], 4);
+    EXPECT_EQ(results[1], static_cast<int>(sizeof(int)));
+    EXPECT_EQ(results[2], -EBADF);
+    EXPECT_EQ(results[3], -ECANCELED);
+
+    char buffer[8];
+    EXPECT_EQ(read(pipeFds[0], buffer, sizeof(buffer)), 4);
+    EXPECT_EQ(recv(socketFds[1], buffer, sizeof(buffer), MSG_DONTWAIT),
+              static_cast<ssize_t>(sizeof(int)));
+
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+    close(socketFds[0]);
+    close(socketFds[1]);
+}
+
 TEST_F(CoreArbiterServerTest, distributeCores_niceToHaveSinglePriority) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipSocketCommunication = true;
@@ -546,6 +921,809 @@ TEST_F(CoreArbiterServerTest, distributeCores_scaleUnmanagedCore) {
     CoreArbiterServer::testingDoNotChangeManagedCores = false;
 }
 
+TEST_F(CoreArbiterServerTest, distributeCores_leastLoadedUnmanagedCore) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipSocketCommunication = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+    server.unmanagedCores[0]->runQueueOccupancy = 2.0;
+    server.unmanagedCores[1]->runQueueOccupancy = 0.1;
+    server.unmanagedCores[2]->runQueueOccupancy = 1.0;
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    createThread(server, 1, process, 1, CoreArbiterServer::BLOCKED);
+    process->desiredCorePriorities[0] = 1;
+    server.corePriorityQueues[0].push_back(process);
+
+    // The core with the fewest unmanaged tasks to move off it is taken
+    server.distributeCores();
+    ASSERT_EQ(server.managedCores.size(), 1u);
+    EXPECT_EQ(server.managedCores[0]->id, 2);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipSocketCommunication = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, getUnmanagedTasks) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+
+    // Without per-node cpusets everything goes to the spanning cpuset
+    EXPECT_EQ(&server.getUnmanagedTasks(0), &server.unmanagedCpusetTasks);
+
+    server.unmanagedNodeCpusets[1].cores = "3,";
+    EXPECT_EQ(&server.getUnmanagedTasks(1),
+              &server.unmanagedNodeCpusets[1].tasks);
+    EXPECT_EQ(&server.getUnmanagedTasks(0), &server.unmanagedCpusetTasks);
+
+    // A node without unmanaged cores can't hold threads
+    server.unmanagedNodeCpusets[1].cores = "";
+    EXPECT_EQ(&server.getUnmanagedTasks(1), &server.unmanagedCpusetTasks);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, updateUnmanagedAffinity) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+    server.unmanagedNodeCpusets[0].cores = "0,";
+    server.unmanagedNodeCpusets[1].cores = "4,";
+    CoreInfo* nodeZeroCore = server.unmanagedCores[0];
+    CoreInfo* firstNodeOneCore = server.unmanagedCores[1];
+    CoreInfo* secondNodeOneCore = server.unmanagedCores[2];
+    nodeZeroCore->numaNode = 0;
+    firstNodeOneCore->numaNode = 1;
+    secondNodeOneCore->numaNode = 1;
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    server.updateUnmanagedAffinity(process);
+    EXPECT_EQ(process->unmanagedNode, -1);
+
+    // Unmanaged threads follow the node with most of the managed cores
+    createThread(server, 1, process, 1, CoreArbiterServer::RUNNING_MANAGED,
+                 nodeZeroCore);
+    server.updateUnmanagedAffinity(process);
+    EXPECT_EQ(process->unmanagedNode, 0);
+    createThread(server, 2, process, 2, CoreArbiterServer::RUNNING_MANAGED,
+                 firstNodeOneCore);
+    server.updateUnmanagedAffinity(process);
+    EXPECT_EQ(process->unmanagedNode, 0);
+    createThread(server, 3, process, 3, CoreArbiterServer::RUNNING_MANAGED,
+                 secondNodeOneCore);
+    server.updateUnmanagedAffinity(process);
+    EXPECT_EQ(process->unmanagedNode, 1);
+
+    // Not to a node that has no unmanaged cores
+    process->unmanagedNode = -1;
+    server.unmanagedNodeCpusets[1].cores = "";
+    server.updateUnmanagedAffinity(process);
+    EXPECT_EQ(process->unmanagedNode, -1);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, updateUnmanagedCpuset_perNode) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    std::string oldCpusetPath = CoreArbiterServer::cpusetPath;
+    std::string arbiterPath = "/tmp/CoreArbiter/testcpuset/CoreArbiter";
+    std::string unmanagedPath = arbiterPath + "/Unmanaged";
+    std::string nodeOnePath = arbiterPath + "/UnmanagedNode1";
+    ensureParents((unmanagedPath + "/tasks").c_str());
+    ensureParents((nodeOnePath + "/tasks").c_str());
+    std::ofstream(unmanagedPath + "/tasks");
+    std::ofstream(nodeOnePath + "/cpuset.cpus");
+    std::ofstream(nodeOnePath + "/tasks") << 1234 << std::endl;
+
+    // The unmanaged cpuset's file is kept open, so it is appended to
+    auto readFile = [](std::string path) {
+        std::ifstream file(path);
+        std::string line, value;
+        while (std::getline(file, line)) {
+            value = line;
+        }
+        return value;
+    };
+
+    ProcessStats processStats;
+    {
+        CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+        CoreArbiterServer::testingSkipCpusetAllocation = false;
+        CoreArbiterServer::cpusetPath = "/tmp/CoreArbiter/testcpuset";
+        server.unmanagedCpusetCpus.open(unmanagedPath + "/cpuset.cpus");
+        server.alwaysUnmanagedString = "0,";
+        server.coreNumaNodes = {0, 0, 1, 1};
+        CoreInfo* nodeZeroCore = server.unmanagedCores[0];
+        nodeZeroCore->numaNode = 0;
+        server.unmanagedCores[1]->numaNode = 1;
+        server.unmanagedCores[2]->numaNode = 1;
+        for (int node = 0; node < 2; node++) {
+            NodeCpuset& nodeCpuset = server.unmanagedNodeCpusets[node];
+            nodeCpuset.path = arbiterPath + "/UnmanagedNode" +
+                              std::to_string(node);
+            ensureParents((nodeCpuset.path + "/tasks").c_str());
+            nodeCpuset.tasks.open(nodeCpuset.path + "/tasks",
+                                  std::ofstream::app);
+        }
+        server.unmanagedNodeCpusets[0].cores = "0,1,";
+        server.unmanagedNodeCpusets[1].cores = "2,3,";
+        ProcessInfo* process = createProcess(server, 1, &processStats);
+        process->unmanagedNode = 1;
+
+        // Only the node that lost a core has its cpuset rewritten
+        server.unmanagedCores.pop_front();
+        server.managedCores.push_back(nodeZeroCore);
+        server.updateUnmanagedCpuset();
+        EXPECT_EQ(readFile(unmanagedPath + "/cpuset.cpus"), "0,2,3,");
+        EXPECT_EQ(readFile(arbiterPath + "/UnmanagedNode0/cpuset.cpus"),
+                  "0,");
+        EXPECT_EQ(readFile(nodeOnePath + "/cpuset.cpus"), "");
+        EXPECT_EQ(server.unmanagedNodeCpusets[0].cores, "0,");
+        EXPECT_EQ(server.unmanagedNodeCpusets[1].cores, "2,3,");
+        EXPECT_EQ(process->unmanagedNode, 1);
+
+        // Once a node has no unmanaged cores its threads are evacuated to
+        // the spanning cpuset, and processes placed there are reset
+        while (!server.unmanagedCores.empty()) {
+            server.managedCores.push_back(server.unmanagedCores.front());
+            server.unmanagedCores.pop_front();
+        }
+        server.updateUnmanagedCpuset();
+        EXPECT_EQ(readFile(unmanagedPath + "/cpuset.cpus"), "0,");
+        EXPECT_EQ(readFile(unmanagedPath + "/tasks"), "1234");
+        EXPECT_EQ(server.unmanagedNodeCpusets[1].cores, "");
+        EXPECT_EQ(process->unmanagedNode, -1);
+        EXPECT_EQ(&server.getUnmanagedTasks(1), &server.unmanagedCpusetTasks);
+
+        CoreArbiterServer::testingSkipCpusetAllocation = true;
+        CoreArbiterServer::cpusetPath = oldCpusetPath;
+    }
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, managedCpusetMems) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    std::string oldCpusetPath = CoreArbiterServer::cpusetPath;
+    std::string arbiterPath = "/tmp/CoreArbiter/testmems/CoreArbiter";
+    std::string managedPath = arbiterPath + "/Managed5";
+    std::string processPath = arbiterPath + "/Process1";
+    ensureParents((arbiterPath + "/tasks").c_str());
+    for (std::string path : {managedPath, processPath}) {
+        for (const char* file :
+             {"/cpuset.mems", "/cpuset.cpus", "/cgroup.procs", "/tasks"}) {
+            unlink((path + file).c_str());
+        }
+        rmdir(path.c_str());
+    }
+    auto readFile = [](std::string path) {
+        std::ifstream file(path);
+        std::string value;
+        std::getline(file, value);
+        return value;
+    };
+
+    {
+        CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+        CoreArbiterServer::testingSkipCpusetAllocation = false;
+        CoreArbiterServer::cpusetPath = "/tmp/CoreArbiter/testmems";
+        server.coreNumaNodes = {0, 0, 0, 0, 0, 1};
+
+        // A core's cpuset allocates memory on the core's own node
+        ASSERT_TRUE(server.addArbitratedCore(5));
+        EXPECT_EQ(readFile(managedPath + "/cpuset.mems"), "1");
+        CoreInfo* core = server.unmanagedCores.back();
+        EXPECT_EQ(core->numaNode, 1);
+
+        // So does the cpuset of a process granted cores on that node
+        ProcessStats processStats;
+        ProcessInfo* process = createProcess(server, 1, &processStats);
+        ThreadInfo* placeholder = createThread(
+            server, 2, process, 2, CoreArbiterServer::RUNNING_MANAGED, core);
+        process->placeholders.push_back(placeholder);
+        server.updateProcessCpuset(process);
+        EXPECT_EQ(readFile(processPath + "/cpuset.mems"), "1,");
+        EXPECT_EQ(readFile(processPath + "/cpuset.cpus"), "5,");
+        process->placeholders.clear();
+        CoreArbiterServer::testingSkipCpusetAllocation = true;
+    }
+
+    CoreArbiterServer::cpusetPath = oldCpusetPath;
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, removeDrainedCpusets) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    std::string oldCpusetPath = CoreArbiterServer::cpusetPath;
+    CoreArbiterServer::cpusetPath = "/tmp/CoreArbiter/testdrain";
+    std::string processPath = "/tmp/CoreArbiter/testdrain/CoreArbiter/Process1";
+    ensureParents(processPath.c_str());
+    mkdir(processPath.c_str(), S_IRWXU);
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    process->hasCpuset = true;
+
+    // A process's cpuset is emptied straight away but not removed inline
+    server.removeProcessCpuset(process);
+    EXPECT_FALSE(process->hasCpuset);
+    EXPECT_EQ(server.drainingCpusets.count(processPath), 1u);
+    EXPECT_EQ(access(processPath.c_str(), F_OK), 0);
+
+    // A cpuset that still holds threads is retried on a later pass
+    sys->rmdirErrno = EBUSY;
+    server.removeDrainedCpusets();
+    EXPECT_EQ(server.drainingCpusets.count(processPath), 1u);
+    sys->rmdirErrno = 0;
+    server.removeDrainedCpusets();
+    EXPECT_TRUE(server.drainingCpusets.empty());
+    EXPECT_NE(access(processPath.c_str(), F_OK), 0);
+
+    // A cpuset that is needed again before it is removed is reused
+    mkdir(processPath.c_str(), S_IRWXU);
+    process->hasCpuset = true;
+    server.removeProcessCpuset(process);
+    server.createCpuset(processPath, "1", "0");
+    EXPECT_TRUE(server.drainingCpusets.empty());
+    for (const char* file : {"/cpuset.mems", "/cpuset.cpus"}) {
+        unlink((processPath + file).c_str());
+    }
+    rmdir(processPath.c_str());
+
+    CoreArbiterServer::cpusetPath = oldCpusetPath;
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, getCoreNumaNode) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+
+    // Cached nodes are used without touching sysfs
+    server.coreNumaNodes = {0, 0, 1, 1};
+    sys->opendirErrno = ENOENT;
+    EXPECT_EQ(server.getCoreNumaNode(2), 1);
+
+    // Other cores are looked up, and are on node 0 if sysfs can't be read
+    EXPECT_EQ(server.getCoreNumaNode(4), 0);
+    EXPECT_EQ(CoreArbiterServer::getNumaNode(0), 0);
+    sys->opendirErrno = 0;
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, placeUnmanagedThreads) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    std::string oldCpusetPath = CoreArbiterServer::cpusetPath;
+    std::string arbiterPath = "/tmp/CoreArbiter/testcpuset/CoreArbiter";
+    std::string nodeTasksPath = arbiterPath + "/UnmanagedNode0/tasks";
+    ensureParents((arbiterPath + "/Unmanaged/tasks").c_str());
+    ensureParents(nodeTasksPath.c_str());
+    std::ofstream(nodeTasksPath).close();
+
+    // A thread that no longer exists is skipped
+    pid_t threadId = static_cast<pid_t>(syscall(SYS_gettid));
+    std::ofstream(arbiterPath + "/Unmanaged/tasks")
+        << 999999999 << std::endl
+        << threadId << std::endl;
+
+    {
+        CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+        CoreArbiterServer::testingSkipCpusetAllocation = false;
+        CoreArbiterServer::cpusetPath = "/tmp/CoreArbiter/testcpuset";
+        int numaNode = server.getCoreNumaNode(sched_getcpu());
+        NodeCpuset& nodeCpuset = server.unmanagedNodeCpusets[numaNode];
+        nodeCpuset.cores = "0,";
+        nodeCpuset.tasks.open(nodeTasksPath);
+
+        // Threads go to the node of the core they last ran on
+        server.placeUnmanagedThreads();
+        std::ifstream nodeTasks(nodeTasksPath);
+        pid_t movedThreadId = 0;
+        nodeTasks >> movedThreadId;
+        EXPECT_EQ(movedThreadId, threadId);
+
+        CoreArbiterServer::testingSkipCpusetAllocation = true;
+        CoreArbiterServer::cpusetPath = oldCpusetPath;
+    }
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, updateCoreFrequencies) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    std::string cpuPath = "/tmp/CoreArbiter/testcpu";
+    std::string governorPath = cpuPath + "/cpu1/cpufreq/scaling_governor";
+    std::string minFrequencyPath = cpuPath + "/cpu1/cpufreq/scaling_min_freq";
+    ensureParents(governorPath.c_str());
+    std::ofstream(governorPath) << "powersave" << std::endl;
+    std::ofstream(minFrequencyPath) << "800000" << std::endl;
+    auto readFile = [](std::string path) {
+        std::ifstream file(path);
+        std::string value;
+        std::getline(file, value);
+        return value;
+    };
+
+    ProcessStats processStats;
+    {
+        CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+        CpuFrequencyManager* manager = new CpuFrequencyManager(cpuPath);
+        manager->setOccupiedSettings(
+            {{"performance", "3000000", ""}, {"", "2000000", ""}});
+        server.setFrequencyManager(manager);
+        CoreInfo* core = server.unmanagedCores[0];
+        server.unmanagedCores.pop_front();
+        server.managedCores.push_back(core);
+
+        // Nothing is configured for idle cores
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(governorPath), "powersave");
+        EXPECT_EQ(readFile(minFrequencyPath), "800000");
+
+        // Occupied cores follow the priority they were granted at, however
+        // much the process wants at higher priorities
+        ProcessInfo* process = createProcess(server, 1, &processStats);
+        ThreadInfo* thread =
+            createThread(server, 1, process, 1,
+                         CoreArbiterServer::RUNNING_MANAGED, core);
+        process->desiredCorePriorities[0] = 1;
+        thread->grantPriority = 1;
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(governorPath), "powersave");
+        EXPECT_EQ(readFile(minFrequencyPath), "2000000");
+        thread->grantPriority = 0;
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(governorPath), "performance");
+        EXPECT_EQ(readFile(minFrequencyPath), "3000000");
+
+        // Spare cores use their priority's settings, and scavenger cores the
+        // lowest priority's
+        thread->grantPriority = SPARE_PRIORITY(1);
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(governorPath), "powersave");
+        EXPECT_EQ(readFile(minFrequencyPath), "2000000");
+        thread->grantPriority = SPARE_PRIORITY(0);
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(minFrequencyPath), "3000000");
+        thread->grantPriority = SCAVENGER_PRIORITY;
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(minFrequencyPath), "2000000");
+        thread->grantPriority = 0;
+
+        // Idle cores go back to the host's settings
+        core->managedThread = NULL;
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(governorPath), "powersave");
+        EXPECT_EQ(readFile(minFrequencyPath), "800000");
+        core->managedThread = thread;
+        server.updateCoreFrequencies();
+        EXPECT_EQ(readFile(governorPath), "performance");
+    }
+
+    // And so does every core when the server exits
+    EXPECT_EQ(readFile(governorPath), "powersave");
+    EXPECT_EQ(readFile(minFrequencyPath), "800000");
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, distributeCores_coreCapacity) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipSocketCommunication = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+    server.unmanagedCores[0]->capacity = 500;
+    server.unmanagedCores[1]->capacity = 1024;
+    server.unmanagedCores[2]->capacity = 1000;
+    server.classifyCores();
+    EXPECT_EQ(server.stats->coreClasses[1], CORE_CLASS_EFFICIENCY);
+    EXPECT_EQ(server.stats->coreClasses[2], CORE_CLASS_PERFORMANCE);
+    EXPECT_EQ(server.stats->coreClasses[3], CORE_CLASS_PERFORMANCE);
+
+    // The fastest core goes to the highest priority
+    ProcessStats highPriorityStats;
+    ProcessInfo* highPriorityProcess =
+        createProcess(server, 1, &highPriorityStats);
+    ThreadInfo* highPriorityThread = createThread(
+        server, 1, highPriorityProcess, 1, CoreArbiterServer::BLOCKED);
+    highPriorityProcess->desiredCorePriorities[0] = 1;
+    server.corePriorityQueues[0].push_back(highPriorityProcess);
+
+    // A process that asks for efficiency cores gets one even though a faster
+    // core is free
+    ProcessStats lowPriorityStats;
+    ProcessInfo* lowPriorityProcess =
+        createProcess(server, 2, &lowPriorityStats);
+    ThreadInfo* lowPriorityThread = createThread(
+        server, 2, lowPriorityProcess, 2, CoreArbiterServer::BLOCKED);
+    lowPriorityProcess->desiredCorePriorities[1] = 1;
+    lowPriorityProcess->coreClass = CORE_CLASS_EFFICIENCY;
+    server.corePriorityQueues[1].push_back(lowPriorityProcess);
+
+    server.distributeCores();
+    ASSERT_EQ(server.managedCores.size(), 2u);
+    ASSERT_NE(highPriorityThread->core, (CoreInfo*)NULL);
+    EXPECT_EQ(highPriorityThread->core->id, 2);
+    ASSERT_NE(lowPriorityThread->core, (CoreInfo*)NULL);
+    EXPECT_EQ(lowPriorityThread->core->id, 1);
+    EXPECT_EQ(highPriorityThread->grantPriority, 0u);
+    EXPECT_EQ(lowPriorityThread->grantPriority, 1u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipSocketCommunication = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, chooseBlockedThread) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    ThreadInfo* firstThread = createThread(
+        server, 1, process, 1, CoreArbiterServer::RUNNING_UNMANAGED);
+    ThreadInfo* secondThread = createThread(
+        server, 2, process, 2, CoreArbiterServer::RUNNING_UNMANAGED);
+    server.changeThreadState(firstThread, CoreArbiterServer::BLOCKED);
+    server.changeThreadState(secondThread, CoreArbiterServer::BLOCKED);
+
+    // By default the most recently blocked thread goes first
+    size_t numChosen = 0;
+    EXPECT_EQ(server.chooseBlockedThread(process, &numChosen), secondThread);
+    EXPECT_EQ(server.chooseBlockedThread(process, &numChosen), firstThread);
+    EXPECT_EQ(server.chooseBlockedThread(process, &numChosen),
+              (ThreadInfo*)NULL);
+    EXPECT_EQ(numChosen, 2u);
+
+    server.setBlockedThreadPolicy(CoreArbiterServer::LONGEST_BLOCKED);
+    numChosen = 0;
+    EXPECT_EQ(server.chooseBlockedThread(process, &numChosen), firstThread);
+    EXPECT_EQ(server.chooseBlockedThread(process, &numChosen), secondThread);
+
+    // Threads leave the order when they stop being blocked
+    server.changeThreadState(firstThread, CoreArbiterServer::RUNNING_MANAGED);
+    numChosen = 0;
+    EXPECT_EQ(server.chooseBlockedThread(process, &numChosen), secondThread);
+    EXPECT_EQ(process->blockedThreads.size(), 1u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, readUtilityCurve) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+
+    // A curve is ignored while the client is writing it
+    processStats.numUtilityPoints = 2;
+    processStats.marginalUtilities[0] = 5;
+    processStats.marginalUtilities[1] = 0.5;
+    processStats.utilityCurveVersion = 1;
+    EXPECT_FALSE(server.readUtilityCurve(process));
+    processStats.utilityCurveVersion = 2;
+    EXPECT_TRUE(server.readUtilityCurve(process));
+    EXPECT_FALSE(server.readUtilityCurve(process));
+    EXPECT_EQ(process->utilityCurve, std::vector<float>({5, 0.5}));
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, PriorityAllocationPolicy_utility) {
+    // Two processes that each want two cores and have two blocked threads.
+    // The second values its first core above the default, but its second
+    // below it.
+    AllocationSnapshot snapshot;
+    for (size_t process = 0; process < 2; process++) {
+        AllocationSnapshot::Process info;
+        info.id = static_cast<pid_t>(process + 1);
+        info.desiredCores = {2};
+        for (size_t i = 0; i < 2; i++) {
+            info.blockedThreads.push_back(snapshot.threads.size());
+            snapshot.threads.push_back(
+                {static_cast<pid_t>(snapshot.threads.size()), process, -1,
+                 false});
+        }
+        snapshot.processes.push_back(info);
+    }
+    snapshot.processes[1].utilityCurve = {5, 0.5};
+    snapshot.priorityQueues = {{0, 1}};
+    snapshot.cores = {{1, 0, -1}, {2, 0, -1}, {3, 0, -1}};
+
+    PriorityAllocationPolicy policy(true);
+    EXPECT_TRUE(policy.usesUtilityCurves());
+    AllocationDecision decision;
+    policy.allocate(snapshot, &decision);
+    ASSERT_EQ(decision.grants.size(), 3u);
+    EXPECT_EQ(decision.grants[0].thread, 2u);
+    EXPECT_EQ(decision.grants[1].thread, 0u);
+    EXPECT_EQ(decision.grants[2].thread, 1u);
+
+    // Without utility, the processes take turns
+    PriorityAllocationPolicy evenPolicy;
+    decision = AllocationDecision();
+    evenPolicy.allocate(snapshot, &decision);
+    ASSERT_EQ(decision.grants.size(), 3u);
+    EXPECT_EQ(decision.grants[0].thread, 0u);
+    EXPECT_EQ(decision.grants[1].thread, 2u);
+    EXPECT_EQ(decision.grants[2].thread, 1u);
+    EXPECT_EQ(decision.priorityQueues[0], std::vector<size_t>({1, 0}));
+}
+
+/**
+ * Gives a core to every thread that has one or is blocked, regardless of
+ * what its process asked for.
+ */
+class GreedyAllocationPolicy : public AllocationPolicy {
+  public:
+    void allocate(const AllocationSnapshot& snapshot,
+                  AllocationDecision* decision) {
+        for (size_t i = 0; i < snapshot.threads.size() &&
+                           decision->grants.size() < snapshot.cores.size();
+             i++) {
+            decision->grants.push_back({i, 0});
+        }
+    }
+};
+
+TEST_F(CoreArbiterServerTest, setAllocationPolicy) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipSocketCommunication = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+    EXPECT_EQ(AllocationPolicy::create("nonexistent"),
+              static_cast<AllocationPolicy*>(NULL));
+    server.setAllocationPolicy(new GreedyAllocationPolicy());
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    for (int i = 0; i < 3; i++) {
+        createThread(server, i, process, i, CoreArbiterServer::BLOCKED);
+    }
+
+    // The process never asked for cores, but the policy gives it all of them
+    server.distributeCores();
+    EXPECT_EQ(server.managedThreads.size(), 2u);
+    EXPECT_EQ(processStats.numOwnedCores, 2u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipSocketCommunication = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, findGoodCoreForThread_lastCore) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    ThreadInfo* thread =
+        createThread(server, 1, process, 1, CoreArbiterServer::BLOCKED);
+    CoreInfo firstCore, secondCore;
+    firstCore.id = 1;
+    secondCore.id = 2;
+    std::deque<CoreInfo*> candidates = {&firstCore, &secondCore};
+
+    // The thread goes back to the core it last ran on
+    thread->lastCore = &secondCore;
+    EXPECT_EQ(server.findGoodCoreForThread(thread, candidates), &secondCore);
+    ASSERT_EQ(candidates.size(), 1u);
+    EXPECT_EQ(candidates.front(), &firstCore);
+
+    // Unless another thread of its process was preempted from it
+    candidates.push_back(&secondCore);
+    process->coresPreemptedFrom.insert(&secondCore);
+    EXPECT_EQ(server.findGoodCoreForThread(thread, candidates), &firstCore);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, holdBackIncompleteGangs) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    ProcessStats gangStats, otherStats;
+    ProcessInfo* gang = createProcess(server, 1, &gangStats);
+    ProcessInfo* other = createProcess(server, 2, &otherStats);
+    gang->gangSize = 3;
+    CoreInfo runningCore;
+    ThreadInfo* running = createThread(
+        server, 1, gang, 1, CoreArbiterServer::RUNNING_MANAGED, &runningCore);
+    ThreadInfo* gangThread1 =
+        createThread(server, 2, gang, 2, CoreArbiterServer::BLOCKED);
+    ThreadInfo* gangThread2 =
+        createThread(server, 3, gang, 3, CoreArbiterServer::BLOCKED);
+    ThreadInfo* otherThread =
+        createThread(server, 4, other, 4, CoreArbiterServer::BLOCKED);
+    CoreInfo firstCore, secondCore;
+    firstCore.numaNode = 0;
+    secondCore.numaNode = 1;
+    std::unordered_set<ThreadInfo*> threadsAlreadyManaged = {running};
+    std::deque<CoreInfo*> availableCores = {&firstCore, &secondCore};
+    std::vector<ProcessInfo*> gangsPlaced;
+
+    // The other process's thread leaves only one core for a gang that needs
+    // two more
+    std::deque<ThreadInfo*> threadsToReceiveCores = {otherThread, gangThread1,
+                                                     gangThread2};
+    server.holdBackIncompleteGangs(threadsToReceiveCores,
+                                   threadsAlreadyManaged, availableCores,
+                                   gangsPlaced);
+    ASSERT_EQ(threadsToReceiveCores.size(), 1u);
+    EXPECT_EQ(threadsToReceiveCores.front(), otherThread);
+    EXPECT_TRUE(gangsPlaced.empty());
+    EXPECT_NE(gang->gangWaitStart, 0u);
+
+    // Once both cores are free the whole gang is woken on one node
+    threadsToReceiveCores = {gangThread1, gangThread2};
+    availableCores.push_back(&firstCore);
+    server.holdBackIncompleteGangs(threadsToReceiveCores,
+                                   threadsAlreadyManaged, availableCores,
+                                   gangsPlaced);
+    EXPECT_EQ(threadsToReceiveCores.size(), 2u);
+    ASSERT_EQ(gangsPlaced.size(), 1u);
+    EXPECT_EQ(gangsPlaced.front(), gang);
+    EXPECT_EQ(gang->gangNumaNode, 0);
+    EXPECT_EQ(gang->gangWaitStart, 0u);
+
+    // A gang that has waited too long receives what is available
+    gangsPlaced.clear();
+    gang->gangNumaNode = -1;
+    gang->gangTimeout = 0;
+    gang->gangWaitStart = 1;
+    availableCores = {&firstCore};
+    server.holdBackIncompleteGangs(threadsToReceiveCores,
+                                   threadsAlreadyManaged, availableCores,
+                                   gangsPlaced);
+    EXPECT_EQ(threadsToReceiveCores.size(), 2u);
+    EXPECT_TRUE(gangsPlaced.empty());
+    EXPECT_TRUE(gang->gangTimedOut);
+    EXPECT_EQ(gang->gangWaitStart, 0u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, sampleCoreUtilization) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    makeUnmanagedCoresManaged(server);
+    CoreInfo* core = server.managedCores[0];
+
+    ProcessStats idleStats, waitingStats;
+    ProcessInfo* idleProcess = createProcess(server, 1, &idleStats);
+    ProcessInfo* waitingProcess = createProcess(server, 2, &waitingStats);
+    createThread(server, 1, idleProcess, 1,
+                 CoreArbiterServer::RUNNING_MANAGED, core);
+    createThread(server, 2, waitingProcess, 2, CoreArbiterServer::BLOCKED);
+    idleProcess->desiredCorePriorities[0] = 2;
+    waitingProcess->desiredCorePriorities[0] = 1;
+    waitingStats.numBlockedThreads = 1;
+    CoreUtilization& utilization = idleStats.coreUtilization[core->id];
+
+    // The first sample only records where the counts start
+    server.sampleCoreUtilization();
+    utilization.idleCycles += 1000;
+    server.sampleCoreUtilization();
+    EXPECT_NE(core->idleSince, 0u);
+    EXPECT_EQ(idleProcess->numIdleCoresReclaimed, 0u);
+
+    // A core that stays idle is reclaimed while another process waits
+    core->idleSince = 1;
+    utilization.idleCycles += 1000;
+    server.sampleCoreUtilization();
+    EXPECT_EQ(idleProcess->numIdleCoresReclaimed, 1u);
+    EXPECT_EQ(server.getDesiredCores(idleProcess, 0), 1u);
+    ProcessEfficiency* efficiency = server.getProcessEfficiency(1);
+    ASSERT_TRUE(efficiency != NULL);
+    EXPECT_EQ(efficiency->usefulCycles, 0u);
+    EXPECT_GT(efficiency->grantedCycles, 0u);
+
+    // The process gets it back once it keeps its cores busy
+    utilization.busyCycles += 1000;
+    server.sampleCoreUtilization();
+    EXPECT_EQ(idleProcess->numIdleCoresReclaimed, 0u);
+    EXPECT_EQ(efficiency->usefulCycles, 1000u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, adjustUnmanagedFloor) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+    server.setUnmanagedFloor(1, 2);
+    EXPECT_EQ(server.getMaxManagedCores(), 2u);
+
+    // Stalled or crowded unmanaged threads raise the floor up to the maximum
+    EXPECT_TRUE(server.adjustUnmanagedFloor(0.5, 0));
+    EXPECT_EQ(server.unmanagedFloor, 2u);
+    EXPECT_FALSE(server.adjustUnmanagedFloor(0, 3));
+    EXPECT_EQ(server.getMaxManagedCores(), 1u);
+
+    // The policy is only offered the cores that may be managed
+    AllocationSnapshot snapshot;
+    std::vector<ThreadInfo*> snapshotThreads;
+    std::vector<ProcessInfo*> snapshotProcesses;
+    server.takeAllocationSnapshot(&snapshot, &snapshotThreads,
+                                  &snapshotProcesses);
+    EXPECT_EQ(snapshot.cores.size(), 1u);
+
+    // The floor comes down only after the unmanaged threads have been idle
+    // for a while, and never below the minimum
+    for (int i = 0; i < UNMANAGED_FLOOR_LOWER_SAMPLES - 1; i++) {
+        EXPECT_FALSE(server.adjustUnmanagedFloor(0, 0));
+    }
+    EXPECT_FALSE(server.adjustUnmanagedFloor(0.05, 0));
+    for (int i = 0; i < UNMANAGED_FLOOR_LOWER_SAMPLES - 1; i++) {
+        EXPECT_FALSE(server.adjustUnmanagedFloor(0, 0));
+    }
+    EXPECT_TRUE(server.adjustUnmanagedFloor(0, 0));
+    EXPECT_EQ(server.unmanagedFloor, 1u);
+    for (int i = 0; i < UNMANAGED_FLOOR_LOWER_SAMPLES; i++) {
+        EXPECT_FALSE(server.adjustUnmanagedFloor(0, 0));
+    }
+    EXPECT_EQ(server.unmanagedFloor, 1u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+}
+
+TEST_F(CoreArbiterServerTest, sampleUnmanagedPressure) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    std::string oldCpusetPath = CoreArbiterServer::cpusetPath;
+    std::string pressurePath =
+        "/tmp/CoreArbiter/testpressure/CoreArbiter/Unmanaged/cpu.pressure";
+    ensureParents(pressurePath.c_str());
+
+    {
+        CoreArbiterServer server(socketPath, memPath, {1, 2, 3}, false);
+        CoreArbiterServer::cpusetPath = "/tmp/CoreArbiter/testpressure";
+        server.setUnmanagedFloor(1, 2);
+
+        // The unmanaged cgroup's own file is preferred to the system-wide one
+        std::ofstream(pressurePath)
+            << "some avg10=0.00 avg60=0.00 avg300=0.00 total=5000"
+            << std::endl;
+        EXPECT_EQ(server.findPressurePath(), pressurePath);
+        server.lastPressureSample = 1;
+        server.sampleUnmanagedPressure();
+        EXPECT_EQ(server.pressurePath, pressurePath);
+        EXPECT_EQ(server.lastPressureStallUs, 5000u);
+
+        // A malformed total is ignored rather than thrown
+        std::ofstream(pressurePath)
+            << "some avg10=0.00 avg60=0.00 avg300=0.00 total=x5000"
+            << std::endl;
+        server.lastPressureSample = 1;
+        server.sampleUnmanagedPressure();
+        EXPECT_EQ(server.lastPressureStallUs, 0u);
+
+        // Without a per-cgroup file the whole system's pressure is used
+        unlink(pressurePath.c_str());
+        EXPECT_EQ(server.findPressurePath(), "/proc/pressure/cpu");
+    }
+
+    CoreArbiterServer::cpusetPath = oldCpusetPath;
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+}
+
 TEST_F(CoreArbiterServerTest, handleEvents_scaleUnmanagedCore) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipSocketCommunication = true;
@@ -568,6 +1746,28 @@ TEST_F(CoreArbiterServerTest, handleEvents_scaleUnmanagedCore) {
     CoreArbiterServer::testingDoNotChangeManagedCores = false;
 }
 
+TEST_F(CoreArbiterServerTest, handleEvents_interrupted) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipSocketCommunication = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    makeUnmanagedCoresManaged(server);
+
+    // An interrupted wait is resumed, so the periodic work is not put off
+    uint64_t now = Cycles::rdtsc();
+    server.unmanagedCpusetLastUpdate = now;
+    server.managedCores[0]->threadRemovalTime = now;
+    sys->epollWaitErrno = EINTR;
+    EXPECT_TRUE(server.handleEvents());
+    EXPECT_EQ(server.managedCores.size(), 0u);
+    EXPECT_EQ(server.unmanagedCores.size(), 1u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipSocketCommunication = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
 TEST_F(CoreArbiterServerTest, timeoutThreadPreemption_basic) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipSocketCommunication = true;
@@ -608,6 +1808,41 @@ TEST_F(CoreArbiterServerTest, timeoutThreadPreemption_basic) {
     CoreArbiterServer::testingDoNotChangeManagedCores = false;
 }
 
+TEST_F(CoreArbiterServerTest, timeoutThreadPreemption_scavenger) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipSocketCommunication = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    makeUnmanagedCoresManaged(server);
+
+    ProcessStats processStats;
+    CoreInfo* core = server.managedCores[0];
+
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    ThreadInfo* thread = createThread(server, 1, process, 1,
+                                      CoreArbiterServer::RUNNING_MANAGED, core);
+    thread->scavenging = true;
+
+    // Revoking a scavenger core does not count as a preemption
+    server.requestCoreRelease(core);
+    while (server.timerFdToInfo.size())
+        server.handleEvents();
+    ASSERT_EQ(thread->state, CoreArbiterServer::RUNNING_PREEMPTED);
+    EXPECT_EQ(processStats.preemptedCount, 0u);
+    EXPECT_EQ(processStats.scavengerRevokedCount, 1u);
+
+    // ...and neither does the thread giving up its preempted state
+    server.threadBlocking(1);
+    ASSERT_EQ(thread->state, CoreArbiterServer::BLOCKED);
+    EXPECT_EQ(processStats.unpreemptedCount, 0u);
+    EXPECT_FALSE(thread->scavengerRevoked);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipSocketCommunication = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
 TEST_F(CoreArbiterServerTest, timeoutThreadPreemption_invalidateOldTimeout) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipSocketCommunication = true;
@@ -639,6 +1874,8 @@ TEST_F(CoreArbiterServerTest, cleanupConnection) {
     CoreArbiterServer::testingSkipCpusetAllocation = true;
     CoreArbiterServer::testingSkipCoreDistribution = true;
     CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    // The process's shared memory was not mmapped by the server
+    CoreArbiterServer::testingSkipMemoryDeallocation = true;
     // Prevent close calls since we're not using real sockets
     sys->closeErrno = 1;
 
@@ -687,6 +1924,299 @@ TEST_F(CoreArbiterServerTest, cleanupConnection) {
               server.threadSocketToInfo.end());
     ASSERT_EQ(server.processIdToInfo.size(), 0u);
 
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+    CoreArbiterServer::testingSkipMemoryDeallocation = false;
+    sys->closeErrno = 0;
+}
+
+TEST_F(CoreArbiterServerTest, processExited) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    CoreArbiterServer::testingSkipMemoryDeallocation = true;
+    // Prevent close calls since we're not using real file descriptors
+    sys->closeErrno = 1;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    makeUnmanagedCoresManaged(server);
+
+    ProcessStats processStats;
+    processStats.preemptedCount = 1;
+    CoreInfo* core = server.managedCores[0];
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    createThread(server, 1, process, 1, CoreArbiterServer::RUNNING_MANAGED,
+                 core);
+    ThreadInfo* preemptedThread = createThread(
+        server, 2, process, 2, CoreArbiterServer::RUNNING_PREEMPTED);
+    preemptedThread->corePreemptedFrom = core;
+    process->coresPreemptedFrom.insert(core);
+    createThread(server, 3, process, 3, CoreArbiterServer::BLOCKED);
+    process->desiredCorePriorities[0] = 2;
+    server.corePriorityQueues[0].push_back(process);
+    int pidFd = 10;
+    process->pidFd = pidFd;
+    server.processPidFdToInfo[pidFd] = process;
+    server.stats->numProcesses = 1;
+
+    // The process's pidfd and one of its hangups arrive in the same batch.
+    // Everything is torn down together, and the hangup is ignored.
+    epoll_event events[2];
+    events[0].events = EPOLLRDHUP;
+    events[0].data.fd = 1;
+    events[1].events = EPOLLIN;
+    events[1].data.fd = pidFd;
+    sys->epollWaitEvents = events;
+    sys->epollWaitCount = 2;
+    server.handleEvents();
+
+    ASSERT_TRUE(server.threadSocketToInfo.empty());
+    ASSERT_TRUE(server.processIdToInfo.empty());
+    ASSERT_TRUE(server.processPidFdToInfo.empty());
+    ASSERT_TRUE(server.corePriorityQueues[0].empty());
+    ASSERT_TRUE(server.managedThreads.empty());
+    ASSERT_EQ(core->managedThread, (ThreadInfo*)NULL);
+    ASSERT_EQ(server.stats->numProcesses, 0u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+    CoreArbiterServer::testingSkipMemoryDeallocation = false;
+    sys->closeErrno = 0;
+}
+
+TEST_F(CoreArbiterServerTest, handleControlMessage) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingSkipMemoryDeallocation = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    process->controlSocket = serverSocket;
+    server.controlSocketToProcess[serverSocket] = process;
+
+    // Register a thread in grant slot 5
+    uint8_t msgType = THREAD_REGISTER;
+    pid_t threadId = 2;
+    uint32_t grantSlot = 5;
+    send(clientSocket, &msgType, sizeof(uint8_t), 0);
+    send(clientSocket, &threadId, sizeof(pid_t), 0);
+    send(clientSocket, &grantSlot, sizeof(uint32_t), 0);
+    server.handleControlMessage(serverSocket);
+    ASSERT_EQ(process->multiplexedThreads.size(), 1u);
+    ThreadInfo* thread = process->multiplexedThreads[threadId];
+    EXPECT_EQ(thread->socket, -1);
+    EXPECT_EQ(thread->grantSlot, 5);
+    EXPECT_EQ(process->threadStateToSet[CoreArbiterServer::RUNNING_UNMANAGED]
+                  .count(thread),
+              1u);
+    EXPECT_TRUE(server.threadSocketToInfo.empty());
+
+    // Block it
+    msgType = THREAD_BLOCK;
+    send(clientSocket, &msgType, sizeof(uint8_t), 0);
+    send(clientSocket, &threadId, sizeof(pid_t), 0);
+    server.handleControlMessage(serverSocket);
+    EXPECT_EQ(thread->state, CoreArbiterServer::BLOCKED);
+    EXPECT_EQ(processStats.numBlockedThreads, 1u);
+
+    // Cores are granted through the thread's slot
+    CoreInfo core;
+    core.id = 3;
+    server.wakeupThread(thread, &core);
+    EXPECT_EQ(processStats.threadGrantSlots[5].grantCount, 1);
+    EXPECT_EQ(processStats.threadGrantSlots[5].coreId, 3);
+
+    // Unregistering the last thread leaves the process in place, since the
+    // control connection is still open
+    msgType = THREAD_UNREGISTER;
+    send(clientSocket, &msgType, sizeof(uint8_t), 0);
+    send(clientSocket, &threadId, sizeof(pid_t), 0);
+    server.handleControlMessage(serverSocket);
+    EXPECT_TRUE(process->multiplexedThreads.empty());
+    EXPECT_EQ(server.processIdToInfo.size(), 1u);
+
+    // Closing the control connection removes the process
+    sys->closeErrno = 1;
+    server.cleanupConnection(serverSocket);
+    EXPECT_TRUE(server.processIdToInfo.empty());
+    EXPECT_TRUE(server.controlSocketToProcess.empty());
+    sys->closeErrno = 0;
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingSkipMemoryDeallocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, agentConnection) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingSkipMemoryDeallocation = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    // Only root may act as an agent
+    sys->peerCredUid = 0;
+    EXPECT_TRUE(server.isPrivilegedPeer(serverSocket));
+    sys->peerCredUid = 1000;
+    EXPECT_FALSE(server.isPrivilegedPeer(serverSocket));
+    sys->peerCredUid = -1;
+
+    // An agent can only register threads that belong to its process
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, getpid(), &processStats);
+    process->proxied = true;
+    server.registerMultiplexedThread(process, getpid() + 1000000, 0);
+    EXPECT_TRUE(process->multiplexedThreads.empty());
+    server.registerMultiplexedThread(process, sys->gettid(), 0);
+    EXPECT_EQ(process->multiplexedThreads.size(), 1u);
+
+    sys->closeErrno = 1;
+    server.cleanupProcess(process);
+    EXPECT_TRUE(server.processIdToInfo.empty());
+    sys->closeErrno = 0;
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingSkipMemoryDeallocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, pollSharedMemory) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingSkipMemoryDeallocation = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    server.registerMultiplexedThread(process, 2, 5);
+    ThreadInfo* thread = process->multiplexedThreads[2];
+
+    // A core request is only read once the client has finished writing it
+    processStats.requestedCores[0] = 2;
+    processStats.coreRequestVersion = 1;
+    server.pollSharedMemory();
+    EXPECT_EQ(process->desiredCorePriorities[0], 0u);
+    processStats.coreRequestVersion = 2;
+    server.pollSharedMemory();
+    EXPECT_EQ(process->desiredCorePriorities[0], 2u);
+    EXPECT_EQ(process->coreRequestVersion, 2u);
+
+    // A thread blocks by bumping its slot's block count, once per bump
+    processStats.threadGrantSlots[5].blockCount = 1;
+    server.pollSharedMemory();
+    EXPECT_EQ(thread->state, CoreArbiterServer::BLOCKED);
+    EXPECT_EQ(processStats.numBlockedThreads, 1u);
+    server.pollSharedMemory();
+    EXPECT_EQ(processStats.numBlockedThreads, 1u);
+
+    // A block from a slot with no registered thread waits for the thread
+    processStats.threadGrantSlots[6].blockCount = 1;
+    server.pollSharedMemory();
+    EXPECT_EQ(process->blockCounts[6], 0);
+    server.registerMultiplexedThread(process, 3, 6);
+    server.pollSharedMemory();
+    EXPECT_EQ(process->multiplexedThreads[3]->state,
+              CoreArbiterServer::BLOCKED);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingSkipMemoryDeallocation = false;
+}
+
+TEST_F(CoreArbiterServerTest, enableBusyPolling) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    CoreArbiterServer server(socketPath, memPath, {1, 2}, false);
+
+    // The server can't poll on a core it arbitrates
+    EXPECT_FALSE(server.enableBusyPolling(2));
+    EXPECT_FALSE(server.busyPolling);
+
+    sys->schedSetaffinityErrno = EINVAL;
+    EXPECT_FALSE(server.enableBusyPolling(3));
+    EXPECT_FALSE(server.stats->busyPolling);
+
+    // Failing to become real-time is not fatal
+    sys->schedSetschedulerErrno = EPERM;
+    EXPECT_TRUE(server.enableBusyPolling(3));
+    EXPECT_EQ(sys->schedSetaffinityCore, 3);
+    EXPECT_TRUE(server.busyPolling);
+    EXPECT_TRUE(server.stats->busyPolling);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+}
+
+TEST_F(CoreArbiterServerTest, threadExited) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    // Prevent close calls since we're not using real file descriptors
+    sys->closeErrno = 1;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+    makeUnmanagedCoresManaged(server);
+
+    ProcessStats processStats;
+    CoreInfo* core = server.managedCores[0];
+    ProcessInfo* process = createProcess(server, 1, &processStats);
+    ThreadInfo* exitedThread = createThread(
+        server, 1, process, 1, CoreArbiterServer::RUNNING_MANAGED, core);
+    createThread(server, 2, process, 2, CoreArbiterServer::BLOCKED);
+    int pidFd = 10;
+    exitedThread->pidFd = pidFd;
+    server.threadPidFdToInfo[pidFd] = exitedThread;
+
+    // The core is reclaimed even though the thread never closed its socket
+    server.threadExited(pidFd);
+    ASSERT_TRUE(server.threadPidFdToInfo.empty());
+    ASSERT_EQ(server.threadSocketToInfo.find(1),
+              server.threadSocketToInfo.end());
+    ASSERT_EQ(core->managedThread, (ThreadInfo*)NULL);
+    ASSERT_EQ(process->stats->numOwnedCores, 0u);
+    ASSERT_EQ(server.processIdToInfo.size(), 1u);
+
+    CoreArbiterServer::testingSkipCpusetAllocation = false;
+    CoreArbiterServer::testingSkipCoreDistribution = false;
+    CoreArbiterServer::testingDoNotChangeManagedCores = false;
+    sys->closeErrno = 0;
+}
+
+TEST_F(CoreArbiterServerTest, reapExitedThreads) {
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingSkipCoreDistribution = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+    // Prevent close calls since we're not using real sockets
+    sys->closeErrno = 1;
+
+    CoreArbiterServer server(socketPath, memPath, {1}, false);
+
+    // Find the ID of a thread that has already exited
+    pid_t exitedThreadId;
+    std::thread exitingThread([&] { exitedThreadId = sys->gettid(); });
+    exitingThread.join();
+
+    ProcessStats processStats;
+    ProcessInfo* process = createProcess(server, getpid(), &processStats);
+    ThreadInfo* liveThread = createThread(server, sys->gettid(), process, 1,
+                                          CoreArbiterServer::RUNNING_UNMANAGED);
+    ThreadInfo* exitedThread = createThread(
+        server, exitedThreadId, process, 2, CoreArbiterServer::BLOCKED);
+    liveThread->pollForExit = true;
+    exitedThread->pollForExit = true;
+
+    server.reapExitedThreads();
+    ASSERT_NE(server.threadSocketToInfo.find(1),
+              server.threadSocketToInfo.end());
+    ASSERT_EQ(server.threadSocketToInfo.find(2),
+              server.threadSocketToInfo.end());
+
     CoreArbiterServer::testingSkipCpusetAllocation = false;
     CoreArbiterServer::testingSkipCoreDistribution = false;
     CoreArbiterServer::testingDoNotChangeManagedCores = false;
@@ -698,4 +2228,33 @@ TEST_F(CoreArbiterServerTest, advisoryLock_multiServer) {
     ASSERT_DEATH(CoreArbiterServer(socketPath, memPath, {1, 2}, false),
                  "Error acquiring advisory lock:.*");
 }
+
+TEST_F(CoreArbiterServerTest, simulator_deterministic) {
+    SimulationParameters parameters;
+    parameters.numCores = 4;
+    // Process 3 wants more cores than are free, so 2 must give one back
+    std::vector<DemandChange> trace = {{0, 1, 0, 2},
+                                       {0, 2, 1, 2},
+                                       {10000, 3, 0, 3},
+                                       {50000, 3, 0, 0}};
+
+    CoreArbiterSimulator simulator(parameters);
+    SimulationReport report = simulator.run(trace, 100000);
+    SimulationReport otherReport = simulator.run(trace, 100000);
+
+    ASSERT_EQ(report.processes.size(), 3u);
+    ASSERT_EQ(report.simulatedNs, otherReport.simulatedNs);
+    ASSERT_EQ(report.numCpusetWrites, otherReport.numCpusetWrites);
+    for (size_t i = 0; i < report.processes.size(); i++) {
+        ProcessReport& process = report.processes[i];
+        ProcessReport& otherProcess = otherReport.processes[i];
+        EXPECT_GT(process.usefulCoreNs, 0u);
+        EXPECT_EQ(process.usefulCoreNs, otherProcess.usefulCoreNs);
+        EXPECT_EQ(process.waitCoreNs, otherProcess.waitCoreNs);
+        EXPECT_EQ(process.numReleaseRequests, otherProcess.numReleaseRequests);
+    }
+    EXPECT_EQ(report.processes[2].numThreads, 3u);
+    EXPECT_GT(report.processes[1].numReleaseRequests, 0u);
+    EXPECT_GT(report.processes[2].numWaits, 0u);
+}
 }  // namespace CoreArbiter
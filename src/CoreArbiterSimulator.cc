@@ -0,0 +1,1315 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <math.h>
+#include <sys/un.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <queue>
+#include <random>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "CoreArbiterSimulator.h"
+#include "MockSyscall.h"
+
+using PerfUtils::Cycles;
+
+namespace CoreArbiter {
+
+// The virtual time (in nanoseconds) at which a simulation starts. This is not
+// 0 because the server uses 0 to mean "never" for several timestamps.
+static const uint64_t SIMULATION_START_NS = 1000000000;
+
+// The first file descriptor handed out by the simulated kernel, chosen to stay
+// clear of the real ones the server opens.
+static const int FIRST_SIMULATED_FD = 1 << 20;
+
+// The first ID given to the threads of simulated processes.
+static const pid_t FIRST_SIMULATED_THREAD_ID = 1 << 22;
+
+// Where the simulated server pretends to keep its socket and shared memory.
+static const char SIMULATED_SOCKET_PATH[] = "/tmp/CoreArbiter/simsocket";
+static const char SIMULATED_SHARED_MEM_PATH[] = "/tmp/CoreArbiter/simmem";
+
+struct SimulatedProcess;
+
+/**
+ * A thread of a simulated process.
+ */
+struct SimulatedThread {
+    enum State {
+        // Waiting in blockUntilCoreAvailable()
+        BLOCKED,
+
+        // Granted a core, but not running on it yet
+        MIGRATING,
+
+        // Running on the core it was granted
+        RUNNING
+    };
+
+    pid_t id;
+    SimulatedProcess* process;
+
+    // This thread's connection to the server, or -1 once it has closed.
+    int socket;
+
+    State state;
+
+    // The core this thread was last granted.
+    int coreId;
+
+    // True if this thread has noticed that it was asked to release its core
+    // and will block soon.
+    bool releasePending;
+};
+
+/**
+ * A simulated process, along with the running totals for its report.
+ */
+struct SimulatedProcess {
+    ProcessReport report;
+    std::vector<SimulatedThread*> threads;
+
+    // The process's shared memory, once the server has mapped it.
+    ProcessStats* stats;
+
+    // False if this process ignores requests to release its cores.
+    bool cooperative;
+
+    // True once the process has exited.
+    bool exited;
+
+    // The number of cores the process currently asks for.
+    uint32_t demand;
+
+    // The number of threads in the RUNNING state.
+    uint32_t numRunning;
+
+    // The number of cores granted, usefully granted and waited for as of
+    // lastUpdate, which the report totals accumulate until the next update.
+    uint32_t numGranted;
+    uint32_t numUseful;
+    uint32_t numWaiting;
+    uint64_t lastUpdate;
+
+    // When the process's current wait for cores began, or 0 if it is not
+    // waiting.
+    uint64_t waitStart;
+
+    // True if the process is in SimulatedKernel::dirtyProcesses.
+    bool dirty;
+};
+
+/**
+ * The fake kernel, and the fake clients running on it, that a
+ * CoreArbiterSimulator runs the server against. Everything happens in the
+ * server's thread: whenever the server waits in epoll_wait(), the kernel
+ * advances virtual time to the next event, lets the clients react to it, and
+ * returns whatever file descriptors became ready as a result.
+ */
+class SimulatedKernel : public MockSyscall {
+  public:
+    SimulatedKernel(const SimulationParameters& parameters,
+                    const std::vector<DemandChange>& trace,
+                    uint64_t durationNs);
+    ~SimulatedKernel();
+    SimulationReport getReport();
+
+    int accept(int sockfd, sockaddr* addr, socklen_t* addrlen);
+    int bind(int sockfd, const sockaddr* addr, socklen_t addrlen);
+    int chmod(const char* path, mode_t mode) { return 0; }
+    int close(int fd);
+    int epoll_create(int size);
+    int epoll_ctl(int epfd, int op, int fd, epoll_event* event);
+    int epoll_wait(int epfd, epoll_event* events, int maxEvents, int timeout);
+    int flock(int fd, int operation) { return 0; }
+    int ftruncate(int fd, off_t length) { return 0; }
+    int futexWake(int* addr, int count) { return 0; }
+    uid_t geteuid() { return 0; }
+    int listen(int sockfd, int backlog) { return 0; }
+    void* mmap(void* addr, size_t length, int prot, int flags, int fd,
+               off_t offset);
+    int munmap(void* addr, size_t length);
+    int open(const char* path, int oflag);
+    int open(const char* path, int oflag, mode_t mode);
+    int pidfd_open(pid_t pid, unsigned int flags);
+    ssize_t read(int fd, void* buf, size_t count);
+    uint64_t rdtsc() { return Cycles::fromNanoseconds(now); }
+    ssize_t recv(int sockfd, void* buf, size_t len, int flags);
+    ssize_t send(int sockfd, const void* buf, size_t len, int flags);
+    int socket(int domain, int type, int protocol);
+    int stat(const char* path, struct stat* buf) { return 0; }
+    int timerfd_create(int clockid, int flags);
+    int timerfd_settime(int fd, int flags, const struct itimerspec* newVal,
+                        struct itimerspec* oldVal);
+    int unlink(const char* pathname) { return 0; }
+    ssize_t write(int fd, const void* buf, size_t count);
+
+  private:
+    enum EventType {
+        PROCESS_START,
+        DEMAND_CHANGE,
+        THREAD_RUNNING,
+        RELEASE_CORE,
+        TIMER_EXPIRED,
+        PROCESS_EXIT
+    };
+
+    /**
+     * Something that will happen at a given virtual time. Events at the same
+     * time happen in the order they were scheduled.
+     */
+    struct Event {
+        uint64_t time;
+        uint64_t sequence;
+        EventType type;
+        SimulatedProcess* process;
+        SimulatedThread* thread;
+        int fd;
+        uint32_t priority;
+        uint32_t numCores;
+
+        bool operator>(const Event& other) const {
+            return time != other.time ? time > other.time
+                                      : sequence > other.sequence;
+        }
+    };
+
+    enum FileType {
+        LISTEN_SOCKET,
+        CONNECTION,
+        SHARED_MEMORY,
+        TIMER,
+        PROCESS_PIDFD,
+        THREAD_PIDFD,
+        EPOLL
+    };
+
+    /**
+     * A file descriptor that the simulated kernel has handed out.
+     */
+    struct File {
+        FileType type;
+
+        // The thread at the other end of a CONNECTION, or the thread whose
+        // core release a TIMER enforces.
+        SimulatedThread* thread;
+
+        // The process a PROCESS_PIDFD refers to.
+        SimulatedProcess* process;
+
+        // The path a SHARED_MEMORY file was opened with.
+        std::string path;
+
+        // Bytes sent by the client that the server has not read yet.
+        std::deque<uint8_t> inbound;
+
+        // True once a TIMER has expired and until it is read.
+        bool expired;
+
+        // Identifies the current setting of a TIMER, so that expirations
+        // from earlier settings are ignored.
+        uint64_t timerGeneration;
+    };
+
+    void schedule(uint64_t time, EventType type, SimulatedProcess* process,
+                  SimulatedThread* thread = NULL);
+    void handleEvent(const Event& event);
+    void startProcess(SimulatedProcess* process);
+    void changeDemand(SimulatedProcess* process, uint32_t priority,
+                      uint32_t numCores);
+    void releaseCore(SimulatedThread* thread);
+    void exitProcess(SimulatedProcess* process);
+    void noticeReleaseRequests(SimulatedThread** releasingThread);
+    void sendToServer(SimulatedThread* thread, const void* buf, size_t len);
+    int newFile(FileType type);
+    void markReady(int fd);
+    bool isReady(int fd);
+    void updateProcess(SimulatedProcess* process);
+    void touch(SimulatedProcess* process);
+
+    // Describes the simulated machine and clients.
+    SimulationParameters parameters;
+
+    // The current virtual time, in nanoseconds.
+    uint64_t now;
+
+    // When every process exits.
+    uint64_t endTime;
+
+    // Events that have yet to happen, earliest first.
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>>
+        events;
+    uint64_t nextEventSequence;
+
+    // Every simulated process, by ID.
+    std::map<pid_t, SimulatedProcess*> processes;
+
+    // The thread that was last granted each core.
+    std::map<int, SimulatedThread*> coreToThread;
+
+    // Every file descriptor the kernel has handed out.
+    std::unordered_map<int, File> files;
+    int nextFd;
+
+    // The file descriptors in the server's epoll set.
+    std::unordered_set<int> epollSet;
+
+    // File descriptors that may be ready, in the order they became so.
+    std::deque<int> readyFds;
+    std::unordered_set<int> queuedFds;
+
+    // Connections that the server has yet to accept.
+    std::deque<int> listenBacklog;
+
+    // The server's listen socket.
+    int listenFd;
+
+    // The server's termination fd, once endArbitration() has written it.
+    int terminationFd;
+
+    // True once the simulation has asked the server to stop.
+    bool terminating;
+
+    // Every shared memory region the server has mapped, and the process
+    // (if any) that each belongs to.
+    std::map<void*, SimulatedProcess*> mappings;
+
+    // Processes whose report totals must be updated before the next event,
+    // because the server may have changed their cores.
+    std::vector<SimulatedProcess*> dirtyProcesses;
+
+    // Makes every random choice of the simulated clients.
+    std::mt19937_64 random;
+
+    // The real time (in cycles) at which epoll_wait() last returned, or 0.
+    uint64_t lastWakeup;
+
+    // Totals for the report that are not kept per process.
+    uint64_t numEventBatches;
+    uint64_t arbiterNs;
+    uint64_t numCpusetWrites;
+    uint64_t cpusetWriteNs;
+};
+
+/**
+ * Sets up the simulated processes in a trace, none of which start before the
+ * server does.
+ *
+ * \param parameters
+ *     Describes the simulated machine and clients
+ * \param trace
+ *     When each process asks for how many cores
+ * \param durationNs
+ *     How long after the start of the simulation every process exits
+ */
+SimulatedKernel::SimulatedKernel(const SimulationParameters& parameters,
+                                 const std::vector<DemandChange>& trace,
+                                 uint64_t durationNs)
+    : parameters(parameters),
+      now(SIMULATION_START_NS),
+      endTime(SIMULATION_START_NS + durationNs),
+      events(),
+      nextEventSequence(0),
+      processes(),
+      coreToThread(),
+      files(),
+      nextFd(FIRST_SIMULATED_FD),
+      epollSet(),
+      readyFds(),
+      queuedFds(),
+      listenBacklog(),
+      listenFd(-1),
+      terminationFd(-1),
+      terminating(false),
+      mappings(),
+      dirtyProcesses(),
+      random(parameters.seed),
+      lastWakeup(0),
+      numEventBatches(0),
+      arbiterNs(0),
+      numCpusetWrites(0),
+      cpusetWriteNs(0) {
+    std::vector<DemandChange> sortedTrace = trace;
+    std::stable_sort(sortedTrace.begin(), sortedTrace.end(),
+                     [](const DemandChange& a, const DemandChange& b) {
+                         return a.timeUs < b.timeUs;
+                     });
+
+    for (const DemandChange& change : sortedTrace) {
+        uint64_t time = SIMULATION_START_NS + change.timeUs * 1000;
+        SimulatedProcess* process;
+        auto processIter = processes.find(change.processId);
+        if (processIter == processes.end()) {
+            process = new SimulatedProcess();
+            process->report = ProcessReport();
+            process->report.processId = change.processId;
+            process->report.priority = change.priority;
+            process->stats = NULL;
+            process->cooperative =
+                static_cast<double>(random() % 1000000) / 1000000 >=
+                parameters.uncooperativeFraction;
+            process->exited = false;
+            process->demand = 0;
+            process->numRunning = 0;
+            process->numGranted = 0;
+            process->numUseful = 0;
+            process->numWaiting = 0;
+            process->lastUpdate = time;
+            process->waitStart = 0;
+            process->dirty = false;
+            processes[change.processId] = process;
+            schedule(time, PROCESS_START, process);
+            schedule(endTime, PROCESS_EXIT, process);
+        } else {
+            process = processIter->second;
+        }
+        process->report.numThreads =
+            std::max(std::max(process->report.numThreads, change.numCores),
+                     1U);
+
+        Event event = Event();
+        event.time = time;
+        event.sequence = nextEventSequence++;
+        event.type = DEMAND_CHANGE;
+        event.process = process;
+        event.priority = change.priority;
+        event.numCores = change.numCores;
+        events.push(event);
+    }
+
+    pid_t nextThreadId = FIRST_SIMULATED_THREAD_ID;
+    for (auto& processIdAndProcess : processes) {
+        SimulatedProcess* process = processIdAndProcess.second;
+        for (uint32_t i = 0; i < process->report.numThreads; i++) {
+            SimulatedThread* thread = new SimulatedThread();
+            thread->id = nextThreadId++;
+            thread->process = process;
+            thread->socket = -1;
+            thread->state = SimulatedThread::BLOCKED;
+            thread->coreId = -1;
+            thread->releasePending = false;
+            process->threads.push_back(thread);
+        }
+    }
+}
+
+SimulatedKernel::~SimulatedKernel() {
+    for (auto& processIdAndProcess : processes) {
+        for (SimulatedThread* thread : processIdAndProcess.second->threads) {
+            delete thread;
+        }
+        delete processIdAndProcess.second;
+    }
+    for (auto& mapping : mappings) {
+        free(mapping.first);
+    }
+}
+
+/**
+ * Returns the report of a simulation that has finished.
+ */
+SimulationReport
+SimulatedKernel::getReport() {
+    SimulationReport report = SimulationReport();
+    report.numCores = parameters.numCores;
+    report.simulatedNs = now - SIMULATION_START_NS;
+    report.numEventBatches = numEventBatches;
+    report.arbiterNs = arbiterNs;
+    report.numCpusetWrites = numCpusetWrites;
+    report.cpusetWriteNs = cpusetWriteNs;
+    for (auto& processIdAndProcess : processes) {
+        report.processes.push_back(processIdAndProcess.second->report);
+    }
+    return report;
+}
+
+int
+SimulatedKernel::accept(int sockfd, sockaddr* addr, socklen_t* addrlen) {
+    if (listenBacklog.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    int fd = listenBacklog.front();
+    listenBacklog.pop_front();
+    return fd;
+}
+
+int
+SimulatedKernel::bind(int sockfd, const sockaddr* addr, socklen_t addrlen) {
+    // Like a real bind, leave a file behind for the server to remove.
+    int fd = ::open(reinterpret_cast<const sockaddr_un*>(addr)->sun_path,
+                    O_CREAT | O_WRONLY, S_IRWXU);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    return 0;
+}
+
+int
+SimulatedKernel::close(int fd) {
+    auto fileIter = files.find(fd);
+    if (fileIter == files.end()) {
+        return MockSyscall::close(fd);
+    }
+    if (fileIter->second.type == CONNECTION) {
+        fileIter->second.thread->socket = -1;
+    }
+    files.erase(fileIter);
+    epollSet.erase(fd);
+    return 0;
+}
+
+int
+SimulatedKernel::epoll_create(int size) {
+    return newFile(EPOLL);
+}
+
+int
+SimulatedKernel::epoll_ctl(int epfd, int op, int fd, epoll_event* event) {
+    if (op == EPOLL_CTL_DEL) {
+        epollSet.erase(fd);
+        return 0;
+    }
+    epollSet.insert(fd);
+    markReady(fd);
+    return 0;
+}
+
+/**
+ * Returns the file descriptors that are ready, first advancing virtual time
+ * through as many events as it takes for one to become ready or for the
+ * timeout to pass. Once there are no events left, the server is asked to stop.
+ */
+int
+SimulatedKernel::epoll_wait(int epfd, epoll_event* readyEvents, int maxEvents,
+                            int timeout) {
+    if (lastWakeup != 0) {
+        numEventBatches++;
+        arbiterNs += Cycles::toNanoseconds(Cycles::rdtsc() - lastWakeup);
+    }
+
+    // The server has had its chance to change the cores of these processes
+    for (SimulatedProcess* process : dirtyProcesses) {
+        process->dirty = false;
+        updateProcess(process);
+    }
+    dirtyProcesses.clear();
+
+    uint64_t deadline = now + static_cast<uint64_t>(timeout) * 1000000;
+    while (true) {
+        int numReady = 0;
+        for (auto fdIter = readyFds.begin(); fdIter != readyFds.end();) {
+            int fd = *fdIter;
+            if (epollSet.find(fd) == epollSet.end() || !isReady(fd)) {
+                queuedFds.erase(fd);
+                fdIter = readyFds.erase(fdIter);
+                continue;
+            }
+            if (numReady < maxEvents) {
+                readyEvents[numReady].events = EPOLLIN;
+                readyEvents[numReady].data.fd = fd;
+                numReady++;
+            }
+            fdIter++;
+        }
+        if (numReady > 0) {
+            lastWakeup = Cycles::rdtsc();
+            return numReady;
+        }
+
+        if (events.empty()) {
+            if (!terminating) {
+                terminating = true;
+                CoreArbiterServer::mostRecentInstance->endArbitration();
+                continue;
+            }
+            // Nothing will ever happen again
+            lastWakeup = Cycles::rdtsc();
+            return 0;
+        }
+
+        if (events.top().time > deadline) {
+            now = std::max(now, deadline);
+            lastWakeup = Cycles::rdtsc();
+            return 0;
+        }
+
+        now = std::max(now, events.top().time);
+        while (!events.empty() && events.top().time <= now) {
+            Event event = events.top();
+            events.pop();
+            handleEvent(event);
+        }
+    }
+}
+
+void*
+SimulatedKernel::mmap(void* addr, size_t length, int prot, int flags, int fd,
+                      off_t offset) {
+    void* memory = calloc(1, length);
+    SimulatedProcess* process = NULL;
+
+    // Per-process shared memory is named after the process
+    const std::string& path = files[fd].path;
+    std::string prefix = SIMULATED_SHARED_MEM_PATH;
+    if (path.compare(0, prefix.size(), prefix) == 0) {
+        pid_t processId = atoi(path.c_str() + prefix.size());
+        auto processIter = processes.find(processId);
+        if (processIter != processes.end()) {
+            process = processIter->second;
+            process->stats = static_cast<ProcessStats*>(memory);
+        }
+    }
+    mappings[memory] = process;
+    return memory;
+}
+
+int
+SimulatedKernel::munmap(void* addr, size_t length) {
+    auto mappingIter = mappings.find(addr);
+    if (mappingIter == mappings.end()) {
+        errno = EINVAL;
+        return -1;
+    }
+    SimulatedProcess* process = mappingIter->second;
+    if (process) {
+        updateProcess(process);
+        process->report.numPreemptions = process->stats->preemptedCount;
+        process->stats = NULL;
+    }
+    free(addr);
+    mappings.erase(mappingIter);
+    return 0;
+}
+
+int
+SimulatedKernel::open(const char* path, int oflag) {
+    return open(path, oflag, 0);
+}
+
+int
+SimulatedKernel::open(const char* path, int oflag, mode_t mode) {
+    int fd = newFile(SHARED_MEMORY);
+    files[fd].path = path;
+    return fd;
+}
+
+int
+SimulatedKernel::pidfd_open(pid_t pid, unsigned int flags) {
+    if (flags & PIDFD_THREAD) {
+        // Simulated threads only exit along with their processes
+        return newFile(THREAD_PIDFD);
+    }
+    auto processIter = processes.find(pid);
+    if (processIter == processes.end()) {
+        errno = ESRCH;
+        return -1;
+    }
+    int fd = newFile(PROCESS_PIDFD);
+    files[fd].process = processIter->second;
+    return fd;
+}
+
+ssize_t
+SimulatedKernel::read(int fd, void* buf, size_t count) {
+    auto fileIter = files.find(fd);
+    if (fileIter == files.end()) {
+        return MockSyscall::read(fd, buf, count);
+    }
+    File& file = fileIter->second;
+    if (file.type != TIMER || !file.expired || count < sizeof(uint64_t)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // The server may now preempt the thread that was slow to release
+    file.expired = false;
+    if (file.thread) {
+        touch(file.thread->process);
+    }
+    uint64_t numExpirations = 1;
+    memcpy(buf, &numExpirations, sizeof(uint64_t));
+    return sizeof(uint64_t);
+}
+
+ssize_t
+SimulatedKernel::recv(int sockfd, void* buf, size_t len, int flags) {
+    auto fileIter = files.find(sockfd);
+    if (fileIter == files.end() || fileIter->second.inbound.empty()) {
+        errno = EAGAIN;
+        return -1;
+    }
+    File& file = fileIter->second;
+    size_t numBytes = std::min(len, file.inbound.size());
+    std::copy(file.inbound.begin(), file.inbound.begin() + numBytes,
+              static_cast<uint8_t*>(buf));
+    file.inbound.erase(file.inbound.begin(), file.inbound.begin() + numBytes);
+    touch(file.thread->process);
+    return static_cast<ssize_t>(numBytes);
+}
+
+/**
+ * Delivers a message from the server to a thread. The only one that matters
+ * is a core ID sent to a blocked thread, which grants it that core.
+ */
+ssize_t
+SimulatedKernel::send(int sockfd, const void* buf, size_t len, int flags) {
+    auto fileIter = files.find(sockfd);
+    if (fileIter == files.end()) {
+        errno = EPIPE;
+        return -1;
+    }
+    SimulatedThread* thread = fileIter->second.thread;
+    SimulatedProcess* process = thread->process;
+    if (len != sizeof(int) || thread->state != SimulatedThread::BLOCKED ||
+        process->exited) {
+        return static_cast<ssize_t>(len);
+    }
+
+    memcpy(&thread->coreId, buf, sizeof(int));
+    thread->state = SimulatedThread::MIGRATING;
+    coreToThread[thread->coreId] = thread;
+    touch(process);
+
+    // The server had to write the thread into the core's cpuset first
+    now += parameters.cpusetWriteNs;
+    numCpusetWrites++;
+    cpusetWriteNs += parameters.cpusetWriteNs;
+    schedule(now + parameters.migrationNs, THREAD_RUNNING, process, thread);
+    return static_cast<ssize_t>(len);
+}
+
+int
+SimulatedKernel::socket(int domain, int type, int protocol) {
+    listenFd = newFile(LISTEN_SOCKET);
+    return listenFd;
+}
+
+/**
+ * The server creates a timer right after it asks a process to release a core,
+ * so this is when the simulated clients find out about such requests.
+ */
+int
+SimulatedKernel::timerfd_create(int clockid, int flags) {
+    SimulatedThread* releasingThread = NULL;
+    noticeReleaseRequests(&releasingThread);
+    int fd = newFile(TIMER);
+    files[fd].thread = releasingThread;
+    return fd;
+}
+
+int
+SimulatedKernel::timerfd_settime(int fd, int flags,
+                                 const struct itimerspec* newVal,
+                                 struct itimerspec* oldVal) {
+    File& file = files[fd];
+    file.expired = false;
+    file.timerGeneration++;
+    uint64_t timeout =
+        static_cast<uint64_t>(newVal->it_value.tv_sec) * 1000000000 +
+        static_cast<uint64_t>(newVal->it_value.tv_nsec);
+
+    Event event = Event();
+    event.time = now + timeout;
+    event.sequence = nextEventSequence++;
+    event.type = TIMER_EXPIRED;
+    event.fd = fd;
+    event.numCores = static_cast<uint32_t>(file.timerGeneration);
+    events.push(event);
+    return 0;
+}
+
+/**
+ * The only file the server writes to through Syscall is its termination fd,
+ * when endArbitration() is called.
+ */
+ssize_t
+SimulatedKernel::write(int fd, const void* buf, size_t count) {
+    if (files.find(fd) != files.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    terminationFd = fd;
+    markReady(fd);
+    return static_cast<ssize_t>(count);
+}
+
+/**
+ * Schedules an event for a process or one of its threads.
+ */
+void
+SimulatedKernel::schedule(uint64_t time, EventType type,
+                          SimulatedProcess* process, SimulatedThread* thread) {
+    Event event = Event();
+    event.time = time;
+    event.sequence = nextEventSequence++;
+    event.type = type;
+    event.process = process;
+    event.thread = thread;
+    events.push(event);
+}
+
+/**
+ * Lets the simulated clients react to an event that is due.
+ */
+void
+SimulatedKernel::handleEvent(const Event& event) {
+    switch (event.type) {
+        case PROCESS_START:
+            startProcess(event.process);
+            break;
+        case DEMAND_CHANGE:
+            changeDemand(event.process, event.priority, event.numCores);
+            break;
+        case THREAD_RUNNING:
+            if (!event.process->exited &&
+                event.thread->state == SimulatedThread::MIGRATING) {
+                event.thread->state = SimulatedThread::RUNNING;
+                event.process->numRunning++;
+                touch(event.process);
+            }
+            break;
+        case RELEASE_CORE:
+            releaseCore(event.thread);
+            break;
+        case TIMER_EXPIRED: {
+            auto fileIter = files.find(event.fd);
+            if (fileIter != files.end() &&
+                fileIter->second.timerGeneration == event.numCores) {
+                fileIter->second.expired = true;
+                markReady(event.fd);
+            }
+            break;
+        }
+        case PROCESS_EXIT:
+            exitProcess(event.process);
+            break;
+    }
+}
+
+/**
+ * Connects all of a process's threads to the server. Like Arachne's kernel
+ * threads, each one blocks as soon as it has registered.
+ */
+void
+SimulatedKernel::startProcess(SimulatedProcess* process) {
+    process->lastUpdate = now;
+    for (SimulatedThread* thread : process->threads) {
+        thread->socket = newFile(CONNECTION);
+        files[thread->socket].thread = thread;
+        pid_t processId = process->report.processId;
+        sendToServer(thread, &processId, sizeof(pid_t));
+        sendToServer(thread, &thread->id, sizeof(pid_t));
+        uint8_t blockMsg = THREAD_BLOCK;
+        sendToServer(thread, &blockMsg, sizeof(uint8_t));
+        listenBacklog.push_back(thread->socket);
+    }
+    markReady(listenFd);
+}
+
+/**
+ * Sends a process's new core request to the server.
+ */
+void
+SimulatedKernel::changeDemand(SimulatedProcess* process, uint32_t priority,
+                              uint32_t numCores) {
+    if (process->exited) {
+        return;
+    }
+    process->demand = numCores;
+    process->report.priority = priority;
+    touch(process);
+
+    uint8_t requestMsg = CORE_REQUEST;
+    uint32_t numCoresArr[NUM_PRIORITIES] = {0};
+    numCoresArr[priority] = numCores;
+    SimulatedThread* thread = process->threads.front();
+    sendToServer(thread, &requestMsg, sizeof(uint8_t));
+    sendToServer(thread, numCoresArr, sizeof(numCoresArr));
+}
+
+/**
+ * Blocks a thread that was asked to release its core, unless the server has
+ * changed its mind in the meantime.
+ */
+void
+SimulatedKernel::releaseCore(SimulatedThread* thread) {
+    SimulatedProcess* process = thread->process;
+    if (process->exited || !thread->releasePending) {
+        return;
+    }
+    if (thread->state == SimulatedThread::MIGRATING) {
+        // It can't check until it is running
+        schedule(now + parameters.releasePollNs, RELEASE_CORE, process,
+                 thread);
+        return;
+    }
+
+    thread->releasePending = false;
+    if (!process->stats->threadCommunicationBlocks[thread->coreId]
+             .coreReleaseRequested) {
+        return;
+    }
+
+    thread->state = SimulatedThread::BLOCKED;
+    process->numRunning--;
+    if (coreToThread[thread->coreId] == thread) {
+        coreToThread.erase(thread->coreId);
+    }
+    touch(process);
+
+    uint8_t blockMsg = THREAD_BLOCK;
+    sendToServer(thread, &blockMsg, sizeof(uint8_t));
+}
+
+/**
+ * Makes a process exit, which the server notices through its pidfd.
+ */
+void
+SimulatedKernel::exitProcess(SimulatedProcess* process) {
+    updateProcess(process);
+    if (process->waitStart != 0) {
+        process->report.numWaits++;
+        process->report.totalWaitNs += now - process->waitStart;
+        process->report.maxWaitNs =
+            std::max(process->report.maxWaitNs, now - process->waitStart);
+        process->waitStart = 0;
+    }
+    process->exited = true;
+    process->numGranted = 0;
+    process->numUseful = 0;
+    process->numWaiting = 0;
+    for (SimulatedThread* thread : process->threads) {
+        if (thread->coreId >= 0 && coreToThread[thread->coreId] == thread) {
+            coreToThread.erase(thread->coreId);
+        }
+    }
+
+    for (auto& file : files) {
+        if (file.second.type == PROCESS_PIDFD &&
+            file.second.process == process) {
+            markReady(file.first);
+        }
+    }
+}
+
+/**
+ * Finds the threads on cores whose release the server has just requested, and
+ * schedules them to block once they notice.
+ *
+ * \param[out] releasingThread
+ *     Set to one of those threads, if there are any
+ */
+void
+SimulatedKernel::noticeReleaseRequests(SimulatedThread** releasingThread) {
+    for (auto& coreAndThread : coreToThread) {
+        SimulatedThread* thread = coreAndThread.second;
+        SimulatedProcess* process = thread->process;
+        if (thread->releasePending ||
+            thread->state == SimulatedThread::BLOCKED ||
+            !process->stats->threadCommunicationBlocks[thread->coreId]
+                 .coreReleaseRequested) {
+            continue;
+        }
+
+        thread->releasePending = true;
+        process->report.numReleaseRequests++;
+        *releasingThread = thread;
+        uint64_t delay = process->cooperative
+                             ? random() % (parameters.releasePollNs + 1)
+                             : parameters.uncooperativeReleaseNs;
+        schedule(now + delay, RELEASE_CORE, process, thread);
+    }
+}
+
+/**
+ * Queues bytes that a thread has sent to the server on its connection.
+ */
+void
+SimulatedKernel::sendToServer(SimulatedThread* thread, const void* buf,
+                              size_t len) {
+    if (thread->socket < 0) {
+        return;
+    }
+    const uint8_t* bytes = static_cast<const uint8_t*>(buf);
+    std::deque<uint8_t>& inbound = files[thread->socket].inbound;
+    inbound.insert(inbound.end(), bytes, bytes + len);
+    markReady(thread->socket);
+}
+
+/**
+ * Hands out a new file descriptor of the given type.
+ */
+int
+SimulatedKernel::newFile(FileType type) {
+    int fd = nextFd++;
+    File& file = files[fd];
+    file.type = type;
+    file.thread = NULL;
+    file.process = NULL;
+    file.expired = false;
+    file.timerGeneration = 0;
+    return fd;
+}
+
+/**
+ * Notes that a file descriptor may have become ready. Whether it really is
+ * ready is checked when epoll_wait() next runs.
+ */
+void
+SimulatedKernel::markReady(int fd) {
+    if (queuedFds.insert(fd).second) {
+        readyFds.push_back(fd);
+    }
+}
+
+/**
+ * Returns true if the server would find something to read on the given file
+ * descriptor.
+ */
+bool
+SimulatedKernel::isReady(int fd) {
+    auto fileIter = files.find(fd);
+    if (fileIter == files.end()) {
+        return fd == terminationFd;
+    }
+    File& file = fileIter->second;
+    switch (file.type) {
+        case LISTEN_SOCKET:
+            return !listenBacklog.empty();
+        case CONNECTION:
+            return !file.inbound.empty();
+        case TIMER:
+            return file.expired;
+        case PROCESS_PIDFD:
+            return file.process->exited;
+        default:
+            return false;
+    }
+}
+
+/**
+ * Adds the time since a process was last updated to its report, then records
+ * how many cores it now has, uses and waits for.
+ */
+void
+SimulatedKernel::updateProcess(SimulatedProcess* process) {
+    ProcessReport& report = process->report;
+    uint64_t elapsed = now - process->lastUpdate;
+    report.grantedCoreNs += process->numGranted * elapsed;
+    report.usefulCoreNs += process->numUseful * elapsed;
+    report.wastedCoreNs +=
+        (process->numGranted - process->numUseful) * elapsed;
+    report.waitCoreNs += process->numWaiting * elapsed;
+    process->lastUpdate = now;
+    if (process->exited || !process->stats) {
+        return;
+    }
+
+    uint32_t numGranted = process->stats->numOwnedCores;
+    uint32_t numWanted = std::min(
+        process->demand, static_cast<uint32_t>(process->threads.size()));
+    process->numGranted = numGranted;
+    process->numUseful =
+        std::min(std::min(process->numRunning, numGranted), process->demand);
+    process->numWaiting = numWanted > numGranted ? numWanted - numGranted : 0;
+
+    if (process->numWaiting > 0 && process->waitStart == 0) {
+        process->waitStart = now;
+    } else if (process->numWaiting == 0 && process->waitStart != 0) {
+        uint64_t wait = now - process->waitStart;
+        report.numWaits++;
+        report.totalWaitNs += wait;
+        report.maxWaitNs = std::max(report.maxWaitNs, wait);
+        process->waitStart = 0;
+    }
+}
+
+/**
+ * Updates a process now, and again before the next event, since the server
+ * may be about to change its cores.
+ */
+void
+SimulatedKernel::touch(SimulatedProcess* process) {
+    updateProcess(process);
+    if (!process->dirty) {
+        process->dirty = true;
+        dirtyProcesses.push_back(process);
+    }
+}
+
+/**
+ * Constructs a simulator for the given machine and clients.
+ */
+CoreArbiterSimulator::CoreArbiterSimulator(
+    const SimulationParameters& parameters)
+    : parameters(parameters),
+      blockedThreadPolicy(CoreArbiterServer::MOST_RECENTLY_BLOCKED),
+      allocationPolicy("priority") {}
+
+/**
+ * Sets the policy the simulated server wakes blocked threads by (see
+ * CoreArbiterServer::setBlockedThreadPolicy()).
+ */
+void
+CoreArbiterSimulator::setBlockedThreadPolicy(
+    CoreArbiterServer::BlockedThreadPolicy policy) {
+    blockedThreadPolicy = policy;
+}
+
+/**
+ * Chooses the policy the simulated server allocates cores by, from the names
+ * accepted by AllocationPolicy::create(). The default is "priority".
+ */
+void
+CoreArbiterSimulator::setAllocationPolicy(const std::string& name) {
+    allocationPolicy = name;
+}
+
+/**
+ * Runs a CoreArbiterServer against the given trace until every process has
+ * exited, and reports what happened.
+ *
+ * \param trace
+ *     When each process asks for how many cores
+ * \param durationUs
+ *     How long (in microseconds) after the start of the simulation every
+ *     process exits
+ */
+SimulationReport
+CoreArbiterSimulator::run(const std::vector<DemandChange>& trace,
+                          uint64_t durationUs) {
+    AllocationPolicy* policy = AllocationPolicy::create(allocationPolicy);
+    if (policy == NULL) {
+        LOG(ERROR, "Unknown allocation policy %s", allocationPolicy.c_str());
+        exit(-1);
+    }
+
+    SimulatedKernel kernel(parameters, trace, durationUs * 1000);
+    SyscallGuard syscallGuard(&CoreArbiterServer::sys, &kernel);
+    bool skipCpusetAllocation = CoreArbiterServer::testingSkipCpusetAllocation;
+    bool doNotChangeManagedCores =
+        CoreArbiterServer::testingDoNotChangeManagedCores;
+    CoreArbiterServer::testingSkipCpusetAllocation = true;
+    CoreArbiterServer::testingDoNotChangeManagedCores = true;
+
+    std::vector<int> coreIds;
+    for (int id = 1; id <= static_cast<int>(parameters.numCores); id++) {
+        coreIds.push_back(id);
+    }
+
+    {
+        CoreArbiterServer server(SIMULATED_SOCKET_PATH,
+                                 SIMULATED_SHARED_MEM_PATH, coreIds, false);
+
+        // Give the cores the simulated topology rather than the host's
+        for (CoreArbiterServer::CoreInfo* core : server.unmanagedCores) {
+            core->numaNode = (core->id - 1) /
+                             static_cast<int>(parameters.coresPerNumaNode);
+            int twin = core->id % 2 == 1 ? core->id + 1 : core->id - 1;
+            core->hyperTwin = parameters.hyperthreading &&
+                                      twin <= static_cast<int>(
+                                                  parameters.numCores)
+                                  ? twin
+                                  : -1;
+        }
+
+        server.setBlockedThreadPolicy(blockedThreadPolicy);
+        server.setAllocationPolicy(policy);
+        server.startArbitration();
+    }
+
+    CoreArbiterServer::testingSkipCpusetAllocation = skipCpusetAllocation;
+    CoreArbiterServer::testingDoNotChangeManagedCores =
+        doNotChangeManagedCores;
+    return kernel.getReport();
+}
+
+/**
+ * Generates a random demand trace, in which each process starts within the
+ * first tenth of the simulation and then changes its request at exponentially
+ * distributed intervals.
+ *
+ * \param numProcesses
+ *     The number of processes, which get IDs from 1 up
+ * \param maxCoresPerProcess
+ *     Each request is for between 0 and this many cores
+ * \param numPriorities
+ *     Each process requests cores at one of the first numPriorities
+ *     priorities
+ * \param durationUs
+ *     How long (in microseconds) the trace covers
+ * \param meanChangeIntervalUs
+ *     The mean time (in microseconds) between a process's requests
+ * \param seed
+ *     Seeds the random choices
+ */
+std::vector<DemandChange>
+CoreArbiterSimulator::generateTrace(uint32_t numProcesses,
+                                    uint32_t maxCoresPerProcess,
+                                    uint32_t numPriorities,
+                                    uint64_t durationUs,
+                                    uint64_t meanChangeIntervalUs,
+                                    uint64_t seed) {
+    std::mt19937_64 random(seed);
+    numPriorities = std::max(
+        std::min(numPriorities, static_cast<uint32_t>(NUM_PRIORITIES)), 1U);
+    std::vector<DemandChange> trace;
+    for (uint32_t i = 0; i < numProcesses; i++) {
+        DemandChange change;
+        change.processId = static_cast<pid_t>(i + 1);
+        change.priority = static_cast<uint32_t>(random() % numPriorities);
+        change.timeUs = random() % (durationUs / 10 + 1);
+        while (change.timeUs < durationUs) {
+            change.numCores =
+                static_cast<uint32_t>(random() % (maxCoresPerProcess + 1));
+            trace.push_back(change);
+
+            double uniform = static_cast<double>(random() >> 11) /
+                             static_cast<double>(1UL << 53);
+            change.timeUs += 1 + static_cast<uint64_t>(
+                                     -log(1 - uniform) *
+                                     static_cast<double>(meanChangeIntervalUs));
+        }
+    }
+    return trace;
+}
+
+/**
+ * Reads a demand trace from a file with one DemandChange per line, as
+ * whitespace-separated "timeUs processId priority numCores". Blank lines and
+ * lines starting with '#' are ignored.
+ */
+std::vector<DemandChange>
+CoreArbiterSimulator::readTrace(std::string path) {
+    std::ifstream traceFile(path);
+    if (!traceFile.is_open()) {
+        LOG(ERROR, "Unable to open trace %s", path.c_str());
+        exit(-1);
+    }
+
+    std::vector<DemandChange> trace;
+    std::string line;
+    for (int lineNumber = 1; std::getline(traceFile, line); lineNumber++) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream fields(line);
+        DemandChange change;
+        if (!(fields >> change.timeUs >> change.processId >>
+              change.priority >> change.numCores) ||
+            change.processId <= 0 || change.priority >= NUM_PRIORITIES) {
+            LOG(ERROR, "Invalid demand change on line %d of %s", lineNumber,
+                path.c_str());
+            exit(-1);
+        }
+        trace.push_back(change);
+    }
+    return trace;
+}
+
+/**
+ * Prints a simulation's report, totalled by priority and optionally for each
+ * process.
+ *
+ * \param report
+ *     The report to print
+ * \param out
+ *     Where to print it
+ * \param perProcess
+ *     If true, also print a line for each process
+ */
+void
+CoreArbiterSimulator::printReport(const SimulationReport& report, FILE* out,
+                                  bool perProcess) {
+    uint64_t numThreads = 0;
+    for (const ProcessReport& process : report.processes) {
+        numThreads += process.numThreads;
+    }
+    fprintf(out, "Simulated %.1f ms on %u cores: %lu processes, %lu threads\n",
+            static_cast<double>(report.simulatedNs) / 1e6, report.numCores,
+            report.processes.size(), numThreads);
+    fprintf(out,
+            "Arbiter: %lu event batches in %.1f ms of CPU (%.2f us each), "
+            "%lu cpuset writes (%.1f ms)\n",
+            report.numEventBatches, static_cast<double>(report.arbiterNs) / 1e6,
+            report.numEventBatches == 0
+                ? 0
+                : static_cast<double>(report.arbiterNs) / 1e3 /
+                      static_cast<double>(report.numEventBatches),
+            report.numCpusetWrites,
+            static_cast<double>(report.cpusetWriteNs) / 1e6);
+
+    fprintf(out, "%-9s %9s %13s %9s %13s %12s %9s %9s %13s %13s\n", "",
+            "processes", "wait(core-ms)", "waits",
+            "mean wait(us)", "max wait(us)", "releases", "preempts",
+            "useful(c-ms)", "wasted(c-ms)");
+
+    auto printRow = [&](std::string label,
+                        const std::vector<ProcessReport>& processes) {
+        ProcessReport total = ProcessReport();
+        for (const ProcessReport& process : processes) {
+            total.waitCoreNs += process.waitCoreNs;
+            total.usefulCoreNs += process.usefulCoreNs;
+            total.wastedCoreNs += process.wastedCoreNs;
+            total.numWaits += process.numWaits;
+            total.totalWaitNs += process.totalWaitNs;
+            total.maxWaitNs = std::max(total.maxWaitNs, process.maxWaitNs);
+            total.numReleaseRequests += process.numReleaseRequests;
+            total.numPreemptions += process.numPreemptions;
+        }
+        fprintf(out,
+                "%-9s %9lu %13.1f %9lu %13.1f %12.1f %9lu %9lu %13.1f %13.1f\n",
+                label.c_str(), processes.size(),
+                static_cast<double>(total.waitCoreNs) / 1e6, total.numWaits,
+                total.numWaits == 0 ? 0
+                                    : static_cast<double>(total.totalWaitNs) /
+                                          1e3 /
+                                          static_cast<double>(total.numWaits),
+                static_cast<double>(total.maxWaitNs) / 1e3,
+                total.numReleaseRequests, total.numPreemptions,
+                static_cast<double>(total.usefulCoreNs) / 1e6,
+                static_cast<double>(total.wastedCoreNs) / 1e6);
+    };
+
+    for (uint32_t priority = 0; priority < NUM_PRIORITIES; priority++) {
+        std::vector<ProcessReport> processes;
+        for (const ProcessReport& process : report.processes) {
+            if (process.priority == priority) {
+                processes.push_back(process);
+            }
+        }
+        if (!processes.empty()) {
+            printRow("prio " + std::to_string(priority), processes);
+        }
+    }
+    printRow("total", report.processes);
+
+    if (perProcess) {
+        for (const ProcessReport& process : report.processes) {
+            printRow("pid " + std::to_string(process.processId), {process});
+        }
+    }
+}
+
+}  // namespace CoreArbiter
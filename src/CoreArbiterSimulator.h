@@ -0,0 +1,192 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_ARBITER_SIMULATOR_H_
+#define CORE_ARBITER_SIMULATOR_H_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "CoreArbiterServer.h"
+
+namespace CoreArbiter {
+
+/**
+ * One entry of a demand trace: at timeUs microseconds into the simulation,
+ * the process asks for numCores cores at the given priority. A process starts
+ * at its first entry and has as many threads as the most cores it ever asks
+ * for.
+ */
+struct DemandChange {
+    uint64_t timeUs;
+    pid_t processId;
+    uint32_t priority;
+    uint32_t numCores;
+};
+
+/**
+ * Describes the simulated machine and how its kernel and clients behave.
+ */
+struct SimulationParameters {
+    // The number of managed cores, which get IDs 1 to numCores.
+    uint32_t numCores;
+
+    // Consecutive cores are split into NUMA nodes of this size.
+    uint32_t coresPerNumaNode;
+
+    // If true, cores 1 and 2, 3 and 4, and so on are hypertwins.
+    bool hyperthreading;
+
+    // How long the server spends writing a thread into a cpuset when it
+    // grants a core.
+    uint64_t cpusetWriteNs;
+
+    // How long a thread takes to start running on a core once it has been
+    // written into the core's cpuset.
+    uint64_t migrationNs;
+
+    // How often clients check whether they have been asked to release a core.
+    uint64_t releasePollNs;
+
+    // The fraction of processes that ignore requests to release their cores,
+    // and how long their threads keep running before they finally block.
+    double uncooperativeFraction;
+    uint64_t uncooperativeReleaseNs;
+
+    // Seeds every random choice the simulated clients make.
+    uint64_t seed;
+
+    SimulationParameters()
+        : numCores(16),
+          coresPerNumaNode(16),
+          hyperthreading(false),
+          cpusetWriteNs(10000),
+          migrationNs(5000),
+          releasePollNs(50000),
+          uncooperativeFraction(0),
+          uncooperativeReleaseNs(2 * RELEASE_TIMEOUT_MS * 1000000),
+          seed(1) {}
+};
+
+/**
+ * What one simulated process (tenant) experienced. All core times are the
+ * sum over cores, in nanoseconds.
+ */
+struct ProcessReport {
+    pid_t processId;
+    uint32_t priority;
+    uint32_t numThreads;
+
+    // Core time the process asked for (and had threads for) but was not
+    // granted.
+    uint64_t waitCoreNs;
+
+    // Core time the process was granted.
+    uint64_t grantedCoreNs;
+
+    // Granted core time during which one of the process's threads was
+    // running on the core and the process still wanted it.
+    uint64_t usefulCoreNs;
+
+    // The rest of the granted core time: cores held while threads migrate
+    // onto them or after the process has been asked to give them back.
+    uint64_t wastedCoreNs;
+
+    // The number of times the process went from having all the cores it
+    // wanted to waiting for some, and how long those waits lasted.
+    uint64_t numWaits;
+    uint64_t totalWaitNs;
+    uint64_t maxWaitNs;
+
+    // The number of times the server asked the process to release a core,
+    // and the number of times it forcibly preempted one of its threads.
+    uint64_t numReleaseRequests;
+    uint64_t numPreemptions;
+};
+
+/**
+ * The results of a simulation.
+ */
+struct SimulationReport {
+    // One entry per process, in order of process ID.
+    std::vector<ProcessReport> processes;
+
+    uint32_t numCores;
+    uint64_t simulatedNs;
+
+    // The number of times the server's event loop woke up, and the real time
+    // it spent handling those wakeups.
+    uint64_t numEventBatches;
+    uint64_t arbiterNs;
+
+    // The number of cores granted, each of which costs a cpuset write, and
+    // the virtual time those writes took.
+    uint64_t numCpusetWrites;
+    uint64_t cpusetWriteNs;
+};
+
+/**
+ * Runs the real CoreArbiterServer against a simulated kernel, so that
+ * changes to core allocation policy can be evaluated deterministically, at
+ * scale, and without root or real threads. The simulated kernel is a
+ * MockSyscall that implements sockets, epoll, timers, pidfds and shared
+ * memory in memory, and replaces the server's clock with virtual time that
+ * only advances between events. It plays the clients too: each process in a
+ * demand trace registers its threads, blocks them, changes its core request
+ * as the trace says, and releases cores some time after the server asks for
+ * them. Granting a core costs the server a cpuset write, and the thread only
+ * starts running after it has migrated to the core.
+ *
+ * Given the same trace and parameters, a simulation always produces the same
+ * report, apart from the real time the server spent.
+ *
+ * The server describes every process and thread to its allocation policy on
+ * each distribution, and distributes cores after almost every event, so the
+ * real time a simulation takes grows with the number of processes times the
+ * number of events. Thousands of processes run well over a hundred times
+ * slower than real time.
+ */
+class CoreArbiterSimulator {
+  public:
+    explicit CoreArbiterSimulator(const SimulationParameters& parameters);
+
+    void setBlockedThreadPolicy(
+        CoreArbiterServer::BlockedThreadPolicy policy);
+    void setAllocationPolicy(const std::string& name);
+    SimulationReport run(const std::vector<DemandChange>& trace,
+                         uint64_t durationUs);
+
+    static std::vector<DemandChange> generateTrace(
+        uint32_t numProcesses, uint32_t maxCoresPerProcess,
+        uint32_t numPriorities, uint64_t durationUs,
+        uint64_t meanChangeIntervalUs, uint64_t seed);
+    static std::vector<DemandChange> readTrace(std::string path);
+    static void printReport(const SimulationReport& report, FILE* out,
+                            bool perProcess);
+
+  private:
+    // Describes the simulated machine and clients.
+    SimulationParameters parameters;
+
+    // Passed on to the server (see CoreArbiterServer::setBlockedThreadPolicy
+    // and AllocationPolicy::create).
+    CoreArbiterServer::BlockedThreadPolicy blockedThreadPolicy;
+    std::string allocationPolicy;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_ARBITER_SIMULATOR_H_
@@ -0,0 +1,208 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <string.h>
+#include "CoreArbiterSimulator.h"
+#include "Logger.h"
+
+using CoreArbiter::CoreArbiterServer;
+using CoreArbiter::CoreArbiterSimulator;
+using CoreArbiter::Logger;
+
+CoreArbiter::SimulationParameters parameters;
+std::string tracePath = "";
+uint32_t numProcesses = 1000;
+uint32_t maxCoresPerProcess = 4;
+uint32_t numPriorities = 2;
+uint64_t durationUs = 1000000;
+uint64_t meanChangeIntervalUs = 10000;
+CoreArbiterServer::BlockedThreadPolicy blockedThreadPolicy =
+    CoreArbiterServer::MOST_RECENTLY_BLOCKED;
+std::string allocationPolicy = "priority";
+bool perProcess = false;
+
+/**
+ * This function currently supports only long options.
+ */
+void
+parseOptions(int* argcp, const char** argv) {
+    if (argcp == NULL)
+        return;
+
+    int argc = *argcp;
+
+    struct OptionSpecifier {
+        // The string that the user uses after `--`.
+        const char* optionName;
+        // The id for the option that is returned when it is recognized.
+        int id;
+        // Does the option take an argument?
+        bool takesArgument;
+    } optionSpecifiers[] = {{"trace", 't', true},
+                            {"numProcesses", 'n', true},
+                            {"maxCoresPerProcess", 'c', true},
+                            {"numPriorities", 'r', true},
+                            {"durationUs", 'd', true},
+                            {"meanChangeIntervalUs", 'i', true},
+                            {"numCores", 'k', true},
+                            {"coresPerNumaNode", 'a', true},
+                            {"hyperthreading", 'h', false},
+                            {"cpusetWriteNs", 'w', true},
+                            {"migrationNs", 'g', true},
+                            {"releasePollNs", 'l', true},
+                            {"uncooperativeFraction", 'f', true},
+                            {"seed", 'e', true},
+                            {"blockedThreadPolicy", 'b', true},
+                            {"allocateByUtility", 'u', false},
+                            {"allocationPolicy", 'y', true},
+                            {"perProcess", 'p', false}};
+    const int UNRECOGNIZED = ~0;
+
+    int i = 1;
+    while (i < argc) {
+        if (argv[i][0] != '-' || argv[i][1] != '-') {
+            i++;
+            continue;
+        }
+        const char* optionName = argv[i] + 2;
+        int optionId = UNRECOGNIZED;
+        const char* optionArgument = NULL;
+
+        for (size_t k = 0;
+             k < sizeof(optionSpecifiers) / sizeof(OptionSpecifier); k++) {
+            const char* candidateName = optionSpecifiers[k].optionName;
+            bool needsArg = optionSpecifiers[k].takesArgument;
+            if (strncmp(candidateName, optionName, strlen(candidateName)) ==
+                0) {
+                if (needsArg) {
+                    if (i + 1 >= argc) {
+                        LOG(CoreArbiter::ERROR,
+                            "Missing argument to option %s!\n", candidateName);
+                        break;
+                    }
+                    optionArgument = argv[i + 1];
+                    optionId = optionSpecifiers[k].id;
+                    argc -= 2;
+                    memmove(argv + i, argv + i + 2, (argc - i) * sizeof(char*));
+                } else {
+                    optionId = optionSpecifiers[k].id;
+                    argc -= 1;
+                    memmove(argv + i, argv + i + 1, (argc - i) * sizeof(char*));
+                }
+                break;
+            }
+        }
+        switch (optionId) {
+            case 't':
+                tracePath = optionArgument;
+                break;
+            case 'n':
+                numProcesses = static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'c':
+                maxCoresPerProcess =
+                    static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'r':
+                numPriorities = static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'd':
+                durationUs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'i':
+                meanChangeIntervalUs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'k':
+                parameters.numCores =
+                    static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'a':
+                parameters.coresPerNumaNode =
+                    static_cast<uint32_t>(atoi(optionArgument));
+                break;
+            case 'h':
+                parameters.hyperthreading = true;
+                break;
+            case 'w':
+                parameters.cpusetWriteNs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'g':
+                parameters.migrationNs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'l':
+                parameters.releasePollNs = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'f':
+                parameters.uncooperativeFraction = atof(optionArgument);
+                break;
+            case 'e':
+                parameters.seed = strtoull(optionArgument, NULL, 10);
+                break;
+            case 'b':
+                if (strcmp(optionArgument, "LIFO") == 0) {
+                    blockedThreadPolicy =
+                        CoreArbiterServer::MOST_RECENTLY_BLOCKED;
+                } else if (strcmp(optionArgument, "FIFO") == 0) {
+                    blockedThreadPolicy = CoreArbiterServer::LONGEST_BLOCKED;
+                } else {
+                    LOG(CoreArbiter::ERROR,
+                        "blockedThreadPolicy must be LIFO or FIFO, not %s",
+                        optionArgument);
+                    abort();
+                }
+                break;
+            case 'u':
+                allocationPolicy = "utility";
+                break;
+            case 'y':
+                allocationPolicy = optionArgument;
+                break;
+            case 'p':
+                perProcess = true;
+                break;
+            case UNRECOGNIZED:
+                LOG(CoreArbiter::ERROR, "Unrecognized option %s given.",
+                    optionName);
+                abort();
+        }
+    }
+    *argcp = argc;
+}
+
+int
+main(int argc, const char** argv) {
+    Logger::setLogLevel(CoreArbiter::ERROR);
+    parseOptions(&argc, argv);
+    if (parameters.numCores == 0 || parameters.coresPerNumaNode == 0) {
+        LOG(CoreArbiter::ERROR, "numCores and coresPerNumaNode must be > 0");
+        abort();
+    }
+
+    std::vector<CoreArbiter::DemandChange> trace;
+    if (tracePath.empty()) {
+        trace = CoreArbiterSimulator::generateTrace(
+            numProcesses, maxCoresPerProcess, numPriorities, durationUs,
+            meanChangeIntervalUs, parameters.seed);
+    } else {
+        trace = CoreArbiterSimulator::readTrace(tracePath);
+    }
+
+    CoreArbiterSimulator simulator(parameters);
+    simulator.setBlockedThreadPolicy(blockedThreadPolicy);
+    simulator.setAllocationPolicy(allocationPolicy);
+    CoreArbiter::SimulationReport report = simulator.run(trace, durationUs);
+    CoreArbiterSimulator::printReport(report, stdout, perProcess);
+    return 0;
+}
@@ -0,0 +1,187 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "CoreDemandEstimator.h"
+#include "Logger.h"
+
+namespace CoreArbiter {
+
+/**
+ * Constructs a CoreDemandEstimator. No cores are requested until the first
+ * call to update(), which asks for minCores.
+ *
+ * \param client
+ *     The client through which cores are requested from the server
+ * \param minCores
+ *     The fewest cores that will be requested. Must be at least 1.
+ * \param maxCores
+ *     The most cores that will be requested
+ * \param priority
+ *     The priority that cores are requested at (see
+ *     CoreArbiterClient::setRequestedCores())
+ */
+CoreDemandEstimator::CoreDemandEstimator(CoreArbiterClient* client,
+                                         uint32_t minCores, uint32_t maxCores,
+                                         uint32_t priority)
+    : client(client),
+      minCores(minCores),
+      maxCores(maxCores),
+      priority(priority),
+      targetCores(0),
+      loadFactorThreshold(1.5),
+      maxUtilization(0.9),
+      idleCoreFractionHysteresis(0.2),
+      utilizedCoresAtScaleUp(maxCores + 1, 0),
+      totalRunnableTasks(0),
+      numLoadSamples(0),
+      busyCycles(0),
+      totalCycles(0),
+      mutex() {
+    if (minCores == 0 || minCores > maxCores || priority >= NUM_PRIORITIES) {
+        std::string err = "Invalid core demand estimator bounds";
+        LOG(ERROR, "%s", err.c_str());
+        throw CoreArbiterClient::ClientException(err);
+    }
+}
+
+/**
+ * Records a sample of how many tasks are runnable or queued. This may be
+ * called from any thread, as often as is convenient; the samples taken between
+ * calls to update() are averaged.
+ *
+ * \param numRunnableTasks
+ *     The number of tasks that are running or waiting to run
+ */
+void
+CoreDemandEstimator::recordLoad(uint64_t numRunnableTasks) {
+    totalRunnableTasks.fetch_add(numRunnableTasks, std::memory_order_relaxed);
+    numLoadSamples.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Records how busy the thread on one of the process's cores has been. This
+ * may be called from any thread; the cycles reported by all threads between
+ * calls to update() are added together.
+ *
+ * \param busyCycles
+ *     The number of cycles spent doing useful work
+ * \param totalCycles
+ *     The number of cycles the thread held its core for, including busyCycles
+ */
+void
+CoreDemandEstimator::recordCoreUsage(uint64_t busyCycles,
+                                     uint64_t totalCycles) {
+    this->busyCycles.fetch_add(busyCycles, std::memory_order_relaxed);
+    this->totalCycles.fetch_add(totalCycles, std::memory_order_relaxed);
+}
+
+/**
+ * Decides how many cores the application needs based on the load signals
+ * recorded since the last call, and requests them from the server if that
+ * differs from the current target. This should be called periodically (every
+ * few milliseconds) by one thread.
+ *
+ * \return
+ *     The number of cores now requested
+ */
+uint32_t
+CoreDemandEstimator::update() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (targetCores == 0) {
+        requestCores(minCores);
+        return targetCores;
+    }
+
+    uint64_t numSamples = numLoadSamples.exchange(0);
+    uint64_t numRunnable = totalRunnableTasks.exchange(0);
+    uint64_t busy = busyCycles.exchange(0);
+    uint64_t total = totalCycles.exchange(0);
+    if (numSamples == 0 && total == 0) {
+        // Nothing has been recorded, so there is no reason to change
+        return targetCores;
+    }
+
+    double averageRunnable =
+        numSamples == 0 ? 0
+                        : static_cast<double>(numRunnable) /
+                              static_cast<double>(numSamples);
+    double utilization =
+        total == 0 ? 0
+                   : static_cast<double>(busy) / static_cast<double>(total);
+    double loadFactor = averageRunnable / targetCores;
+    double utilizedCores = utilization * targetCores;
+
+    if (targetCores < maxCores &&
+        (loadFactor > loadFactorThreshold || utilization > maxUtilization)) {
+        utilizedCoresAtScaleUp[targetCores] = utilizedCores;
+        requestCores(targetCores + 1);
+    } else if (targetCores > minCores) {
+        // Only give a core back if the work would fit on one fewer core
+        // without immediately asking for it again.
+        uint32_t fewerCores = targetCores - 1;
+        double utilizationThreshold = utilizedCoresAtScaleUp[fewerCores];
+        if (utilizationThreshold == 0) {
+            utilizationThreshold = maxUtilization * fewerCores;
+        }
+        if (averageRunnable <= loadFactorThreshold * fewerCores &&
+            utilizedCores < utilizationThreshold - idleCoreFractionHysteresis) {
+            requestCores(fewerCores);
+        }
+    }
+    return targetCores;
+}
+
+/**
+ * Sets the number of runnable tasks per core above which another core is
+ * requested. The default is 1.5.
+ */
+void
+CoreDemandEstimator::setLoadFactorThreshold(double threshold) {
+    loadFactorThreshold = threshold;
+}
+
+/**
+ * Sets the fraction of cycles that the cores must be busy for another core to
+ * be requested. The default is 0.9.
+ */
+void
+CoreDemandEstimator::setMaxUtilization(double utilization) {
+    maxUtilization = utilization;
+}
+
+/**
+ * Sets how much of a core must be left to spare before a core is given back.
+ * Larger values make the estimator slower to give up cores. The default is
+ * 0.2.
+ */
+void
+CoreDemandEstimator::setIdleCoreFractionHysteresis(double hysteresis) {
+    idleCoreFractionHysteresis = hysteresis;
+}
+
+/**
+ * Asks the server for the given number of cores at this estimator's priority.
+ * The caller must hold mutex.
+ */
+void
+CoreDemandEstimator::requestCores(uint32_t numCores) {
+    LOG(DEBUG, "Core demand changed from %u to %u", targetCores, numCores);
+    std::vector<uint32_t> coreRequest(NUM_PRIORITIES, 0);
+    coreRequest[priority] = numCores;
+    client->setRequestedCores(coreRequest);
+    targetCores = numCores;
+}
+
+}  // namespace CoreArbiter
@@ -0,0 +1,107 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_DEMAND_ESTIMATOR_H_
+#define CORE_DEMAND_ESTIMATOR_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "CoreArbiterClient.h"
+
+namespace CoreArbiter {
+
+/**
+ * This class decides how many cores a thread pool should ask the
+ * CoreArbiterServer for, so that applications without a runtime of their own
+ * (such as Arachne) can scale their cores automatically. The application
+ * feeds it load signals from any of its threads: how many tasks are runnable
+ * or queued, and how busy the threads on its cores are. Periodically, one
+ * thread calls update(), which applies the same rules as Arachne's core load
+ * estimator:
+ *   - Add a core if there are more than loadFactorThreshold runnable tasks
+ *     per core, or if the cores are more than maxUtilization busy.
+ *   - Remove a core if the work would fit on one fewer core with
+ *     idleCoreFractionHysteresis of a core to spare, and would not have
+ *     caused the core to be added in the first place.
+ * The request sent to the server only changes when the target does.
+ */
+class CoreDemandEstimator {
+  public:
+    CoreDemandEstimator(CoreArbiterClient* client, uint32_t minCores,
+                        uint32_t maxCores,
+                        uint32_t priority = NUM_PRIORITIES - 1);
+
+    void recordLoad(uint64_t numRunnableTasks);
+    void recordCoreUsage(uint64_t busyCycles, uint64_t totalCycles);
+    uint32_t update();
+
+    /**
+     * Returns the number of cores most recently requested from the server.
+     */
+    uint32_t getTargetCores() { return targetCores; }
+
+    void setLoadFactorThreshold(double threshold);
+    void setMaxUtilization(double utilization);
+    void setIdleCoreFractionHysteresis(double hysteresis);
+
+  private:
+    void requestCores(uint32_t numCores);
+
+    // The client through which cores are requested from the server.
+    CoreArbiterClient* client;
+
+    // Bounds on the number of cores that will be requested.
+    uint32_t minCores;
+    uint32_t maxCores;
+
+    // The priority that cores are requested at.
+    uint32_t priority;
+
+    // The number of cores most recently requested, or 0 before the first
+    // call to update().
+    uint32_t targetCores;
+
+    // A core is added when the average number of runnable tasks per core
+    // exceeds this.
+    double loadFactorThreshold;
+
+    // A core is added when the fraction of cycles that the cores spend busy
+    // exceeds this.
+    double maxUtilization;
+
+    // A core is only removed if the cores in use would still have this much
+    // of a core to spare.
+    double idleCoreFractionHysteresis;
+
+    // Entry i is the number of cores that were busy when the target was last
+    // raised from i cores, which is also where the target is allowed back
+    // down to i. 0 if the target has never been raised from i.
+    std::vector<double> utilizedCoresAtScaleUp;
+
+    // Load signals accumulated since the last call to update().
+    std::atomic<uint64_t> totalRunnableTasks;
+    std::atomic<uint64_t> numLoadSamples;
+    std::atomic<uint64_t> busyCycles;
+    std::atomic<uint64_t> totalCycles;
+
+    // Serializes calls to update().
+    std::mutex mutex;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_DEMAND_ESTIMATOR_H_
@@ -0,0 +1,278 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "CoreExecutor.h"
+#include "Logger.h"
+#include "PerfUtils/Cycles.h"
+
+using PerfUtils::Cycles;
+
+namespace CoreArbiter {
+
+thread_local int CoreExecutor::workerIndex = -1;
+thread_local CoreExecutor* CoreExecutor::currentExecutor = NULL;
+
+/**
+ * Constructs a CoreExecutor and starts its worker threads, which block until
+ * the server grants the executor cores. minCores are requested right away.
+ *
+ * Throws a ClientException if the bounds are invalid.
+ *
+ * \param client
+ *     The client through which the workers obtain cores
+ * \param minCores
+ *     The fewest cores that will be requested. Must be at least 1.
+ * \param maxCores
+ *     The most cores that will be requested, which is also the number of
+ *     worker threads
+ * \param priority
+ *     The priority that cores are requested at (see
+ *     CoreArbiterClient::setRequestedCores())
+ */
+CoreExecutor::CoreExecutor(CoreArbiterClient* client, uint32_t minCores,
+                           uint32_t maxCores, uint32_t priority)
+    : client(client),
+      estimator(client, minCores, maxCores, priority),
+      priority(priority),
+      workers(),
+      sharedTasks(),
+      sharedTasksMutex(),
+      numUnfinishedTasks(0),
+      stopping(false),
+      estimatorThread() {
+    for (uint32_t i = 0; i < maxCores; i++) {
+        workers.emplace_back(new Worker());
+    }
+    for (size_t i = 0; i < workers.size(); i++) {
+        workers[i]->thread = std::thread(&CoreExecutor::workerMain, this, i);
+    }
+    estimatorThread = std::thread(&CoreExecutor::estimatorMain, this);
+}
+
+/**
+ * Shuts the executor down, if that has not been done already.
+ */
+CoreExecutor::~CoreExecutor() {
+    if (!stopping) {
+        shutdown();
+    }
+}
+
+/**
+ * Queues a task to be run on one of the executor's cores. This may be called
+ * from any thread, including from within a task.
+ *
+ * \param task
+ *     The task to run
+ */
+void
+CoreExecutor::submit(Task task) {
+    numUnfinishedTasks++;
+    if (currentExecutor == this) {
+        // Keep the task on this worker's core, where its data is likely to
+        // be in the cache
+        Worker* worker = workers[workerIndex].get();
+        Lock lock(worker->mutex);
+        worker->tasks.push_back(std::move(task));
+        return;
+    }
+
+    Lock lock(sharedTasksMutex);
+    sharedTasks.push_back(std::move(task));
+}
+
+/**
+ * Waits for every submitted task to finish, then stops the workers and gives
+ * the executor's cores back to the server. Workers that are still waiting for
+ * a core are woken with CoreArbiterClient::cancelBlock(), so this returns even
+ * if the server never grants them one. This must not be called from a task.
+ */
+void
+CoreExecutor::shutdown() {
+    while (numUnfinishedTasks > 0) {
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(EXECUTOR_ESTIMATE_INTERVAL_US));
+    }
+
+    // Cancel every worker before setting stopping, so that none of them can
+    // see stopping and unregister before its cancellation has been recorded
+    for (std::unique_ptr<Worker>& worker : workers) {
+        while (worker->threadId == 0) {
+            std::this_thread::yield();
+        }
+        client->cancelBlock(worker->threadId);
+    }
+    stopping = true;
+    estimatorThread.join();
+    for (std::unique_ptr<Worker>& worker : workers) {
+        worker->thread.join();
+    }
+
+    std::vector<uint32_t> coreRequest(NUM_PRIORITIES, 0);
+    client->setRequestedCores(coreRequest);
+}
+
+/**
+ * The main loop of a worker thread, which runs tasks whenever the server has
+ * granted it a core.
+ *
+ * \param workerIndex
+ *     The index of this worker in workers
+ */
+void
+CoreExecutor::workerMain(size_t workerIndex) {
+    CoreExecutor::workerIndex = static_cast<int>(workerIndex);
+    currentExecutor = this;
+    workers[workerIndex]->threadId = static_cast<pid_t>(syscall(SYS_gettid));
+    uint64_t reportInterval =
+        Cycles::fromMicroseconds(EXECUTOR_ESTIMATE_INTERVAL_US);
+
+    while (!stopping) {
+        if (client->blockUntilCoreAvailable() < 0) {
+            // shutdown() cancelled the wait
+            break;
+        }
+
+        uint64_t busyCycles = 0;
+        uint64_t lastReport = Cycles::rdtsc();
+        while (!client->mustReleaseCore()) {
+            uint64_t start = Cycles::rdtsc();
+            if (runOneTask(workerIndex)) {
+                busyCycles += Cycles::rdtsc() - start;
+            } else if (stopping) {
+                break;
+            }
+
+            uint64_t now = Cycles::rdtsc();
+            if (now - lastReport >= reportInterval) {
+                estimator.recordCoreUsage(busyCycles, now - lastReport);
+                client->recordCoreUtilization(busyCycles,
+                                              now - lastReport - busyCycles);
+                busyCycles = 0;
+                lastReport = now;
+            }
+        }
+
+        // Don't leave tasks stranded while this worker is blocked
+        handOffTasks(workerIndex);
+    }
+
+    client->unregisterThread();
+    currentExecutor = NULL;
+}
+
+/**
+ * Runs one task, if there are any to run.
+ *
+ * \param workerIndex
+ *     The worker that will run the task
+ * \return
+ *     True if a task was run
+ */
+bool
+CoreExecutor::runOneTask(size_t workerIndex) {
+    Task task;
+    if (!takeTask(workerIndex, &task)) {
+        return false;
+    }
+    task();
+    numUnfinishedTasks--;
+    return true;
+}
+
+/**
+ * Chooses the next task for a worker to run: the newest task in its own queue,
+ * otherwise the oldest shared task, otherwise the oldest task of the first
+ * sibling that has one.
+ *
+ * \param workerIndex
+ *     The worker that will run the task
+ * \param[out] task
+ *     Set to the chosen task
+ * \return
+ *     True if a task was found
+ */
+bool
+CoreExecutor::takeTask(size_t workerIndex, Task* task) {
+    Worker* worker = workers[workerIndex].get();
+    {
+        Lock lock(worker->mutex);
+        if (!worker->tasks.empty()) {
+            *task = std::move(worker->tasks.back());
+            worker->tasks.pop_back();
+            return true;
+        }
+    }
+    {
+        Lock lock(sharedTasksMutex);
+        if (!sharedTasks.empty()) {
+            *task = std::move(sharedTasks.front());
+            sharedTasks.pop_front();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < workers.size(); i++) {
+        Worker* sibling = workers[(workerIndex + i) % workers.size()].get();
+        Lock lock(sibling->mutex);
+        if (!sibling->tasks.empty()) {
+            *task = std::move(sibling->tasks.front());
+            sibling->tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Moves a worker's queued tasks to the shared queue, where the workers that
+ * still have cores will find them. Called before the worker blocks.
+ *
+ * \param workerIndex
+ *     The worker giving up its tasks
+ */
+void
+CoreExecutor::handOffTasks(size_t workerIndex) {
+    Worker* worker = workers[workerIndex].get();
+    Lock lock(worker->mutex);
+    if (worker->tasks.empty()) {
+        return;
+    }
+
+    Lock sharedLock(sharedTasksMutex);
+    for (Task& task : worker->tasks) {
+        sharedTasks.push_back(std::move(task));
+    }
+    worker->tasks.clear();
+}
+
+/**
+ * The main loop of the thread that keeps the number of cores requested in line
+ * with the task backlog.
+ */
+void
+CoreExecutor::estimatorMain() {
+    while (!stopping) {
+        estimator.recordLoad(numUnfinishedTasks);
+        estimator.update();
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(EXECUTOR_ESTIMATE_INTERVAL_US));
+    }
+}
+
+}  // namespace CoreArbiter
@@ -0,0 +1,128 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_EXECUTOR_H_
+#define CORE_EXECUTOR_H_
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "CoreArbiterClient.h"
+#include "CoreDemandEstimator.h"
+
+// How often (in microseconds) a CoreExecutor re-evaluates how many cores it
+// needs.
+#define EXECUTOR_ESTIMATE_INTERVAL_US 1000
+
+namespace CoreArbiter {
+
+/**
+ * A work-stealing task executor whose threads only run on cores granted by the
+ * CoreArbiterServer, so that ordinary C++ services can use the arbiter without
+ * writing their own block/poll loop. There is one worker thread for every core
+ * the executor may be granted. A worker blocks in blockUntilCoreAvailable()
+ * until it is given a core, then runs tasks until the server asks for the core
+ * back; mustReleaseCore() is checked between tasks, so tasks should be short.
+ * Before blocking again, a worker hands its queued tasks to its siblings.
+ *
+ * Tasks submitted by a worker go to the back of its own queue, and it runs
+ * them newest first. Other tasks go to a shared queue. A worker with nothing
+ * of its own to run takes the oldest task from the shared queue, or steals the
+ * oldest task from a sibling. A CoreDemandEstimator fed with the task backlog
+ * and the workers' busy time decides how many cores to request.
+ */
+class CoreExecutor {
+  public:
+    typedef std::function<void()> Task;
+
+    CoreExecutor(CoreArbiterClient* client, uint32_t minCores,
+                 uint32_t maxCores, uint32_t priority = NUM_PRIORITIES - 1);
+    ~CoreExecutor();
+
+    void submit(Task task);
+    void shutdown();
+
+  private:
+    /**
+     * The state of one worker thread.
+     */
+    struct Worker {
+        Worker() : tasks(), mutex(), threadId(0), thread() {}
+
+        // Tasks submitted by this worker that have not started yet.
+        std::deque<Task> tasks;
+
+        // Protects tasks.
+        std::mutex mutex;
+
+        // The kernel thread ID of thread, or 0 until it has started.
+        std::atomic<pid_t> threadId;
+
+        // The thread that runs this worker.
+        std::thread thread;
+    };
+
+    void workerMain(size_t workerIndex);
+    bool runOneTask(size_t workerIndex);
+    bool takeTask(size_t workerIndex, Task* task);
+    void handOffTasks(size_t workerIndex);
+    void estimatorMain();
+
+    typedef std::unique_lock<std::mutex> Lock;
+
+    // The client through which the workers obtain cores.
+    CoreArbiterClient* client;
+
+    // Decides how many cores the executor requests.
+    CoreDemandEstimator estimator;
+
+    // The priority that cores are requested at.
+    uint32_t priority;
+
+    // One worker per core that the executor may be granted.
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    // Tasks submitted from outside the executor, or handed off by workers
+    // that gave up their cores.
+    std::deque<Task> sharedTasks;
+
+    // Protects sharedTasks.
+    std::mutex sharedTasksMutex;
+
+    // The number of tasks that have been submitted and not yet finished.
+    std::atomic<uint64_t> numUnfinishedTasks;
+
+    // Set by shutdown() once every task has finished.
+    std::atomic<bool> stopping;
+
+    // Periodically updates the estimator.
+    std::thread estimatorThread;
+
+    // The index of the calling thread's worker, or -1 if it is not one of
+    // this executor's workers.
+    static thread_local int workerIndex;
+
+    // The executor that the calling worker thread belongs to, if any.
+    static thread_local CoreExecutor* currentExecutor;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_EXECUTOR_H_
@@ -0,0 +1,231 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <algorithm>
+#include <fstream>
+
+#include "CpuFrequencyManager.h"
+#include "Logger.h"
+
+namespace CoreArbiter {
+
+/**
+ * Constructs a CpuFrequencyManager that leaves every core as it is until it
+ * is given settings.
+ *
+ * \param cpuPath
+ *     The sysfs directory holding a cpu<N> directory for each core
+ */
+CpuFrequencyManager::CpuFrequencyManager(std::string cpuPath)
+    : cpuPath(cpuPath),
+      occupiedSettings(1),
+      idleSetting(),
+      unmanagedSetting(),
+      cores() {}
+
+CpuFrequencyManager::~CpuFrequencyManager() { restore(); }
+
+/**
+ * Parses a setting given as GOVERNOR,MIN_FREQUENCY,ENERGY_PREFERENCE, where
+ * any field may be empty and trailing fields may be left out; for example
+ * "performance,3000000" or ",,balance_power".
+ *
+ * \param spec
+ *     The setting to parse
+ * \param setting
+ *     Filled in with the parsed setting
+ * \return
+ *     False if spec is malformed
+ */
+bool
+CpuFrequencyManager::parseSetting(const std::string& spec, Setting* setting) {
+    std::vector<std::string> fields(1);
+    for (char c : spec) {
+        if (c == ',') {
+            fields.emplace_back();
+        } else {
+            fields.back() += c;
+        }
+    }
+    if (fields.size() > 3) {
+        return false;
+    }
+    fields.resize(3);
+    if (fields[1].find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    setting->governor = fields[0];
+    setting->minFrequency = fields[1];
+    setting->energyPreference = fields[2];
+    return true;
+}
+
+/**
+ * Sets the settings of managed cores that have a thread, by the priority the
+ * core was granted at.
+ *
+ * \param settings
+ *     The settings at each priority, highest first. Lower priorities than
+ *     there are entries use the last entry.
+ */
+void
+CpuFrequencyManager::setOccupiedSettings(const std::vector<Setting>& settings) {
+    occupiedSettings = settings;
+    if (occupiedSettings.empty()) {
+        occupiedSettings.resize(1);
+    }
+}
+
+/**
+ * Applies the settings for a core's new state. Nothing is written unless
+ * they differ from what the core already has, so this can be called for
+ * every core after each core distribution.
+ *
+ * \param coreId
+ *     The core whose state may have changed
+ * \param state
+ *     The core's state
+ * \param priority
+ *     For MANAGED_OCCUPIED, the priority the core was granted at, from 0
+ *     (highest) to NUM_PRIORITIES - 1
+ */
+void
+CpuFrequencyManager::setCoreState(int coreId, CoreState state,
+                                  size_t priority) {
+    if (state == MANAGED_OCCUPIED) {
+        priority = std::min(priority, occupiedSettings.size() - 1);
+        apply(coreId, occupiedSettings[priority]);
+    } else if (state == MANAGED_IDLE) {
+        apply(coreId, idleSetting);
+    } else {
+        apply(coreId, unmanagedSetting);
+    }
+}
+
+/**
+ * Gives a core back its original settings and forgets about it, for cores
+ * that are no longer arbitrated.
+ */
+void
+CpuFrequencyManager::restoreCore(int coreId) {
+    auto coreIter = cores.find(coreId);
+    if (coreIter == cores.end()) {
+        return;
+    }
+    apply(coreId, coreIter->second.original);
+    cores.erase(coreIter);
+}
+
+/**
+ * Gives every core that was changed its original settings.
+ */
+void
+CpuFrequencyManager::restore() {
+    for (auto& idAndSettings : cores) {
+        apply(idAndSettings.first, idAndSettings.second.original);
+    }
+    cores.clear();
+}
+
+/**
+ * Writes the fields of a setting that differ from the core's current ones,
+ * using the core's original values for empty fields.
+ */
+void
+CpuFrequencyManager::apply(int coreId, const Setting& setting) {
+    auto coreIter = cores.find(coreId);
+    if (coreIter == cores.end()) {
+        if (setting.governor.empty() && setting.minFrequency.empty() &&
+            setting.energyPreference.empty()) {
+            return;
+        }
+        struct CoreSettings& settings = cores[coreId];
+        settings.original.governor = readFile(coreId, "scaling_governor");
+        settings.original.minFrequency = readFile(coreId, "scaling_min_freq");
+        settings.original.energyPreference =
+            readFile(coreId, "energy_performance_preference");
+        settings.current = settings.original;
+        coreIter = cores.find(coreId);
+    }
+    struct CoreSettings& settings = coreIter->second;
+
+    // The governor goes first, since changing it can reset the others
+    const struct {
+        const char* fileName;
+        const std::string& value;
+        const std::string& original;
+        std::string& current;
+    } fields[] = {
+        {"scaling_governor", setting.governor, settings.original.governor,
+         settings.current.governor},
+        {"scaling_min_freq", setting.minFrequency,
+         settings.original.minFrequency, settings.current.minFrequency},
+        {"energy_performance_preference", setting.energyPreference,
+         settings.original.energyPreference,
+         settings.current.energyPreference},
+    };
+    for (auto& field : fields) {
+        const std::string& value =
+            field.value.empty() ? field.original : field.value;
+        if (value.empty() || value == field.current) {
+            continue;
+        }
+        if (writeFile(coreId, field.fileName, value)) {
+            field.current = value;
+        }
+    }
+}
+
+/**
+ * Returns the path of one of a core's cpufreq files.
+ */
+std::string
+CpuFrequencyManager::getFilePath(int coreId, const char* fileName) {
+    return cpuPath + "/cpu" + std::to_string(coreId) + "/cpufreq/" + fileName;
+}
+
+/**
+ * Returns the first line of one of a core's cpufreq files, or an empty string
+ * if the core does not have that file.
+ */
+std::string
+CpuFrequencyManager::readFile(int coreId, const char* fileName) {
+    std::ifstream file(getFilePath(coreId, fileName));
+    std::string value;
+    std::getline(file, value);
+    return value;
+}
+
+/**
+ * Writes a value to one of a core's cpufreq files.
+ *
+ * \return
+ *     False if the value could not be written
+ */
+bool
+CpuFrequencyManager::writeFile(int coreId, const char* fileName,
+                               const std::string& value) {
+    std::string path = getFilePath(coreId, fileName);
+    std::ofstream file(path);
+    file << value << std::endl;
+    if (!file.good()) {
+        LOG(WARNING, "Unable to write %s to %s", value.c_str(), path.c_str());
+        return false;
+    }
+    LOG(DEBUG, "Wrote %s to %s", value.c_str(), path.c_str());
+    return true;
+}
+
+}  // namespace CoreArbiter
@@ -0,0 +1,99 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_ARBITER_CPU_FREQUENCY_MANAGER_H_
+#define CORE_ARBITER_CPU_FREQUENCY_MANAGER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace CoreArbiter {
+
+/**
+ * Changes the cpufreq settings of the cores the server arbitrates as they
+ * move between being unmanaged, managed without a thread, and managed with a
+ * thread, so that granted cores can be kept at a high frequency while idle
+ * ones are allowed to drop. The settings of a core are read from sysfs the
+ * first time it is changed, and written back by restore(), which the
+ * destructor calls.
+ */
+class CpuFrequencyManager {
+  public:
+    /**
+     * The cpufreq settings for cores in one state. An empty field leaves the
+     * core's original value in place.
+     */
+    struct Setting {
+        // Written to scaling_governor.
+        std::string governor;
+
+        // Written to scaling_min_freq, in kHz.
+        std::string minFrequency;
+
+        // Written to energy_performance_preference.
+        std::string energyPreference;
+    };
+
+    enum CoreState { UNMANAGED, MANAGED_IDLE, MANAGED_OCCUPIED };
+
+    explicit CpuFrequencyManager(
+        std::string cpuPath = "/sys/devices/system/cpu");
+    ~CpuFrequencyManager();
+
+    static bool parseSetting(const std::string& spec, Setting* setting);
+    void setOccupiedSettings(const std::vector<Setting>& settings);
+    void setIdleSetting(const Setting& setting) { idleSetting = setting; }
+    void setUnmanagedSetting(const Setting& setting) {
+        unmanagedSetting = setting;
+    }
+    void setCoreState(int coreId, CoreState state, size_t priority = 0);
+    void restoreCore(int coreId);
+    void restore();
+
+  private:
+    void apply(int coreId, const Setting& setting);
+    std::string getFilePath(int coreId, const char* fileName);
+    std::string readFile(int coreId, const char* fileName);
+    bool writeFile(int coreId, const char* fileName, const std::string& value);
+
+    /**
+     * The settings a core had before it was first changed, and the settings
+     * it has now.
+     */
+    struct CoreSettings {
+        Setting original;
+        Setting current;
+    };
+
+    // The directory holding a cpu<N> directory for each core.
+    std::string cpuPath;
+
+    // The settings for occupied managed cores at each priority. Priorities
+    // past the end use the last entry.
+    std::vector<Setting> occupiedSettings;
+
+    // The settings for managed cores without a thread, and for unmanaged
+    // cores.
+    Setting idleSetting;
+    Setting unmanagedSetting;
+
+    // The cores that have been changed, by ID.
+    std::map<int, struct CoreSettings> cores;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_ARBITER_CPU_FREQUENCY_MANAGER_H_
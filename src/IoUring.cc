@@ -0,0 +1,270 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <linux/io_uring.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "IoUring.h"
+#include "Logger.h"
+
+namespace CoreArbiter {
+
+static Syscall defaultSyscall;
+Syscall* IoUring::sys = &defaultSyscall;
+
+/**
+ * Constructs an IoUring that cannot be used until init() succeeds.
+ */
+IoUring::IoUring()
+    : ringFd(-1),
+      sqRing(NULL),
+      sqRingSize(0),
+      cqRing(NULL),
+      cqRingSize(0),
+      sqes(NULL),
+      sqesSize(0),
+      sqHead(NULL),
+      sqTail(NULL),
+      sqArray(NULL),
+      sqMask(0),
+      sqEntries(0),
+      cqHead(NULL),
+      cqTail(NULL),
+      cqMask(0),
+      cqes(NULL),
+      localSqTail(0),
+      numInFlight(0) {}
+
+/**
+ * Tears down the ring. Note that once the kernel has finished cleaning it up,
+ * it interrupts the thread that used it, so that thread's next blocking system
+ * call may fail with EINTR.
+ */
+IoUring::~IoUring() {
+    if (sqes) {
+        sys->munmap(sqes, sqesSize);
+    }
+    if (cqRing && cqRing != sqRing) {
+        sys->munmap(cqRing, cqRingSize);
+    }
+    if (sqRing) {
+        sys->munmap(sqRing, sqRingSize);
+    }
+    if (ringFd >= 0) {
+        sys->close(ringFd);
+    }
+}
+
+/**
+ * Sets up the ring. This fails on kernels without io_uring (or where it has
+ * been disabled), in which case the caller should do its I/O synchronously.
+ *
+ * \param numEntries
+ *     The number of operations that can be queued between submissions
+ * \return
+ *     True if the ring is ready to use
+ */
+bool
+IoUring::init(unsigned int numEntries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ringFd = sys->io_uring_setup(numEntries, &params);
+    if (ringFd < 0) {
+        LOG(WARNING, "Unable to set up io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+    }
+    sqRing = sys->mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (sqRing == MAP_FAILED) {
+        sqRing = NULL;
+    } else if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cqRing = sqRing;
+    } else {
+        cqRing =
+            sys->mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (cqRing == MAP_FAILED) {
+            cqRing = NULL;
+        }
+    }
+    sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqesMemory =
+        sys->mmap(NULL, sqesSize, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+    if (sqesMemory != MAP_FAILED) {
+        sqes = static_cast<struct io_uring_sqe*>(sqesMemory);
+    }
+    if (!sqRing || !cqRing || !sqes) {
+        LOG(WARNING, "Unable to map io_uring: %s", strerror(errno));
+        return false;
+    }
+
+    char* sq = static_cast<char*>(sqRing);
+    sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sqEntries = params.sq_entries;
+    localSqTail = *sqTail;
+
+    char* cq = static_cast<char*>(cqRing);
+    cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+}
+
+/**
+ * Queues a write to a file.
+ *
+ * \param fd
+ *     The file to write to
+ * \param buf
+ *     The bytes to write, which must stay valid until the write completes
+ * \param count
+ *     The number of bytes to write
+ * \param userData
+ *     Returned with the write's completion
+ * \param linkNext
+ *     If true, the next operation queued only runs if this one succeeds
+ * \return
+ *     False if the submission queue is full
+ */
+bool
+IoUring::prepareWrite(int fd, const void* buf, size_t count,
+                      uint64_t userData, bool linkNext) {
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<uint32_t>(count);
+    // Write at the file's current position, like write()
+    sqe->off = static_cast<uint64_t>(-1);
+    sqe->user_data = userData;
+    sqe->flags = linkNext ? IOSQE_IO_LINK : 0;
+    return true;
+}
+
+/**
+ * Queues a send on a socket. The parameters are the same as prepareWrite's,
+ * plus the flags that would be passed to send().
+ */
+bool
+IoUring::prepareSend(int fd, const void* buf, size_t count, int flags,
+                     uint64_t userData, bool linkNext) {
+    struct io_uring_sqe* sqe = getSqe();
+    if (!sqe) {
+        return false;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(buf);
+    sqe->len = static_cast<uint32_t>(count);
+    sqe->msg_flags = static_cast<uint32_t>(flags);
+    sqe->user_data = userData;
+    sqe->flags = linkNext ? IOSQE_IO_LINK : 0;
+    return true;
+}
+
+/**
+ * Hands every queued operation to the kernel and waits until all of the
+ * operations in flight have completed, in a single system call unless it is
+ * interrupted.
+ *
+ * \return
+ *     False if the kernel refused the operations, with errno set
+ */
+bool
+IoUring::submitAndWait() {
+    unsigned int numToSubmit = localSqTail - *sqTail;
+    __atomic_store_n(sqTail, localSqTail, __ATOMIC_RELEASE);
+    numInFlight += numToSubmit;
+
+    while (true) {
+        unsigned int numCompleted =
+            __atomic_load_n(cqTail, __ATOMIC_ACQUIRE) - *cqHead;
+        if (numToSubmit == 0 && numCompleted >= numInFlight) {
+            return true;
+        }
+        int result = sys->io_uring_enter(ringFd, numToSubmit,
+                                         numInFlight - numCompleted,
+                                         IORING_ENTER_GETEVENTS);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        numToSubmit -= std::min(numToSubmit, static_cast<unsigned>(result));
+    }
+}
+
+/**
+ * Returns the result of an operation that has completed, if there are any.
+ *
+ * \param[out] userData
+ *     Set to the userData the operation was queued with
+ * \param[out] result
+ *     Set to what the equivalent system call would have returned, or minus
+ *     the errno if it failed
+ * \return
+ *     False if there are no completions left
+ */
+bool
+IoUring::popCompletion(uint64_t* userData, int* result) {
+    unsigned int head = *cqHead;
+    if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe* cqe = &cqes[head & cqMask];
+    *userData = cqe->user_data;
+    *result = cqe->res;
+    __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+    numInFlight--;
+    return true;
+}
+
+/**
+ * Returns a cleared submission queue entry to fill in, or NULL if the queue
+ * is full.
+ */
+struct io_uring_sqe*
+IoUring::getSqe() {
+    if (localSqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >=
+        sqEntries) {
+        return NULL;
+    }
+    unsigned int index = localSqTail & sqMask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqArray[index] = index;
+    localSqTail++;
+    return sqe;
+}
+
+}  // namespace CoreArbiter
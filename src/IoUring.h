@@ -0,0 +1,95 @@
+/* Copyright (c) 2015-2017 Stanford University
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR(S) DISCLAIM ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL AUTHORS BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CORE_ARBITER_IO_URING_H_
+#define CORE_ARBITER_IO_URING_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "Syscall.h"
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace CoreArbiter {
+
+/**
+ * A minimal io_uring, driven with raw system calls, that lets the server
+ * queue up many writes and sends and then submit them all and wait for them
+ * to finish with a single system call. An operation can be linked to the one
+ * queued after it, in which case the second only runs if the first succeeds
+ * in full; otherwise it completes with -ECANCELED. Only writes and sends are
+ * supported, which is all the server's grants need (see
+ * CoreArbiterServer::enableIoUring()).
+ */
+class IoUring {
+  public:
+    IoUring();
+    ~IoUring();
+
+    bool init(unsigned int numEntries);
+    bool isInitialized() { return cqes != NULL; }
+    bool prepareWrite(int fd, const void* buf, size_t count,
+                      uint64_t userData, bool linkNext);
+    bool prepareSend(int fd, const void* buf, size_t count, int flags,
+                     uint64_t userData, bool linkNext);
+    bool submitAndWait();
+    bool popCompletion(uint64_t* userData, int* result);
+
+  private:
+    struct io_uring_sqe* getSqe();
+
+    // The io_uring file descriptor, or -1 if io_uring_setup() failed.
+    int ringFd;
+
+    // The memory shared with the kernel: the submission and completion rings
+    // (which may be one mapping) and the submission queue entries.
+    void* sqRing;
+    size_t sqRingSize;
+    void* cqRing;
+    size_t cqRingSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    // Fields of the submission ring.
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int* sqArray;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+
+    // Fields of the completion ring. cqes is only set once the whole ring has
+    // been set up.
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe* cqes;
+
+    // The submission queue tail including entries that have been prepared
+    // but not yet handed to the kernel.
+    unsigned int localSqTail;
+
+    // The number of operations submitted whose completions have not yet been
+    // popped.
+    unsigned int numInFlight;
+
+    // Wrap all system calls for easier testing.
+    static Syscall* sys;
+};
+
+}  // namespace CoreArbiter
+
+#endif  // CORE_ARBITER_IO_URING_H_
@@ -57,13 +57,18 @@ class MockSyscall : public Syscall {
           callGeteuid(true),
           geteuidResult(0),
           getsocknameErrno(0),
+          getsockoptErrno(0),
+          peerCredUid(-1),
+          ioUringSetupErrno(0),
           ioctlErrno(0),
           ioctlRetriesToSuccess(0),
           listenErrno(0),
           mkdirErrno(0),
           mmapErrno(0),
+          munmapErrno(0),
           openErrno(0),
           opendirErrno(0),
+          pidfdOpenErrno(0),
           pipeErrno(0),
           readdirErrno(0),
           recvErrno(0),
@@ -72,6 +77,12 @@ class MockSyscall : public Syscall {
           recvfromEof(false),
           recvmmsgErrno(0),
           rmdirErrno(0),
+          rseqErrno(0),
+          schedGetcpuCore(-1),
+          schedSetaffinityErrno(0),
+          schedSetaffinityCore(-1),
+          schedSetschedulerErrno(0),
+          schedSetschedulerPolicy(-1),
           sendErrno(0),
           sendReturnCount(-1),
           sendmsgErrno(0),
@@ -80,6 +91,7 @@ class MockSyscall : public Syscall {
           sendtoReturnCount(-1),
           setsockoptErrno(0),
           socketErrno(0),
+          statErrno(0),
           writeErrno(0) {}
 
     int acceptErrno;
@@ -171,6 +183,7 @@ class MockSyscall : public Syscall {
             return ::epoll_wait(epfd, events, maxEvents, timeout);
         }
         errno = epollWaitErrno;
+        epollWaitErrno = 0;
         return -1;
     }
 
@@ -249,6 +262,34 @@ class MockSyscall : public Syscall {
         return -1;
     }
 
+    // If peerCredUid is not negative, it replaces the user ID that the
+    // kernel reports for the peer of a socket with SO_PEERCRED.
+    int getsockoptErrno;
+    int peerCredUid;
+    int getsockopt(int sockfd, int level, int optname, void* optval,
+                   socklen_t* optlen) {
+        if (getsockoptErrno != 0) {
+            errno = getsockoptErrno;
+            getsockoptErrno = 0;
+            return -1;
+        }
+        int result = ::getsockopt(sockfd, level, optname, optval, optlen);
+        if (result == 0 && optname == SO_PEERCRED && peerCredUid >= 0) {
+            static_cast<struct ucred*>(optval)->uid =
+                static_cast<uid_t>(peerCredUid);
+        }
+        return result;
+    }
+
+    int ioUringSetupErrno;
+    int io_uring_setup(unsigned int entries, struct io_uring_params* params) {
+        if (ioUringSetupErrno == 0) {
+            return Syscall::io_uring_setup(entries, params);
+        }
+        errno = ioUringSetupErrno;
+        return -1;
+    }
+
     int ioctlErrno;
     int ioctlRetriesToSuccess;
     int ioctl(int fd, int reqType, void* request) {
@@ -294,6 +335,15 @@ class MockSyscall : public Syscall {
         return MAP_FAILED;
     }
 
+    int munmapErrno;
+    int munmap(void* addr, size_t length) {
+        if (munmapErrno == 0) {
+            return ::munmap(addr, length);
+        }
+        errno = munmapErrno;
+        return -1;
+    }
+
     int openErrno;
     int open(const char* path, int oflag) {
         if (openErrno == 0) {
@@ -319,6 +369,15 @@ class MockSyscall : public Syscall {
         return NULL;
     }
 
+    int pidfdOpenErrno;
+    int pidfd_open(pid_t pid, unsigned int flags) {
+        if (pidfdOpenErrno == 0) {
+            return Syscall::pidfd_open(pid, flags);
+        }
+        errno = pidfdOpenErrno;
+        return -1;
+    }
+
     int pipeErrno;
     int pipe(int fds[2]) {
         if (pipeErrno == 0) {
@@ -384,6 +443,58 @@ class MockSyscall : public Syscall {
         return -1;
     }
 
+    // A thread may only register one rseq area, and glibc usually registers
+    // one itself, so this call is never passed on either.
+    int rseqErrno;
+    int rseq(struct rseq* rseqArea, uint32_t len, int flags, uint32_t sig) {
+        if (rseqErrno == 0)
+            return 0;
+        errno = rseqErrno;
+        rseqErrno = 0;
+        return -1;
+    }
+
+    int schedGetcpuCore;
+    int sched_getcpu() {
+        if (schedGetcpuCore < 0)
+            return Syscall::sched_getcpu();
+        return schedGetcpuCore;
+    }
+
+    // The scheduling calls are never passed on, so that tests cannot pin
+    // themselves to a core or make themselves real-time. The core or policy
+    // most recently asked for is recorded instead.
+    int schedSetaffinityErrno;
+    int schedSetaffinityCore;
+    int sched_setaffinity(pid_t pid, size_t cpusetsize,
+                          const cpu_set_t* mask) {
+        if (schedSetaffinityErrno == 0) {
+            for (int core = 0; core < CPU_SETSIZE; core++) {
+                if (CPU_ISSET(core, mask)) {
+                    schedSetaffinityCore = core;
+                    break;
+                }
+            }
+            return 0;
+        }
+        errno = schedSetaffinityErrno;
+        schedSetaffinityErrno = 0;
+        return -1;
+    }
+
+    int schedSetschedulerErrno;
+    int schedSetschedulerPolicy;
+    int sched_setscheduler(pid_t pid, int policy,
+                           const struct sched_param* param) {
+        if (schedSetschedulerErrno == 0) {
+            schedSetschedulerPolicy = policy;
+            return 0;
+        }
+        errno = schedSetschedulerErrno;
+        schedSetschedulerErrno = 0;
+        return -1;
+    }
+
     int sendErrno;
     int sendReturnCount;
     ssize_t send(int sockfd, const void* buf, size_t len, int flags) {
@@ -444,7 +555,7 @@ class MockSyscall : public Syscall {
     int statErrno;
     int stat(const char* path, struct stat* buf) {
         if (statErrno == 0) {
-            ::stat(path, buf);
+            return ::stat(path, buf);
         }
         errno = statErrno;
         return -1;
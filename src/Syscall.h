@@ -17,9 +17,11 @@
 #define CORE_ARBITER_SYSCALL_H
 
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/futex.h>
 #include <netinet/in.h>
+#include <sched.h>
 #include <sys/epoll.h>
 #include <sys/file.h>
 #include <sys/ioctl.h>
@@ -32,6 +34,12 @@
 
 #include <cstdio>
 #include "CoreArbiterCommon.h"
+#include "PerfUtils/Cycles.h"
+
+// Defined in <linux/io_uring.h>, which only IoUring.cc needs.
+struct io_uring_params;
+// Defined in <linux/rseq.h>, which only CoreArbiterClient.cc needs.
+struct rseq;
 
 namespace CoreArbiter {
 
@@ -73,6 +81,25 @@ class Syscall {
         return ::epoll_wait(epfd, events, maxEvents, timeout);
     }
     virtual void exit(int status) { ::exit(status); }
+    virtual int io_uring_enter(int fd, unsigned int toSubmit,
+                               unsigned int minComplete, unsigned int flags) {
+#ifdef SYS_io_uring_enter
+        return static_cast<int>(::syscall(SYS_io_uring_enter, fd, toSubmit,
+                                          minComplete, flags, NULL, 0));
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+    virtual int io_uring_setup(unsigned int entries,
+                               struct io_uring_params* params) {
+#ifdef SYS_io_uring_setup
+        return static_cast<int>(::syscall(SYS_io_uring_setup, entries, params));
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
     virtual int ioctl(int fd, int reqType, void* request) {
         return ::ioctl(fd, reqType, request);
     }
@@ -103,6 +130,10 @@ class Syscall {
     virtual int getsockname(int sockfd, sockaddr* addr, socklen_t* addrlen) {
         return ::getsockname(sockfd, addr, addrlen);
     }
+    virtual int getsockopt(int sockfd, int level, int optname, void* optval,
+                           socklen_t* optlen) {
+        return ::getsockopt(sockfd, level, optname, optval, optlen);
+    }
     virtual pid_t gettid() { return (pid_t)syscall(SYS_gettid); }
     virtual pid_t getpid() { return ::getpid(); }
     virtual int listen(int sockfd, int backlog) {
@@ -115,6 +146,9 @@ class Syscall {
                        off_t offset) {
         return ::mmap(addr, length, prot, flags, fd, offset);
     }
+    virtual int munmap(void* addr, size_t length) {
+        return ::munmap(addr, length);
+    }
     virtual int open(const char* path, int oflag) {
         return ::open(path, oflag);
     }
@@ -122,6 +156,14 @@ class Syscall {
         return ::open(path, oflag, mode);
     }
     virtual DIR* opendir(const char* name) { return ::opendir(name); }
+    virtual int pidfd_open(pid_t pid, unsigned int flags) {
+#ifdef SYS_pidfd_open
+        return static_cast<int>(::syscall(SYS_pidfd_open, pid, flags));
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
     virtual int pipe(int fds[2]) { return ::pipe(fds); }
     virtual ssize_t pread(int fd, void* buf, size_t count, off_t offset) {
         return ::pread(fd, buf, count, offset);
@@ -131,6 +173,9 @@ class Syscall {
         return ::pwrite(fd, buf, count, offset);
     }
     virtual struct dirent* readdir(DIR* dirp) { return ::readdir(dirp); }
+    // Not a system call, but the server's only source of time, so that a
+    // simulation can replace it with a virtual clock.
+    virtual uint64_t rdtsc() { return PerfUtils::Cycles::rdtsc(); }
     virtual ssize_t recv(int sockfd, void* buf, size_t len, int flags) {
         return ::recv(sockfd, buf, len, flags);
     }
@@ -144,6 +189,24 @@ class Syscall {
         return ::recvmmsg(sockfd, msgvec, vlen, flags, timeout);
     }
     virtual int rmdir(const char* pathname) { return ::rmdir(pathname); }
+    virtual int rseq(struct rseq* rseqArea, uint32_t len, int flags,
+                     uint32_t sig) {
+#ifdef SYS_rseq
+        return static_cast<int>(::syscall(SYS_rseq, rseqArea, len, flags, sig));
+#else
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+    virtual int sched_getcpu() { return ::sched_getcpu(); }
+    virtual int sched_setaffinity(pid_t pid, size_t cpusetsize,
+                                  const cpu_set_t* mask) {
+        return ::sched_setaffinity(pid, cpusetsize, mask);
+    }
+    virtual int sched_setscheduler(pid_t pid, int policy,
+                                   const struct sched_param* param) {
+        return ::sched_setscheduler(pid, policy, param);
+    }
     virtual int select(int nfds, fd_set* readfds, fd_set* writefds,
                        fd_set* errorfds, struct timeval* timeout) {
         return ::select(nfds, readfds, writefds, errorfds, timeout);
@@ -163,6 +226,9 @@ class Syscall {
                            const void* optval, socklen_t optlen) {
         return ::setsockopt(sockfd, level, optname, optval, optlen);
     }
+    virtual int shutdown(int sockfd, int how) {
+        return ::shutdown(sockfd, how);
+    }
     virtual int socket(int domain, int type, int protocol) {
         return ::socket(domain, type, protocol);
     }